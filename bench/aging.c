@@ -0,0 +1,201 @@
+/* Ages an image with randomized create/overwrite/unlink cycles and prints,
+ * every interval cycles, how scattered the files have become and what that
+ * costs when reading them back:
+ *
+ *   bench_aging [-n cycles] [-i interval] [-b blksz] [-m image_mb]
+ *               [-f fill_pct] [-r sync|deferred] [-s seed]
+ *
+ * The image lives in memory.  Files are picked at random among MAXFILES
+ * names: a missing one is created, an existing one is overwritten or (more
+ * often while the image is fuller than fill_pct) unlinked.  Sizes mix small
+ * files of a few blocks with larger ones of up to BIGBLOCKS blocks.  fs.c is
+ * included directly, so the block maps of the files are walked to measure
+ * them.  Output is one header line followed by one line per sample:
+ *
+ *   aging blksz=<n> image_mb=<n> fill_pct=<n> reclaim=<mode> seed=<n>
+ *   aging cycle=<n> files=<n> used_pct=<p> extent_blocks=<x> read_mb_s=<x> hdd_mb_s=<x> seeks_mb=<x>
+ *
+ * extent_blocks is the fragmentation score: the mean over files of their
+ * data blocks divided by their extents (runs of consecutive blocks), so 1 is
+ * fully scattered and higher is better.  read_mb_s reads every file from
+ * memory; hdd_mb_s reads the first HDDBYTES of them through the latency device
+ * with a hard disk profile, and seeks_mb counts the reads that did not
+ * follow the previous one per megabyte read.
+ */
+#include <time.h>
+
+#include "../fs.c"
+
+#define MAXFILES 4096
+#define BIGBLOCKS 256
+#define HDDBYTES (256 << 10)
+
+static uint64_t sizes[MAXFILES]; /* bytes of each file, zero if missing */
+static char *buf;
+
+/* a disk with no cost per call, so that only seeks and transfer count */
+static const struct fs_latency hdd = {.seek_ns = 4000000, .bytes_per_us = 150};
+
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/*}}}*/
+
+
+static void file_name(char *name, int i)/*{{{*/
+{
+	sprintf(name, "/d%d/f%d", i % 16, i);
+}
+/*}}}*/
+
+
+/* data blocks and extents of the file whose first inode is no */
+static int extents(struct superblock *sb, uint64_t no, uint64_t size,/*{{{*/
+		uint64_t *blocks, uint64_t *runs)
+{
+	struct inode *in = malloc(sb->blksz);
+	struct mapa m = {0};
+	uint64_t n = (size + sb->blksz - 1) / sb->blksz, b, prev = 0, cur;
+	*blocks = n;
+	*runs = 0;
+	if(leBloco(sb, no, in) || abreMapa(sb, &m, no, in)) { free(in); return -1; }
+	for(b = 0; b < n; b++) {
+		if(!(cur = blocoMapa(sb, &m, b))) { fechaMapa(&m); free(in); return -1; }
+		if(cur != prev + 1) (*runs)++;
+		prev = cur;
+	}
+	fechaMapa(&m);
+	free(in);
+	return 0;
+}
+/*}}}*/
+
+
+static int sample(struct superblock *sb, struct fs_backend *slow, uint64_t cycle)/*{{{*/
+{
+	struct fs_backend *fast = sb->dev;
+	struct fs_stat st;
+	char name[32];
+	uint64_t files = 0, blocks, runs, bytes = 0, hddbytes = 0;
+	double score = 0, t, tread, thdd = 0, seeks = 0;
+	int i;
+
+	for(i = 0; i < MAXFILES; i++) {
+		if(!sizes[i]) continue;
+		file_name(name, i);
+		if(fs_stat(sb, name, &st) || extents(sb, st.inode, sizes[i], &blocks, &runs)) {
+			perror(name);
+			return -1;
+		}
+		files++;
+		score += (double)blocks / runs;
+	}
+
+	t = now();
+	for(i = 0; i < MAXFILES; i++) {
+		if(!sizes[i]) continue;
+		file_name(name, i);
+		if(fs_read_file(sb, name, buf, sizes[i]) != sizes[i]) { perror(name); return -1; }
+		bytes += sizes[i];
+	}
+	tread = now() - t;
+
+	/* the same reads on the slow device; its seeks are the reads that did
+	 * not start where the previous one ended */
+	sb->dev = slow;
+	for(i = 0; i < MAXFILES && hddbytes < HDDBYTES; i++) {
+		if(!sizes[i]) continue;
+		file_name(name, i);
+		t = now();
+		if(fs_read_file(sb, name, buf, sizes[i]) != sizes[i]) { perror(name); return -1; }
+		thdd += now() - t;
+		hddbytes += sizes[i];
+	}
+	sb->dev = fast;
+	if(!files) return 0;
+	/* every call paid the transfer; the rest of the time is seeks */
+	seeks = (thdd - (double)hddbytes * 1000 / hdd.bytes_per_us) / hdd.seek_ns;
+	if(seeks < 0) seeks = 0;
+
+	printf("aging cycle=%" PRIu64 " files=%" PRIu64 " used_pct=%.1f extent_blocks=%.2f "
+			"read_mb_s=%.1f hdd_mb_s=%.2f seeks_mb=%.1f\n", cycle, files,
+			100.0 * (sb->blks - sb->freeblks) / sb->blks, files ? score / files : 0,
+			bytes / tread * 1e9 / (1 << 20), hddbytes / thdd * 1e9 / (1 << 20),
+			seeks / ((double)hddbytes / (1 << 20)));
+	fflush(stdout);
+	return 0;
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t cycles = 1000000, interval = 100000, blksz = 1024, image_mb = 64;
+	uint64_t fill = 70, seed = 1, cycle;
+	int reclaim = FS_RECLAIM_SYNC, c, i;
+	char name[32];
+	while((c = getopt(argc, argv, "n:i:b:m:f:r:s:")) != -1) {
+		switch(c) {
+		case 'n': cycles = strtoull(optarg, NULL, 10); break;
+		case 'i': interval = strtoull(optarg, NULL, 10); break;
+		case 'b': blksz = strtoull(optarg, NULL, 10); break;
+		case 'm': image_mb = strtoull(optarg, NULL, 10); break;
+		case 'f': fill = strtoull(optarg, NULL, 10); break;
+		case 'r': reclaim = strcmp(optarg, "sync") ? FS_RECLAIM_DEFERRED : FS_RECLAIM_SYNC; break;
+		case 's': seed = strtoull(optarg, NULL, 10); break;
+		default:
+			fprintf(stderr, "usage: %s [-n cycles] [-i interval] [-b blksz] "
+					"[-m image_mb] [-f fill_pct] [-r sync|deferred] [-s seed]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	printf("aging blksz=%d image_mb=%d fill_pct=%d reclaim=%s seed=%d\n", (int)blksz,
+			(int)image_mb, (int)fill, reclaim == FS_RECLAIM_SYNC ? "sync" : "deferred",
+			(int)seed);
+	srand(seed);
+
+	struct fs_options opts = {.btree_dirs = 1};
+	struct fs_backend *mem = fs_backend_memory(image_mb << 20);
+	struct fs_backend *slow = fs_backend_latency(mem, &hdd);
+	struct superblock *sb = slow ? fs_format_dev(mem, blksz, &opts) : NULL;
+	if(!sb) { perror("fs_format_dev"); exit(EXIT_FAILURE); }
+	if(fs_set_reclaim(sb, reclaim)) { perror("fs_set_reclaim"); exit(EXIT_FAILURE); }
+	buf = malloc(BIGBLOCKS * blksz);
+	memset(buf, 'x', BIGBLOCKS * blksz);
+	for(i = 0; i < 16; i++) {
+		sprintf(name, "/d%d", i);
+		fs_mkdir(sb, name);
+	}
+	if(sample(sb, slow, 0)) exit(EXIT_FAILURE);
+
+	for(cycle = 1; cycle <= cycles; cycle++) {
+		i = rand() % MAXFILES;
+		file_name(name, i);
+		uint64_t used = 100 * (sb->blks - sb->freeblks) / sb->blks;
+		int r = rand() % 100;
+		if(sizes[i] && r < (used > fill ? 70 : 30)) {
+			if(fs_unlink(sb, name)) { perror(name); exit(EXIT_FAILURE); }
+			sizes[i] = 0;
+		} else if(used <= fill || sizes[i]) {
+			/* three small files (up to 4 blocks) for each large one */
+			uint64_t n = rand() % 4 ? 1 + rand() % 4 : 1 + rand() % BIGBLOCKS;
+			uint64_t size = n * blksz - rand() % blksz;
+			if(fs_write_file(sb, name, buf, size)) {
+				if(errno != ENOSPC) { perror(name); exit(EXIT_FAILURE); }
+			} else {
+				sizes[i] = size;
+			}
+		}
+		if(reclaim != FS_RECLAIM_SYNC && cycle % 64 == 0) fs_reclaim(sb, UINT64_MAX);
+		if(cycle % interval == 0 && sample(sb, slow, cycle)) exit(EXIT_FAILURE);
+	}
+	fs_close(sb);
+	fs_backend_close(slow);
+	free(buf);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
@@ -0,0 +1,16 @@
+#!/bin/bash
+set -u
+
+gcc -O2 -Wall -I. bench/aging.c -o bench_aging -pthread &>> gcc.log
+if [ ! -x bench_aging ] ; then
+    echo "[aging] compilation error"
+    exit 1 ;
+fi
+
+if ! ./bench_aging "$@" ; then
+    echo "[aging] error"
+    exit 1
+fi
+
+rm -f bench_aging
+exit 0
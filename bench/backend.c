@@ -0,0 +1,119 @@
+/* The same workload on each kind of device: the image file through preadv
+ * and pwritev (as fs_format and fs_open use it), the file mapped into
+ * memory, an anonymous image in memory, and that image behind the latency
+ * profiles of an SSD and of a hard disk.  The workload creates, reads and
+ * unlinks small files in a B+tree root, with and without a journal; the slow
+ * devices run fewer files.  fs.c is included directly.  Output has one
+ * measurement per line:
+ *
+ *   backend dev=<file|mmap|memory|ssd|hdd> journal=<blocks> op=<create|read|unlink> n=<ops> ns_op=<ns> calls_op=<n>
+ *
+ * calls_op counts the device calls (fs_get_stats' syscalls) per operation.
+ */
+#include <time.h>
+
+#include "../fs.c"
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define IMAGE (8 << 20)
+#define BLKSZ 1024
+
+static char *fname = "bench.img";
+
+/* latency profiles of the simulated disks */
+static const struct fs_latency ssd = {.read_ns = 80000, .write_ns = 25000,
+		.flush_ns = 400000, .bytes_per_us = 500};
+static const struct fs_latency hdd = {.read_ns = 100000, .write_ns = 100000,
+		.flush_ns = 8000000, .seek_ns = 4000000, .bytes_per_us = 150};
+
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/*}}}*/
+
+
+static struct fs_backend *create_dev(const char *name)/*{{{*/
+{
+	FILE *fp = fopen(fname, "w");
+	if(!fp || ftruncate(fileno(fp), IMAGE)) { perror(fname); return NULL; }
+	fclose(fp);
+	if(!strcmp(name, "file")) return fs_backend_file(fname, 1);
+	if(!strcmp(name, "mmap")) return fs_backend_mmap(fname, 1);
+	if(!strcmp(name, "memory")) return fs_backend_memory(IMAGE);
+	return fs_backend_latency(fs_backend_memory(IMAGE),
+			!strcmp(name, "ssd") ? &ssd : &hdd);
+}
+/*}}}*/
+
+
+static void report(const char *dev, uint64_t journal, const char *op, int n,/*{{{*/
+		double ns, struct superblock *sb)
+{
+	struct fs_stats st;
+	fs_get_stats(sb, &st);
+	printf("backend dev=%s journal=%d op=%s n=%d ns_op=%.0f calls_op=%.1f\n",
+			dev, (int)journal, op, n, ns / n, (double)st.syscalls / n);
+	fs_reset_stats(sb);
+}
+/*}}}*/
+
+
+static int bench(const char *name, uint64_t journal, int n)/*{{{*/
+{
+	struct fs_options opts = {.journal = journal, .btree_dirs = 1};
+	char path[32], buf[BLKSZ];
+	int i;
+	struct fs_backend *dev = create_dev(name);
+	if(!dev) { perror(name); return -1; }
+	struct superblock *sb = fs_format_dev(dev, BLKSZ, &opts);
+	if(!sb) { perror("fs_format_dev"); return -1; }
+	memset(buf, 'x', sizeof(buf));
+	fs_reset_stats(sb);
+
+	double t = now();
+	for(i = 0; i < n; i++) {
+		sprintf(path, "/f%d", i);
+		if(fs_write_file(sb, path, buf, sizeof(buf))) { perror(path); return -1; }
+	}
+	report(name, journal, "create", n, now() - t, sb);
+
+	t = now();
+	for(i = 0; i < n; i++) {
+		sprintf(path, "/f%d", i);
+		if(fs_read_file(sb, path, buf, sizeof(buf)) != sizeof(buf)) { perror(path); return -1; }
+	}
+	report(name, journal, "read", n, now() - t, sb);
+
+	t = now();
+	for(i = 0; i < n; i++) {
+		sprintf(path, "/f%d", i);
+		if(fs_unlink(sb, path)) { perror(path); return -1; }
+	}
+	report(name, journal, "unlink", n, now() - t, sb);
+
+	fs_close(sb);
+	fs_backend_close(dev);
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	const char *devs[] = {"file", "mmap", "memory", "ssd", "hdd"};
+	int files[] = {2000, 2000, 2000, 100, 10};
+	uint64_t journals[] = {0, 64};
+	int i, j;
+	for(i = 0; i < NELEMS(devs); i++) {
+		for(j = 0; j < NELEMS(journals); j++) {
+			if(bench(devs[i], journals[j], files[i])) exit(EXIT_FAILURE);
+		}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
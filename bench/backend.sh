@@ -0,0 +1,16 @@
+#!/bin/bash
+set -u
+
+gcc -O2 -Wall -I. bench/backend.c -o bench_backend -pthread &>> gcc.log
+if [ ! -x bench_backend ] ; then
+    echo "[backend] compilation error"
+    exit 1 ;
+fi
+
+if ! ./bench_backend "$@" ; then
+    echo "[backend] error"
+    exit 1
+fi
+
+rm -f bench_backend
+exit 0
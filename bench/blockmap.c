@@ -0,0 +1,149 @@
+/* Random reads at arbitrary offsets of a large file through fs_read_file_at,
+ * with the file laid out as a block map and as the chain of child inodes
+ * written by older versions (built here with the internal routines of fs.c,
+ * which is included directly).  Read system calls are taken from
+ * /proc/self/io.  Output has one measurement per line:
+ *
+ *   blockmap blksz=<n> layout=<chain|map> size_mb=<mb> ops_s=<ops> reads_op=<n> p50_us=<us> p99_us=<us>
+ */
+#include <time.h>
+
+#include "../fs.c"
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "bench.img";
+static uint64_t size = 32 << 20;
+static int nreads = 2000;
+
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/*}}}*/
+
+
+static uint64_t syscr(void)/*{{{*/
+{
+	char line[128];
+	uint64_t n = 0;
+	FILE *fp = fopen("/proc/self/io", "r");
+	while(fp && fgets(line, sizeof(line), fp)) sscanf(line, "syscr: %" SCNu64, &n);
+	if(fp) fclose(fp);
+	return n;
+}
+/*}}}*/
+
+
+static int compare(const void *a, const void *b)/*{{{*/
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+/*}}}*/
+
+
+/* =name with =size bytes of =data as a chain: a full first inode followed by
+ * child inodes linked through =next. */
+static int write_chain(struct superblock *sb, const char *name, char *data)/*{{{*/
+{
+	uint64_t nl = sb->nlinks, bs = sb->blksz, n = size / bs - nl, i, c, prev;
+	uint64_t children = (n + nl - 1) / nl;
+	uint64_t *v = malloc((n + children) * sizeof(uint64_t)), *p = v;
+	struct inode *in = malloc(bs), *ch = malloc(bs);
+	struct nodeinfo *info = malloc(bs);
+
+	if(fs_write_file(sb, name, data, nl * bs) < 0) return -1;
+	if(pegaBlocos(sb, v, n + children) == -1) return -1;
+	prev = encontraBloco(sb, name, 0);
+	if(leBloco(sb, prev, in) == -1) return -1;
+	for(c = 0, data += nl * bs; c < children; c++) {
+		memset(ch, 0, bs);
+		ch->mode = IMCHILD;
+		ch->parent = encontraBloco(sb, name, 0);
+		ch->meta = prev;
+		for(i = 0; i < nl && n > 0; i++, n--, data += bs) {
+			ch->links[i] = *p++;
+			if(escreveDados(sb, ch->links[i], data) == -1) return -1;
+		}
+		in->next = *p++;
+		if(escreveBloco(sb, prev, in) == -1) return -1;
+		prev = in->next;
+		memcpy(in, ch, bs);
+	}
+	if(escreveBloco(sb, prev, in) == -1) return -1;
+	if(leBloco(sb, encontraBloco(sb, name, 0), in) == -1) return -1;
+	if(leBloco(sb, in->meta, info) == -1) return -1;
+	info->size = size;
+	if(escreveBloco(sb, in->meta, info) == -1) return -1;
+	free(v);
+	free(in);
+	free(ch);
+	free(info);
+	return 0;
+}
+/*}}}*/
+
+
+static int run(uint64_t blksz, int chain, char *data)/*{{{*/
+{
+	double *lat = malloc(nreads * sizeof(*lat));
+	char buf[4096];
+	int i;
+
+	FILE *fp = fopen(fname, "w");
+	if(!fp || ftruncate(fileno(fp), 4 * size)) { perror(fname); return -1; }
+	fclose(fp);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(!sb) { perror("fs_format"); return -1; }
+	if(chain ? write_chain(sb, "/f", data) : fs_write_file(sb, "/f", data, size)) {
+		perror("write");
+		return -1;
+	}
+
+	srand(1);
+	uint64_t r = syscr();
+	double t = now();
+	for(i = 0; i < nreads; i++) {
+		uint64_t off = ((uint64_t)rand() * RAND_MAX + rand()) % (size - sizeof(buf));
+		double t0 = now();
+		if(fs_read_file_at(sb, "/f", buf, sizeof(buf), off) != sizeof(buf) ||
+		   memcmp(buf, data + off, sizeof(buf))) {
+			puts("FAIL fs_read_file_at");
+			return -1;
+		}
+		lat[i] = now() - t0;
+	}
+	t = now() - t;
+	r = syscr() - r;
+
+	qsort(lat, nreads, sizeof(*lat), compare);
+	printf("blockmap blksz=%d layout=%s size_mb=%d ops_s=%.0f reads_op=%.1f "
+			"p50_us=%.1f p99_us=%.1f\n", (int)blksz, chain ? "chain" : "map",
+			(int)(size >> 20), nreads / (t / 1e9), (double)r / nreads,
+			lat[nreads / 2] / 1e3, lat[nreads * 99 / 100] / 1e3);
+	free(lat);
+	fs_close(sb);
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t blkszs[] = {512, 4096}, i;
+	int chain;
+	char *data = malloc(size);
+	for(i = 0; i < size; i++) data[i] = i * 7 + i / 4096;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+		for(chain = 1; chain >= 0; chain--) {
+			if(run(blkszs[i], chain, data)) exit(EXIT_FAILURE);
+		}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
@@ -0,0 +1,16 @@
+#!/bin/bash
+set -u
+
+gcc -O2 -Wall -I. bench/blockmap.c -o bench_blockmap -pthread &>> gcc.log
+if [ ! -x bench_blockmap ] ; then
+    echo "[blockmap] compilation error"
+    exit 1 ;
+fi
+
+if ! ./bench_blockmap ; then
+    echo "[blockmap] error"
+    exit 1
+fi
+
+rm -f bench_blockmap
+exit 0
@@ -0,0 +1,137 @@
+/* Creates, looks up and removes many files in a single directory, with the
+ * directory as a chain of inodes and as a B+tree of names (fs_options
+ * =btree_dirs).  fs.c is included directly.  Read system calls are taken
+ * from /proc/self/io.  Output has one measurement per line:
+ *
+ *   btreedir blksz=<n> layout=<chain|btree> entries=<n> op=<create|lookup|unlink> ops_s=<ops> reads_op=<n> p50_us=<us> p99_us=<us>
+ */
+#include <time.h>
+
+#include "../fs.c"
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "bench.img";
+
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/*}}}*/
+
+
+static uint64_t syscr(void)/*{{{*/
+{
+	char line[128];
+	uint64_t n = 0;
+	FILE *fp = fopen("/proc/self/io", "r");
+	while(fp && fgets(line, sizeof(line), fp)) sscanf(line, "syscr: %" SCNu64, &n);
+	if(fp) fclose(fp);
+	return n;
+}
+/*}}}*/
+
+
+static int compare(const void *a, const void *b)/*{{{*/
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+/*}}}*/
+
+
+static void report(uint64_t blksz, int btree, int n, const char *op,/*{{{*/
+		double *lat, double t, uint64_t r)
+{
+	qsort(lat, n, sizeof(*lat), compare);
+	printf("btreedir blksz=%d layout=%s entries=%d op=%s ops_s=%.0f reads_op=%.1f "
+			"p50_us=%.1f p99_us=%.1f\n", (int)blksz, btree ? "btree" : "chain",
+			n, op, n / (t / 1e9), (double)r / n, lat[n / 2] / 1e3,
+			lat[n * 99 / 100] / 1e3);
+}
+/*}}}*/
+
+
+static int run(uint64_t blksz, int btree, int n)/*{{{*/
+{
+	struct fs_options opts = {.btree_dirs = btree};
+	double *lat = malloc(n * sizeof(*lat)), t, t0;
+	uint64_t r;
+	char name[32], buf[32];
+	int i;
+
+	FILE *fp = fopen(fname, "w");
+	if(!fp || ftruncate(fileno(fp), (uint64_t)n * 4 * blksz + (1 << 20))) {
+		perror(fname);
+		return -1;
+	}
+	fclose(fp);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(!sb) { perror("fs_format_opts"); return -1; }
+
+	/* names in a scrambled order, so that the tree sees random inserts */
+	r = syscr();
+	t = now();
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/file%07d", (int)((uint64_t)i * 7919 % n));
+		t0 = now();
+		if(fs_write_file(sb, name, name, strlen(name) + 1)) {
+			perror("fs_write_file");
+			return -1;
+		}
+		lat[i] = now() - t0;
+	}
+	report(blksz, btree, n, "create", lat, now() - t, syscr() - r);
+
+	srand(1);
+	r = syscr();
+	t = now();
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/file%07d", rand() % n);
+		t0 = now();
+		if(fs_read_file(sb, name, buf, sizeof(buf)) != strlen(name) + 1) {
+			puts("FAIL fs_read_file");
+			return -1;
+		}
+		lat[i] = now() - t0;
+	}
+	report(blksz, btree, n, "lookup", lat, now() - t, syscr() - r);
+
+	r = syscr();
+	t = now();
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/file%07d", i);
+		t0 = now();
+		if(fs_unlink(sb, name)) {
+			perror("fs_unlink");
+			return -1;
+		}
+		lat[i] = now() - t0;
+	}
+	report(blksz, btree, n, "unlink", lat, now() - t, syscr() - r);
+
+	free(lat);
+	fs_close(sb);
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t blkszs[] = {512, 4096}, i;
+	int entries[] = {1000, 5000}, j, btree;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+		for(j = 0; j < NELEMS(entries); j++) {
+			for(btree = 0; btree <= 1; btree++) {
+				if(run(blkszs[i], btree, entries[j])) exit(EXIT_FAILURE);
+			}
+		}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
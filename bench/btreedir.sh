@@ -0,0 +1,16 @@
+#!/bin/bash
+set -u
+
+gcc -O2 -Wall -I. bench/btreedir.c -o bench_btreedir -pthread &>> gcc.log
+if [ ! -x bench_btreedir ] ; then
+    echo "[btreedir] compilation error"
+    exit 1 ;
+fi
+
+if ! ./bench_btreedir ; then
+    echo "[btreedir] error"
+    exit 1
+fi
+
+rm -f bench_btreedir
+exit 0
@@ -0,0 +1,171 @@
+/* Defragments an image with fs_defrag and reports how fragmented it was
+ * before and after:
+ *
+ *   bench_defrag [-b budget] [-I] [image]
+ *
+ * fs_defrag is called with budget blocks at a time (FS_DEFRAG_INODES with
+ * -I) until it returns zero.  The image given is defragmented in place.
+ * Without one, an image in memory is aged first by CYCLES randomized
+ * create/overwrite/unlink cycles, as in bench/aging, and the time to read
+ * back the first HDDBYTES of its files through a hard disk profile is
+ * measured too.  fs.c is included directly.  Output has one line per stage:
+ *
+ *   defrag stage=before files=<n> blocks=<n> extents=<n> fragmented=<n> detached=<n> [hdd_mb_s=<x>]
+ *   defrag stage=after files=<n> blocks=<n> extents=<n> fragmented=<n> detached=<n> [hdd_mb_s=<x>] calls=<n> moved=<n> ms=<x> max_call_ms=<x>
+ *
+ * The counts are those of struct fs_fragmentation; max_call_ms is the
+ * longest single call, during which the image is unavailable to other
+ * threads.
+ */
+#include <time.h>
+
+#include "../fs.c"
+
+#define MAXFILES 4096
+#define BIGBLOCKS 256
+#define CYCLES 200000
+#define IMAGE_MB 64
+#define HDDBYTES (4 << 20)
+
+static uint64_t sizes[MAXFILES]; /* bytes of each file, zero if missing */
+static char *buf;
+
+/* a disk with no cost per call, so that only seeks and transfer count */
+static const struct fs_latency hdd = {.seek_ns = 4000000, .bytes_per_us = 150};
+
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/*}}}*/
+
+
+static void file_name(char *name, int i)/*{{{*/
+{
+	sprintf(name, "/d%d/f%d", i % 16, i);
+}
+/*}}}*/
+
+
+/* fills an image with a mix of small and large files, churned enough that
+ * they end up scattered */
+static void age(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	char name[32];
+	int cycle, i;
+	for(i = 0; i < 16; i++) {
+		sprintf(name, "/d%d", i);
+		fs_mkdir(sb, name);
+	}
+	for(cycle = 0; cycle < CYCLES; cycle++) {
+		i = rand() % MAXFILES;
+		file_name(name, i);
+		uint64_t used = 100 * (sb->blks - sb->freeblks) / sb->blks;
+		if(sizes[i] && rand() % 100 < (used > 70 ? 70 : 30)) {
+			if(fs_unlink(sb, name)) { perror(name); exit(EXIT_FAILURE); }
+			sizes[i] = 0;
+		} else if(used <= 70 || sizes[i]) {
+			uint64_t n = rand() % 4 ? 1 + rand() % 4 : 1 + rand() % BIGBLOCKS;
+			uint64_t size = n * blksz - rand() % blksz;
+			if(fs_write_file(sb, name, buf, size)) {
+				if(errno != ENOSPC) { perror(name); exit(EXIT_FAILURE); }
+			} else {
+				sizes[i] = size;
+			}
+		}
+	}
+}
+/*}}}*/
+
+
+/* MB/s reading the first HDDBYTES of files back through the slow device */
+static double read_all(struct superblock *sb, struct fs_backend *slow)/*{{{*/
+{
+	struct fs_backend *fast = sb->dev;
+	uint64_t bytes = 0;
+	char name[32];
+	double t = now();
+	int i;
+	sb->dev = slow;
+	for(i = 0; i < MAXFILES && bytes < HDDBYTES; i++) {
+		if(!sizes[i]) continue;
+		file_name(name, i);
+		if(fs_read_file(sb, name, buf, sizes[i]) != sizes[i]) { perror(name); exit(EXIT_FAILURE); }
+		bytes += sizes[i];
+	}
+	sb->dev = fast;
+	return bytes / (now() - t) * 1e9 / (1 << 20);
+}
+/*}}}*/
+
+
+static void report(struct superblock *sb, const char *stage, struct fs_backend *slow)/*{{{*/
+{
+	struct fs_fragmentation f;
+	if(fs_fragmentation(sb, &f)) { perror("fs_fragmentation"); exit(EXIT_FAILURE); }
+	printf("defrag stage=%s files=%" PRIu64 " blocks=%" PRIu64 " extents=%" PRIu64
+			" fragmented=%" PRIu64 " detached=%" PRIu64, stage, f.files, f.blocks,
+			f.extents, f.fragmented, f.detached);
+	if(slow) printf(" hdd_mb_s=%.2f", read_all(sb, slow));
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t budget = 4096, calls = 0, moved = 0, blksz = 1024;
+	struct fs_backend *slow = NULL;
+	struct superblock *sb;
+	double t, call, longest = 0;
+	int64_t n;
+	int flags = 0, c;
+	while((c = getopt(argc, argv, "b:I")) != -1) {
+		switch(c) {
+		case 'b': budget = strtoull(optarg, NULL, 10); break;
+		case 'I': flags |= FS_DEFRAG_INODES; break;
+		default:
+			fprintf(stderr, "usage: %s [-b budget] [-I] [image]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(optind < argc) {
+		sb = fs_open(argv[optind]);
+		if(!sb) { perror(argv[optind]); exit(EXIT_FAILURE); }
+	} else {
+		struct fs_options opts = {.btree_dirs = 1};
+		struct fs_backend *mem = fs_backend_memory((uint64_t)IMAGE_MB << 20);
+		slow = fs_backend_latency(mem, &hdd);
+		sb = slow ? fs_format_dev(mem, blksz, &opts) : NULL;
+		if(!sb) { perror("fs_format_dev"); exit(EXIT_FAILURE); }
+		buf = malloc(BIGBLOCKS * blksz);
+		memset(buf, 'x', BIGBLOCKS * blksz);
+		srand(1);
+		age(sb, blksz);
+	}
+
+	report(sb, "before", slow);
+	printf("\n");
+	fflush(stdout);
+	t = now();
+	do {
+		call = now();
+		if((n = fs_defrag(sb, budget, flags)) < 0) { perror("fs_defrag"); exit(EXIT_FAILURE); }
+		call = now() - call;
+		if(call > longest) longest = call;
+		moved += n;
+		calls++;
+	} while(n > 0);
+	t = now() - t;
+	report(sb, "after", slow);
+	printf(" calls=%" PRIu64 " moved=%" PRIu64 " ms=%.1f max_call_ms=%.1f\n", calls,
+			moved, t / 1e6, longest / 1e6);
+
+	if(fs_close(sb)) { perror("fs_close"); exit(EXIT_FAILURE); }
+	if(slow) fs_backend_close(slow);
+	free(buf);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
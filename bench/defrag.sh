@@ -0,0 +1,16 @@
+#!/bin/bash
+set -u
+
+gcc -O2 -Wall -I. bench/defrag.c -o bench_defrag -pthread &>> gcc.log
+if [ ! -x bench_defrag ] ; then
+    echo "[defrag] compilation error"
+    exit 1 ;
+fi
+
+if ! ./bench_defrag "$@" ; then
+    echo "[defrag] error"
+    exit 1
+fi
+
+rm -f bench_defrag
+exit 0
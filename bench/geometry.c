@@ -0,0 +1,149 @@
+/* Compares the block-size-specialized geometry routines of fs.c against the
+ * generic ones, and the vectorized link scans against a scalar loop.  fs.c
+ * is included directly so that every version can be selected on the same
+ * superblock.  Output has one measurement per line:
+ *
+ *   geometry blksz=<n> op=<op> impl=<generic|specialized> simd=<isa> ns_op=<ns>
+ */
+#include <time.h>
+
+#include "../fs.c"
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "bench.img";
+static volatile int64_t sink;
+
+#ifdef FS_SIMD
+/* scalar baseline; fs.c only builds it when there are no vector kernels */
+GERA_PROCURA(Escalar_Generico, sb->nlinks, procuraEscalar, )
+GERA_PROCURA(Escalar_128, NLINKS_DE(128), procuraEscalar, )
+GERA_PROCURA(Escalar_256, NLINKS_DE(256), procuraEscalar, )
+GERA_PROCURA(Escalar_512, NLINKS_DE(512), procuraEscalar, )
+GERA_PROCURA(Escalar_1024, NLINKS_DE(1024), procuraEscalar, )
+GERA_PROCURA(Escalar_4096, NLINKS_DE(4096), procuraEscalar, )
+static const struct fs_geomops geometriasEscalar[] = TABELA_GEOMETRIA(Escalar);
+#endif
+
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/*}}}*/
+
+
+static void report(uint64_t blksz, const char *op, const struct fs_geomops *ops,/*{{{*/
+		double ns, uint64_t n)
+{
+	printf("geometry blksz=%d op=%s impl=%s simd=%s ns_op=%.2f\n", (int)blksz,
+			op, ops->blksz ? "specialized" : "generic", ops->nucleo, ns / n);
+}
+/*}}}*/
+
+
+/* link scans over an in-memory inode: a free-slot search that only
+ * succeeds at the last link and a walk over every used link. */
+static void bench_scan(struct superblock *sb, const struct fs_geomops *ops)/*{{{*/
+{
+	uint64_t n = 2000000, i;
+	int64_t j;
+	struct inode *in = calloc(sb->blksz, 1);
+	for(i = 0; i < sb->nlinks - 1; i++) in->links[i] = i + 100;
+
+	double t = now();
+	for(i = 0; i < n; i++) sink += ops->procura(sb, in->links, 0, 0);
+	report(sb->blksz, "find_zero", ops, now() - t, n);
+
+	t = now();
+	for(i = 0; i < n; i++) sink += ops->procura(sb, in->links, 0, 100 + i % (sb->nlinks - 1));
+	report(sb->blksz, "find_value", ops, now() - t, n);
+
+	for(i = 0; i < sb->nlinks; i += 3) in->links[i] = 0;
+	t = now();
+	for(i = 0; i < n / 4; i++) {
+		for(j = ops->procuraUsado(sb, in->links, 0); j >= 0;
+				j = ops->procuraUsado(sb, in->links, j + 1))
+			sink += j;
+	}
+	report(sb->blksz, "walk_used", ops, now() - t, n / 4);
+	free(in);
+}
+/*}}}*/
+
+
+/* block I/O through the page cache, then whole filesystem operations
+ * against a freshly formatted image. */
+static int bench_ops(uint64_t blksz, const struct fs_geomops *ops)/*{{{*/
+{
+	FILE *fp = fopen(fname, "w");
+	if(!fp || ftruncate(fileno(fp), 8 << 20)) { perror(fname); return -1; }
+	fclose(fp);
+
+	struct superblock *sb = fs_format(fname, blksz);
+	if(!sb) { perror("fs_format"); return -1; }
+	sb->ops = ops;
+
+	uint64_t n = 200000, i;
+	char *buf = calloc(blksz, 1);
+	double t = now();
+	for(i = 0; i < n; i++) sink += leBloco(sb, 3 + (i * 7919) % (sb->blks - 3), buf);
+	report(blksz, "read_block", sb->ops, now() - t, n);
+	free(buf);
+
+	char name[32];
+	int nfiles = sb->nlinks, rounds = 20, r;
+	t = now();
+	for(r = 0; r < rounds; r++) {
+		for(i = 0; i < nfiles; i++) {
+			sprintf(name, "/f%d", (int)i);
+			fs_write_file(sb, name, name, strlen(name) + 1);
+		}
+		for(i = 0; i < nfiles; i++) {
+			sprintf(name, "/f%d", (int)i);
+			fs_unlink(sb, name);
+		}
+	}
+	report(blksz, "create_unlink", sb->ops, now() - t, rounds * nfiles);
+
+	fs_close(sb);
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+/* every table that can run on this machine */
+static const struct fs_geomops *tables[3];
+static int ntables;
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t blkszs[] = {128, 256, 512, 1024, 4096};
+	int i, j, k;
+#ifdef FS_SIMD
+	tables[ntables++] = geometriasEscalar;
+	tables[ntables++] = geometrias;
+	if(__builtin_cpu_supports("avx2")) tables[ntables++] = geometriasAvx2;
+#else
+	tables[ntables++] = geometrias;
+#endif
+	for(i = 0; i < NELEMS(blkszs); i++) {
+		struct superblock sb = {.blksz = blkszs[i]};
+		calculaGeometria(&sb);
+		if(!sb.ops->blksz) { puts("FAIL no specialized routines"); exit(EXIT_FAILURE); }
+		for(j = 0; j < ntables; j++) {
+			for(k = 0; k < NGEOMETRIAS; k++) {
+				const struct fs_geomops *ops = &tables[j][k];
+				if(ops->blksz && ops->blksz != blkszs[i]) continue;
+				bench_scan(&sb, ops);
+				if(bench_ops(blkszs[i], ops)) exit(EXIT_FAILURE);
+			}
+		}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
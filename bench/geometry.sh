@@ -0,0 +1,16 @@
+#!/bin/bash
+set -u
+
+gcc -O2 -Wall -I. bench/geometry.c -o bench_geometry &>> gcc.log
+if [ ! -x bench_geometry ] ; then
+    echo "[geometry] compilation error"
+    exit 1 ;
+fi
+
+if ! ./bench_geometry ; then
+    echo "[geometry] error"
+    exit 1
+fi
+
+rm -f bench_geometry
+exit 0
@@ -0,0 +1,109 @@
+/* Durable metadata throughput with the journal, as the number of threads
+ * creating and removing files grows, against an image without journal that
+ * calls fdatasync after every operation.  Each thread works in its own
+ * directory.  Output has one measurement per line:
+ *
+ *   journal mode=<fsync|journal> threads=<n> ops_s=<ops> fsyncs_op=<n>
+ */
+#include <time.h>
+
+#include "../fs.c"
+
+static char *fname = "bench.img";
+static int nops = 400;
+static int journaled;
+static volatile uint64_t nsyncs;
+static int next; /* directory of the next worker */
+
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/*}}}*/
+
+
+/* without the journal each operation is made durable by hand */
+static void sync_op(struct superblock *sb)/*{{{*/
+{
+	if(journaled) return;
+	fdatasync(sb->fd);
+	__sync_fetch_and_add(&nsyncs, 1);
+}
+/*}}}*/
+
+
+static void *worker(void *arg)/*{{{*/
+{
+	struct superblock *sb = arg;
+	char name[32];
+	int id = __sync_fetch_and_add(&next, 1), i;
+
+	for(i = 0; i < nops; i++) {
+		sprintf(name, "/d%d/f%d", id, i % 64);
+		if(i >= 64) {
+			fs_unlink(sb, name);
+			sync_op(sb);
+		}
+		if(fs_write_file(sb, name, name, strlen(name) + 1) < 0) {
+			perror("fs_write_file");
+			exit(EXIT_FAILURE);
+		}
+		sync_op(sb);
+	}
+	return NULL;
+}
+/*}}}*/
+
+
+static int run(int nthreads)/*{{{*/
+{
+	struct fs_options opts = {.journal = 4096};
+	pthread_t threads[64];
+	char name[32];
+	int i;
+
+	FILE *fp = fopen(fname, "w");
+	if(!fp || ftruncate(fileno(fp), 64 << 20)) { perror(fname); return -1; }
+	fclose(fp);
+	struct superblock *sb = fs_format_opts(fname, 4096, journaled ? &opts : NULL);
+	if(!sb) { perror("fs_format_opts"); return -1; }
+	for(i = 0; i < nthreads; i++) {
+		sprintf(name, "/d%d", i);
+		fs_mkdir(sb, name);
+	}
+	next = 0;
+	/* the lock (and with the journal, group commit) is on from here */
+	if(!journaled) criaEstado(sb);
+
+	uint64_t syncs = journaled ? sb->bg->diario->grupos : nsyncs;
+	double t = now();
+	for(i = 0; i < nthreads; i++) pthread_create(&threads[i], NULL, worker, sb);
+	for(i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+	t = now() - t;
+	uint64_t ops = (uint64_t)nthreads * nops * 2 - (uint64_t)nthreads * 64;
+	syncs = (journaled ? sb->bg->diario->grupos : nsyncs) - syncs;
+
+	printf("journal mode=%s threads=%d ops_s=%.0f fsyncs_op=%.3f\n",
+			journaled ? "journal" : "fsync", nthreads, ops / (t / 1e9),
+			(double)syncs / ops);
+	fs_close(sb);
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	int nthreads[] = {1, 2, 4, 8, 16}, i;
+	for(journaled = 0; journaled < 2; journaled++) {
+		for(i = 0; i < sizeof(nthreads) / sizeof(nthreads[0]); i++) {
+			if(run(nthreads[i])) exit(EXIT_FAILURE);
+		}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
@@ -0,0 +1,16 @@
+#!/bin/bash
+set -u
+
+gcc -O2 -Wall -I. bench/journal.c -o bench_journal -pthread &>> gcc.log
+if [ ! -x bench_journal ] ; then
+    echo "[journal] compilation error"
+    exit 1 ;
+fi
+
+if ! ./bench_journal ; then
+    echo "[journal] error"
+    exit 1
+fi
+
+rm -f bench_journal
+exit 0
@@ -0,0 +1,132 @@
+/* Lists a directory with many entries through fs_readdir, which reads the
+ * inodes and nodeinfos of the entries in batches, and through a serial walk
+ * that reads each entry's inode and then its nodeinfo (built here with the
+ * internal routines of fs.c, which is included directly).  Read system
+ * calls are taken from /proc/self/io.  Output has one measurement per line:
+ *
+ *   listdir blksz=<n> layout=<chain|btree> entries=<n> impl=<serial|batched> ms=<ms> reads=<n> reads_entry=<n>
+ */
+#include <time.h>
+
+#include "../fs.c"
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "bench.img";
+static int nentries = 10000;
+
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/*}}}*/
+
+
+static uint64_t syscr(void)/*{{{*/
+{
+	char line[128];
+	uint64_t n = 0;
+	FILE *fp = fopen("/proc/self/io", "r");
+	while(fp && fgets(line, sizeof(line), fp)) sscanf(line, "syscr: %" SCNu64, &n);
+	if(fp) fclose(fp);
+	return n;
+}
+/*}}}*/
+
+
+/* one inode read and one nodeinfo read per entry, as listings used to do */
+static int list_serial(struct superblock *sb, uint64_t *n)/*{{{*/
+{
+	struct listaBlocos entradas = {NULL, 0, 0}, nos = {NULL, 0, 0};
+	struct inode *in = malloc(sb->blksz);
+	struct nodeinfo *info = malloc(sb->blksz);
+	uint64_t i;
+	if(leBloco(sb, sb->root, in) == -1) return -1;
+	if(entradasDiretorio(sb, in, &entradas, &nos) == -1) return -1;
+	for(i = 0; i < entradas.n; i++) {
+		if(leBloco(sb, entradas.v[i], in) == -1) return -1;
+		if(leBloco(sb, in->meta, info) == -1) return -1;
+	}
+	*n = entradas.n;
+	free(entradas.v);
+	free(nos.v);
+	free(in);
+	free(info);
+	return 0;
+}
+/*}}}*/
+
+
+static int list_batched(struct superblock *sb, uint64_t *n)/*{{{*/
+{
+	struct fs_dir *d = fs_opendir(sb, "/");
+	if(!d) return -1;
+	for(*n = 0; fs_readdir(d) != NULL; (*n)++);
+	fs_closedir(d);
+	return errno ? -1 : 0;
+}
+/*}}}*/
+
+
+static int run(uint64_t blksz, int btree)/*{{{*/
+{
+	struct fs_options opts = {.btree_dirs = btree};
+	char name[32];
+	uint64_t n, r;
+	double t;
+	int i, batched;
+
+	FILE *fp = fopen(fname, "w");
+	if(!fp || ftruncate(fileno(fp), (uint64_t)nentries * 4 * blksz + (1 << 20))) {
+		perror(fname);
+		return -1;
+	}
+	fclose(fp);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(!sb) { perror("fs_format_opts"); return -1; }
+	struct fs_write_req *reqs = malloc(nentries * sizeof(*reqs));
+	char (*names)[32] = malloc(nentries * sizeof(*names));
+	for(i = 0; i < nentries; i++) {
+		sprintf(names[i], "/file%07d", i);
+		reqs[i] = (struct fs_write_req){names[i], name, 8};
+	}
+	if(fs_write_files(sb, reqs, nentries)) { perror("fs_write_files"); return -1; }
+
+	for(batched = 0; batched <= 1; batched++) {
+		r = syscr();
+		t = now();
+		if((batched ? list_batched : list_serial)(sb, &n) || n != nentries) {
+			puts("FAIL listing");
+			return -1;
+		}
+		t = now() - t;
+		r = syscr() - r;
+		printf("listdir blksz=%d layout=%s entries=%d impl=%s ms=%.2f reads=%d "
+				"reads_entry=%.3f\n", (int)blksz, btree ? "btree" : "chain",
+				nentries, batched ? "batched" : "serial", t / 1e6, (int)r,
+				(double)r / n);
+	}
+	free(reqs);
+	free(names);
+	fs_close(sb);
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t blkszs[] = {512, 4096}, i;
+	int btree;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+		for(btree = 0; btree <= 1; btree++) {
+			if(run(blkszs[i], btree)) exit(EXIT_FAILURE);
+		}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
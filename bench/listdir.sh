@@ -0,0 +1,16 @@
+#!/bin/bash
+set -u
+
+gcc -O2 -Wall -I. bench/listdir.c -o bench_listdir -pthread &>> gcc.log
+if [ ! -x bench_listdir ] ; then
+    echo "[listdir] compilation error"
+    exit 1 ;
+fi
+
+if ! ./bench_listdir ; then
+    echo "[listdir] error"
+    exit 1
+fi
+
+rm -f bench_listdir
+exit 0
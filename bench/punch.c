@@ -0,0 +1,149 @@
+/* Measures what hole punching (fs_set_punch) costs the operations that free
+ * blocks and how much of a sparse image file it gives back to the host:
+ *
+ *   bench_punch [-s MB] [-j journal] [file]
+ *
+ * For each batch size (0 is punching off), a fully allocated image of MB
+ * megabytes (64 by default) on file (punch.img by default) is formatted with
+ * a journal of the given number of blocks (none by default), punching is
+ * turned on, FILES files of random sizes fill about two thirds of it and are
+ * then all unlinked, each call timed.  fs.c is included directly.  Output has
+ * one line per batch size:
+ *
+ *   punch batch=<n> files=<n> unlink_us=<x> max_unlink_us=<x> host_mb_before=<x> host_mb_after=<x> reclaimed_mb=<x> reclaim_mb_s=<x> discards=<n>
+ *
+ * host_mb_* is the storage the host keeps for the file (st_blocks) with the
+ * files written and once the image is closed after the unlinks;
+ * reclaim_mb_s divides the difference by the time of the unlinks and of
+ * fs_close, which releases what is still queued.  discards counts the calls
+ * made by the unlinks alone.
+ */
+#include <time.h>
+
+#include "../fs.c"
+
+#define FILES 2048
+#define BIGBLOCKS 256
+#define BLKSZ 4096
+
+static uint64_t blocks[FILES]; /* blocks of each file */
+static char *buf;
+
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/*}}}*/
+
+
+static void file_name(char *name, int i)/*{{{*/
+{
+	sprintf(name, "/d%d/f%d", i % 16, i);
+}
+/*}}}*/
+
+
+static double host_mb(const char *fname)/*{{{*/
+{
+	struct stat st;
+	if(stat(fname, &st)) { perror(fname); exit(EXIT_FAILURE); }
+	return (double)st.st_blocks * 512 / (1 << 20);
+}
+/*}}}*/
+
+
+/* a file of mb megabytes with all its storage allocated */
+static void generate_file(const char *fname, uint64_t mb)/*{{{*/
+{
+	int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || ftruncate(fd, mb << 20) || posix_fallocate(fd, 0, mb << 20)) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+}
+/*}}}*/
+
+
+static void run(const char *fname, uint64_t mb, uint64_t journal, uint64_t batch)/*{{{*/
+{
+	struct fs_options opts = {.journal = journal, .btree_dirs = 1};
+	struct superblock *sb;
+	struct fs_stats st;
+	double t, call, total = 0, longest = 0, before, after;
+	char name[32];
+	int i, files = 0;
+	generate_file(fname, mb);
+	sb = fs_format_opts(fname, BLKSZ, &opts);
+	if(!sb) { perror("fs_format_opts"); exit(EXIT_FAILURE); }
+	if(batch && fs_set_punch(sb, batch)) { perror("fs_set_punch"); exit(EXIT_FAILURE); }
+	for(i = 0; i < 16; i++) {
+		sprintf(name, "/d%d", i);
+		if(fs_mkdir(sb, name)) { perror(name); exit(EXIT_FAILURE); }
+	}
+	srand(1);
+	for(i = 0; i < FILES; i++) {
+		blocks[i] = rand() % 4 ? 1 + rand() % 4 : 1 + rand() % BIGBLOCKS;
+		if(3 * (sb->blks - sb->freeblks + 2 * blocks[i]) > 2 * sb->blks) {
+			blocks[i] = 0;
+			continue;
+		}
+		file_name(name, i);
+		if(fs_write_file(sb, name, buf, blocks[i] * BLKSZ)) { perror(name); exit(EXIT_FAILURE); }
+		files++;
+	}
+	before = host_mb(fname);
+
+	fs_reset_stats(sb);
+	for(i = 0; i < FILES; i++) {
+		if(!blocks[i]) continue;
+		file_name(name, i);
+		call = now();
+		if(fs_unlink(sb, name)) { perror(name); exit(EXIT_FAILURE); }
+		call = now() - call;
+		if(call > longest) longest = call;
+		total += call;
+	}
+	if(fs_get_stats(sb, &st)) { perror("fs_get_stats"); exit(EXIT_FAILURE); }
+	t = now();
+	if(fs_close(sb)) { perror("fs_close"); exit(EXIT_FAILURE); }
+	t = now() - t + total;
+	after = host_mb(fname);
+	printf("punch batch=%" PRIu64 " files=%d unlink_us=%.2f max_unlink_us=%.1f"
+			" host_mb_before=%.1f host_mb_after=%.1f reclaimed_mb=%.1f"
+			" reclaim_mb_s=%.1f discards=%" PRIu64 "\n", batch, files,
+			total / files / 1e3, longest / 1e3, before, after, before - after,
+			(before - after) / t * 1e9, st.discards);
+	fflush(stdout);
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t batches[] = {0, 1, 64, 1024, 16384};
+	uint64_t mb = 64, journal = 0;
+	const char *fname = "punch.img";
+	int c, i;
+	while((c = getopt(argc, argv, "s:j:")) != -1) {
+		switch(c) {
+		case 's': mb = strtoull(optarg, NULL, 10); break;
+		case 'j': journal = strtoull(optarg, NULL, 10); break;
+		default:
+			fprintf(stderr, "usage: %s [-s MB] [-j journal] [file]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(optind < argc) fname = argv[optind];
+	buf = malloc(BIGBLOCKS * BLKSZ);
+	memset(buf, 'x', BIGBLOCKS * BLKSZ);
+	for(i = 0; i < sizeof(batches) / sizeof(batches[0]); i++)
+		run(fname, mb, journal, batches[i]);
+	unlink(fname);
+	free(buf);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
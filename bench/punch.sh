@@ -0,0 +1,16 @@
+#!/bin/bash
+set -u
+
+gcc -O2 -Wall -I. bench/punch.c -o bench_punch -pthread &>> gcc.log
+if [ ! -x bench_punch ] ; then
+    echo "[punch] compilation error"
+    exit 1 ;
+fi
+
+if ! ./bench_punch "$@" ; then
+    echo "[punch] error"
+    exit 1
+fi
+
+rm -f bench_punch
+exit 0
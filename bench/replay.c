@@ -0,0 +1,177 @@
+/* Replays a recording made with fs_record_start and reports the latency of
+ * each kind of call:
+ *
+ *   bench_replay [-t threads] [-s speedup] [-i image] [recording]
+ *
+ * The calls are made on a copy of the image given with -i or, without it,
+ * on an image in memory formatted with the geometry of the recording.
+ * -t and -s are the fields of struct fs_replay_options.  Without a
+ * recording, a workload of NTHREADS threads is recorded first and then
+ * replayed with one thread and with one per recorded thread, as fast as
+ * possible and at the recorded speed.  fs.c is included directly.  Output
+ * has one measurement per line:
+ *
+ *   replay threads=<n> speedup=<x> op=<name> calls=<n> mean_us=<us> p50_us=<us> p99_us=<us>
+ *   replay threads=<n> speedup=<x> calls=<n> failed=<n> wall_ms=<ms>
+ *
+ * Percentiles are the upper ends of the power-of-two buckets of struct
+ * fs_stats.
+ */
+#include <time.h>
+
+#include "../fs.c"
+
+#define NTHREADS 4
+#define NFILES 2000
+
+static char *copy = "replay.img";
+static char *recorded = "replay.rec";
+
+
+/* upper end, in microseconds, of the bucket holding quantile q of op */
+static double percentile(const struct fs_stats *st, int op, double q)/*{{{*/
+{
+	uint64_t n = 0, k;
+	for(k = 0; k < FS_LATENCY_BUCKETS; k++) {
+		n += st->latency[op][k];
+		if(n >= q * st->calls[op]) break;
+	}
+	return (double)((uint64_t)2 << k) / 1000;
+}
+/*}}}*/
+
+
+static int copy_file(const char *from, const char *to)/*{{{*/
+{
+	char buf[1 << 16];
+	size_t n;
+	FILE *in = fopen(from, "r"), *out = fopen(to, "w");
+	if(!in || !out) return -1;
+	while((n = fread(buf, 1, sizeof(buf), in)) > 0)
+		if(fwrite(buf, 1, n, out) != n) return -1;
+	fclose(in);
+	return fclose(out);
+}
+/*}}}*/
+
+
+static int replay(const char *path, const char *image, uint64_t threads,/*{{{*/
+		double speedup)
+{
+	struct fs_replay_options opts = {threads, speedup};
+	struct fs_replay_result res;
+	struct fs_record_header h;
+	struct fs_backend *dev = NULL;
+	struct superblock *sb;
+	struct fs_stats st;
+	int op;
+
+	FILE *fp = fopen(path, "r");
+	if(!fp || fread(&h, sizeof(h), 1, fp) != 1) { perror(path); return -1; }
+	fclose(fp);
+	if(image) {
+		if(copy_file(image, copy)) { perror(image); return -1; }
+		sb = fs_open(copy);
+	} else {
+		struct fs_options fopts = {.journal = h.journal, .btree_dirs = h.btree};
+		dev = fs_backend_memory(h.blks * h.blksz);
+		sb = dev ? fs_format_dev(dev, h.blksz, &fopts) : NULL;
+	}
+	if(!sb) { perror("image"); return -1; }
+
+	fs_reset_stats(sb);
+	if(fs_replay(sb, path, &opts, &res)) { perror("fs_replay"); return -1; }
+	fs_get_stats(sb, &st);
+	for(op = 0; op < FS_NOPS; op++) {
+		if(!st.calls[op]) continue;
+		printf("replay threads=%d speedup=%g op=%s calls=%d mean_us=%.1f "
+				"p50_us=%.1f p99_us=%.1f\n", (int)threads, speedup, nomesOp[op],
+				(int)st.calls[op], (double)st.ns[op] / st.calls[op] / 1000,
+				percentile(&st, op, 0.5), percentile(&st, op, 0.99));
+	}
+	printf("replay threads=%d speedup=%g calls=%d failed=%d wall_ms=%.1f\n",
+			(int)threads, speedup, (int)res.calls, (int)res.failed,
+			(double)res.ns / 1e6);
+	fs_close(sb);
+	if(dev) fs_backend_close(dev);
+	if(image) unlink(copy);
+	return 0;
+}
+/*}}}*/
+
+
+static void * record_thread(void *arg)/*{{{*/
+{
+	struct superblock *sb = arg;
+	char name[32], buf[4096];
+	int i;
+	static int ids;
+	memset(buf, 'x', sizeof(buf));
+	sprintf(name, "/t%d", __atomic_add_fetch(&ids, 1, __ATOMIC_RELAXED));
+	fs_mkdir(sb, name);
+	char *end = name + strlen(name);
+	for(i = 0; i < NFILES; i++) {
+		sprintf(end, "/%d", i);
+		fs_write_file(sb, name, buf, 1 + i % sizeof(buf));
+		fs_read_file(sb, name, buf, sizeof(buf));
+		if(i % 3 == 0) fs_unlink(sb, name);
+		if(i % 100 == 0) {
+			*end = 0;
+			free(fs_list_dir(sb, name));
+		}
+	}
+	return NULL;
+}
+/*}}}*/
+
+
+/* records NTHREADS threads writing, reading and unlinking files */
+static int record(const char *path)/*{{{*/
+{
+	/* the journal gives the superblock the lock its threads need */
+	struct fs_options opts = {.journal = 256, .btree_dirs = 1};
+	pthread_t threads[NTHREADS];
+	int i;
+	struct fs_backend *dev = fs_backend_memory(64 << 20);
+	struct superblock *sb = dev ? fs_format_dev(dev, 1024, &opts) : NULL;
+	if(!sb || fs_record_start(sb, path)) { perror("fs_record_start"); return -1; }
+	for(i = 0; i < NTHREADS; i++) pthread_create(&threads[i], NULL, record_thread, sb);
+	for(i = 0; i < NTHREADS; i++) pthread_join(threads[i], NULL);
+	if(fs_record_stop(sb)) { perror("fs_record_stop"); return -1; }
+	fs_close(sb);
+	fs_backend_close(dev);
+	return 0;
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t threads = 0;
+	double speedup = 0;
+	char *image = NULL;
+	int c;
+	while((c = getopt(argc, argv, "t:s:i:")) != -1) {
+		switch(c) {
+		case 't': threads = strtoull(optarg, NULL, 10); break;
+		case 's': speedup = strtod(optarg, NULL); break;
+		case 'i': image = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-t threads] [-s speedup] [-i image] "
+					"[recording]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(optind < argc) {
+		if(replay(argv[optind], image, threads, speedup)) exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+
+	if(record(recorded)) exit(EXIT_FAILURE);
+	if(replay(recorded, NULL, 1, 0) || replay(recorded, NULL, 0, 0) ||
+			replay(recorded, NULL, 0, 1))
+		exit(EXIT_FAILURE);
+	unlink(recorded);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
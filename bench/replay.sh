@@ -0,0 +1,16 @@
+#!/bin/bash
+set -u
+
+gcc -O2 -Wall -I. bench/replay.c -o bench_replay -pthread &>> gcc.log
+if [ ! -x bench_replay ] ; then
+    echo "[replay] compilation error"
+    exit 1 ;
+fi
+
+if ! ./bench_replay "$@" ; then
+    echo "[replay] error"
+    exit 1
+fi
+
+rm -f bench_replay
+exit 0
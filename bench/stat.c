@@ -0,0 +1,114 @@
+/* Looks up the metadata of every file in a few directories, one path at a
+ * time with fs_stat and all at once with fs_stat_many, for both directory
+ * layouts.  fs.c is included directly.  Read system calls are taken from
+ * /proc/self/io.  Output has one measurement per line:
+ *
+ *   stat blksz=<n> layout=<chain|btree> files=<n> impl=<stat|stat_many> ops_s=<ops> reads_op=<n>
+ */
+#include <time.h>
+
+#include "../fs.c"
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NDIRS 4
+
+static char *fname = "bench.img";
+static int nfiles = 4000;
+
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/*}}}*/
+
+
+static uint64_t syscr(void)/*{{{*/
+{
+	char line[128];
+	uint64_t n = 0;
+	FILE *fp = fopen("/proc/self/io", "r");
+	while(fp && fgets(line, sizeof(line), fp)) sscanf(line, "syscr: %" SCNu64, &n);
+	if(fp) fclose(fp);
+	return n;
+}
+/*}}}*/
+
+
+static int run(uint64_t blksz, int btree)/*{{{*/
+{
+	struct fs_options opts = {.btree_dirs = btree};
+	struct fs_write_req *reqs = malloc(nfiles * sizeof(*reqs));
+	struct fs_stat *out = malloc(nfiles * sizeof(*out));
+	const char **paths = malloc(nfiles * sizeof(*paths));
+	char (*names)[32] = malloc(nfiles * sizeof(*names)), dir[16];
+	int i, many;
+
+	FILE *fp = fopen(fname, "w");
+	if(!fp || ftruncate(fileno(fp), (uint64_t)nfiles * 4 * blksz + (1 << 20))) {
+		perror(fname);
+		return -1;
+	}
+	fclose(fp);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(!sb) { perror("fs_format_opts"); return -1; }
+	for(i = 0; i < NDIRS; i++) {
+		sprintf(dir, "/d%d", i);
+		if(fs_mkdir(sb, dir)) { perror("fs_mkdir"); return -1; }
+	}
+	for(i = 0; i < nfiles; i++) {
+		sprintf(names[i], "/d%d/file%06d", i % NDIRS, i);
+		reqs[i] = (struct fs_write_req){names[i], names[i], i % 100};
+	}
+	if(fs_write_files(sb, reqs, nfiles)) { perror("fs_write_files"); return -1; }
+	/* a scrambled order, as a scheduler would ask */
+	for(i = 0; i < nfiles; i++) paths[i] = names[(uint64_t)i * 7919 % nfiles];
+
+	for(many = 0; many <= 1; many++) {
+		uint64_t r = syscr();
+		double t = now();
+		if(many) {
+			if(fs_stat_many(sb, paths, nfiles, out) != nfiles) {
+				puts("FAIL fs_stat_many");
+				return -1;
+			}
+		} else {
+			for(i = 0; i < nfiles; i++) {
+				if(fs_stat(sb, paths[i], &out[i])) {
+					puts("FAIL fs_stat");
+					return -1;
+				}
+			}
+		}
+		t = now() - t;
+		r = syscr() - r;
+		printf("stat blksz=%d layout=%s files=%d impl=%s ops_s=%.0f reads_op=%.2f\n",
+				(int)blksz, btree ? "btree" : "chain", nfiles,
+				many ? "stat_many" : "stat", nfiles / (t / 1e9),
+				(double)r / nfiles);
+	}
+	free(reqs);
+	free(out);
+	free(paths);
+	free(names);
+	fs_close(sb);
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t blkszs[] = {512, 4096}, i;
+	int btree;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+		for(btree = 0; btree <= 1; btree++) {
+			if(run(blkszs[i], btree)) exit(EXIT_FAILURE);
+		}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
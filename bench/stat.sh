@@ -0,0 +1,16 @@
+#!/bin/bash
+set -u
+
+gcc -O2 -Wall -I. bench/stat.c -o bench_stat -pthread &>> gcc.log
+if [ ! -x bench_stat ] ; then
+    echo "[stat] compilation error"
+    exit 1 ;
+fi
+
+if ! ./bench_stat ; then
+    echo "[stat] error"
+    exit 1
+fi
+
+rm -f bench_stat
+exit 0
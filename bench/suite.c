@@ -0,0 +1,312 @@
+/* Throughput and latency of the public operations over the block sizes of
+ * tests/test2.c to test6.c (64 is left out: fs_format rejects it) at larger
+ * image sizes: these are multiplied by the scale given as the first argument
+ * (default 1; 64 gives 4 GB images), and the number of small files grows
+ * with the image.  Small files are spread over directories of at most
+ * FANOUT_CHAIN (chain layout) or FANOUT_BTREE (B+tree layout) entries.  fs.c is included
+ * directly.  System calls are the read and write calls counted in
+ * /proc/self/io.  Output has one measurement per line:
+ *
+ *   suite blksz=<n> image_mb=<n> layout=<chain|btree> op=<op> n=<ops> ops_s=<ops> mb_s=<mb> p50_us=<us> p99_us=<us> syscalls_op=<n>
+ *
+ * op is one of format, open, mkdir, create, lookup_fanout, lookup_depth<d>,
+ * list_dir, write_seq, read_seq and unlink.  mb_s is zero for operations
+ * that do not move file data.
+ */
+#include <time.h>
+
+#include "../fs.c"
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define FANOUT_CHAIN 64
+#define FANOUT_BTREE 4096
+#define DEPTH 8
+#define REPEAT 5
+
+static char *fname = "bench.img";
+static uint64_t scale = 1;
+static uint64_t maxfiles = 20000; /* small files per image, times scale */
+
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/*}}}*/
+
+
+static uint64_t syscalls(void)/*{{{*/
+{
+	char line[128];
+	uint64_t n = 0, r = 0, w = 0;
+	FILE *fp = fopen("/proc/self/io", "r");
+	while(fp && fgets(line, sizeof(line), fp)) {
+		if(sscanf(line, "syscr: %" SCNu64, &n) == 1) r = n;
+		if(sscanf(line, "syscw: %" SCNu64, &n) == 1) w = n;
+	}
+	if(fp) fclose(fp);
+	return r + w;
+}
+/*}}}*/
+
+
+static int compare(const void *a, const void *b)/*{{{*/
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+/*}}}*/
+
+
+/* one operation being measured: n calls, their latencies and the bytes of
+ * file data they moved */
+struct measure {
+	const char *op;
+	uint64_t n, bytes, sys;
+	double *lat, t, t0;
+};
+
+static uint64_t blksz, fsize;
+static int btree;
+
+
+static void start(struct measure *m, const char *op, uint64_t n)/*{{{*/
+{
+	m->op = op;
+	m->n = 0;
+	m->bytes = 0;
+	m->lat = realloc(m->lat, (n ? n : 1) * sizeof(double));
+	m->sys = syscalls();
+	m->t = now();
+}
+/*}}}*/
+
+
+static void tick(struct measure *m)/*{{{*/
+{
+	m->t0 = now();
+}
+/*}}}*/
+
+
+static void tock(struct measure *m, uint64_t bytes)/*{{{*/
+{
+	m->lat[m->n++] = now() - m->t0;
+	m->bytes += bytes;
+}
+/*}}}*/
+
+
+static void report(struct measure *m)/*{{{*/
+{
+	double t = now() - m->t;
+	uint64_t sys = syscalls() - m->sys;
+	if(m->n == 0) return;
+	qsort(m->lat, m->n, sizeof(double), compare);
+	printf("suite blksz=%d image_mb=%d layout=%s op=%s n=%d ops_s=%.0f "
+			"mb_s=%.1f p50_us=%.1f p99_us=%.1f syscalls_op=%.2f\n",
+			(int)blksz, (int)(fsize >> 20), btree ? "btree" : "chain",
+			m->op, (int)m->n, m->n / (t / 1e9), m->bytes / (t / 1e9) / 1e6,
+			m->lat[m->n / 2] / 1e3, m->lat[m->n * 99 / 100] / 1e3,
+			(double)sys / m->n);
+	fflush(stdout);
+}
+/*}}}*/
+
+
+#define FAIL(str) { perror(str); return -1; }
+
+
+static struct superblock *format(struct measure *m)/*{{{*/
+{
+	struct fs_options opts = {.btree_dirs = btree};
+	struct superblock *sb = NULL;
+	int i;
+
+	start(m, "format", REPEAT);
+	for(i = 0; i < REPEAT; i++) {
+		unlink(fname);
+		FILE *fp = fopen(fname, "w");
+		if(!fp || ftruncate(fileno(fp), fsize)) { perror(fname); return NULL; }
+		fclose(fp);
+		if(sb) fs_close(sb);
+		tick(m);
+		sb = fs_format_opts(fname, blksz, &opts);
+		tock(m, 0);
+		if(!sb) { perror("fs_format_opts"); return NULL; }
+	}
+	report(m);
+
+	fs_close(sb);
+	start(m, "open", REPEAT);
+	for(i = 0; i < REPEAT; i++) {
+		if(i) fs_close(sb);
+		tick(m);
+		sb = fs_open(fname);
+		tock(m, 0);
+		if(!sb) { perror("fs_open"); return NULL; }
+	}
+	report(m);
+	return sb;
+}
+/*}}}*/
+
+
+/* small files spread over fan-out directories, looked up, listed and
+ * removed; the number of files grows with the image */
+static int small_files(struct superblock *sb, struct measure *m)/*{{{*/
+{
+	uint64_t fanout = btree ? FANOUT_BTREE : FANOUT_CHAIN;
+	uint64_t nfiles = fsize / blksz / 8, ndirs, i;
+	char name[64], data[64] = "small file contents";
+	struct fs_stat st;
+
+	if(nfiles > maxfiles * scale) nfiles = maxfiles * scale;
+	ndirs = (nfiles + fanout - 1) / fanout;
+
+	start(m, "mkdir", ndirs);
+	for(i = 0; i < ndirs; i++) {
+		sprintf(name, "/d%d", (int)i);
+		tick(m);
+		if(fs_mkdir(sb, name)) FAIL("fs_mkdir");
+		tock(m, 0);
+	}
+	report(m);
+
+	start(m, "create", nfiles);
+	for(i = 0; i < nfiles; i++) {
+		sprintf(name, "/d%d/f%d", (int)(i % ndirs), (int)i);
+		tick(m);
+		if(fs_write_file(sb, name, data, sizeof(data))) FAIL("fs_write_file");
+		tock(m, sizeof(data));
+	}
+	report(m);
+
+	start(m, "lookup_fanout", nfiles);
+	for(i = 0; i < nfiles; i++) {
+		uint64_t k = i * 7919 % nfiles;
+		sprintf(name, "/d%d/f%d", (int)(k % ndirs), (int)k);
+		tick(m);
+		if(fs_stat(sb, name, &st)) FAIL("fs_stat");
+		tock(m, 0);
+	}
+	report(m);
+
+	start(m, "list_dir", ndirs);
+	for(i = 0; i < ndirs; i++) {
+		sprintf(name, "/d%d", (int)i);
+		tick(m);
+		char *list = fs_list_dir(sb, name);
+		tock(m, 0);
+		if(!list) FAIL("fs_list_dir");
+		free(list);
+	}
+	report(m);
+
+	start(m, "unlink", nfiles);
+	for(i = 0; i < nfiles; i++) {
+		sprintf(name, "/d%d/f%d", (int)(i % ndirs), (int)i);
+		tick(m);
+		if(fs_unlink(sb, name)) FAIL("fs_unlink");
+		tock(m, 0);
+	}
+	report(m);
+
+	for(i = 0; i < ndirs; i++) {
+		sprintf(name, "/d%d", (int)i);
+		if(fs_rmdir(sb, name)) FAIL("fs_rmdir");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+/* a file at each depth of a chain of nested directories */
+static int depth(struct superblock *sb, struct measure *m)/*{{{*/
+{
+	char path[DEPTH * 4 + 16] = "", file[DEPTH * 4 + 16], op[32];
+	struct fs_stat st;
+	int d, i, n = 1000;
+
+	for(d = 1; d <= DEPTH; d++) {
+		strcat(path, "/l");
+		if(fs_mkdir(sb, path)) FAIL("fs_mkdir");
+		sprintf(file, "%s/f", path);
+		if(fs_write_file(sb, file, "", 0)) FAIL("fs_write_file");
+		if(d != 1 && d != DEPTH / 2 && d != DEPTH) continue;
+		sprintf(op, "lookup_depth%d", d);
+		start(m, op, n);
+		for(i = 0; i < n; i++) {
+			tick(m);
+			if(fs_stat(sb, file, &st)) FAIL("fs_stat");
+			tock(m, 0);
+		}
+		report(m);
+	}
+	return fs_rmdir_recursive(sb, "/l");
+}
+/*}}}*/
+
+
+/* one large file written and read back whole */
+static int sequential(struct superblock *sb, struct measure *m)/*{{{*/
+{
+	uint64_t size = fsize / 4, i;
+	char *data = malloc(size), *back = malloc(size);
+	if(!data || !back) FAIL("malloc");
+	for(i = 0; i < size; i++) data[i] = i * 13 + i / 4096;
+
+	start(m, "write_seq", 1);
+	tick(m);
+	if(fs_write_file(sb, "/big", data, size)) FAIL("fs_write_file /big");
+	tock(m, size);
+	report(m);
+
+	start(m, "read_seq", 1);
+	tick(m);
+	if(fs_read_file(sb, "/big", back, size) != size) FAIL("fs_read_file /big");
+	tock(m, size);
+	report(m);
+	if(memcmp(data, back, size)) { puts("FAIL read_seq contents"); return -1; }
+	free(data);
+	free(back);
+	return fs_unlink(sb, "/big");
+}
+/*}}}*/
+
+
+static int run(struct measure *m)/*{{{*/
+{
+	struct superblock *sb = format(m);
+	if(!sb) return -1;
+	if(small_files(sb, m) || depth(sb, m) || sequential(sb, m)) return -1;
+	if(fs_close(sb)) FAIL("fs_close");
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t blkszs[] = {128, 256, 512, 1024, 4096};
+	uint64_t fsizes[] = {1 << 22, 1 << 26};
+	struct measure m = {0};
+	int i, j;
+	if(argc > 1) scale = strtoull(argv[1], NULL, 0);
+	if(scale == 0) scale = 1;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(btree = 0; btree <= 1; btree++) {
+		blksz = blkszs[i];
+		fsize = fsizes[j] * scale;
+		if(run(&m)) exit(EXIT_FAILURE);
+	}
+	}
+	}
+	free(m.lat);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
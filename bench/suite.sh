@@ -0,0 +1,16 @@
+#!/bin/bash
+set -u
+
+gcc -O2 -Wall -I. bench/suite.c -o bench_suite -pthread &>> gcc.log
+if [ ! -x bench_suite ] ; then
+    echo "[suite] compilation error"
+    exit 1 ;
+fi
+
+if ! ./bench_suite "$@" ; then
+    echo "[suite] error"
+    exit 1
+fi
+
+rm -f bench_suite
+exit 0
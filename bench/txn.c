@@ -0,0 +1,92 @@
+/* Bulk updates with and without fs_txn_begin/fs_txn_commit, on images with
+ * and without journal: creates a directory of small files, then removes them.
+ * Write system calls and bytes are taken from /proc/self/io.  Output has one
+ * measurement per line:
+ *
+ *   txn journal=<blocks> txn=<0|1> op=<create|unlink> ops_s=<ops> writes_op=<n> kb_op=<kb>
+ */
+#include <time.h>
+
+#include "../fs.c"
+
+static char *fname = "bench.img";
+static int nfiles = 1000;
+
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/*}}}*/
+
+
+/* write system calls and bytes written so far by this process */
+static void io(uint64_t *syscw, uint64_t *wchar)/*{{{*/
+{
+	char line[128];
+	FILE *fp = fopen("/proc/self/io", "r");
+	*syscw = *wchar = 0;
+	while(fp && fgets(line, sizeof(line), fp)) {
+		sscanf(line, "syscw: %" SCNu64, syscw);
+		sscanf(line, "wchar: %" SCNu64, wchar);
+	}
+	if(fp) fclose(fp);
+}
+/*}}}*/
+
+
+static int run(uint64_t journal, int txn)/*{{{*/
+{
+	struct fs_options opts = {.journal = journal};
+	char name[32];
+	int i, op;
+
+	FILE *fp = fopen(fname, "w");
+	if(!fp || ftruncate(fileno(fp), 64 << 20)) { perror(fname); return -1; }
+	fclose(fp);
+	struct superblock *sb = fs_format_opts(fname, 4096, &opts);
+	if(!sb) { perror("fs_format_opts"); return -1; }
+	fs_mkdir(sb, "/d");
+
+	for(op = 0; op < 2; op++) {
+		uint64_t syscw, wchar, syscw2, wchar2;
+		io(&syscw, &wchar);
+		double t = now();
+		if(txn && fs_txn_begin(sb)) { perror("fs_txn_begin"); return -1; }
+		for(i = 0; i < nfiles; i++) {
+			sprintf(name, "/d/f%d", i);
+			if(op == 0 && fs_write_file(sb, name, name, strlen(name) + 1) < 0) {
+				perror("fs_write_file");
+				return -1;
+			}
+			if(op == 1 && fs_unlink(sb, name) < 0) { perror("fs_unlink"); return -1; }
+		}
+		if(txn && fs_txn_commit(sb)) { perror("fs_txn_commit"); return -1; }
+		t = now() - t;
+		io(&syscw2, &wchar2);
+		printf("txn journal=%d txn=%d op=%s ops_s=%.0f writes_op=%.3f kb_op=%.2f\n",
+				(int)journal, txn, op ? "unlink" : "create", nfiles / (t / 1e9),
+				(double)(syscw2 - syscw) / nfiles,
+				(double)(wchar2 - wchar) / 1024 / nfiles);
+	}
+	fs_close(sb);
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t journals[] = {0, 4096};
+	int i, txn;
+	for(i = 0; i < sizeof(journals) / sizeof(journals[0]); i++) {
+		for(txn = 0; txn < 2; txn++) {
+			if(run(journals[i], txn)) exit(EXIT_FAILURE);
+		}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
@@ -0,0 +1,16 @@
+#!/bin/bash
+set -u
+
+gcc -O2 -Wall -I. bench/txn.c -o bench_txn &>> gcc.log
+if [ ! -x bench_txn ] ; then
+    echo "[txn] compilation error"
+    exit 1 ;
+fi
+
+if ! ./bench_txn ; then
+    echo "[txn] error"
+    exit 1
+fi
+
+rm -f bench_txn
+exit 0
@@ -0,0 +1,108 @@
+/* Latency and throughput of small file creation and removal under each
+ * durability policy, with write-through (max_dirty=0), write-back and the
+ * journal.  Write system calls are taken from /proc/self/io.  Output has one
+ * measurement per line:
+ *
+ *   writeback journal=<blocks> max_dirty=<n> policy=<name> ops_s=<ops> p50_us=<us> p99_us=<us> writes_op=<n>
+ */
+#include <time.h>
+
+#include "../fs.c"
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "bench.img";
+static int nfiles = 1000;
+static const char *policies[] = {"none", "close", "periodic", "fsync"};
+
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/*}}}*/
+
+
+static uint64_t syscw(void)/*{{{*/
+{
+	char line[128];
+	uint64_t n = 0;
+	FILE *fp = fopen("/proc/self/io", "r");
+	while(fp && fgets(line, sizeof(line), fp)) sscanf(line, "syscw: %" SCNu64, &n);
+	if(fp) fclose(fp);
+	return n;
+}
+/*}}}*/
+
+
+static int compare(const void *a, const void *b)/*{{{*/
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+/*}}}*/
+
+
+static int run(uint64_t journal, uint64_t maxdirty, int policy)/*{{{*/
+{
+	struct fs_options opts = {.journal = journal};
+	double *lat = malloc(2 * nfiles * sizeof(*lat));
+	char name[32];
+	int i, op, n = 0;
+
+	FILE *fp = fopen(fname, "w");
+	if(!fp || ftruncate(fileno(fp), 64 << 20)) { perror(fname); return -1; }
+	fclose(fp);
+	struct superblock *sb = fs_format_opts(fname, 4096, &opts);
+	if(!sb) { perror("fs_format_opts"); return -1; }
+	if(maxdirty && fs_set_writeback(sb, maxdirty)) { perror("fs_set_writeback"); return -1; }
+	if(fs_set_durability(sb, policy, 100)) { perror("fs_set_durability"); return -1; }
+	fs_mkdir(sb, "/d");
+
+	uint64_t w = syscw();
+	double t = now();
+	for(op = 0; op < 2; op++) {
+		for(i = 0; i < nfiles; i++) {
+			sprintf(name, "/d/f%d", i);
+			double t0 = now();
+			if(op == 0 && fs_write_file(sb, name, name, strlen(name) + 1) < 0) {
+				perror("fs_write_file");
+				return -1;
+			}
+			if(op == 1 && fs_unlink(sb, name) < 0) { perror("fs_unlink"); return -1; }
+			lat[n++] = now() - t0;
+		}
+	}
+	if(fs_close(sb)) { perror("fs_close"); return -1; }
+	t = now() - t;
+	w = syscw() - w;
+
+	qsort(lat, n, sizeof(*lat), compare);
+	printf("writeback journal=%d max_dirty=%d policy=%s ops_s=%.0f p50_us=%.1f "
+			"p99_us=%.1f writes_op=%.3f\n", (int)journal, (int)maxdirty,
+			policies[policy], n / (t / 1e9), lat[n / 2] / 1e3,
+			lat[n * 99 / 100] / 1e3, (double)w / n);
+	free(lat);
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t maxdirty[] = {0, 256};
+	int i, policy;
+	for(i = 0; i < NELEMS(maxdirty); i++) {
+		for(policy = FS_DURABLE_NONE; policy <= FS_DURABLE_FSYNC; policy++) {
+			if(run(0, maxdirty[i], policy)) exit(EXIT_FAILURE);
+		}
+	}
+	for(policy = FS_DURABLE_NONE; policy <= FS_DURABLE_FSYNC; policy++) {
+		if(run(4096, 0, policy)) exit(EXIT_FAILURE);
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
@@ -0,0 +1,16 @@
+#!/bin/bash
+set -u
+
+gcc -O2 -Wall -I. bench/writeback.c -o bench_writeback -pthread &>> gcc.log
+if [ ! -x bench_writeback ] ; then
+    echo "[writeback] compilation error"
+    exit 1 ;
+fi
+
+if ! ./bench_writeback ; then
+    echo "[writeback] error"
+    exit 1
+fi
+
+rm -f bench_writeback
+exit 0
@@ -4,1136 +4,6710 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #include "fs.h"
 
 
-int NLINKS;
+/* Bytes do superbloco que sao persistidos no bloco 0 da imagem (o restante
+ * da struct superblock so existe em memoria). */
+#define SB_DISCO offsetof(struct superblock, fd)
+
+/* Marca nos 32 bits altos de freepage->count das paginas livres que guardam
+ * outros blocos livres em links[] (veja tamanhoLote). */
+#define MARCA_LOTE ((uint64_t)0xdcc605f5 << 32)
+
+/* Blocos liberados por vez pelo recuperador em segundo plano, entre os quais
+ * as demais operacoes podem pegar a trava. */
+#define LOTE_RECUPERACAO 4096
+
+/* Estado compartilhado de um superbloco usado por mais de uma thread: existe
+ * enquanto houver a thread em segundo plano ou o diario.  Enquanto existe,
+ * toda operacao publica segura a trava (recursiva) com TRAVA, e com o diario
+ * cada TRAVA mais externo eh uma transacao. */
+struct fs_background {
+	pthread_mutex_t trava;
+	pthread_cond_t acorda;
+	pthread_t thread;
+	int temThread, parar;
+	int profundidade; /* TRAVA aninhados da operacao que tem a trava */
+	struct fs_diario *diario; /* NULL se a imagem nao tiver diario */
+	int explicita; /* ha uma transacao de fs_txn_begin, da thread dono */
+	pthread_t dono;
+	int politica; /* FS_DURABLE_*, veja fs_set_durability */
+	uint64_t periodo; /* em ms, com FS_DURABLE_PERIODIC */
+	uint64_t maxSujos; /* blocos sujos que acordam o escritor; 0 sem escrita adiada */
+	int sujo; /* a operacao corrente escreveu direto na imagem */
+	pthread_t escritor;
+	pthread_cond_t sinal; /* acorda o escritor */
+	int temEscritor, pararEscritor;
+};
+
+static struct superblock *trava(struct superblock *sb);
+static void destrava(struct superblock **sb);
+
+/* Segura a trava de sb ate o fim do bloco em que aparece. */
+#define TRAVA(sb) \
+	struct superblock *travado_ __attribute__((cleanup(destrava))) = trava(sb)
+
+static int garanteLivres(struct superblock *sb, uint64_t n);
+static void paraEscritor(struct superblock *sb);
+
+/* Soma n ao contador c de sb->stats (veja fs_get_stats).  As threads em
+ * segundo plano tambem contam, sem a trava. */
+#define CONTA(c, n) __atomic_fetch_add(&(c), (uint64_t)(n), __ATOMIC_RELAXED)
+
+static inline struct fs_stats *estatisticas(const struct superblock *sb) {
+	return (struct fs_stats*) &sb->stats;
+}
 
-/*
-Retorna o índice do bloco do arquivo que tenha o nome fname
-*/
-uint64_t encontraBloco(struct superblock *sb, const char *fname, int opmode) {
-	char lastbar[strlen(fname) + 1];
-	if (opmode == 1) {
-		strcpy(lastbar, fname);
-		char* c = strrchr(lastbar, '/');
-		*c = '\0';
-		if (strlen(lastbar) == 0) return 2; // retorna o endereco da raiz
-		fname = lastbar;
-	}
-
-	// fila dos blocos a serem percorridos
-	uint64_t* fila = (uint64_t*) malloc(sb->blks * sizeof(uint64_t));
-	// fila que marca se um bloco foi visitado ou nao
-	int* visitado = (int*) malloc(sb->blks * sizeof(int));
-	int inicio = 0, fim = 0, i, aux;
-
-	// zerando as duas filas
-	for (i = 0; i < sb->blks; i++) {
-		fila[i] = 0;
-		visitado[i] = 0;
-	}
-	// colocando o inode pasta raiz no inicio da fila, marcando ela
-	// como visitada e incrementando o tamanho da fila
-	fila[inicio] = sb->root;
-	visitado[sb->root] = 1;
-	fim++;
+static inline uint64_t agora(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
 
-	struct inode *in = (struct inode*) calloc(sb->blksz, 1);
-	struct nodeinfo *ni = (struct nodeinfo*) calloc(sb->blksz, 1);
-	while (inicio < fim) {
-		// colocando o ponteiro na posicao indicada pelo inicio da fila
-		lseek(sb->fd, (fila[inicio] * sb->blksz), SEEK_SET);
-		// lendo os dados do inicio da fila
-		aux = read(sb->fd, in, sb->blksz);
-		// se o inode in for de um arquivo regular (nao eh filho)
-		if (in->mode == IMREG) {
-			// posicionando o ponteiro na posicao do nodeinfo
-			lseek(sb->fd, ((in->meta) * sb->blksz), SEEK_SET);
-			// lendo o nodeinfo
-			aux = read(sb->fd, ni, sb->blksz);
-			// se o nome do arquivo eh igual ao parametro procurado
-			if (strcmp(ni->name, fname) == 0) {
-				// libera os recursos e retorna o indice no FS
-				aux = fila[inicio];
-				free(fila);
-				free(visitado);
-				free(ni);
-				free(in);
-				return aux;
-			}
-		}
-		// se o inode in for de uma pasta
-		if (in->mode == IMDIR) {
-			// posicionando o ponteiro na posicao do nodeinfo
-			lseek(sb->fd, ((in->meta) * sb->blksz), SEEK_SET);
-			// lendo o nodeinfo
-			aux = read(sb->fd, ni, sb->blksz);
-
-			// se o nome do arquivo eh igual ao parametro procurado
-			if (strcmp(ni->name, fname) == 0) {
-				// libera os recursos e retorna o indice no FS
-				aux = fila[inicio];
-				free(fila);
-				free(visitado);
-				free(ni);
-				free(in);
-				return aux;
-			}
+/* Tipos de evento do traco (veja fs_trace_start). */
+#define EV_INICIO 0  /* inicio de uma chamada publica; arg eh a FS_OP_* */
+#define EV_FIM 1     /* fim dela */
+#define EV_LEITURA 2 /* bloco lido; arg eh o FS_BLOCK_*, mais EV_CACHE se veio do cache */
+#define EV_ESCRITA 3 /* bloco escrito; arg eh o FS_BLOCK_* */
+#define EV_ALOCA 4   /* bloco tirado da lista de blocos livres */
+#define EV_LIBERA 5  /* bloco devolvido a ela */
+#define EV_CACHE 0x100
+
+struct evento {
+	uint64_t seq; /* posicao do evento + 1 quando completo, zero enquanto eh escrito */
+	uint64_t instante, bloco;
+	uint32_t tipo, arg, thread, reservado;
+};
+
+/* Anel de eventos de um superbloco: cada evento pega a proxima posicao com
+ * uma soma atomica e sobrescreve o mais antigo quando o anel esta cheio. */
+struct fs_trace {
+	uint64_t mascara; /* mascara + 1 eventos, potencia de 2 */
+	uint64_t cabeca; /* eventos ja registrados */
+	struct evento v[];
+};
+
+/* Numero da thread nos eventos e gravacoes, dado no primeiro deles. */
+static __thread uint32_t idThread;
+static uint32_t nthreads;
+
+static inline uint32_t numeroThread(void) {
+	if (idThread == 0) idThread = __atomic_add_fetch(&nthreads, 1, __ATOMIC_RELAXED);
+	return idThread;
+}
 
-			// para cada elemento da pasta
-			for (i = 0; i < NLINKS; i++) {
-				// se esse elemento nao foi visitado
-				if (visitado[in->links[i]] == 0) {
-					if (in->links[i] != 0) {
-
-						// marca ele como visitado
-						visitado[in->links[i]] = 1;
-						// insere ele no final da fila
-						fila[fim] = in->links[i];
-						// incrementa o final da fila
-						fim++;
-					}
-				}
-			}
-		}
-		inicio++;
-	}
+static void anotaEvento(struct fs_trace *t, int tipo, int arg, uint64_t bloco) {
+	uint64_t i = __atomic_fetch_add(&t->cabeca, 1, __ATOMIC_RELAXED);
+	struct evento *e = &t->v[i & t->mascara];
+	numeroThread();
+	__atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e->instante = agora();
+	e->bloco = bloco;
+	e->tipo = tipo;
+	e->arg = arg;
+	e->thread = idThread;
+	__atomic_store_n(&e->seq, i + 1, __ATOMIC_RELEASE);
+}
 
-	free(fila);
-	free(visitado);
-	free(ni);
-	free(in);
-	// caso erro, retorna -1
-	return 0;
+/* Registra um evento no traco de sb, se houver. */
+static inline void traca(const struct superblock *sb, int tipo, int arg, uint64_t bloco) {
+	if (sb->trace != NULL) anotaEvento(sb->trace, tipo, arg, bloco);
 }
 
-/*
-Adiciona um bloco a um inode no FS
-*/
-int linkaBlocos(struct superblock *sb, struct inode *in, uint64_t in_n, uint64_t block) {
-	int i;
-	uint64_t aux, iaux_n, n;
-	struct inode *iaux = (struct inode*) calloc(sb->blksz, 1);
+/* Conta em sb uma chamada da operacao op (FS_OP_*) iniciada em inicio. */
+static void registraChamada(struct superblock *sb, int op, uint64_t inicio) {
+	uint64_t ns = agora() - inicio;
+	int k = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (k >= FS_LATENCY_BUCKETS) k = FS_LATENCY_BUCKETS - 1;
+	CONTA(sb->stats.calls[op], 1);
+	CONTA(sb->stats.ns[op], ns);
+	CONTA(sb->stats.latency[op][k], 1);
+}
 
-	if (in->next == 0) {
-		// percorre para axar um local vazio
-		for (i = 0; i < NLINKS; i++) {
-			if (in->links[i] == 0) {
-				in->links[i] = block;
-				free(iaux);
-				return 0;
-			}
-		}
+/* Chamada publica sendo medida por MEDE. */
+struct medida {
+	struct superblock *sb;
+	int op;
+	uint64_t inicio;
+	/* argumentos gravados por fs_record_start, dados com GRAVA: um caminho
+	 * ou, com lote, os nlote pedidos de fs_write_files ou caminhos de
+	 * fs_stat_many */
+	const char *caminho;
+	uint64_t arg[2];
+	const void *lote;
+	uint64_t nlote;
+};
+
+static void gravaChamada(struct fs_recorder *g, const struct medida *m);
+static int fechaGravacao(struct fs_recorder *g);
+
+/* MEDE aninhados na thread: so o mais externo conta. */
+static __thread int medindo;
+
+static uint64_t iniciaMedida(struct superblock *sb, int op) {
+	if (medindo++ != 0) return 0;
+	traca(sb, EV_INICIO, op, 0);
+	return agora();
+}
 
-		// cria um novo inode
-		n = fs_get_block(sb);
-		if (n == (uint64_t)-1) {
-			free(iaux);
-			return -1;
-		}
-		in->next = n;
-		iaux->mode = IMCHILD;
-		iaux->parent = in_n;
-		iaux->next = 0;
-		iaux->meta = in_n;
-		iaux->links[0] = block;
-
-		// escreve o novo inode
-		lseek(sb->fd, n * sb->blksz, SEEK_SET);
-		aux = write(sb->fd, iaux, sb->blksz);
-		free(iaux);
-		if (aux == -1) return -1;
-		return 0;
-	}
+static void fimMedida(struct medida *m) {
+	if (--medindo != 0) return;
+	registraChamada(m->sb, m->op, m->inicio);
+	traca(m->sb, EV_FIM, m->op, 0);
+	if (m->sb->recorder != NULL) gravaChamada(m->sb->recorder, m);
+}
 
-	while (in->next != 0) {
-		iaux_n = in->next;
-		lseek(sb->fd, iaux_n * sb->blksz, SEEK_SET);
-		aux = read(sb->fd, iaux, sb->blksz);
-		in = iaux;
-	}
+/* Conta a chamada publica o em s ao fim do bloco em que aparece.  Deve vir
+ * antes de TRAVA, para que a espera pelo disco em destrava entre na conta. */
+#define MEDE(s, o) \
+	struct medida medida_ __attribute__((cleanup(fimMedida))) = \
+		{ .sb = (s), .op = (o), .inicio = iniciaMedida((s), (o)) }
+
+/* Argumentos da chamada medida por MEDE, para a gravacao. */
+#define GRAVA(c, a0, a1) \
+	(medida_.caminho = (c), medida_.arg[0] = (a0), medida_.arg[1] = (a1))
+#define GRAVA_LOTE(v, n) (medida_.lote = (v), medida_.nlote = (n))
+
+/* Grava uma chamada publica que nao eh medida (fs_txn_begin e fs_closedir),
+ * se nao tiver sido feita por outra chamada publica. */
+static void gravaAvulsa(struct superblock *sb, int op, uint64_t arg) {
+	if (sb->recorder == NULL || medindo != 0) return;
+	struct medida m = { .sb = sb, .op = op, .inicio = agora() };
+	m.arg[0] = arg;
+	gravaChamada(sb->recorder, &m);
+}
 
-	// percorre para axar um local vazio
-	for (i = 0; i < NLINKS; i++) {
-		if (in->links[i] == 0) {
-			in->links[i] = block;
-			// escreve o inode de volta
-			lseek(sb->fd, iaux_n * sb->blksz, SEEK_SET);
-			aux = write(sb->fd, iaux, sb->blksz);
-			free(iaux);
-			return 0;
-		}
-	}
+/* Numero de links em um inode com blocos de BS bytes. */
+#define NLINKS_DE(BS) (((BS) - sizeof(struct inode)) / sizeof(uint64_t))
+
+/* Rotinas que dependem apenas do tamanho de bloco.  Ha uma versao generica,
+ * que le a geometria de sb em tempo de execucao, e versoes especializadas
+ * para os tamanhos de bloco mais comuns, em que a geometria eh constante e
+ * os lacos podem ser desenrolados pelo compilador.  A versao usada por cada
+ * superbloco eh escolhida uma vez, em fs_format/fs_open. */
+struct fs_geomops {
+	uint64_t blksz; /* tamanho de bloco atendido; zero na versao generica */
+	const char *nucleo; /* conjunto de instrucoes das buscas em links[] */
+	/* primeiro indice i >= inicio de links[] com links[i] == valor, ou -1 */
+	int64_t (*procura)(const struct superblock *sb, const uint64_t *links,
+	                   uint64_t inicio, uint64_t valor);
+	/* primeiro indice i >= inicio de links[] com links[i] != 0, ou -1 */
+	int64_t (*procuraUsado)(const struct superblock *sb,
+	                        const uint64_t *links, uint64_t inicio);
+	/* le/escreve o bloco de numero bloco da imagem */
+	ssize_t (*le)(const struct superblock *sb, uint64_t bloco, void *buf);
+	ssize_t (*escreve)(const struct superblock *sb, uint64_t bloco,
+	                   const void *buf);
+};
 
-	// cria um novo inode
-	n = fs_get_block(sb);
-	if (n == (uint64_t)-1) {
-		free(iaux);
-		return -1;
+/*
+Nucleos de busca em vetores de links: retornam o primeiro indice i >= inicio
+em que (links[i] == valor) == igual, ou -1.  Sao sempre expandidos em linha
+para que, nas versoes especializadas, n e igual sejam constantes.  Os nucleos
+vetoriais tratam 4 (SSE2) ou 8 (AVX2) links por iteracao e deixam o resto
+para o nucleo mais estreito
+*/
+static inline __attribute__((always_inline))
+int64_t procuraEscalar(const uint64_t *links, uint64_t i, uint64_t n,
+                       uint64_t valor, int igual) {
+	for (; i < n; i++) {
+		if ((links[i] == valor) == igual) return i;
 	}
-	in->next = n;
-	iaux->mode = IMCHILD;
-	iaux->parent = in_n;
-	iaux->next = 0;
-	iaux->meta = iaux_n;
-	iaux->links[0] = block;
-
-	// escreve o novo inode
-	lseek(sb->fd, n * sb->blksz, SEEK_SET);
-	aux = write(sb->fd, iaux, sb->blksz);
-
-	free(iaux);
-	if (aux == -1) return -1;
-	return 0;
+	return -1;
 }
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FS_SIMD
+
+static inline __attribute__((always_inline))
+int64_t procuraSse2(const uint64_t *links, uint64_t i, uint64_t n,
+                    uint64_t valor, int igual) {
+	const __m128i v = _mm_set1_epi64x(valor);
+	// percursos em vetores densos costumam parar no primeiro link
+	if (i < n && (links[i] == valor) == igual) return i;
+	for (; i + 4 <= n; i += 4) {
+		__m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(links + i)), v);
+		__m128i b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(links + i + 2)), v);
+		// SSE2 nao compara 64 bits: as duas metades precisam ser iguais
+		a = _mm_and_si128(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(2, 3, 0, 1)));
+		b = _mm_and_si128(b, _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 3, 0, 1)));
+		int m = _mm_movemask_pd(_mm_castsi128_pd(a))
+		      | (_mm_movemask_pd(_mm_castsi128_pd(b)) << 2);
+		if (!igual) m ^= 0xf;
+		if (m) return i + __builtin_ctz(m);
+	}
+	return procuraEscalar(links, i, n, valor, igual);
+}
 
+static inline __attribute__((always_inline, target("avx2")))
+int64_t procuraAvx2(const uint64_t *links, uint64_t i, uint64_t n,
+                    uint64_t valor, int igual) {
+	const __m256i v = _mm256_set1_epi64x(valor);
+	if (i < n && (links[i] == valor) == igual) return i;
+	for (; i + 8 <= n; i += 8) {
+		__m256i a = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(links + i)), v);
+		__m256i b = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(links + i + 4)), v);
+		int m = _mm256_movemask_pd(_mm256_castsi256_pd(a))
+		      | (_mm256_movemask_pd(_mm256_castsi256_pd(b)) << 4);
+		if (!igual) m ^= 0xff;
+		if (m) return i + __builtin_ctz(m);
+	}
+	return procuraSse2(links, i, n, valor, igual);
+}
+#endif
 
 /*
-Constroi um novo sistema de arquivos no arquivo de nome fname
+Gera as buscas em links[] de nome NOME usando o nucleo NUCLEO sobre NL links
 */
-struct superblock * fs_format(const char *fname, uint64_t blocksize){
-	NLINKS = (blocksize - (4 * sizeof(uint64_t)))/sizeof(uint64_t);
+#define GERA_PROCURA(NOME, NL, NUCLEO, ALVO) \
+static ALVO int64_t procura##NOME(const struct superblock *sb, \
+                                  const uint64_t *links, uint64_t inicio, \
+                                  uint64_t valor) { \
+	(void) sb; \
+	return NUCLEO(links, inicio, NL, valor, 1); \
+} \
+static ALVO int64_t procuraUsado##NOME(const struct superblock *sb, \
+                                       const uint64_t *links, uint64_t inicio) { \
+	(void) sb; \
+	return NUCLEO(links, inicio, NL, 0, 0); \
+}
 
-	//verifica se o tamanho do bloco eh maior que o minimo
-	if(blocksize < MIN_BLOCK_SIZE){
-		errno = EINVAL;
-		return NULL;
-	}
+/*
+Gera a leitura/escrita de blocos de nome NOME para blocos de BS bytes
+*/
+#define GERA_ES(NOME, BS) \
+static ssize_t le##NOME(const struct superblock *sb, uint64_t bloco, void *buf) { \
+	struct iovec iov = { buf, BS }; \
+	return sb->dev->read_blocks(sb->dev, &iov, 1, bloco * (BS)); \
+} \
+static ssize_t escreve##NOME(const struct superblock *sb, uint64_t bloco, \
+                             const void *buf) { \
+	struct iovec iov = { (void*) buf, BS }; \
+	return sb->dev->write_blocks(sb->dev, &iov, 1, bloco * (BS)); \
+}
 
-	//calcula o tamanho de fname.
-	FILE* arquivo = fopen(fname, "r");
-	long fsize;
-	if(arquivo != NULL){
-		fseek(arquivo, 0, SEEK_END);
-		fsize = ftell(arquivo);
-	}
-	fclose(arquivo);
+#define GEOMOPS(BS, NUCLEO, NOME) \
+	{ BS, #NUCLEO, procura##NUCLEO##_##NOME, procuraUsado##NUCLEO##_##NOME, \
+	  le##NOME, escreve##NOME }
+
+GERA_ES(Generico, sb->blksz)
+GERA_ES(128, 128)
+GERA_ES(256, 256)
+GERA_ES(512, 512)
+GERA_ES(1024, 1024)
+GERA_ES(4096, 4096)
+
+#ifdef FS_SIMD
+#define NUCLEO_PADRAO Sse2
+#define GERA_PROCURAS(NOME, NL) \
+	GERA_PROCURA(Sse2_##NOME, NL, procuraSse2, ) \
+	GERA_PROCURA(Avx2_##NOME, NL, procuraAvx2, __attribute__((target("avx2"))))
+#else
+#define NUCLEO_PADRAO Escalar
+#define GERA_PROCURAS(NOME, NL) \
+	GERA_PROCURA(Escalar_##NOME, NL, procuraEscalar, )
+#endif
+
+GERA_PROCURAS(Generico, sb->nlinks)
+GERA_PROCURAS(128, NLINKS_DE(128))
+GERA_PROCURAS(256, NLINKS_DE(256))
+GERA_PROCURAS(512, NLINKS_DE(512))
+GERA_PROCURAS(1024, NLINKS_DE(1024))
+GERA_PROCURAS(4096, NLINKS_DE(4096))
+
+/* Tabelas de despacho consultadas por calculaGeometria: a primeira entrada eh
+ * a versao generica. */
+#define TABELA_GEOMETRIA(NUCLEO) { \
+	GEOMOPS(0, NUCLEO, Generico), GEOMOPS(128, NUCLEO, 128), \
+	GEOMOPS(256, NUCLEO, 256), GEOMOPS(512, NUCLEO, 512), \
+	GEOMOPS(1024, NUCLEO, 1024), GEOMOPS(4096, NUCLEO, 4096) \
+}
+#define EXPANDE_TABELA(NUCLEO) TABELA_GEOMETRIA(NUCLEO)
 
-	//calcula numero de blocos
-	int numeroBlocos = fsize / blocksize;
+static const struct fs_geomops geometrias[] = EXPANDE_TABELA(NUCLEO_PADRAO);
+#ifdef FS_SIMD
+static const struct fs_geomops geometriasAvx2[] = TABELA_GEOMETRIA(Avx2);
+#endif
+#define NGEOMETRIAS (sizeof(geometrias) / sizeof(geometrias[0]))
 
-	//verifica se o numero de blocos eh maior que o minimo
-	if(numeroBlocos < MIN_BLOCK_COUNT){
-		errno = ENOSPC;
-		return NULL;
+/*
+Deriva a geometria (links por inode, tamanho do nome e links por freepage) a
+partir do tamanho de bloco de sb e escolhe as rotinas de geometria
+*/
+static void calculaGeometria(struct superblock *sb) {
+	sb->nlinks = NLINKS_DE(sb->blksz);
+	sb->namelen = sb->blksz - sizeof(struct nodeinfo);
+	sb->nfree = (sb->blksz - sizeof(struct freepage)) / sizeof(uint64_t);
+
+	const struct fs_geomops *tabela = geometrias;
+#ifdef FS_SIMD
+	if (__builtin_cpu_supports("avx2")) tabela = geometriasAvx2;
+#endif
+	sb->ops = &tabela[0];
+	for (int i = 1; i < NGEOMETRIAS; i++) {
+		if (tabela[i].blksz == sb->blksz) {
+			sb->ops = &tabela[i];
+			break;
+		}
 	}
+}
 
-	//criando o superbloco
-	struct superblock* superBloco = (struct superblock*) malloc (blocksize);
-	superBloco->magic = 0xdcc605f5; //conforme estabelecido em fs.h
-	superBloco->blks = numeroBlocos;
-	superBloco->blksz = blocksize;
-
-	//superbloco, nodeinfo, root e inode de root ocupam 3 blocos
-	int memoriaOcupada = 3;
+/*
+Diario de metadados.  Com sb->journal != 0, cada TRAVA mais externo eh uma
+transacao: as imagens dos blocos de metadados gravados por ela ficam num cache
+em memoria (lido por leBloco) e, ao fim da operacao, sao serializadas no
+grupo pendente.  A primeira operacao a esperar grava o grupo inteiro no log
+com um pwrite e um fdatasync (as que fecharem enquanto isso entram no grupo
+seguinte).  O checkpoint grava o cache nos lugares definitivos e reinicia o
+log; eh feito no inicio de uma transacao quando o log passa da metade.
+
+No disco o diario ocupa journalblks blocos a partir de journal: o primeiro eh
+o cabecalho, com a sequencia da primeira transacao do log, e os demais sao o
+log.  Sem journal, fs_txn_begin e fs_set_writeback criam um diario sem log
+(tamanho zero), que so acumula as imagens no cache: ate fs_txn_commit, ou ate
+o escritor (veja escritor) as gravar.  Cada transacao eh uma serie de
+registros com a mesma sequencia: blocos REVOGA, blocos DESCRITOR seguidos das
+imagens dos blocos que listam e um COMMIT com a soma de todos os anteriores.
+Os blocos de dados sao escritos direto no lugar (escreveDados); se o bloco
+estava no cache eh revogado, para que a recuperacao nao escreva uma imagem
+antiga sobre ele.  A excecao sao os blocos que os metadados no disco ainda
+usam (marcados em recentes, veja marcaRecentes), cujos dados passam pelo log
+como os metadados
+*/
+#define MAGIC_DIARIO ((uint64_t)0xdcc605f5 << 32 | 0x6a726e6c)
+#define DIARIO_CABECALHO 1
+#define DIARIO_DESCRITOR 2
+#define DIARIO_REVOGA 3
+#define DIARIO_COMMIT 4
+
+struct registro {
+	uint64_t magic, tipo, seq, n;
+	uint64_t v[]; /* blocos descritos/revogados; no COMMIT, v[0] eh a soma */
+};
+
+/* Imagem de um bloco no cache; seq eh a transacao que a gravou por ultimo. */
+struct imagem {
+	uint64_t bloco, seq;
+	char *dados;
+};
+
+struct fs_diario {
+	struct fs_backend *dev;
+	struct fs_stats *stats; /* do superbloco dono do diario */
+	uint64_t blksz, porRegistro; /* blocos listados por registro */
+	uint64_t log, tamanho; /* primeiro bloco e numero de blocos do log */
+
+	/* cache e transacao aberta: so mudam com a trava do superbloco */
+	struct imagem *cache;
+	uint64_t ncache, mascara; /* mascara + 1 entradas, potencia de 2 */
+	uint64_t atual; /* sequencia da transacao aberta */
+	uint64_t *blocos, nblocos, capBlocos; /* blocos gravados por ela */
+	uint64_t *revogados, nrevogados, capRevogados;
+	uint64_t liberou; /* ultima transacao que devolveu blocos a sb->freed */
+	uint64_t *recentes; /* mapa dos blocos que os metadados no disco ainda usam */
+	uint64_t *pendentes, npendentes, capPendentes; /* pares (bloco, transacao) */
+
+	/* grupo pendente e log: protegidos por mutex */
+	pthread_mutex_t mutex;
+	pthread_cond_t pronto;
+	char *grupo, *reserva;
+	uint64_t ngrupo, capGrupo, capReserva; /* em blocos */
+	uint64_t inicioGrupo; /* posicao do grupo pendente no log */
+	uint64_t cabeca; /* blocos do log ja reservados */
+	uint64_t ultimo; /* ultima transacao serializada */
+	uint64_t duravel; /* ultima transacao no disco */
+	uint64_t grupos; /* grupos gravados (um fdatasync cada) */
+	int escrevendo, erro;
+
+	char salvo[SB_DISCO]; /* superbloco no inicio de fs_txn_begin */
+	int falhou; /* errno da primeira escrita que falhou na transacao dele */
+
+	/* cache que o escritor esta gravando sem a trava: continua valendo para
+	 * leBloco ate ser recolhido (veja recolheEscrita) */
+	struct imagem *escrita;
+	uint64_t mascaraEscrita;
+	int escritaPronta;
+};
+
+/* Leitura, escrita e flush na imagem, contados em st (veja fs_get_stats). */
+static inline ssize_t lePosicao(struct fs_stats *st, struct fs_backend *dev,
+                                void *buf, size_t n, off_t pos) {
+	struct iovec iov = { buf, n };
+	CONTA(st->syscalls, 1);
+	return dev->read_blocks(dev, &iov, 1, pos);
+}
 
-	//blocos livres
-	superBloco->freeblks = numeroBlocos-memoriaOcupada;
+static inline ssize_t escrevePosicao(struct fs_stats *st, struct fs_backend *dev,
+                                     const void *buf, size_t n, off_t pos) {
+	struct iovec iov = { (void*) buf, n };
+	CONTA(st->syscalls, 1);
+	return dev->write_blocks(dev, &iov, 1, pos);
+}
 
-	//apontador para o primeiro bloco livre
-	superBloco->freelist = 3;
+static inline int sincronizaImagem(struct fs_stats *st, struct fs_backend *dev) {
+	CONTA(st->syscalls, 1);
+	CONTA(st->syncs, 1);
+	return dev->flush(dev);
+}
 
-	//apontador para o inode da pasta raiz
-	superBloco->root = 2;
+static inline uint64_t somaBytes(uint64_t soma, const void *buf, uint64_t n) {
+	const unsigned char *p = (const unsigned char*) buf;
+	for (uint64_t i = 0; i < n; i++) soma = (soma ^ p[i]) * 0x100000001b3ULL;
+	return soma;
+}
 
-	//descritor de arquivos
-	superBloco->fd = open(fname, O_RDWR, S_IWRITE | S_IREAD);
-	if(superBloco->fd == -1){
-		errno = EBADF;
-		free(superBloco);
-		return NULL;
-	}
+static inline uint64_t espalha(uint64_t bloco) {
+	return (bloco * 0x9e3779b97f4a7c15ULL) >> 17;
+}
 
-	//inicializando o superbloco
-	int aux = write(superBloco->fd, superBloco, superBloco->blksz);
-	if(aux == -1){
-		close(superBloco->fd);
-		free(superBloco);
-		return NULL;
+static struct imagem *procuraEm(struct imagem *v, uint64_t mascara, uint64_t bloco) {
+	for (uint64_t i = espalha(bloco) & mascara;; i = (i + 1) & mascara) {
+		if (v[i].dados == NULL) return NULL;
+		if (v[i].bloco == bloco) return &v[i];
 	}
+}
 
-	//inicializando a pasta raiz
-	struct nodeinfo* rootInfo = (struct nodeinfo*) calloc (superBloco->blksz,1);
-	rootInfo->size = 0;
-	strcpy(rootInfo->name, "/\0");
-	aux = write(superBloco->fd, rootInfo, superBloco->blksz);
-	free(rootInfo);
-
-	struct inode* rootInode = (struct inode*) calloc (superBloco->blksz,1);
-	rootInode->mode = IMDIR;
-	rootInode->parent = 0;
-	rootInode->meta = 1;
-	rootInode->next = 0;
-	aux = write(superBloco->fd, rootInode, superBloco->blksz);
-	free(rootInode);
+static inline struct imagem *procuraImagem(const struct fs_diario *d, uint64_t bloco) {
+	return procuraEm(d->cache, d->mascara, bloco);
+}
 
-	//inicializando lista de blocos vazios
-	struct freepage* root_fp = (struct freepage*) malloc (sizeof(struct freepage*));
-	for(int i = superBloco->freelist; i < superBloco->blks; i++){
-		if(i == (superBloco->blks - 1)){
-			root_fp->next = 0; //ultima pagina livre
-		}
-		else{
-			root_fp->next = i+1;
+/* Tira a imagem e do cache, puxando para tras as entradas seguintes. */
+static void removeImagem(struct fs_diario *d, struct imagem *e) {
+	uint64_t i = e - d->cache, j = i;
+	free(e->dados);
+	for (;;) {
+		d->cache[i].dados = NULL;
+		for (;;) {
+			j = (j + 1) & d->mascara;
+			if (d->cache[j].dados == NULL) {
+				d->ncache--;
+				return;
+			}
+			uint64_t k = espalha(d->cache[j].bloco) & d->mascara;
+			if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) break;
 		}
+		d->cache[i] = d->cache[j];
+		i = j;
+	}
+}
 
-		aux = write(superBloco->fd, root_fp, superBloco->blksz);
+/* Dobra a tabela do cache (so o diario sem log cresce sem limite). */
+static int cresceCache(struct fs_diario *d) {
+	uint64_t mascara = 2 * d->mascara + 1, i, j;
+	struct imagem *cache = (struct imagem*) calloc(mascara + 1, sizeof(struct imagem));
+	if (cache == NULL) return -1;
+	for (i = 0; i <= d->mascara; i++) {
+		if (d->cache[i].dados == NULL) continue;
+		for (j = espalha(d->cache[i].bloco) & mascara; cache[j].dados != NULL;
+		     j = (j + 1) & mascara);
+		cache[j] = d->cache[i];
 	}
-	free(root_fp);
+	free(d->cache);
+	d->cache = cache;
+	d->mascara = mascara;
+	return 0;
+}
 
-	return superBloco;
+static int comparaImagens(const void *a, const void *b) {
+	uint64_t x = (*(struct imagem* const*) a)->bloco;
+	uint64_t y = (*(struct imagem* const*) b)->bloco;
+	return x < y ? -1 : x > y;
 }
 
 /*
-Abre o sistema de arquivos em fname e retorna seu superbloco
+Grava as imagens da tabela t (com mascara + 1 entradas) nos lugares
+definitivos, em ordem de bloco, com um pwritev por sequencia de blocos
+vizinhos.  Nao mexe na tabela, que pode estar sendo lida por leBloco
 */
-struct superblock * fs_open(const char *fname){
-	//pega o descritor de arquivo do FS
-	int descritorArquivos = open(fname, O_RDWR);
-
-	// aplica uma trava exclusiva no arquivo (LOCK_EX = exclusive lock)
-	// apenas um processo poderá usar esse arquivo de cada vez
-	// flock retorna 0 se sucesso, -1 se erro
-	if((flock(descritorArquivos, LOCK_EX | LOCK_NB)) == -1){
-		errno = EBUSY;
-		close(descritorArquivos);
-		return NULL;
+static int gravaImagens(const struct fs_diario *d, struct imagem *t, uint64_t mascara) {
+	struct iovec iov[64];
+	uint64_t n = 0, i, j, k;
+	int ret = 0;
+	for (i = 0; i <= mascara; i++) n += t[i].dados != NULL;
+	struct imagem **v = (struct imagem**) malloc((n + 1) * sizeof(*v));
+	if (v == NULL) return -1;
+	for (i = n = 0; i <= mascara; i++)
+		if (t[i].dados != NULL) v[n++] = &t[i];
+	qsort(v, n, sizeof(*v), comparaImagens);
+	for (i = 0; i < n && ret == 0; i = j) {
+		for (j = i, k = 0; j < n && k < 64 && v[j]->bloco == v[i]->bloco + k; j++, k++) {
+			iov[k].iov_base = v[j]->dados;
+			iov[k].iov_len = d->blksz;
+		}
+		CONTA(d->stats->syscalls, 1);
+		if (d->dev->write_blocks(d->dev, iov, k, v[i]->bloco * d->blksz) != (ssize_t)(k * d->blksz))
+			ret = -1;
 	}
+	free(v);
+	return ret;
+}
 
-	//move o leitor para a posição inicial do arquivo.
-	lseek(descritorArquivos, 0, SEEK_SET);
-
-	//carrega o superbloco do FS
-	struct superblock* superbloco = (struct superblock*) malloc(sizeof(struct superblock));
-	if(read(descritorArquivos, superbloco, sizeof(struct superblock)) == -1 ){
-		close(descritorArquivos);
-		free(superbloco);
-		return NULL;
+static void esvaziaTabela(struct imagem *t, uint64_t mascara) {
+	for (uint64_t i = 0; i <= mascara; i++) {
+		free(t[i].dados);
+		t[i].dados = NULL;
 	}
+}
 
+/* Grava as imagens do cache nos lugares definitivos e esvazia o cache. */
+static int gravaCache(struct fs_diario *d) {
+	int ret = d->ncache ? gravaImagens(d, d->cache, d->mascara) : 0;
+	esvaziaTabela(d->cache, d->mascara);
+	d->ncache = 0;
+	return ret;
+}
 
-	//verifica o erro EBADF
-	if(superbloco->magic != 0xdcc605f5){
-		//LOCK_UN: remove a trava do arquivo
-		flock(descritorArquivos, LOCK_UN | LOCK_NB);
-		close(descritorArquivos);
-		errno = EBADF;
-		free(superbloco);
-		return NULL;
-	}
+/*
+Espera o escritor terminar de gravar o cache que levou e o descarta.
+Chamado com a trava
+*/
+static void recolheEscrita(struct fs_diario *d) {
+	if (d->escrita == NULL) return;
+	pthread_mutex_lock(&d->mutex);
+	while (!d->escritaPronta) pthread_cond_wait(&d->pronto, &d->mutex);
+	pthread_mutex_unlock(&d->mutex);
+	esvaziaTabela(d->escrita, d->mascaraEscrita);
+	free(d->escrita);
+	d->escrita = NULL;
+	d->escritaPronta = 0;
+}
 
-	return superbloco;
+/* Numero de blocos de log de uma transacao com n imagens e r revogacoes. */
+static inline uint64_t blocosTransacao(const struct fs_diario *d, uint64_t n,
+                                       uint64_t r) {
+	return (r + d->porRegistro - 1) / d->porRegistro +
+	       (n + d->porRegistro - 1) / d->porRegistro + n + 1;
 }
 
-/*
-Fecha o sistema de arquivos apontado por sb
- */
-int fs_close(struct superblock *sb){
-	//verifica o descritor do sistema de arquivos
-	if(sb->magic != 0xdcc605f5){
-		errno = EBADF;
-		return -1;
-	}
+static inline int temBit(const uint64_t *v, uint64_t i) {
+	return v[i / 64] >> (i % 64) & 1;
+}
 
-	//LOCK_UN: remove a trava do arquivo
-	if(flock(sb->fd, LOCK_UN | LOCK_NB) == -1){
-		errno = EBUSY;
-		return -1;
-	}
+static inline void poeBit(uint64_t *v, uint64_t i) {
+	v[i / 64] |= (uint64_t)1 << (i % 64);
+}
 
-	//fechando o arquivo
-	int aux = close(sb->fd);
-	if(aux == -1) return -1;
-	free(sb);
+static inline void tiraBit(uint64_t *v, uint64_t i) {
+	v[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
 
+static int anexaNumero(uint64_t **v, uint64_t *n, uint64_t *cap, uint64_t x) {
+	if (*n == *cap) {
+		uint64_t nova = *cap ? 2 * *cap : 64;
+		uint64_t *p = (uint64_t*) realloc(*v, nova * sizeof(uint64_t));
+		if (p == NULL) return -1;
+		*v = p;
+		*cap = nova;
+	}
+	(*v)[(*n)++] = x;
 	return 0;
 }
 
 /*
-Pega um ponteiro para um bloco livre no sistema de arquivos sb
+Serializa a transacao aberta no grupo pendente e passa para a proxima.
+Retorna a sequencia dela, ou zero se ela nao gravou nada
 */
-uint64_t fs_get_block(struct superblock *sb){
-	//verifica o descritor do sistema de arquivos
-	if(sb->magic != 0xdcc605f5){
-		errno = EBADF;
-		return (uint64_t) 0;
+static uint64_t fechaTransacao(struct fs_diario *d) {
+	uint64_t i, j, seq = d->atual, soma = 0xcbf29ce484222325ULL;
+	uint64_t k = d->porRegistro, bs = d->blksz;
+	if (d->tamanho == 0) return 0;
+
+	//imagens revogadas depois de gravadas nesta transacao ja sairam do cache
+	for (i = j = 0; i < d->nblocos; i++) {
+		struct imagem *e = procuraImagem(d, d->blocos[i]);
+		if (e != NULL && e->seq == seq) d->blocos[j++] = d->blocos[i];
 	}
-
-	//verifica se ha blocos livres
-	if(sb->freeblks == 0){
-		errno = ENOSPC;
-		return (uint64_t) 0;
+	d->nblocos = j;
+	if (d->nblocos == 0 && d->nrevogados == 0) return 0;
+
+	uint64_t n = blocosTransacao(d, d->nblocos, d->nrevogados);
+	pthread_mutex_lock(&d->mutex);
+	if (d->ngrupo + n > d->capGrupo) {
+		uint64_t cap = d->capGrupo ? d->capGrupo : 64;
+		while (cap < d->ngrupo + n) cap *= 2;
+		char *p = (char*) realloc(d->grupo, cap * bs);
+		if (p == NULL) {
+			pthread_mutex_unlock(&d->mutex);
+			d->erro = ENOMEM;
+			return 0;
+		}
+		d->grupo = p;
+		d->capGrupo = cap;
 	}
 
-	struct freepage *pagina = (struct freepage*) calloc (sb->blksz,1);
-	//localizando posição do primeiro bloco livre
-	lseek(sb->fd, (sb->freelist * sb->blksz), SEEK_SET);
-	//verificando se há algum erro na leitura
-	int aux = read(sb->fd, pagina, sb->blksz);
-	if(aux == -1){
-		free(pagina);
-		return (uint64_t) 0;
+	char *saida = d->grupo + d->ngrupo * bs;
+	struct registro *r;
+	for (i = 0; i < d->nrevogados; i += k) {
+		r = (struct registro*) saida;
+		memset(r, 0, bs);
+		r->magic = MAGIC_DIARIO;
+		r->tipo = DIARIO_REVOGA;
+		r->seq = seq;
+		r->n = d->nrevogados - i < k ? d->nrevogados - i : k;
+		memcpy(r->v, d->revogados + i, r->n * sizeof(uint64_t));
+		soma = somaBytes(soma, r, bs);
+		saida += bs;
 	}
-
-	//pegando o "ponteiro" do bloco a ser retornado
-	uint64_t bloco = sb->freelist;
-	//mudando o ponteiro de lista vazia para o próximo bloco livre
-	sb->freelist = pagina->next;
-	//decrementando a quantidade de blocos livres
-	sb->freeblks--;
-
-	//escrevendo os novos dados do super bloco (freelist e freeblks)
-	lseek(sb->fd, 0, SEEK_SET);
-	aux = write(sb->fd, sb, sb->blksz);
-	if(aux == -1){
-		free(pagina);
-		return (uint64_t) 0;
+	for (i = 0; i < d->nblocos; i += k) {
+		r = (struct registro*) saida;
+		memset(r, 0, bs);
+		r->magic = MAGIC_DIARIO;
+		r->tipo = DIARIO_DESCRITOR;
+		r->seq = seq;
+		r->n = d->nblocos - i < k ? d->nblocos - i : k;
+		memcpy(r->v, d->blocos + i, r->n * sizeof(uint64_t));
+		soma = somaBytes(soma, r, bs);
+		saida += bs;
+		for (j = 0; j < r->n; j++) {
+			memcpy(saida, procuraImagem(d, d->blocos[i + j])->dados, bs);
+			soma = somaBytes(soma, saida, bs);
+			saida += bs;
+		}
 	}
-
-	free(pagina);
-	return bloco;
+	r = (struct registro*) saida;
+	memset(r, 0, bs);
+	r->magic = MAGIC_DIARIO;
+	r->tipo = DIARIO_COMMIT;
+	r->seq = seq;
+	r->n = 1;
+	r->v[0] = soma;
+
+	d->ngrupo += n;
+	d->cabeca += n;
+	d->ultimo = seq;
+	pthread_mutex_unlock(&d->mutex);
+
+	d->nblocos = d->nrevogados = 0;
+	d->atual++;
+	return seq;
 }
 
 /*
-Retorna o bloco de numero block para a lista de blocos livres do sistema de arquivo sb
+Espera a transacao seq chegar ao disco.  Se ninguem estiver gravando, grava o
+grupo pendente (com todas as transacoes fechadas ate agora) e acorda as demais
 */
-int fs_put_block(struct superblock *sb, uint64_t block){
-	//verifica o descritor do sistema de arquivos
-	if(sb->magic != 0xdcc605f5){
-		errno = EBADF;
-		return -1;
+static int aguardaDuravel(struct fs_diario *d, uint64_t seq) {
+	pthread_mutex_lock(&d->mutex);
+	while (d->duravel < seq && !d->erro) {
+		if (d->escrevendo) {
+			pthread_cond_wait(&d->pronto, &d->mutex);
+			continue;
+		}
+		char *grupo = d->grupo;
+		uint64_t n = d->ngrupo, pos = d->inicioGrupo, ultimo = d->ultimo;
+		d->grupo = d->reserva;
+		d->reserva = grupo;
+		uint64_t cap = d->capGrupo;
+		d->capGrupo = d->capReserva;
+		d->capReserva = cap;
+		d->ngrupo = 0;
+		d->inicioGrupo = d->cabeca;
+		d->escrevendo = 1;
+		pthread_mutex_unlock(&d->mutex);
+
+		int erro = 0;
+		if (escrevePosicao(d->stats, d->dev, grupo, n * d->blksz,
+		           (off_t)((d->log + pos) * d->blksz)) != (ssize_t)(n * d->blksz) ||
+		    sincronizaImagem(d->stats, d->dev) == -1)
+			erro = errno ? errno : EIO;
+
+		pthread_mutex_lock(&d->mutex);
+		d->escrevendo = 0;
+		if (erro) {
+			d->erro = erro;
+		} else {
+			d->duravel = ultimo;
+			d->grupos++;
+		}
+		pthread_cond_broadcast(&d->pronto);
 	}
-
-	//novo bloco a ser inserido na lista de blocos livres
-	struct freepage *novoBloco = (struct freepage*) malloc (sb->blksz);
-
-	//setando os ponteiros do bloco, a nova posição da tabela de blocos livres
-	novoBloco->next = sb->freelist;
-	sb->freelist = block;
-	sb->freeblks++;
-
-	//escrevendo os novos dados do super bloco (freelist e freeblks)
-	lseek(sb->fd, 0, SEEK_SET);
-	int aux = write(sb->fd, sb, sb->blksz);
-	if(aux == -1){
-		free(novoBloco);
+	int erro = d->erro;
+	pthread_mutex_unlock(&d->mutex);
+	if (erro) {
+		errno = erro;
 		return -1;
 	}
-
-	//escrevendo novoBloco no arquivo
-	lseek(sb->fd, block * sb->blksz, SEEK_SET);
-	aux = write(sb->fd, novoBloco, sb->blksz);
-
-	free(novoBloco);
-	if(aux == -1) return -1;
 	return 0;
 }
 
+static int gravaCabecalho(struct fs_diario *d, uint64_t seq) {
+	struct registro *r = (struct registro*) calloc(d->blksz, 1);
+	r->magic = MAGIC_DIARIO;
+	r->tipo = DIARIO_CABECALHO;
+	r->seq = seq;
+	ssize_t aux = escrevePosicao(d->stats, d->dev, r, d->blksz, (off_t)((d->log - 1) * d->blksz));
+	free(r);
+	return aux == (ssize_t)d->blksz ? 0 : -1;
+}
+
 /*
-Escreve cnt bytes de buf no sistema de arquivos apontado por sb
+Leva ao disco todas as transacoes fechadas, grava o cache nos lugares
+definitivos e reinicia o log.  Chamado com a trava e sem transacao aberta
 */
-int fs_write_file(struct superblock *sb, const char *fname, char *buf, size_t cnt){
-	int i, aux;
-	//verifica o descritor do sistema de arquivos
-	if(sb->magic != 0xdcc605f5){
-		errno = EBADF;
+static int checkpoint(struct superblock *sb) {
+	struct fs_diario *d = sb->bg->diario;
+	if (aguardaDuravel(d, d->ultimo) == -1) return -1;
+	if (gravaCache(d) == -1) {
+		d->erro = errno ? errno : EIO;
 		return -1;
 	}
-
-	//verifica se o nome do arquivo (caminho) é maior que o permitido
-	if(strlen(fname) > ((sb->blksz) - (8*sizeof(uint64_t)))){
-		errno = ENAMETOOLONG;
+	//o cabecalho so avanca depois que os blocos estao no lugar
+	if (sincronizaImagem(d->stats, d->dev) == -1 || gravaCabecalho(d, d->atual) == -1 ||
+	    sincronizaImagem(d->stats, d->dev) == -1) {
+		d->erro = errno ? errno : EIO;
 		return -1;
 	}
+	pthread_mutex_lock(&d->mutex);
+	d->cabeca = d->inicioGrupo = 0;
+	pthread_mutex_unlock(&d->mutex);
+	return 0;
+}
 
-	uint64_t arquivoN, node_atual;
-	uint64_t diretorioPai_n = encontraBloco(sb,fname, 1);
-	if(diretorioPai_n == 0) return -1; //por erro
-	struct inode *diretorioPai = (struct inode*) calloc(sb->blksz,1);
-	struct inode *arquivo = (struct inode*) calloc(sb->blksz,1);
-	struct inode *aux_inode = (struct inode*) calloc(sb->blksz,1);
-	struct nodeinfo *arquivoIn = (struct nodeinfo*) calloc(sb->blksz,1);
-	struct nodeinfo *paiIn = (struct nodeinfo*) calloc(sb->blksz,1);
-
-	//verifica se o arquivo existe no FS
-	uint64_t arquivoAntigoN = encontraBloco(sb, fname, 0);
-	if(arquivoAntigoN > 0){
-		if(fs_unlink(sb,fname) == -1){
-			free(diretorioPai);
-			free(arquivo);
-			free(aux_inode);
-			free(arquivoIn);
-			free(paiIn);
-			return -1;
-		}
-		arquivoN = fs_get_block(sb);
-		if(arquivoN == (uint64_t)-1){
-			free(diretorioPai);
-			free(arquivo);
-			free(aux_inode);
-			free(arquivoIn);
-			free(paiIn);
-			errno = ENOSPC;
-			return -1;
-		}
+/*
+Esquece os blocos de recentes marcados por transacoes que ja estao no disco.
+Os pares estao em ordem de transacao, entao os esquecidos sao um prefixo; as
+marcas dos que ficam sao refeitas, pois um bloco pode aparecer mais de uma vez
+*/
+static void podaRecentes(struct fs_diario *d) {
+	uint64_t i, duravel;
+	if (d->npendentes == 0) return;
+	pthread_mutex_lock(&d->mutex);
+	duravel = d->duravel;
+	pthread_mutex_unlock(&d->mutex);
+	for (i = 0; i < d->npendentes && d->pendentes[i + 1] <= duravel; i += 2)
+		tiraBit(d->recentes, d->pendentes[i]);
+	if (i == 0) return;
+	d->npendentes -= i;
+	memmove(d->pendentes, d->pendentes + i, d->npendentes * sizeof(uint64_t));
+	for (i = 0; i < d->npendentes; i += 2) poeBit(d->recentes, d->pendentes[i]);
+}
 
-		//procura pela referencia do arq no diretorio e atualiza para o novo arq
-		node_atual = diretorioPai_n;
-		do{
-			lseek(sb->fd, node_atual*sb->blksz, SEEK_SET);
-			aux = read(sb->fd, aux_inode, sb->blksz);
-			for(i=0; i<NLINKS; i++){
-				if(aux_inode->links[i] == arquivoAntigoN){
-					aux_inode->links[i] = arquivoN;
-					lseek(sb->fd, node_atual*sb->blksz, SEEK_SET);
-					aux = write(sb->fd, aux_inode, sb->blksz);
-					break;
-				}
-			}
-			node_atual = aux_inode->next;
-		}
-		while(node_atual != 0);
-	}
-	//se o arq nao existia
-	else{
-		//pega um novo bloco
-		arquivoN = fs_get_block(sb);
-		if(arquivoN == (uint64_t)-1){
-			free(diretorioPai);
-			free(arquivo);
-			free(aux_inode);
-			free(arquivoIn);
-			free(paiIn);
-			errno = ENOSPC;
-			return -1;
-		}
+/*
+Inicio de uma transacao: faz o checkpoint se o log passou da metade.  Uma
+transacao de fs_txn_begin comeca com o log vazio, para poder usa-lo inteiro
+*/
+static int iniciaTransacao(struct superblock *sb) {
+	struct fs_diario *d = sb->bg->diario;
+	int ret = 0;
+	if (!d->erro && (d->cabeca > d->tamanho / 2 || (sb->bg->explicita && d->cabeca != 0)))
+		ret = checkpoint(sb);
+	podaRecentes(d);
+	return ret;
+}
 
-		//le o nodeinfo e inode do dir pai e atualiza o nodeinfo
-		lseek(sb->fd, diretorioPai_n*sb->blksz, SEEK_SET);
-		aux = read(sb->fd, diretorioPai, sb->blksz);
-		lseek(sb->fd, diretorioPai->meta*sb->blksz, SEEK_SET);
-		aux = read(sb->fd, paiIn, sb->blksz);
-		paiIn->size++;
-		lseek(sb->fd, diretorioPai->meta*sb->blksz, SEEK_SET);
-		aux = write(sb->fd,paiIn,sb->blksz);
-
-		//linka o novo bloco no dir pai
-		linkaBlocos(sb,diretorioPai,diretorioPai_n,arquivoN);
-
-		//escreve o inode do pai
-		lseek(sb->fd, diretorioPai_n*sb->blksz, SEEK_SET);
-		aux = write(sb->fd,diretorioPai,sb->blksz);
-	}
-
-	//cria estrutura do novo arq
-	arquivo->parent = diretorioPai_n;
-	arquivo->mode = IMREG;
-	arquivo->next = 0;
-
-	//pega novo bloco pro meta do arq
-	arquivo->meta = fs_get_block(sb);
-	if(arquivo->meta == (uint64_t)-1){
-		free(diretorioPai);
-		free(arquivo);
-		free(aux_inode);
-		free(arquivoIn);
-		free(paiIn);
+/*
+Garante espaco no log para a transacao aberta com mais n imagens e r
+revogacoes.  Uma operacao grande demais para o log eh dividida: o que ela ja
+gravou vira uma transacao, o log eh esvaziado e o resto continua noutra
+*/
+static int reservaLog(struct superblock *sb, uint64_t n, uint64_t r) {
+	struct fs_diario *d = sb->bg->diario;
+	if (d->tamanho == 0 ||
+	    d->cabeca + blocosTransacao(d, d->nblocos + n, d->nrevogados + r) <= d->tamanho)
+		return 0;
+	//uma transacao de fs_txn_begin nao pode ser dividida
+	if (sb->bg->explicita) {
 		errno = ENOSPC;
 		return -1;
 	}
+	uint64_t seq = fechaTransacao(d);
+	if (seq && aguardaDuravel(d, seq) == -1) return -1;
+	return checkpoint(sb);
+}
 
-	//cria estrutura do meta do arq e a escreve
-	strcpy(arquivoIn->name,fname);
-	arquivoIn->size = cnt;
-	lseek(sb->fd, arquivo->meta*sb->blksz, SEEK_SET);
-	aux = write(sb->fd,arquivoIn,sb->blksz);
-
-	//cria blocos e escreve o dado
-	memset(aux_inode,0,sb->blksz);
-	uint64_t block_n;
-	uint64_t bytes_left = (uint64_t) cnt*sizeof(char);
-	void *block = calloc(sb->blksz,1);
-
-	uint64_t last_n;
-	node_atual = arquivoN;
-	free(aux_inode);
-	aux_inode = arquivo;
-	int flageof = 0;
-	do{
-		for(i = 0; i<NLINKS && !flageof; i++){
-			if(aux_inode->links[i] == 0){
-				//limpa o bloco
-				memset(block,0,sb->blksz);
-				if(bytes_left >= sb->blksz){
-					memcpy(block,buf,sb->blksz);
-					bytes_left -= sb->blksz;
-				}
-				else{
-					memcpy(block,buf, bytes_left);
-					flageof = 1;
-				}
-				//pega um indice pro bloco
-				block_n = fs_get_block(sb);
-				if(block_n == (uint64_t) -1){
-					free(diretorioPai);
-					free(arquivo);
-					free(arquivoIn);
-					free(paiIn);
-					errno = ENOSPC;
-					return -1;
-				}
-
-				//linka o bloco
-				aux_inode->links[i] = block_n;
-
-				//escreve o bloco
-				lseek(sb->fd, block_n*sb->blksz, SEEK_SET);
-				aux = write(sb->fd,block,sb->blksz);
-			}
-		}
-		if(flageof){
-			//Escreve o inode corrente
-			lseek(sb->fd, node_atual*sb->blksz, SEEK_SET);
-			aux = write(sb->fd,aux_inode,sb->blksz);
-		}
-		else{
-			//Inode cheio, e eof n encontrado
-
-			last_n = node_atual;
-			aux_inode->next = fs_get_block(sb);
-			if(aux_inode->next == (uint64_t) -1){
-				free(diretorioPai);
-				free(arquivo);
-				free(arquivoIn);
-				free(paiIn);
-				errno = ENOSPC;
-				return -1;
-			}
-
-			//Escreve o inode corrente
-			lseek(sb->fd, node_atual*sb->blksz, SEEK_SET);
-			aux = write(sb->fd,aux_inode,sb->blksz);
-
-			//Limpa o struct aux_inode e atualiza node_atual
-			node_atual = aux_inode->next;
-			memset(aux_inode,0,sb->blksz);
-
-			//Cria estrutura do inode filho
-			aux_inode->parent = arquivoN;
-			aux_inode->meta = last_n;
-			aux_inode->mode = IMCHILD;
-			aux_inode->next = 0;
+/*
+Grava buf como nova imagem de bloco na transacao aberta.  Se falhar numa
+transacao de fs_txn_begin, a operacao fica pela metade no cache: a falha eh
+guardada em falhou, e fs_txn_commit desfaz a transacao
+*/
+static int registraBloco(const struct superblock *sb, uint64_t bloco,
+                         const void *buf) {
+	struct fs_diario *d = sb->bg->diario;
+	struct imagem *e = procuraImagem(d, bloco);
+	if (e == NULL || e->seq != d->atual) {
+		if (reservaLog((struct superblock*) sb, 1, 0) == -1) goto falha;
+		e = procuraImagem(d, bloco); //o checkpoint esvazia o cache
+		if (e == NULL && 2 * (d->ncache + 1) > d->mascara + 1 && cresceCache(d) == -1)
+			goto falha;
+		if (e == NULL) {
+			uint64_t i = espalha(bloco) & d->mascara;
+			while (d->cache[i].dados != NULL) i = (i + 1) & d->mascara;
+			e = &d->cache[i];
+			if ((e->dados = (char*) malloc(d->blksz)) == NULL) goto falha;
+			e->bloco = bloco;
+			d->ncache++;
 		}
+		e->seq = d->atual;
+		if (d->tamanho != 0 &&
+		    anexaNumero(&d->blocos, &d->nblocos, &d->capBlocos, bloco) == -1)
+			goto falha;
+		//com a escrita adiada, acorda o escritor quando o cache enche
+		if (d->tamanho == 0 && d->ncache == sb->bg->maxSujos && !sb->bg->explicita)
+			pthread_cond_signal(&sb->bg->sinal);
 	}
-	while(!flageof);
+	memcpy(e->dados, buf, d->blksz);
+	return 0;
 
-	free(diretorioPai);
-	free(arquivo);
-	free(arquivoIn);
-	free(paiIn);
+falha:
+	if (sb->bg->explicita && d->falhou == 0) d->falhou = errno ? errno : EIO;
+	return -1;
+}
 
-	return 0;
+static inline struct fs_diario *diarioAtivo(const struct superblock *sb) {
+	return sb->bg != NULL && sb->bg->profundidade > 0 ? sb->bg->diario : NULL;
 }
 
 /*
-Le os primeiros bufsz bytes do arquivo fname e coloca no vetor apontado por buf
+Imagem do bloco de numero bloco no cache do diario (ou no que o escritor esta
+gravando), ou NULL se ele deve ser lido da imagem
 */
-ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf, size_t bufsz) {
-    // Verifica o descritor do sistema de arquivos.
-    if (sb->magic != 0xdcc605f5) {
-        errno = EBADF;
-        return -1;
-    }
+static inline struct imagem *imagemCache(const struct superblock *sb, uint64_t bloco) {
+	struct fs_diario *d = diarioAtivo(sb);
+	struct imagem *e = NULL;
+	if (d != NULL && d->ncache != 0) e = procuraImagem(d, bloco);
+	if (d != NULL && e == NULL && d->escrita != NULL)
+		e = procuraEm(d->escrita, d->mascaraEscrita, bloco);
+	return e;
+}
+
+/*
+Le/escreve o bloco de numero bloco da imagem, do tipo tipo (FS_BLOCK_*),
+usando as rotinas de geometria.  Com o diario, os blocos de metadados passam
+pelo cache (e pelo que o escritor esta gravando)
+*/
+static inline int leBlocoTipo(const struct superblock *sb, uint64_t bloco,
+                              void *buf, int tipo) {
+	struct fs_stats *st = estatisticas(sb);
+	struct imagem *e = imagemCache(sb, bloco);
+	CONTA(st->reads[tipo], 1);
+	traca(sb, EV_LEITURA, tipo | (e != NULL ? EV_CACHE : 0), bloco);
+	if (e != NULL) {
+		CONTA(st->cache_hits, 1);
+		memcpy(buf, e->dados, sb->blksz);
+		return 0;
+	}
+	CONTA(st->cache_misses, 1);
+	CONTA(st->syscalls, 1);
+	return sb->ops->le(sb, bloco, buf) == (ssize_t)sb->blksz ? 0 : -1;
+}
+
+static inline int escreveBlocoTipo(const struct superblock *sb, uint64_t bloco,
+                                   const void *buf, int tipo) {
+	((struct superblock*) sb)->writes++;
+	CONTA(estatisticas(sb)->writes[tipo], 1);
+	traca(sb, EV_ESCRITA, tipo, bloco);
+	if (diarioAtivo(sb) != NULL) return registraBloco(sb, bloco, buf);
+	if (sb->bg != NULL) sb->bg->sujo = 1;
+	CONTA(estatisticas(sb)->syscalls, 1);
+	return sb->ops->escreve(sb, bloco, buf) == (ssize_t)sb->blksz ? 0 : -1;
+}
+
+/* Inodes (e nos de mapas e de arvores de diretorio) e nodeinfos. */
+static inline int leBloco(const struct superblock *sb, uint64_t bloco, void *buf) {
+	return leBlocoTipo(sb, bloco, buf, FS_BLOCK_INODE);
+}
+
+static inline int escreveBloco(const struct superblock *sb, uint64_t bloco,
+                               const void *buf) {
+	return escreveBlocoTipo(sb, bloco, buf, FS_BLOCK_INODE);
+}
+
+static inline int leInfo(const struct superblock *sb, uint64_t bloco, void *buf) {
+	return leBlocoTipo(sb, bloco, buf, FS_BLOCK_NODEINFO);
+}
+
+static inline int escreveInfo(const struct superblock *sb, uint64_t bloco,
+                              const void *buf) {
+	return escreveBlocoTipo(sb, bloco, buf, FS_BLOCK_NODEINFO);
+}
+
+/* Maior buraco (em blocos) lido e descartado para juntar duas leituras de
+ * leBlocos em um unico preadv. */
+#define LACUNA_LEITURA 8
+
+/* Bloco a ler e sua posicao no pedido de leBlocos. */
+struct leitura {
+	uint64_t bloco, i;
+};
+
+static int comparaLeituras(const void *a, const void *b) {
+	const struct leitura *x = (const struct leitura*) a;
+	const struct leitura *y = (const struct leitura*) b;
+	return x->bloco < y->bloco ? -1 : x->bloco > y->bloco;
+}
+
+/*
+Le os n blocos de v, o i-esimo em buf[i], de uma vez: em ordem de bloco, com
+um preadv por sequencia de blocos proximos (os buracos de ate LACUNA_LEITURA
+blocos sao lidos para uma area descartada).  Os blocos que estao no cache do
+diario sao copiados dele.  tipos[i] eh o tipo (FS_BLOCK_*) de v[i]
+*/
+static int leBlocos(const struct superblock *sb, const uint64_t *v, uint64_t n,
+                    char **buf, const int *tipos) {
+	struct leitura *l = (struct leitura*) malloc((n ? n : 1) * sizeof(struct leitura));
+	struct fs_stats *st = estatisticas(sb);
+	struct iovec iov[64];
+	char *lixo = NULL;
+	uint64_t m = 0, i, j, k, esperado;
+	struct imagem *e;
+	int ret = -1;
+
+	for (i = 0; i < n; i++) {
+		CONTA(st->reads[tipos[i]], 1);
+		e = imagemCache(sb, v[i]);
+		traca(sb, EV_LEITURA, tipos[i] | (e != NULL ? EV_CACHE : 0), v[i]);
+		if (e != NULL) {
+			memcpy(buf[i], e->dados, sb->blksz);
+			continue;
+		}
+		l[m].bloco = v[i];
+		l[m++].i = i;
+	}
+	CONTA(st->cache_hits, n - m);
+	CONTA(st->cache_misses, m);
+	qsort(l, m, sizeof(struct leitura), comparaLeituras);
+
+	for (i = 0; i < m; i = j) {
+		k = 0;
+		iov[k].iov_base = buf[l[i].i];
+		iov[k++].iov_len = sb->blksz;
+		for (j = i + 1; j < m && l[j].bloco - l[j - 1].bloco <= LACUNA_LEITURA &&
+		     k + 2 <= 64; j++) {
+			// o mesmo bloco pedido duas vezes eh copiado depois
+			if (l[j].bloco == l[j - 1].bloco) continue;
+			if (l[j].bloco - l[j - 1].bloco > 1) {
+				if (lixo == NULL) lixo = (char*) malloc((LACUNA_LEITURA - 1) * sb->blksz);
+				iov[k].iov_base = lixo;
+				iov[k++].iov_len = (l[j].bloco - l[j - 1].bloco - 1) * sb->blksz;
+			}
+			iov[k].iov_base = buf[l[j].i];
+			iov[k++].iov_len = sb->blksz;
+		}
+		esperado = (l[j - 1].bloco - l[i].bloco + 1) * sb->blksz;
+		CONTA(st->syscalls, 1);
+		if (sb->dev->read_blocks(sb->dev, iov, k, l[i].bloco * sb->blksz) != (ssize_t)esperado) {
+			if (errno == 0) errno = EIO;
+			goto fim;
+		}
+		for (k = i + 1; k < j; k++) {
+			if (l[k].bloco == l[k - 1].bloco)
+				memcpy(buf[l[k].i], buf[l[k - 1].i], sb->blksz);
+		}
+	}
+	ret = 0;
+
+fim:
+	free(l);
+	free(lixo);
+	return ret;
+}
+
+/*
+Escreve um bloco de dados de arquivo.  Com o journal, so passa pelo diario
+dentro de uma transacao de fs_txn_begin (para que fs_txn_abort possa
+desfaze-la) ou se os metadados no disco ainda usam o bloco (veja
+marcaRecentes); sem ele, o diario sem log guarda tambem os dados
+*/
+static int escreveDados(const struct superblock *sb, uint64_t bloco, const void *buf) {
+	struct fs_diario *d = diarioAtivo(sb);
+	struct imagem *e;
+	CONTA(estatisticas(sb)->writes[FS_BLOCK_DATA], 1);
+	traca(sb, EV_ESCRITA, FS_BLOCK_DATA, bloco);
+	if (d != NULL && (sb->bg->explicita || d->tamanho == 0 ||
+	                  (d->recentes != NULL && temBit(d->recentes, bloco))))
+		return registraBloco(sb, bloco, buf);
+	if (sb->bg != NULL) sb->bg->sujo = 1;
+	if (d != NULL && d->ncache != 0 && (e = procuraImagem(d, bloco)) != NULL) {
+		if (reservaLog((struct superblock*) sb, 0, 1) == -1) return -1;
+		if ((e = procuraImagem(d, bloco)) != NULL) {
+			removeImagem(d, e);
+			if (anexaNumero(&d->revogados, &d->nrevogados, &d->capRevogados, bloco) == -1)
+				return -1;
+		}
+	}
+	CONTA(estatisticas(sb)->syscalls, 1);
+	return sb->ops->escreve(sb, bloco, buf) == (ssize_t)sb->blksz ? 0 : -1;
+}
+
+/*
+Grava a parte persistente do superbloco sb no bloco 0 da imagem
+*/
+static int gravaSuperbloco(struct superblock *sb) {
+	CONTA(sb->stats.writes[FS_BLOCK_SUPER], 1);
+	traca(sb, EV_ESCRITA, FS_BLOCK_SUPER, 0);
+	if (diarioAtivo(sb) != NULL) {
+		char *bloco = (char*) calloc(sb->blksz, 1);
+		memcpy(bloco, sb, SB_DISCO);
+		int aux = registraBloco(sb, 0, bloco);
+		free(bloco);
+		return aux;
+	}
+	if (sb->bg != NULL) sb->bg->sujo = 1;
+	if (escrevePosicao(&sb->stats, sb->dev, sb, SB_DISCO, 0) != SB_DISCO) return -1;
+	return 0;
+}
+
+/* Le o bloco p do log do diario d em buf. */
+static int leLog(const struct fs_diario *d, uint64_t p, void *buf) {
+	ssize_t aux = lePosicao(d->stats, d->dev, buf, d->blksz, (off_t)((d->log + p) * d->blksz));
+	return aux == (ssize_t)d->blksz ? 0 : -1;
+}
+
+/* Bloco revogado e a ultima transacao que o revogou. */
+struct revogacao {
+	uint64_t bloco, seq;
+};
+
+static int comparaRevogacoes(const void *a, const void *b) {
+	const struct revogacao *x = (const struct revogacao*) a;
+	const struct revogacao *y = (const struct revogacao*) b;
+	if (x->bloco != y->bloco) return x->bloco < y->bloco ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+Refaz as transacoes completas do log nos lugares definitivos e reinicia o
+log.  Uma passada acha as transacoes cujo COMMIT confere e junta as
+revogacoes; a outra copia as imagens que nao foram revogadas por uma
+transacao posterior.  Retorna a sequencia da proxima transacao, ou -1
+*/
+static int64_t recuperaDiario(struct fs_diario *d) {
+	struct registro *r = (struct registro*) malloc(d->blksz);
+	char *img = (char*) malloc(d->blksz);
+	struct revogacao *rev = NULL, *achada;
+	uint64_t nrev = 0, caprev = 0, inicioRev, pos, fimLog, p, i, seq, ultimo;
+	int64_t ret = -1;
+
+	if (lePosicao(d->stats, d->dev, r, d->blksz, (off_t)((d->log - 1) * d->blksz)) != (ssize_t)d->blksz)
+		goto fim;
+	if (r->magic != MAGIC_DIARIO || r->tipo != DIARIO_CABECALHO) {
+		errno = EBADF;
+		goto fim;
+	}
+	ultimo = r->seq - 1;
+
+	//primeira passada: transacoes completas e suas revogacoes
+	for (pos = 0, seq = ultimo + 1;; seq++) {
+		uint64_t soma = 0xcbf29ce484222325ULL;
+		inicioRev = nrev;
+		for (p = pos; p < d->tamanho; p++) {
+			if (leLog(d, p, r) == -1)
+				goto fim;
+			if (r->magic != MAGIC_DIARIO || r->seq != seq || r->n > d->porRegistro) break;
+			if (r->tipo == DIARIO_COMMIT) break;
+			soma = somaBytes(soma, r, d->blksz);
+			if (r->tipo == DIARIO_REVOGA) {
+				for (i = 0; i < r->n; i++) {
+					if (nrev == caprev) {
+						struct revogacao *maior = (struct revogacao*)
+							realloc(rev, (caprev ? 2 * caprev : 64) * sizeof(*rev));
+						if (maior == NULL) goto fim;
+						rev = maior;
+						caprev = caprev ? 2 * caprev : 64;
+					}
+					rev[nrev].bloco = r->v[i];
+					rev[nrev++].seq = seq;
+				}
+			} else if (r->tipo == DIARIO_DESCRITOR) {
+				uint64_t n = r->n;
+				for (i = 0; i < n && ++p < d->tamanho; i++) {
+					if (leLog(d, p, img) == -1)
+						goto fim;
+					soma = somaBytes(soma, img, d->blksz);
+				}
+				if (i < n) break;
+			} else {
+				break;
+			}
+		}
+		if (p >= d->tamanho || r->magic != MAGIC_DIARIO || r->seq != seq ||
+		    r->tipo != DIARIO_COMMIT || r->v[0] != soma) {
+			nrev = inicioRev;
+			break;
+		}
+		ultimo = seq;
+		pos = p + 1;
+	}
+
+	//fica so a ultima revogacao de cada bloco
+	if (nrev > 0) qsort(rev, nrev, sizeof(*rev), comparaRevogacoes);
+	for (i = p = 0; i < nrev; i++) {
+		if (p > 0 && rev[p - 1].bloco == rev[i].bloco) p--;
+		rev[p++] = rev[i];
+	}
+	nrev = p;
+
+	//segunda passada: copia as imagens
+	for (fimLog = pos, pos = 0; pos < fimLog; pos++) {
+		if (leLog(d, pos, r) == -1)
+			goto fim;
+		if (r->tipo != DIARIO_DESCRITOR) continue;
+		for (i = 0; i < r->n; i++) {
+			pos++;
+			//a revogacao do bloco, se houver
+			uint64_t a = 0, b = nrev;
+			while (a < b) {
+				uint64_t m = (a + b) / 2;
+				if (rev[m].bloco < r->v[i]) a = m + 1; else b = m;
+			}
+			achada = a < nrev && rev[a].bloco == r->v[i] ? &rev[a] : NULL;
+			if (achada != NULL && achada->seq > r->seq) continue;
+			if (leLog(d, pos, img) == -1 ||
+			    escrevePosicao(d->stats, d->dev, img, d->blksz, (off_t)(r->v[i] * d->blksz)) != (ssize_t)d->blksz)
+				goto fim;
+		}
+	}
+
+	if (sincronizaImagem(d->stats, d->dev) == -1 || gravaCabecalho(d, ultimo + 1) == -1 ||
+	    sincronizaImagem(d->stats, d->dev) == -1)
+		goto fim;
+	ret = ultimo + 1;
+fim:
+	free(rev);
+	free(img);
+	free(r);
+	return ret;
+}
+
+/* Diario do superbloco sb, sem transacoes (veja recuperaDiario). */
+static struct fs_diario *criaDiario(const struct superblock *sb) {
+	struct fs_diario *d = (struct fs_diario*) calloc(1, sizeof(struct fs_diario));
+	if (d == NULL) return NULL;
+	d->dev = sb->dev;
+	d->stats = estatisticas(sb);
+	d->blksz = sb->blksz;
+	d->porRegistro = (sb->blksz - sizeof(struct registro)) / sizeof(uint64_t);
+	d->log = sb->journal ? sb->journal + 1 : 0;
+	d->tamanho = sb->journal ? sb->journalblks - 1 : 0;
+	for (d->mascara = 63; d->mascara < 2 * d->tamanho; d->mascara = 2 * d->mascara + 1);
+	d->cache = (struct imagem*) calloc(d->mascara + 1, sizeof(struct imagem));
+	if (d->cache == NULL) {
+		free(d);
+		return NULL;
+	}
+	pthread_mutex_init(&d->mutex, NULL);
+	pthread_cond_init(&d->pronto, NULL);
+	return d;
+}
+
+static void liberaDiario(struct fs_diario *d) {
+	for (uint64_t i = 0; i <= d->mascara; i++) free(d->cache[i].dados);
+	pthread_cond_destroy(&d->pronto);
+	pthread_mutex_destroy(&d->mutex);
+	free(d->cache);
+	free(d->blocos);
+	free(d->revogados);
+	free(d->recentes);
+	free(d->pendentes);
+	free(d->grupo);
+	free(d->reserva);
+	free(d);
+}
+
+/* Estado compartilhado de sb, criado na primeira vez. */
+static struct fs_background *criaEstado(struct superblock *sb) {
+	if (sb->bg != NULL) return sb->bg;
+	pthread_mutexattr_t atributos;
+	struct fs_background *bg = (struct fs_background*) calloc(1, sizeof(struct fs_background));
+	if (bg == NULL) return NULL;
+	pthread_mutexattr_init(&atributos);
+	pthread_mutexattr_settype(&atributos, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&bg->trava, &atributos);
+	pthread_mutexattr_destroy(&atributos);
+	pthread_cond_init(&bg->acorda, NULL);
+	pthread_cond_init(&bg->sinal, NULL);
+	sb->bg = bg;
+	return bg;
+}
+
+/* Liga o diario de sb, com seq como proxima transacao. */
+static int iniciaDiario(struct superblock *sb, uint64_t seq) {
+	struct fs_diario *d = criaDiario(sb);
+	if (d == NULL || criaEstado(sb) == NULL) {
+		if (d != NULL) liberaDiario(d);
+		errno = ENOMEM;
+		return -1;
+	}
+	d->atual = seq;
+	d->ultimo = d->duravel = seq - 1;
+	sb->bg->diario = d;
+	if (sb->journal != 0) sb->bg->politica = FS_DURABLE_FSYNC;
+	return 0;
+}
+
+static void liberaEstado(struct superblock *sb) {
+	struct fs_background *bg = sb->bg;
+	sb->bg = NULL;
+	if (bg->diario != NULL) liberaDiario(bg->diario);
+	pthread_cond_destroy(&bg->sinal);
+	pthread_cond_destroy(&bg->acorda);
+	pthread_mutex_destroy(&bg->trava);
+	free(bg);
+}
+
+/*
+Grava os blocos sujos do diario sem log de sb (depois dos que o escritor
+estiver gravando) e, com sincroniza, faz o fdatasync.  Chamado com a trava
+*/
+static int escreveSujos(struct superblock *sb, int sincroniza) {
+	struct fs_diario *d = sb->bg->diario;
+	recolheEscrita(d);
+	if (gravaCache(d) == -1 || (sincroniza && sincronizaImagem(d->stats, d->dev) == -1)) {
+		d->erro = errno ? errno : EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/* Furos (veja fs_set_punch).  Os blocos liberados que vao para links[] de
+ * uma pagina livre (nunca as proprias paginas) entram numa fila e sao
+ * marcados num mapa de bits, um por bloco da imagem.  Um bloco que sai da
+ * lista de blocos livres, ou vira pagina, perde a marca: so os blocos ainda
+ * marcados quando a fila eh esvaziada sao furados. */
+struct fs_punch {
+	uint64_t *marcados;
+	uint64_t *fila, nfila, capFila;
+	uint64_t lote;      /* tamanho da fila que dispara os furos */
+	uint64_t inicioTxn; /* tamanho da fila em fs_txn_begin */
+};
+
+/* Poe o bloco liberado na fila de furos de sb, se houver. */
+static void marcaFuro(struct superblock *sb, uint64_t bloco) {
+	struct fs_punch *f = sb->punch;
+	if (f == NULL || temBit(f->marcados, bloco)) return;
+	// sem memoria para a fila, o bloco apenas deixa de ser furado
+	if (anexaNumero(&f->fila, &f->nfila, &f->capFila, bloco) == 0) poeBit(f->marcados, bloco);
+}
+
+/* Tira a marca do bloco que voltou a ser usado (ou virou pagina livre). */
+static inline void retiraFuro(struct superblock *sb, uint64_t bloco) {
+	if (sb->punch != NULL) tiraBit(sb->punch->marcados, bloco);
+}
+
+static int comparaNumeros(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+Descarta os n blocos de v (que eh ordenado) no dispositivo de sb, com um
+discard por sequencia de blocos seguidos
+*/
+static int furaBlocos(struct superblock *sb, uint64_t *v, uint64_t n) {
+	struct fs_stats *st = estatisticas(sb);
+	uint64_t i, j;
+
+	qsort(v, n, sizeof(uint64_t), comparaNumeros);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && v[j] <= v[j - 1] + 1; j++) ;
+		CONTA(st->syscalls, 1);
+		CONTA(st->discards, 1);
+		if (sb->dev->discard(sb->dev, v[i] * sb->blksz, (v[j - 1] - v[i] + 1) * sb->blksz) == -1)
+			return -1;
+		CONTA(st->punched, v[j - 1] - v[i] + 1);
+	}
+	return 0;
+}
+
+/*
+Fura os blocos da fila que continuam marcados e esvazia a fila.  Os blocos
+precisam ja estar fora de todo inode na imagem
+*/
+static int furaLivres(struct superblock *sb) {
+	struct fs_punch *f = sb->punch;
+	uint64_t i, n = 0;
+
+	// a marca sai na primeira vez, de modo que um bloco repetido na fila
+	// so aparece uma vez
+	for (i = 0; i < f->nfila; i++) {
+		if (!temBit(f->marcados, f->fila[i])) continue;
+		tiraBit(f->marcados, f->fila[i]);
+		f->fila[n++] = f->fila[i];
+	}
+	f->nfila = 0;
+	return furaBlocos(sb, f->fila, n);
+}
+
+/*
+Leva ao disco o que as operacoes ja fizeram (com o diario, um checkpoint;
+com a escrita adiada, o cache), de modo que os blocos liberados estejam fora
+de todo inode tambem na imagem, e fura os blocos da fila.  Chamado com a
+trava, fora de transacao explicita
+*/
+static int esvaziaFuros(struct superblock *sb) {
+	struct fs_diario *d = sb->bg != NULL ? sb->bg->diario : NULL;
+	if (d != NULL && d->tamanho != 0) {
+		//no meio de uma operacao, o que ela ja gravou vira uma transacao
+		fechaTransacao(d);
+		if (checkpoint(sb) == -1) return -1;
+	} else if (d != NULL && escreveSujos(sb, 0) == -1) {
+		return -1;
+	}
+	return furaLivres(sb);
+}
+
+static void liberaFuros(struct superblock *sb) {
+	if (sb->punch == NULL) return;
+	free(sb->punch->marcados);
+	free(sb->punch->fila);
+	free(sb->punch);
+	sb->punch = NULL;
+}
+
+static struct superblock *trava(struct superblock *sb) {
+	struct fs_background *bg = sb->bg;
+	if (bg == NULL) return sb;
+	pthread_mutex_lock(&bg->trava);
+	if (bg->profundidade++ == 0 && bg->diario != NULL) iniciaTransacao(sb);
+	return sb;
+}
+
+/*
+Solta a trava.  No TRAVA mais externo fecha a transacao e, ja sem a trava,
+com FS_DURABLE_FSYNC, espera o grupo em que ela entrou chegar ao disco.  Sem
+journal, aplica a politica aos blocos que a operacao escreveu: grava o cache
+(se houver escrita adiada) e faz o fdatasync.  Com a fila de furos cheia
+(veja fs_set_punch), fura os blocos dela.  Preserva errno, que eh o
+resultado da operacao
+*/
+static void destrava(struct superblock **psb) {
+	struct superblock *sb = *psb;
+	struct fs_background *bg = sb->bg;
+	struct fs_punch *f = sb->punch;
+	int salvo = errno, sincroniza = 0;
+	if (bg == NULL) {
+		//sem cache, as paginas com os blocos liberados ja estao na imagem
+		if (f != NULL && f->nfila >= f->lote) furaLivres(sb);
+		errno = salvo;
+		return;
+	}
+	uint64_t seq = 0;
+	if (--bg->profundidade == 0) {
+		struct fs_diario *d = bg->diario;
+		int fsync = bg->politica == FS_DURABLE_FSYNC;
+		if (d != NULL && d->tamanho != 0) {
+			seq = fechaTransacao(d);
+			if (!fsync) seq = 0;
+		} else if (d != NULL) {
+			//o escritor nao da conta: a operacao grava o cache ela mesma
+			if (fsync || d->ncache >= 4 * bg->maxSujos) escreveSujos(sb, fsync);
+		} else {
+			sincroniza = fsync && bg->sujo;
+		}
+		if (f != NULL && f->nfila >= f->lote) esvaziaFuros(sb);
+		bg->sujo = 0;
+	}
+	pthread_mutex_unlock(&bg->trava);
+	if (seq != 0) aguardaDuravel(bg->diario, seq);
+	if (sincroniza) sincronizaImagem(&sb->stats, sb->dev);
+	errno = salvo;
+}
+
+/*
+Numero de blocos livres guardados em links[] da pagina livre p.  So valem as
+paginas marcadas com MARCA_LOTE: nas gravadas por versoes antigas count nao
+era inicializado
+*/
+static inline uint64_t tamanhoLote(const struct freepage *p) {
+	return (p->count & ~(uint64_t)0xffffffff) == MARCA_LOTE ? (uint32_t)p->count : 0;
+}
+
+/*
+Diario com log de sb, dentro de uma operacao, ou NULL.  Com ele, os blocos
+devolvidos ficam retidos em =freed ate que as transacoes que os liberaram
+estejam no disco: antes disso, uma interrupcao volta aos metadados que ainda
+apontam para eles, e um bloco de dados escrito no lugar os estragaria
+*/
+static inline struct fs_diario *diarioRetem(const struct superblock *sb) {
+	struct fs_diario *d = diarioAtivo(sb);
+	return d != NULL && d->tamanho != 0 ? d : NULL;
+}
+
+/*
+Marca em recentes os n blocos de v, que os metadados no disco usam ate a
+transacao aberta de d estar no disco: os que ela devolveu, ainda apontados
+pelos arquivos de antes, e as paginas de blocos livres que ela tirou das
+listas, ainda no meio delas.  Ate la, escreveDados os grava pelo log
+*/
+static int marcaRecentes(const struct superblock *sb, struct fs_diario *d,
+                         const uint64_t *v, uint64_t n) {
+	if (d->recentes == NULL &&
+	    (d->recentes = (uint64_t*) calloc((sb->blks + 63) / 64, sizeof(uint64_t))) == NULL)
+		return -1;
+	for (uint64_t i = 0; i < n; i++) {
+		if (anexaNumero(&d->pendentes, &d->npendentes, &d->capPendentes, v[i]) == -1)
+			return -1;
+		//os pares ficam sempre inteiros
+		if (anexaNumero(&d->pendentes, &d->npendentes, &d->capPendentes, d->atual) == -1) {
+			d->npendentes--;
+			return -1;
+		}
+		poeBit(d->recentes, v[i]);
+	}
+	return 0;
+}
+
+/* Diz se os blocos retidos em =freed ja podem ser reaproveitados. */
+static int liberadosNoDisco(const struct superblock *sb) {
+	struct fs_diario *d = diarioRetem(sb);
+	if (d == NULL) return 1;
+	pthread_mutex_lock(&d->mutex);
+	int ret = d->duravel >= d->liberou;
+	pthread_mutex_unlock(&d->mutex);
+	return ret;
+}
+
+/*
+Reserva n blocos livres de uma vez, guardando seus numeros em v.  Os blocos
+guardados em links[] de cada pagina saem antes da propria pagina; cada pagina
+eh lida uma unica vez, a pagina inicial restante eh regravada uma vez e o
+superbloco eh gravado so no fim.  Os blocos retidos em =freed (veja
+diarioRetem) saem antes de =freelist se ja podem ser reaproveitados, e so
+depois dela, se ela acabar, senao.  As paginas que saem sao marcadas em
+recentes (veja marcaRecentes)
+*/
+static int pegaBlocos(struct superblock *sb, uint64_t *v, uint64_t n) {
+	if (n == 0) return 0;
+	if (garanteLivres(sb, n) == -1) return -1;
+
+	struct freepage *pagina = (struct freepage*) malloc(sb->blksz);
+	struct fs_diario *d = diarioRetem(sb);
+	uint64_t inicio = sb->freelist, liberados = sb->freed, i, k;
+	uint64_t *primeira = &sb->freed, *segunda = &sb->freelist, *lista = NULL;
+	int lida = 0, suja = 0;
+	if (sb->freed != 0 && !liberadosNoDisco(sb)) {
+		primeira = &sb->freelist;
+		segunda = &sb->freed;
+	}
+	for (i = 0; i < n; i++) {
+		if (!lida) lista = *primeira != 0 ? primeira : segunda;
+		if (!lida && leBlocoTipo(sb, *lista, pagina, FS_BLOCK_FREEPAGE) == -1) {
+			// nada foi gravado: basta voltar ao inicio das listas
+			sb->freelist = inicio;
+			sb->freed = liberados;
+			free(pagina);
+			return -1;
+		}
+		lida = 1;
+		k = tamanhoLote(pagina);
+		if (k > 0) {
+			v[i] = pagina->links[k - 1];
+			pagina->count = MARCA_LOTE | (k - 1);
+			suja = 1;
+		} else {
+			v[i] = *lista;
+			*lista = pagina->next;
+			lida = suja = 0;
+			if (d != NULL && marcaRecentes(sb, d, &v[i], 1) == -1) {
+				sb->freelist = inicio;
+				sb->freed = liberados;
+				free(pagina);
+				return -1;
+			}
+		}
+	}
+	if (suja && escreveBlocoTipo(sb, *lista, pagina, FS_BLOCK_FREEPAGE) == -1) {
+		sb->freelist = inicio;
+		sb->freed = liberados;
+		free(pagina);
+		return -1;
+	}
+	free(pagina);
+
+	for (i = 0; i < n; i++) {
+		traca(sb, EV_ALOCA, 0, v[i]);
+		retiraFuro(sb, v[i]);
+	}
+	sb->freeblks -= n;
+	return gravaSuperbloco(sb);
+}
+
+/*
+Devolve os n blocos de v de uma vez a lista de blocos livres (a =freed, com o
+journal; veja diarioRetem): os blocos sao emendados em paginas que guardam
+ate nfree outros blocos em links[], e o superbloco eh gravado uma unica vez.
+Com a fila de furos, os ultimos blocos de v completam antes links[] da pagina
+inicial, para que poucos virem paginas; os blocos guardados em links[] vao
+para a fila
+*/
+static int devolveBlocos(struct superblock *sb, const uint64_t *v, uint64_t n) {
+	if (n == 0) return 0;
+
+	struct fs_diario *d = diarioRetem(sb);
+	uint64_t *lista = d != NULL ? &sb->freed : &sb->freelist;
+	struct freepage *pagina = (struct freepage*) calloc(sb->blksz, 1);
+	uint64_t i, j, k, total = n;
+	if (d != NULL && marcaRecentes(sb, d, v, n) == -1) {
+		free(pagina);
+		return -1;
+	}
+	if (sb->punch != NULL && *lista != 0) {
+		if (leBlocoTipo(sb, *lista, pagina, FS_BLOCK_FREEPAGE) == -1) {
+			free(pagina);
+			return -1;
+		}
+		k = tamanhoLote(pagina);
+		if ((pagina->count & ~(uint64_t)0xffffffff) == MARCA_LOTE && k < sb->nfree) {
+			j = sb->nfree - k < n ? sb->nfree - k : n;
+			n -= j;
+			memcpy(pagina->links + k, v + n, j * sizeof(uint64_t));
+			pagina->count = MARCA_LOTE | (k + j);
+			if (escreveBlocoTipo(sb, *lista, pagina, FS_BLOCK_FREEPAGE) == -1) {
+				free(pagina);
+				return -1;
+			}
+			for (i = n; i < total; i++) marcaFuro(sb, v[i]);
+		}
+		memset(pagina, 0, sb->blksz);
+	}
+	for (i = 0; i < n; i += k + 1) {
+		k = n - i - 1 < sb->nfree ? n - i - 1 : sb->nfree;
+		memcpy(pagina->links, v + i + 1, k * sizeof(uint64_t));
+		pagina->count = MARCA_LOTE | k;
+		pagina->next = i + k + 1 < n ? v[i + k + 1] : *lista;
+		if (escreveBlocoTipo(sb, v[i], pagina, FS_BLOCK_FREEPAGE) == -1) {
+			free(pagina);
+			return -1;
+		}
+		for (j = 1; j <= k; j++) marcaFuro(sb, v[i + j]);
+	}
+	free(pagina);
+
+	for (i = 0; i < total; i++) traca(sb, EV_LIBERA, 0, v[i]);
+	if (n > 0) *lista = v[0];
+	if (d != NULL) d->liberou = d->atual;
+	sb->freeblks += total;
+	return gravaSuperbloco(sb);
+}
+
+/* Vetor crescente de numeros de blocos, usado para juntar os blocos de varias
+ * operacoes antes de reserva-los ou devolve-los de uma vez. */
+struct listaBlocos {
+	uint64_t *v;
+	uint64_t n, cap;
+};
+
+static int anexaBloco(struct listaBlocos *l, uint64_t bloco) {
+	if (l->n == l->cap) {
+		uint64_t cap = l->cap ? 2 * l->cap : 64;
+		uint64_t *v = (uint64_t*) realloc(l->v, cap * sizeof(uint64_t));
+		if (v == NULL) return -1;
+		l->v = v;
+		l->cap = cap;
+	}
+	l->v[l->n++] = bloco;
+	return 0;
+}
+
+/* Mapa de blocos (IMMAP): links[] do primeiro inode de um arquivo grande eh a
+ * raiz de uma arvore de altura next.  Cada link de um no de altura k cobre
+ * nlinks^k blocos de dados seguidos; os links dos nos de altura zero apontam
+ * os proprios blocos de dados.  Os demais nos sao inodes IMCHILD|IMMAP.  Com
+ * nlinks >= 12, ALTURA_MAXIMA cobre qualquer numero de blocos. */
+#define ALTURA_MAXIMA 24
+
+/*
+Altura do mapa de um arquivo com nblocos blocos de dados; zero se eles cabem
+no primeiro inode (que entao nao tem IMMAP)
+*/
+static uint64_t alturaMapa(const struct superblock *sb, uint64_t nblocos) {
+	uint64_t altura = 0, cobertos = sb->nlinks;
+	while (cobertos < nblocos) {
+		cobertos *= sb->nlinks;
+		altura++;
+	}
+	return altura;
+}
+
+/*
+Le a altura do mapa do primeiro inode in, conferindo-a
+*/
+static int64_t alturaInode(const struct inode *in) {
+	if (!(in->mode & IMMAP)) return 0;
+	if (in->next == 0 || in->next > ALTURA_MAXIMA) {
+		errno = EIO;
+		return -1;
+	}
+	return in->next;
+}
+
+/*
+Anexa a l os blocos abaixo do no in, de altura k: os nos do mapa e os blocos
+de dados.  area tem espaco para k blocos
+*/
+static int coletaMapa(struct superblock *sb, const struct inode *in, uint64_t k,
+                      struct listaBlocos *l, char *area) {
+	struct inode *filho = (struct inode*) area;
+	int64_t i;
+
+	for (i = sb->ops->procuraUsado(sb, in->links, 0); i >= 0;
+	     i = sb->ops->procuraUsado(sb, in->links, i + 1)) {
+		if (anexaBloco(l, in->links[i]) == -1) return -1;
+		if (k == 0) continue;
+		if (leBloco(sb, in->links[i], filho) == -1) return -1;
+		if (coletaMapa(sb, filho, k - 1, l, area + sb->blksz) == -1) return -1;
+	}
+	return 0;
+}
+
+/*
+Desliga do no in, de altura k >= 1, as subarvores da esquerda para a direita
+enquanto l tiver menos de limite blocos, anexando a l os blocos delas.  Um no
+de altura zero sai sempre inteiro, com seus blocos de dados; o filho que
+ficar pela metade eh regravado antes de seus blocos serem devolvidos (in fica
+para o chamador).  area tem espaco para k blocos.  Retorna 1 se in ficou
+vazio, 0 se nao, ou -1
+*/
+static int podaMapa(struct superblock *sb, struct inode *in, uint64_t k,
+                    uint64_t limite, struct listaBlocos *l, char *area) {
+	struct inode *filho = (struct inode*) area;
+	int64_t i, j;
+	int vazio;
+
+	for (i = sb->ops->procuraUsado(sb, in->links, 0); i >= 0 && l->n < limite;
+	     i = sb->ops->procuraUsado(sb, in->links, i + 1)) {
+		if (leBloco(sb, in->links[i], filho) == -1) return -1;
+		if (k == 1) {
+			for (j = sb->ops->procuraUsado(sb, filho->links, 0); j >= 0;
+			     j = sb->ops->procuraUsado(sb, filho->links, j + 1)) {
+				if (anexaBloco(l, filho->links[j]) == -1) return -1;
+			}
+			vazio = 1;
+		} else {
+			vazio = podaMapa(sb, filho, k - 1, limite, l, area + sb->blksz);
+			if (vazio == -1) return -1;
+		}
+		if (!vazio) return escreveBloco(sb, in->links[i], filho);
+		if (anexaBloco(l, in->links[i]) == -1) return -1;
+		in->links[i] = 0;
+	}
+	return sb->ops->procuraUsado(sb, in->links, 0) < 0;
+}
+
+/* Posicao de leitura num arquivo: guarda o caminho ate o ultimo bloco de
+ * dados localizado (um no por altura do mapa, a raiz em cima), de modo que
+ * blocos vizinhos nao releem nada.  Nos arquivos sem mapa nos[0] eh o inode
+ * corrente da cadeia. */
+struct mapa {
+	uint64_t primeiro;                      /* primeiro inode do arquivo */
+	uint64_t altura;
+	uint64_t cobre[ALTURA_MAXIMA + 1];      /* blocos de dados sob um no de cada altura */
+	uint64_t carregado[ALTURA_MAXIMA + 1];  /* qual no de cada altura esta em nos */
+	char *nos;                              /* altura + 1 blocos */
+};
+
+/*
+Prepara m para localizar os blocos do arquivo cujo primeiro inode, no, esta
+lido em in
+*/
+static int abreMapa(const struct superblock *sb, struct mapa *m, uint64_t no,
+                    const struct inode *in) {
+	int64_t altura = alturaInode(in);
+	uint64_t k;
+
+	if (altura == -1) return -1;
+	m->primeiro = no;
+	m->altura = altura;
+	m->nos = (char*) malloc((altura + 1) * sb->blksz);
+	if (m->nos == NULL) return -1;
+	memcpy(m->nos + altura * sb->blksz, in, sb->blksz);
+	for (k = 0; k <= m->altura; k++) {
+		m->cobre[k] = k ? m->cobre[k - 1] * sb->nlinks : sb->nlinks;
+		m->carregado[k] = UINT64_MAX;
+	}
+	m->carregado[altura] = 0;
+	return 0;
+}
+
+static void fechaMapa(struct mapa *m) {
+	free(m->nos);
+}
+
+/*
+Retorna o numero do bloco de dados b (contado do inicio do arquivo) do
+arquivo de m, lendo so os nos do mapa que mudaram desde o ultimo bloco
+localizado, ou zero em caso de erro
+*/
+static uint64_t blocoMapa(const struct superblock *sb, struct mapa *m, uint64_t b) {
+	struct inode *no = (struct inode*) m->nos;
+	uint64_t k, alvo;
+
+	if (m->altura == 0) {
+		// sem mapa: anda pela cadeia, voltando ao inicio se preciso
+		alvo = b / sb->nlinks;
+		if (alvo < m->carregado[0]) {
+			if (leBloco(sb, m->primeiro, no) == -1) return 0;
+			m->carregado[0] = 0;
+		}
+		for (; m->carregado[0] < alvo; m->carregado[0]++) {
+			if (no->next == 0) {
+				errno = EIO;
+				return 0;
+			}
+			if (leBloco(sb, no->next, no) == -1) return 0;
+		}
+	} else {
+		// desce da raiz, relendo so a partir do primeiro no que mudou
+		for (k = m->altura; k > 0; k--) {
+			alvo = b / m->cobre[k - 1];
+			if (m->carregado[k - 1] == alvo) continue;
+			no = (struct inode*) (m->nos + k * sb->blksz);
+			if (no->links[alvo % sb->nlinks] == 0) {
+				errno = EIO;
+				return 0;
+			}
+			if (leBloco(sb, no->links[alvo % sb->nlinks], m->nos + (k - 1) * sb->blksz) == -1)
+				return 0;
+			m->carregado[k - 1] = alvo;
+		}
+		no = (struct inode*) m->nos;
+	}
+	if (no->links[b % sb->nlinks] == 0) errno = EIO;
+	return no->links[b % sb->nlinks];
+}
+
+/*
+Anexa a l o nodeinfo e os inodes filhos da entidade cujo primeiro inode ja
+esta lido em in (in eh usado como area de trabalho).  Com links, anexa tambem
+os blocos apontados por links[] (os blocos de dados de um arquivo) e, se o
+arquivo tiver mapa, os nos do mapa
+*/
+static int coletaCadeia(struct superblock *sb, struct inode *in, int links,
+                        struct listaBlocos *l) {
+	int64_t i, altura;
+
+	if (anexaBloco(l, in->meta) == -1) return -1;
+	if (links && (altura = alturaInode(in)) != 0) {
+		if (altura == -1) return -1;
+		char *area = (char*) malloc(altura * sb->blksz);
+		int ret = area != NULL ? coletaMapa(sb, in, altura, l, area) : -1;
+		free(area);
+		return ret;
+	}
+	for (;;) {
+		for (i = links ? sb->ops->procuraUsado(sb, in->links, 0) : -1; i >= 0;
+		     i = sb->ops->procuraUsado(sb, in->links, i + 1)) {
+			if (anexaBloco(l, in->links[i]) == -1) return -1;
+		}
+		if (in->next == 0) return 0;
+		if (anexaBloco(l, in->next) == -1) return -1;
+		if (leBloco(sb, in->next, in) == -1) return -1;
+	}
+}
+
+/* Lista de orfaos: arquivos ja retirados do diretorio cujos blocos ainda nao
+ * foram liberados.  O primeiro inode de cada orfao aponta o proximo por
+ * =parent e o superbloco aponta o primeiro por =orphans.  Um orfao com
+ * =meta zero eh o resto (os inodes filhos, ou uma copia da raiz do mapa
+ * gravada no bloco do antigo nodeinfo) de um arquivo sobrescrito, cujo
+ * primeiro inode foi reaproveitado, e nao tem nodeinfo a liberar. */
+
+/*
+Poe o orfao no, cujo primeiro inode esta em in, no inicio da lista de orfaos
+*/
+static int enfileiraOrfao(struct superblock *sb, uint64_t no, struct inode *in) {
+	in->parent = sb->orphans;
+	if (escreveBloco(sb, no, in) == -1) return -1;
+	sb->orphans = no;
+	if (gravaSuperbloco(sb) == -1) return -1;
+	if (sb->bg) pthread_cond_signal(&sb->bg->acorda);
+	return 0;
+}
+
+/*
+Libera os blocos dos orfaos, do primeiro em diante, ate liberar cerca de
+orcamento blocos.  Os inodes filhos (ou as subarvores do mapa) de um orfao
+sao desligados dele (e o orfao regravado) antes de seus blocos serem
+devolvidos, de modo que uma interrupcao no meio nunca deixa um bloco livre
+ainda ligado a um orfao.  Retorna o numero de blocos liberados, ou -1
+*/
+static int64_t recuperaOrfaos(struct superblock *sb, uint64_t orcamento) {
+	struct inode *in = (struct inode*) malloc(sb->blksz);
+	struct inode *filho = (struct inode*) malloc(sb->blksz);
+	struct listaBlocos blocos = {NULL, 0, 0};
+	char *area = NULL;
+	uint64_t no, c;
+	int64_t liberados = 0;
+	int64_t i, altura;
+	int resta;
+
+	while (sb->orphans != 0 && (uint64_t)liberados < orcamento) {
+		no = sb->orphans;
+		blocos.n = 0;
+		if (leBloco(sb, no, in) == -1) goto erro;
+		if ((altura = alturaInode(in)) == -1) goto erro;
+
+		if (altura != 0) {
+			// mapa: as subarvores saem da esquerda para a direita
+			if (area == NULL && (area = (char*) malloc(ALTURA_MAXIMA * sb->blksz)) == NULL)
+				goto erro;
+			resta = podaMapa(sb, in, altura, orcamento - liberados, &blocos, area);
+			if (resta == -1) goto erro;
+			resta = !resta;
+		} else {
+			// inodes filhos, do primeiro em diante, enquanto houver orcamento
+			for (c = in->next; c != 0 && liberados + blocos.n < orcamento; c = filho->next) {
+				if (leBloco(sb, c, filho) == -1) goto erro;
+				if (anexaBloco(&blocos, c) == -1) goto erro;
+				for (i = sb->ops->procuraUsado(sb, filho->links, 0); i >= 0;
+				     i = sb->ops->procuraUsado(sb, filho->links, i + 1)) {
+					if (anexaBloco(&blocos, filho->links[i]) == -1) goto erro;
+				}
+			}
+			// sobrou cadeia: o orfao passa a apontar o que falta
+			resta = c != 0;
+			if (resta) in->next = c;
+		}
+
+		if (resta) {
+			if (escreveBloco(sb, no, in) == -1) goto erro;
+		} else {
+			// o orfao inteiro sai da lista
+			if (anexaBloco(&blocos, no) == -1) goto erro;
+			if (in->meta != 0 && anexaBloco(&blocos, in->meta) == -1) goto erro;
+			for (i = sb->ops->procuraUsado(sb, in->links, 0); i >= 0;
+			     i = sb->ops->procuraUsado(sb, in->links, i + 1)) {
+				if (anexaBloco(&blocos, in->links[i]) == -1) goto erro;
+			}
+			sb->orphans = in->parent;
+		}
+
+		// grava tambem o superbloco (orphans)
+		if (devolveBlocos(sb, blocos.v, blocos.n) == -1) goto erro;
+		liberados += blocos.n;
+	}
+
+	free(blocos.v);
+	free(in);
+	free(filho);
+	free(area);
+	return liberados;
+
+erro:
+	free(blocos.v);
+	free(in);
+	free(filho);
+	free(area);
+	return -1;
+}
+
+/*
+Garante, se preciso liberando orfaos, que haja ao menos n blocos livres
+*/
+static int garanteLivres(struct superblock *sb, uint64_t n) {
+	if (sb->freeblks < n && sb->orphans != 0 &&
+	    recuperaOrfaos(sb, n - sb->freeblks) == -1)
+		return -1;
+	if (sb->freeblks < n) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+Diz se os blocos de um arquivo cujo primeiro inode esta em in devem ir para a
+lista de orfaos em vez de serem liberados na hora
+*/
+static inline int adiaLiberacao(const struct superblock *sb, const struct inode *in) {
+	return sb->reclaim != FS_RECLAIM_SYNC && in->next != 0;
+}
+
+/*
+Retorna o ultimo componente do caminho nome
+*/
+static const char *ultimoNome(const char *nome) {
+	const char *c = strrchr(nome, '/');
+	return c ? c + 1 : nome;
+}
+
+/* Diretorios IMBTREE: next do primeiro inode aponta a raiz de uma arvore B+
+ * de struct dirnode (zero com o diretorio vazio), com as entradas ordenadas
+ * pelo ultimo componente do nome, como strcmp.  Cada chave guarda os
+ * primeiros PREFIXO bytes do nome, e o nome inteiro so eh lido (do nodeinfo
+ * da entrada) quando os prefixos empatam.  Nos nos internos, a chave de cada
+ * filho eh sempre a menor chave da subarvore dele.  As remocoes nao
+ * redistribuem chaves: um no so sai da arvore quando fica vazio. */
+#define PREFIXO sizeof(((struct dirkey*) 0)->prefix)
+
+static inline uint64_t chavesPorNo(const struct superblock *sb) {
+	return (sb->blksz - sizeof(struct dirnode)) / sizeof(struct dirkey);
+}
+
+static void preencheChave(struct dirkey *k, uint64_t no, uint64_t entrada,
+                          const char *nome, size_t n) {
+	k->node = no;
+	k->inode = entrada;
+	memset(k->prefix, 0, PREFIXO);
+	memcpy(k->prefix, nome, n < PREFIXO ? n : PREFIXO);
+}
+
+/*
+Compara a chave k com os n bytes de nome, como strcmp, deixando o resultado
+em *c.  Se os prefixos empatam, le o nome inteiro da entrada de k (in e info
+sao areas de trabalho)
+*/
+static int comparaChave(struct superblock *sb, const struct dirkey *k,
+                        const char *nome, size_t n, struct inode *in,
+                        struct nodeinfo *info, int *c) {
+	char prefixo[PREFIXO] = {0};
+	const char *u;
+	size_t m;
+
+	memcpy(prefixo, nome, n < PREFIXO ? n : PREFIXO);
+	*c = memcmp(k->prefix, prefixo, PREFIXO);
+	// nomes sem '\0': prefixos iguais e nome curto sao nomes iguais
+	if (*c != 0 || n < PREFIXO) return 0;
+	if (leBloco(sb, k->inode, in) == -1 || leInfo(sb, in->meta, info) == -1) return -1;
+	u = ultimoNome(info->name);
+	m = strlen(u);
+	*c = memcmp(u, nome, m < n ? m : n);
+	if (*c == 0) *c = (m > n) - (m < n);
+	return 0;
+}
+
+/*
+Busca binaria dos n bytes de nome nas chaves de no: *pos recebe o numero de
+chaves menores que nome e *igual diz se a chave seguinte eh igual a ele
+*/
+static int posicaoNo(struct superblock *sb, const struct dirnode *no,
+                     const char *nome, size_t n, uint64_t *pos, int *igual,
+                     struct inode *in, struct nodeinfo *info) {
+	uint64_t ini = 0, fim = no->count, meio;
+	int c;
+
+	*igual = 0;
+	while (ini < fim) {
+		meio = (ini + fim) / 2;
+		if (comparaChave(sb, &no->keys[meio], nome, n, in, info, &c) == -1) return -1;
+		if (c < 0) {
+			ini = meio + 1;
+		} else {
+			fim = meio;
+			*igual = c == 0;
+		}
+	}
+	*pos = ini;
+	return 0;
+}
+
+/* Caminho da raiz (profundidade 0) ate a folha que cobre um nome: o numero e
+ * o conteudo de cada no, e o indice do filho seguido em cada no interno. */
+struct caminho {
+	uint64_t altura;
+	uint64_t *nos;
+	uint64_t *indices;
+	char *blocos;
+};
+
+static inline struct dirnode *noCaminho(const struct superblock *sb,
+                                        const struct caminho *c, uint64_t d) {
+	return (struct dirnode*) (c->blocos + d * sb->blksz);
+}
+
+static void liberaCaminho(struct caminho *c) {
+	free(c->nos);
+	free(c->indices);
+	free(c->blocos);
+}
+
+/*
+Desce da raiz da arvore do diretorio dir ate a folha em que os n bytes de nome
+estao ou entrariam (com nome NULL, ate a primeira folha), preenchendo c.  *pos
+e *igual sao os de posicaoNo na folha
+*/
+static int desceArvore(struct superblock *sb, const struct inode *dir,
+                       const char *nome, size_t n, struct caminho *c,
+                       uint64_t *pos, int *igual, struct inode *in,
+                       struct nodeinfo *info) {
+	struct dirnode *no = (struct dirnode*) malloc(sb->blksz);
+	uint64_t d;
+
+	memset(c, 0, sizeof(*c));
+	if (leBloco(sb, dir->next, no) == -1) {
+		free(no);
+		return -1;
+	}
+	c->altura = no->height;
+	c->nos = (uint64_t*) malloc((c->altura + 1) * sizeof(uint64_t));
+	c->indices = (uint64_t*) malloc((c->altura + 1) * sizeof(uint64_t));
+	c->blocos = (char*) malloc((c->altura + 1) * sb->blksz);
+	if (c->nos == NULL || c->indices == NULL || c->blocos == NULL) {
+		free(no);
+		return -1;
+	}
+	memcpy(c->blocos, no, sb->blksz);
+	free(no);
+	c->nos[0] = dir->next;
+
+	for (d = 0;; d++) {
+		no = noCaminho(sb, c, d);
+		*pos = *igual = 0;
+		if (nome != NULL && posicaoNo(sb, no, nome, n, pos, igual, in, info) == -1)
+			return -1;
+		if (d == c->altura) return 0;
+		// o filho com a ultima chave <= nome (o primeiro, se nao houver)
+		c->indices[d] = *igual ? *pos : *pos ? *pos - 1 : 0;
+		c->nos[d + 1] = no->keys[c->indices[d]].node;
+		if (leBloco(sb, c->nos[d + 1], noCaminho(sb, c, d + 1)) == -1) return -1;
+	}
+}
+
+/*
+Procura na arvore do diretorio dir a entrada cujo ultimo componente do nome
+sao os n bytes de nome.  Retorna o inode da entrada, ou 0
+*/
+static uint64_t procuraArvore(struct superblock *sb, const struct inode *dir,
+                              const char *nome, size_t n, struct inode *in,
+                              struct nodeinfo *info) {
+	struct caminho c;
+	uint64_t pos, ret = 0;
+	int igual;
+
+	if (dir->next == 0) return 0;
+	if (desceArvore(sb, dir, nome, n, &c, &pos, &igual, in, info) == 0 && igual)
+		ret = noCaminho(sb, &c, c.altura)->keys[pos].node;
+	liberaCaminho(&c);
+	return ret;
+}
+
+/*
+Insere na arvore do diretorio dir_n, cujo inode esta em dir, a entrada filho
+de nome nome (n bytes).  Nos cheios sao divididos ao meio, de baixo para
+cima; se a raiz for dividida, a arvore ganha uma nova raiz e dir eh regravado
+*/
+static int insereArvore(struct superblock *sb, uint64_t dir_n, struct inode *dir,
+                        uint64_t filho, const char *nome, size_t n,
+                        struct inode *in, struct nodeinfo *info) {
+	uint64_t cap = chavesPorNo(sb), pos, d, esquerda, novo;
+	struct dirkey k, *todas = NULL;
+	struct dirnode *no, *dir2 = NULL;
+	struct caminho c = {0};
+	int igual, ret = -1;
+
+	preencheChave(&k, filho, filho, nome, n);
+	if (dir->next == 0) {
+		// primeira entrada: a raiz eh uma folha
+		no = (struct dirnode*) calloc(sb->blksz, 1);
+		no->mode = IMCHILD | IMBTREE;
+		no->parent = dir_n;
+		no->count = 1;
+		no->keys[0] = k;
+		if (pegaBlocos(sb, &novo, 1) == 0 && escreveBloco(sb, novo, no) == 0) {
+			dir->next = novo;
+			ret = escreveBloco(sb, dir_n, dir);
+		}
+		free(no);
+		return ret;
+	}
+
+	if (desceArvore(sb, dir, nome, n, &c, &pos, &igual, in, info) == -1) goto fim;
+	if (igual) {
+		errno = EEXIST;
+		goto fim;
+	}
+
+	// a nova chave sera a menor da folha: passa a ser a chave dos
+	// ancestrais de que a folha eh a subarvore mais a esquerda
+	if (pos == 0) {
+		for (d = c.altura; d-- > 0;) {
+			no = noCaminho(sb, &c, d);
+			no->keys[c.indices[d]].inode = k.inode;
+			memcpy(no->keys[c.indices[d]].prefix, k.prefix, PREFIXO);
+			if (escreveBloco(sb, c.nos[d], no) == -1) goto fim;
+			if (c.indices[d] != 0) break;
+		}
+	}
+
+	todas = (struct dirkey*) malloc((cap + 1) * sizeof(struct dirkey));
+	dir2 = (struct dirnode*) calloc(sb->blksz, 1);
+	for (d = c.altura;; d--) {
+		no = noCaminho(sb, &c, d);
+		if (no->count < cap) {
+			memmove(&no->keys[pos + 1], &no->keys[pos],
+			        (no->count - pos) * sizeof(struct dirkey));
+			no->keys[pos] = k;
+			no->count++;
+			ret = escreveBloco(sb, c.nos[d], no);
+			goto fim;
+		}
+
+		// no cheio: a metade de cima vai para um no novo
+		memcpy(todas, no->keys, pos * sizeof(struct dirkey));
+		todas[pos] = k;
+		memcpy(todas + pos + 1, no->keys + pos, (cap - pos) * sizeof(struct dirkey));
+		esquerda = (cap + 2) / 2;
+		if (pegaBlocos(sb, &novo, 1) == -1) goto fim;
+		memset(dir2, 0, sb->blksz);
+		dir2->mode = IMCHILD | IMBTREE;
+		dir2->parent = dir_n;
+		dir2->height = no->height;
+		dir2->count = cap + 1 - esquerda;
+		memcpy(dir2->keys, todas + esquerda, dir2->count * sizeof(struct dirkey));
+		no->count = esquerda;
+		memcpy(no->keys, todas, esquerda * sizeof(struct dirkey));
+		if (escreveBloco(sb, novo, dir2) == -1) goto fim;
+		if (escreveBloco(sb, c.nos[d], no) == -1) goto fim;
+		preencheChave(&k, novo, dir2->keys[0].inode, dir2->keys[0].prefix, PREFIXO);
+
+		if (d == 0) {
+			// a raiz foi dividida: nova raiz com as duas metades
+			memset(dir2, 0, sb->blksz);
+			dir2->mode = IMCHILD | IMBTREE;
+			dir2->parent = dir_n;
+			dir2->height = no->height + 1;
+			dir2->count = 2;
+			preencheChave(&dir2->keys[0], c.nos[0], no->keys[0].inode,
+			              no->keys[0].prefix, PREFIXO);
+			dir2->keys[1] = k;
+			if (pegaBlocos(sb, &novo, 1) == -1) goto fim;
+			if (escreveBloco(sb, novo, dir2) == -1) goto fim;
+			dir->next = novo;
+			ret = escreveBloco(sb, dir_n, dir);
+			goto fim;
+		}
+		pos = c.indices[d - 1] + 1;
+	}
+
+fim:
+	free(todas);
+	free(dir2);
+	liberaCaminho(&c);
+	return ret;
+}
+
+/*
+Remove da arvore do diretorio dir_n, cujo inode esta em dir, a entrada filho
+de nome nome (n bytes).  Nos que ficam vazios saem da arvore, e uma raiz
+interna com um so filho da lugar a ele; os blocos sao devolvidos depois que
+a arvore ja nao aponta para eles
+*/
+static int removeArvore(struct superblock *sb, uint64_t dir_n, struct inode *dir,
+                        uint64_t filho, const char *nome, size_t n,
+                        struct inode *in, struct nodeinfo *info) {
+	struct listaBlocos livres = {NULL, 0, 0};
+	struct caminho c = {0};
+	struct dirnode *no;
+	uint64_t pos, d, raiz;
+	int igual, ret = -1;
+
+	if (dir->next == 0 ||
+	    desceArvore(sb, dir, nome, n, &c, &pos, &igual, in, info) == -1)
+		goto fim;
+	if (!igual || noCaminho(sb, &c, c.altura)->keys[pos].node != filho) {
+		errno = ENOENT;
+		goto fim;
+	}
+
+	// tira a chave e, de baixo para cima, os nos que ficarem vazios
+	for (d = c.altura;; d--) {
+		no = noCaminho(sb, &c, d);
+		memmove(&no->keys[pos], &no->keys[pos + 1],
+		        (no->count - pos - 1) * sizeof(struct dirkey));
+		no->count--;
+		if (no->count > 0 || d == 0) break;
+		if (anexaBloco(&livres, c.nos[d]) == -1) goto fim;
+		pos = c.indices[d - 1];
+	}
+	if (no->count > 0 && escreveBloco(sb, c.nos[d], no) == -1) goto fim;
+
+	// a menor chave do no mudou: corrige os ancestrais
+	for (; pos == 0 && no->count > 0 && d > 0; d--) {
+		struct dirnode *pai = noCaminho(sb, &c, d - 1);
+		pos = c.indices[d - 1];
+		pai->keys[pos].inode = no->keys[0].inode;
+		memcpy(pai->keys[pos].prefix, no->keys[0].prefix, PREFIXO);
+		if (escreveBloco(sb, c.nos[d - 1], pai) == -1) goto fim;
+		no = pai;
+	}
+
+	// a raiz vazia ou com um so filho sai da arvore
+	raiz = dir->next;
+	no = noCaminho(sb, &c, 0);
+	while (no->count == 0 || (no->count == 1 && no->height > 0)) {
+		if (anexaBloco(&livres, raiz) == -1) goto fim;
+		if (no->count == 0) {
+			raiz = 0;
+			break;
+		}
+		raiz = no->keys[0].node;
+		if (leBloco(sb, raiz, no) == -1) goto fim;
+	}
+	if (raiz != dir->next) {
+		dir->next = raiz;
+		if (escreveBloco(sb, dir_n, dir) == -1) goto fim;
+	}
+	ret = devolveBlocos(sb, livres.v, livres.n);
+
+fim:
+	free(livres.v);
+	liberaCaminho(&c);
+	return ret;
+}
+
+/*
+Anexa a entradas as entradas da subarvore de raiz no, em ordem de nome, e a
+nos os blocos dos nos da subarvore
+*/
+static int percorreArvore(struct superblock *sb, uint64_t no,
+                          struct listaBlocos *entradas, struct listaBlocos *nos) {
+	struct dirnode *d = (struct dirnode*) malloc(sb->blksz);
+	uint64_t i;
+	int ret = -1;
+
+	if (leBloco(sb, no, d) == -1 || anexaBloco(nos, no) == -1) goto fim;
+	for (i = 0; i < d->count; i++) {
+		if (d->height == 0 ? anexaBloco(entradas, d->keys[i].node) == -1
+		                   : percorreArvore(sb, d->keys[i].node, entradas, nos) == -1)
+			goto fim;
+	}
+	ret = 0;
+
+fim:
+	free(d);
+	return ret;
+}
+
+/*
+Anexa a entradas as entradas do diretorio cujo primeiro inode esta em dir (na
+ordem da cadeia ou, nas arvores, dos nomes) e a nos os demais blocos que
+guardam as entradas: os inodes da cadeia ou os nos da arvore.  dir eh usado
+como area de trabalho
+*/
+static int entradasDiretorio(struct superblock *sb, struct inode *dir,
+                             struct listaBlocos *entradas, struct listaBlocos *nos) {
+	int64_t i;
+
+	if (dir->mode & IMBTREE)
+		return dir->next ? percorreArvore(sb, dir->next, entradas, nos) : 0;
+	for (;;) {
+		for (i = sb->ops->procuraUsado(sb, dir->links, 0); i >= 0;
+		     i = sb->ops->procuraUsado(sb, dir->links, i + 1)) {
+			if (anexaBloco(entradas, dir->links[i]) == -1) return -1;
+		}
+		if (dir->next == 0) return 0;
+		if (anexaBloco(nos, dir->next) == -1) return -1;
+		if (leBloco(sb, dir->next, dir) == -1) return -1;
+	}
+}
+
+/*
+Numero maximo de blocos que a insercao de novos entradas no diretorio cujo
+primeiro inode esta em dir, com entradas entradas, pode ocupar: inodes novos
+na cadeia ou, na arvore, uma divisao por nivel (e uma raiz nova) por entrada.
+Em lotes grandes vale um limite menor: so com insercoes, cada no criado por
+divisao fica com pelo menos metade (m) das chaves de um no cheio, e os nos
+novos somam no maximo todas as chaves da arvore ao fim do lote, que sao as
+entradas mais uma por no (ha ate altura + 1 nos por entrada antiga).  As
+raizes novas e a primeira folha ficam de fora, com uma folga de 64 nos (uma
+raiz nova exige que a anterior tenha enchido)
+*/
+static int64_t crescimentoDiretorio(struct superblock *sb, const struct inode *dir,
+                                    uint64_t novos, uint64_t entradas) {
+	struct dirnode *no;
+	uint64_t altura = 0, m = chavesPorNo(sb) / 2, lote;
+
+	if (!(dir->mode & IMBTREE)) return (novos + sb->nlinks - 1) / sb->nlinks;
+	if (novos == 0) return 0;
+	if (dir->next != 0) {
+		no = (struct dirnode*) malloc(sb->blksz);
+		if (leBloco(sb, dir->next, no) == -1) {
+			free(no);
+			return -1;
+		}
+		altura = no->height;
+		free(no);
+	}
+	if (m < 2) return novos * (altura + 2);
+	lote = (entradas * (altura + 2) + novos + 64) / (m - 1) + 64;
+	return novos * (altura + 2) < lote ? novos * (altura + 2) : lote;
+}
+
+/*
+Procura, na cadeia (ou na arvore) do diretorio cujo primeiro inode esta em
+dir, a entrada cujo ultimo componente do nome sao os n bytes de nome.  dir, in
+e info sao usados como area de trabalho.  Retorna o inode da entrada, ou 0
+*/
+static uint64_t procuraEntrada(struct superblock *sb, struct inode *dir,
+                               const char *nome, size_t n,
+                               struct inode *in, struct nodeinfo *info) {
+	const char *u;
+	int64_t i;
+
+	if (dir->mode & IMBTREE) return procuraArvore(sb, dir, nome, n, in, info);
+	for (;;) {
+		for (i = sb->ops->procuraUsado(sb, dir->links, 0); i >= 0;
+		     i = sb->ops->procuraUsado(sb, dir->links, i + 1)) {
+			if (leBloco(sb, dir->links[i], in) == -1) continue;
+			if (leInfo(sb, in->meta, info) == -1) continue;
+			u = ultimoNome(info->name);
+			if (strlen(u) == n && memcmp(u, nome, n) == 0) return dir->links[i];
+		}
+		if (dir->next == 0 || leBloco(sb, dir->next, dir) == -1) return 0;
+	}
+}
+
+/*
+Percorre os tam primeiros bytes de caminho componente a componente a partir
+da raiz.  Retorna o inode encontrado, ou 0 se algum componente nao existir ou
+se um componente intermediario nao for um diretorio
+*/
+static uint64_t procuraCaminho(struct superblock *sb, const char *caminho,
+                               size_t tam) {
+	struct inode *dir = (struct inode*) malloc(sb->blksz);
+	struct inode *in = (struct inode*) malloc(sb->blksz);
+	struct nodeinfo *info = (struct nodeinfo*) malloc(sb->blksz);
+	const char *p = caminho, *fim = caminho + tam, *comp;
+	uint64_t atual = sb->root;
+
+	while (atual != 0) {
+		while (p < fim && *p == '/') p++;
+		if (p == fim) break;
+		comp = p;
+		while (p < fim && *p != '/') p++;
+
+		if (leBloco(sb, atual, dir) == -1 || !(dir->mode & IMDIR)) {
+			atual = 0;
+			break;
+		}
+		atual = procuraEntrada(sb, dir, comp, p - comp, in, info);
+	}
+
+	free(dir);
+	free(in);
+	free(info);
+	return atual;
+}
+
+/*
+Retorna o índice do bloco do arquivo que tenha o nome fname (com opmode == 1,
+o do diretório que contém fname)
+*/
+uint64_t encontraBloco(struct superblock *sb, const char *fname, int opmode) {
+	size_t tam = strlen(fname);
+	if (opmode == 1) {
+		const char *c = strrchr(fname, '/');
+		if (c == NULL) return 0;
+		tam = c - fname;
+	}
+	return procuraCaminho(sb, fname, tam);
+}
+
+/* Uso de nodeinfo->reserved[] nos diretorios: dicas persistentes para achar
+ * um link livre sem ler a cadeia de inodes do diretorio.  Links livres na
+ * cauda sao achados lendo so a cauda; os buracos deixados por remocoes nos
+ * demais inodes da cadeia sao contados e os inodes que os contem ficam
+ * anotados em ate NDICAS dicas. */
+#define DIR_CAUDA 0   /* ultimo inode da cadeia; zero se for o proprio diretorio */
+#define DIR_BURACOS 1 /* links livres nos inodes da cadeia, fora a cauda */
+#define DIR_DICAS 2   /* inodes da cadeia (fora a cauda) com links livres */
+#define NDICAS 4
+
+/*
+Anota (ou, com anota == 0, desanota) no como inode com buracos em info
+*/
+static void dicaBuraco(struct nodeinfo *info, uint64_t no, int anota) {
+	int i, livre = -1;
+	for (i = 0; i < NDICAS; i++) {
+		if (info->reserved[DIR_DICAS + i] == no) {
+			if (!anota) info->reserved[DIR_DICAS + i] = 0;
+			return;
+		}
+		if (info->reserved[DIR_DICAS + i] == 0 && livre < 0) livre = i;
+	}
+	// sem espaco, o buraco so sera achado por procuraBuracos
+	if (anota && livre >= 0) info->reserved[DIR_DICAS + livre] = no;
+}
+
+/*
+Percorre a cadeia do diretorio dir_n (fora a cauda) anotando em info os
+inodes com buracos.  Usado apenas quando ha buracos contados mas nenhuma
+dica.  Retorna o primeiro inode com buraco, ou 0
+*/
+static uint64_t procuraBuracos(struct superblock *sb, uint64_t dir_n,
+                               struct inode *dir, struct nodeinfo *info) {
+	struct inode *in = (struct inode*) malloc(sb->blksz);
+	struct inode *atual = dir;
+	uint64_t no = dir_n, primeiro = 0;
+	int ndicas = 0;
+
+	while (atual->next != 0 && ndicas < NDICAS) {
+		if (sb->ops->procura(sb, atual->links, 0, 0) >= 0) {
+			dicaBuraco(info, no, 1);
+			if (primeiro == 0) primeiro = no;
+			ndicas++;
+		}
+		no = atual->next;
+		if (leBloco(sb, no, in) == -1) break;
+		atual = in;
+	}
+	free(in);
+	return primeiro;
+}
+
+/*
+Insere os n inodes de filhos, de nomes nomes, no diretorio dir_n, cujo inode e
+nodeinfo estao em dir e info.  Usa as dicas de info para ir direto aos links
+livres, grava uma vez cada inode da cadeia que mudar (inclusive dir) e reserva
+de uma vez os inodes novos da cadeia; info so eh atualizado em memoria.  Nas
+arvores, cada filho eh inserido pelo ultimo componente do seu nome
+*/
+static int insereEntradas(struct superblock *sb, uint64_t dir_n, struct inode *dir,
+                          struct nodeinfo *info, const uint64_t *filhos,
+                          const char **nomes, uint64_t n) {
+	struct inode *in = (struct inode*) calloc(sb->blksz, 1);
+	uint64_t *novos = NULL;
+	struct inode *alvo;
+	uint64_t no, feito = 0, antes, k, j;
+	int64_t i;
+	int d;
+
+	if (dir->mode & IMBTREE) {
+		struct nodeinfo *aux = (struct nodeinfo*) malloc(sb->blksz);
+		const char *u;
+		for (; feito < n; feito++) {
+			u = ultimoNome(nomes[feito]);
+			if (insereArvore(sb, dir_n, dir, filhos[feito], u, strlen(u), in, aux) == -1)
+				break;
+		}
+		free(aux);
+		free(in);
+		return feito == n ? 0 : -1;
+	}
+
+	// buracos anotados nas dicas
+	while (feito < n && info->reserved[DIR_BURACOS] > 0) {
+		no = 0;
+		for (d = 0; d < NDICAS && no == 0; d++) no = info->reserved[DIR_DICAS + d];
+		if (no == 0) no = procuraBuracos(sb, dir_n, dir, info);
+		if (no == 0) {
+			// contagem velha: nao ha buracos fora da cauda
+			info->reserved[DIR_BURACOS] = 0;
+			break;
+		}
+		alvo = no == dir_n ? dir : in;
+		if (alvo == in && leBloco(sb, no, in) == -1) goto erro;
+		if (alvo->next == 0) {
+			// dica velha: o inode virou a cauda
+			dicaBuraco(info, no, 0);
+			continue;
+		}
+		antes = feito;
+		for (i = sb->ops->procura(sb, alvo->links, 0, 0);
+		     i >= 0 && feito < n && info->reserved[DIR_BURACOS] > 0;
+		     i = sb->ops->procura(sb, alvo->links, i + 1, 0)) {
+			alvo->links[i] = filhos[feito++];
+			info->reserved[DIR_BURACOS]--;
+		}
+		if (sb->ops->procura(sb, alvo->links, 0, 0) < 0) dicaBuraco(info, no, 0);
+		if (feito > antes && escreveBloco(sb, no, alvo) == -1) goto erro;
+	}
+	if (feito == n) goto fim;
+
+	// links livres na cauda
+	no = info->reserved[DIR_CAUDA] ? info->reserved[DIR_CAUDA] : dir_n;
+	alvo = no == dir_n ? dir : in;
+	if (alvo == in && leBloco(sb, no, in) == -1) goto erro;
+	while (alvo->next != 0) {
+		// cauda velha (imagens sem dicas): segue a cadeia
+		no = alvo->next;
+		alvo = in;
+		if (leBloco(sb, no, in) == -1) goto erro;
+	}
+	info->reserved[DIR_CAUDA] = no == dir_n ? 0 : no;
+	for (i = sb->ops->procura(sb, alvo->links, 0, 0); i >= 0 && feito < n;
+	     i = sb->ops->procura(sb, alvo->links, i + 1, 0)) {
+		alvo->links[i] = filhos[feito++];
+	}
+
+	// cauda cheia: novos inodes na cadeia, reservados de uma vez
+	if (feito < n) {
+		k = (n - feito + sb->nlinks - 1) / sb->nlinks;
+		novos = (uint64_t*) malloc(k * sizeof(uint64_t));
+		if (pegaBlocos(sb, novos, k) == -1) goto erro;
+		alvo->next = novos[0];
+	}
+	if (escreveBloco(sb, no, alvo) == -1) goto erro;
+	for (j = 0; feito < n; j++) {
+		memset(in, 0, sb->blksz);
+		in->mode = IMCHILD;
+		in->parent = dir_n;
+		in->meta = j ? novos[j - 1] : no;
+		for (i = 0; i < sb->nlinks && feito < n; i++) in->links[i] = filhos[feito++];
+		in->next = feito < n ? novos[j + 1] : 0;
+		if (escreveBloco(sb, novos[j], in) == -1) goto erro;
+		info->reserved[DIR_CAUDA] = novos[j];
+	}
+
+fim:
+	free(novos);
+	free(in);
+	return 0;
+
+erro:
+	free(novos);
+	free(in);
+	return -1;
+}
+
+/*
+Insere o inode filho, de nome nome, no diretorio dir_n (veja insereEntradas)
+*/
+static int insereEntrada(struct superblock *sb, uint64_t dir_n, struct inode *dir,
+                         struct nodeinfo *info, uint64_t filho, const char *nome) {
+	return insereEntradas(sb, dir_n, dir, info, &filho, &nome, 1);
+}
+
+/*
+Remove o inode filho, de nome nome, do diretorio dir_n, cujo inode e nodeinfo
+estao em dir e info, anotando o buraco deixado.  Grava o inode da cadeia que
+mudar (inclusive dir); info so eh atualizado em memoria
+*/
+static int removeEntrada(struct superblock *sb, uint64_t dir_n, struct inode *dir,
+                         struct nodeinfo *info, uint64_t filho, const char *nome) {
+	struct inode *in = (struct inode*) malloc(sb->blksz);
+	struct inode *alvo = dir;
+	uint64_t no = dir_n;
+	int64_t i;
+
+	if (dir->mode & IMBTREE) {
+		struct nodeinfo *aux = (struct nodeinfo*) malloc(sb->blksz);
+		nome = ultimoNome(nome);
+		i = removeArvore(sb, dir_n, dir, filho, nome, strlen(nome), in, aux);
+		free(aux);
+		free(in);
+		return i == -1 ? -1 : 0;
+	}
+	for (;;) {
+		i = sb->ops->procura(sb, alvo->links, 0, filho);
+		if (i >= 0) break;
+		if (alvo->next == 0) {
+			free(in);
+			errno = ENOENT;
+			return -1;
+		}
+		no = alvo->next;
+		alvo = in;
+		if (leBloco(sb, no, in) == -1) {
+			free(in);
+			return -1;
+		}
+	}
+
+	alvo->links[i] = 0;
+	if (alvo->next != 0) {
+		// buraco fora da cauda
+		info->reserved[DIR_BURACOS]++;
+		dicaBuraco(info, no, 1);
+	}
+	i = escreveBloco(sb, no, alvo);
+	free(in);
+	return i == -1 ? -1 : 0;
+}
+
+
+
+/* Dispositivo de fs_backend_file: a imagem eh um arquivo comum. */
+struct arquivo {
+	struct fs_backend dev;
+	int fd, exclusivo;
+};
+
+static ssize_t leArquivo(struct fs_backend *dev, const struct iovec *iov,
+                         int n, uint64_t pos) {
+	int fd = ((struct arquivo*) dev)->fd;
+	if (n == 1) return pread(fd, iov[0].iov_base, iov[0].iov_len, (off_t) pos);
+	return preadv(fd, iov, n, (off_t) pos);
+}
+
+static ssize_t escreveArquivo(struct fs_backend *dev, const struct iovec *iov,
+                              int n, uint64_t pos) {
+	int fd = ((struct arquivo*) dev)->fd;
+	if (n == 1) return pwrite(fd, iov[0].iov_base, iov[0].iov_len, (off_t) pos);
+	return pwritev(fd, iov, n, (off_t) pos);
+}
+
+static int sincronizaArquivo(struct fs_backend *dev) {
+	return fdatasync(((struct arquivo*) dev)->fd);
+}
+
+/*
+Fura n bytes de fd a partir de pos, sem mudar o tamanho do arquivo.  Vai
+direto ao kernel: fallocate so eh declarada com _GNU_SOURCE, que os
+programas que incluem fs.c nao definem
+*/
+static int furaDescritor(int fd, uint64_t pos, uint64_t n) {
+	return syscall(SYS_fallocate, fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	               (off_t) pos, (off_t) n) == -1 ? -1 : 0;
+}
+
+static int descartaArquivo(struct fs_backend *dev, uint64_t pos, uint64_t n) {
+	return furaDescritor(((struct arquivo*) dev)->fd, pos, n);
+}
+
+static uint64_t tamanhoArquivo(struct fs_backend *dev) {
+	struct stat st;
+	if (fstat(((struct arquivo*) dev)->fd, &st) == -1) return 0;
+	return (uint64_t) st.st_size;
+}
+
+/*
+Solta a trava (se houver) e fecha o descritor fd.  Se a trava nao puder ser
+solta, falha com EBUSY
+*/
+static int fechaDescritor(int fd, int exclusivo) {
+	int ret = 0;
+	if (exclusivo && flock(fd, LOCK_UN | LOCK_NB) == -1) ret = -1;
+	if (close(fd) == -1 && ret == 0) return -1;
+	if (ret == -1) errno = EBUSY;
+	return ret;
+}
+
+static int fechaArquivo(struct fs_backend *dev) {
+	struct arquivo *a = (struct arquivo*) dev;
+	int ret = fechaDescritor(a->fd, a->exclusivo);
+	free(a);
+	return ret;
+}
+
+/*
+Abre fname para leitura e escrita; com exclusivo, aplica uma trava exclusiva
+(LOCK_EX), de modo que apenas um processo use a imagem de cada vez
+*/
+static int abreImagem(const char *fname, int exclusivo) {
+	int fd = open(fname, O_RDWR);
+	if (fd == -1) return -1;
+	if (exclusivo && flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		close(fd);
+		errno = EBUSY;
+		return -1;
+	}
+	return fd;
+}
+
+struct fs_backend * fs_backend_file(const char *fname, int exclusive) {
+	struct arquivo *a = (struct arquivo*) calloc(1, sizeof(struct arquivo));
+	if (a == NULL) return NULL;
+	a->fd = abreImagem(fname, exclusive);
+	if (a->fd == -1) {
+		free(a);
+		return NULL;
+	}
+	a->exclusivo = exclusive;
+	a->dev.read_blocks = leArquivo;
+	a->dev.write_blocks = escreveArquivo;
+	a->dev.flush = sincronizaArquivo;
+	a->dev.size = tamanhoArquivo;
+	a->dev.close = fechaArquivo;
+	a->dev.discard = descartaArquivo;
+	return &a->dev;
+}
+
+/* Descritor da imagem em dev, se for um arquivo comum, ou -1. */
+static int descritorImagem(struct fs_backend *dev) {
+	return dev->read_blocks == leArquivo ? ((struct arquivo*) dev)->fd : -1;
+}
+
+/* Dispositivo de fs_backend_mmap e de fs_backend_memory (com fd == -1): a
+ * imagem esta toda em mem. */
+struct mapeada {
+	struct fs_backend dev;
+	int fd, exclusivo;
+	char *mem;
+	uint64_t tamanho;
+};
+
+/*
+Copia entre os buffers de iov e a imagem a partir de pos (para a imagem, com
+escreve), parando no fim da imagem.  Retorna os bytes copiados
+*/
+static ssize_t copiaMapeada(struct mapeada *m, const struct iovec *iov, int n,
+                         uint64_t pos, int escreve) {
+	uint64_t feito = 0, k;
+	for (int i = 0; i < n && pos < m->tamanho; i++) {
+		k = iov[i].iov_len < m->tamanho - pos ? iov[i].iov_len : m->tamanho - pos;
+		if (escreve) memcpy(m->mem + pos, iov[i].iov_base, k);
+		else memcpy(iov[i].iov_base, m->mem + pos, k);
+		pos += k;
+		feito += k;
+	}
+	return (ssize_t) feito;
+}
+
+static ssize_t leMapeada(struct fs_backend *dev, const struct iovec *iov, int n,
+                      uint64_t pos) {
+	return copiaMapeada((struct mapeada*) dev, iov, n, pos, 0);
+}
+
+static ssize_t escreveMapeada(struct fs_backend *dev, const struct iovec *iov,
+                           int n, uint64_t pos) {
+	return copiaMapeada((struct mapeada*) dev, iov, n, pos, 1);
+}
+
+static int sincronizaMapeada(struct fs_backend *dev) {
+	struct mapeada *m = (struct mapeada*) dev;
+	return m->fd == -1 ? 0 : msync(m->mem, m->tamanho, MS_SYNC);
+}
+
+static uint64_t tamanhoMapeada(struct fs_backend *dev) {
+	return ((struct mapeada*) dev)->tamanho;
+}
+
+/*
+Descarta n bytes da imagem a partir de pos: fura o arquivo ou, na memoria
+anonima, devolve as paginas inteiras (que voltam zeradas) e zera o resto
+*/
+static int descartaMapeada(struct fs_backend *dev, uint64_t pos, uint64_t n) {
+	struct mapeada *m = (struct mapeada*) dev;
+	uint64_t pagina = (uint64_t) sysconf(_SC_PAGESIZE), inicio, fim;
+	if (pos >= m->tamanho) return 0;
+	if (n > m->tamanho - pos) n = m->tamanho - pos;
+	if (m->fd != -1) return furaDescritor(m->fd, pos, n);
+	inicio = (pos + pagina - 1) / pagina * pagina;
+	fim = (pos + n) / pagina * pagina;
+	if (inicio >= fim) {
+		memset(m->mem + pos, 0, n);
+		return 0;
+	}
+	memset(m->mem + pos, 0, inicio - pos);
+	memset(m->mem + fim, 0, pos + n - fim);
+	return madvise(m->mem + inicio, fim - inicio, MADV_DONTNEED);
+}
+
+static int fechaMapeada(struct fs_backend *dev) {
+	struct mapeada *m = (struct mapeada*) dev;
+	int ret = munmap(m->mem, m->tamanho);
+	if (m->fd != -1 && fechaDescritor(m->fd, m->exclusivo) == -1) ret = -1;
+	free(m);
+	return ret;
+}
+
+/*
+Mapeia tamanho bytes de fd (ou memoria anonima, com fd == -1) em um novo
+dispositivo.  Em caso de erro, fecha fd
+*/
+static struct fs_backend *criaMapeada(int fd, int exclusivo, uint64_t tamanho) {
+	struct mapeada *m = (struct mapeada*) calloc(1, sizeof(struct mapeada));
+	int erro;
+	if (m == NULL) goto falha;
+	m->mem = (char*) mmap(NULL, tamanho, PROT_READ | PROT_WRITE,
+	                      fd == -1 ? MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE : MAP_SHARED,
+	                      fd, 0);
+	if (m->mem == MAP_FAILED) goto falha;
+	m->fd = fd;
+	m->exclusivo = exclusivo;
+	m->tamanho = tamanho;
+	m->dev.read_blocks = leMapeada;
+	m->dev.write_blocks = escreveMapeada;
+	m->dev.flush = sincronizaMapeada;
+	m->dev.size = tamanhoMapeada;
+	m->dev.close = fechaMapeada;
+	m->dev.discard = descartaMapeada;
+	return &m->dev;
+
+falha:
+	erro = errno;
+	if (fd != -1) fechaDescritor(fd, exclusivo);
+	free(m);
+	errno = erro;
+	return NULL;
+}
+
+struct fs_backend * fs_backend_mmap(const char *fname, int exclusive) {
+	struct stat st;
+	int fd = abreImagem(fname, exclusive);
+	if (fd == -1) return NULL;
+	int erro = fstat(fd, &st) == -1 ? errno : st.st_size == 0 ? ENOSPC : 0;
+	if (erro) {
+		fechaDescritor(fd, exclusive);
+		errno = erro;
+		return NULL;
+	}
+	return criaMapeada(fd, exclusive, (uint64_t) st.st_size);
+}
+
+struct fs_backend * fs_backend_memory(uint64_t size) {
+	if (size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return criaMapeada(-1, 0, size);
+}
+
+/* Dispositivo de fs_backend_latency. */
+struct lento {
+	struct fs_backend dev;
+	struct fs_backend *dentro;
+	struct fs_latency lat;
+	uint64_t fim; /* posicao seguinte ao ultimo acesso */
+};
+
+/*
+Espera ns nanossegundos: dorme a maior parte e gira no final, ja que um
+nanosleep passa do prazo em dezenas de microssegundos
+*/
+static void espera(uint64_t ns) {
+	uint64_t prazo = agora() + ns;
+	if (ns > 100000) {
+		struct timespec t = { (time_t) ((ns - 60000) / 1000000000),
+		                      (long) ((ns - 60000) % 1000000000) };
+		nanosleep(&t, NULL);
+	}
+	while (agora() < prazo) sched_yield();
+}
+
+/*
+Espera o que o acesso de bytes bytes em pos custaria ao disco de l, alem de
+base (o custo fixo de cada chamada)
+*/
+static void esperaAcesso(struct lento *l, uint64_t base, uint64_t pos, ssize_t bytes) {
+	uint64_t ns = base;
+	if (bytes < 0) bytes = 0;
+	if (__atomic_exchange_n(&l->fim, pos + bytes, __ATOMIC_RELAXED) != pos)
+		ns += l->lat.seek_ns;
+	if (l->lat.bytes_per_us != 0) ns += (uint64_t) bytes * 1000 / l->lat.bytes_per_us;
+	if (ns != 0) espera(ns);
+}
+
+static ssize_t leLento(struct fs_backend *dev, const struct iovec *iov, int n,
+                       uint64_t pos) {
+	struct lento *l = (struct lento*) dev;
+	ssize_t ret = l->dentro->read_blocks(l->dentro, iov, n, pos);
+	int erro = errno;
+	esperaAcesso(l, l->lat.read_ns, pos, ret);
+	errno = erro;
+	return ret;
+}
+
+static ssize_t escreveLento(struct fs_backend *dev, const struct iovec *iov,
+                            int n, uint64_t pos) {
+	struct lento *l = (struct lento*) dev;
+	ssize_t ret = l->dentro->write_blocks(l->dentro, iov, n, pos);
+	int erro = errno;
+	esperaAcesso(l, l->lat.write_ns, pos, ret);
+	errno = erro;
+	return ret;
+}
+
+static int sincronizaLento(struct fs_backend *dev) {
+	struct lento *l = (struct lento*) dev;
+	int ret = l->dentro->flush(l->dentro), erro = errno;
+	if (l->lat.flush_ns != 0) espera(l->lat.flush_ns);
+	errno = erro;
+	return ret;
+}
+
+static uint64_t tamanhoLento(struct fs_backend *dev) {
+	struct lento *l = (struct lento*) dev;
+	return l->dentro->size(l->dentro);
+}
+
+static int descartaLento(struct fs_backend *dev, uint64_t pos, uint64_t n) {
+	struct lento *l = (struct lento*) dev;
+	return l->dentro->discard(l->dentro, pos, n);
+}
+
+static int fechaLento(struct fs_backend *dev) {
+	struct lento *l = (struct lento*) dev;
+	int ret = fs_backend_close(l->dentro);
+	free(l);
+	return ret;
+}
+
+struct fs_backend * fs_backend_latency(struct fs_backend *inner,
+                                       const struct fs_latency *lat) {
+	if (inner == NULL || lat == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct lento *l = (struct lento*) calloc(1, sizeof(struct lento));
+	if (l == NULL) return NULL;
+	l->dentro = inner;
+	l->lat = *lat;
+	l->dev.read_blocks = leLento;
+	l->dev.write_blocks = escreveLento;
+	l->dev.flush = sincronizaLento;
+	l->dev.size = tamanhoLento;
+	l->dev.close = fechaLento;
+	l->dev.discard = inner->discard != NULL ? descartaLento : NULL;
+	return &l->dev;
+}
+
+int fs_backend_close(struct fs_backend *dev) {
+	return dev->close(dev);
+}
+
+/*
+Constroi um novo sistema de arquivos no arquivo de nome fname
+*/
+struct superblock * fs_format(const char *fname, uint64_t blocksize){
+	return fs_format_opts(fname, blocksize, NULL);
+}
+
+/*
+Verifica se um sistema de arquivos com blocos de blocksize bytes e diario de
+diario blocos cabe em fsize bytes
+*/
+static int validaFormato(uint64_t blocksize, uint64_t diario, uint64_t fsize){
+	//verifica se o tamanho do bloco eh maior que o minimo
+	if(blocksize < MIN_BLOCK_SIZE || (diario != 0 && diario < FS_MIN_JOURNAL)){
+		errno = EINVAL;
+		return -1;
+	}
+
+	//verifica se o numero de blocos eh maior que o minimo
+	if(fsize / blocksize < MIN_BLOCK_COUNT + diario){
+		errno = ENOSPC;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+Escreve o bloco de numero bloco da imagem em dev durante a formatacao
+*/
+static int formataBloco(struct superblock *sb, uint64_t bloco, const void *buf){
+	struct iovec iov = { (void*) buf, sb->blksz };
+	return sb->dev->write_blocks(sb->dev, &iov, 1, bloco * sb->blksz) ==
+	       (ssize_t)sb->blksz ? 0 : -1;
+}
+
+/*
+Constroi um novo sistema de arquivos com as opcoes opts (ja validadas) nos
+numeroBlocos primeiros blocos de dev
+*/
+static struct superblock * formata(struct fs_backend *dev, uint64_t blocksize,
+                                   const struct fs_options *opts,
+                                   uint64_t numeroBlocos, uint64_t inicio){
+	uint64_t diario = opts != NULL ? opts->journal : 0;
+
+	//criando o superbloco
+	struct superblock* superBloco = (struct superblock*) calloc (1, sizeof(struct superblock));
+	superBloco->magic = 0xdcc605f5; //conforme estabelecido em fs.h
+	superBloco->blks = numeroBlocos;
+	superBloco->blksz = blocksize;
+	calculaGeometria(superBloco);
+
+	//superbloco, nodeinfo, root e inode de root ocupam 3 blocos, seguidos
+	//do diario (se houver)
+	int memoriaOcupada = 3 + diario;
+
+	//blocos livres
+	superBloco->freeblks = numeroBlocos-memoriaOcupada;
+
+	//apontador para a primeira pagina livre, que guarda os blocos antes dela
+	//(veja a lista de blocos vazios abaixo)
+	uint64_t grupo = diario ? superBloco->nfree + 1 : 1;
+	superBloco->freelist = memoriaOcupada + grupo - 1 < numeroBlocos ?
+	                       memoriaOcupada + grupo - 1 : numeroBlocos - 1;
+
+	//apontador para o inode da pasta raiz
+	superBloco->root = 2;
+
+	//campos da versao atual (a lista de orfaos comeca vazia)
+	superBloco->version = FS_VERSION;
+	superBloco->orphans = 0;
+	superBloco->journal = diario ? 3 : 0;
+	superBloco->journalblks = diario;
+	superBloco->freed = 0;
+
+	//dispositivo da imagem
+	superBloco->dev = dev;
+	superBloco->fd = descritorImagem(dev);
+
+	//inicializando o superbloco (o resto do bloco 0 fica zerado)
+	void *bloco = calloc(superBloco->blksz, 1);
+	memcpy(bloco, superBloco, SB_DISCO);
+	int aux = formataBloco(superBloco, 0, bloco);
+	free(bloco);
+	if(aux == -1){
+		free(superBloco);
+		return NULL;
+	}
+
+	//inicializando a pasta raiz
+	struct nodeinfo* rootInfo = (struct nodeinfo*) calloc (superBloco->blksz,1);
+	rootInfo->size = 0;
+	strcpy(rootInfo->name, "/\0");
+	aux = formataBloco(superBloco, 1, rootInfo);
+	free(rootInfo);
+
+	struct inode* rootInode = (struct inode*) calloc (superBloco->blksz,1);
+	rootInode->mode = IMDIR | (opts != NULL && opts->btree_dirs ? IMBTREE : 0);
+	rootInode->parent = 0;
+	rootInode->meta = 1;
+	rootInode->next = 0;
+	aux = formataBloco(superBloco, 2, rootInode);
+	free(rootInode);
+
+	//inicializando o diario: cabecalho e log vazio
+	if(diario != 0){
+		struct registro *cabecalho = (struct registro*) calloc(superBloco->blksz, 1);
+		cabecalho->magic = MAGIC_DIARIO;
+		cabecalho->tipo = DIARIO_CABECALHO;
+		cabecalho->seq = 1;
+		aux = formataBloco(superBloco, 3, cabecalho);
+		memset(cabecalho, 0, superBloco->blksz);
+		for(uint64_t i = 1; i < diario && aux != -1; i++)
+			aux = formataBloco(superBloco, 3 + i, cabecalho);
+		free(cabecalho);
+	}
+
+	//inicializando lista de blocos vazios.  Sem journal, cada bloco eh uma
+	//pagina, e tira-lo da lista custa so uma leitura.  Com ele, as paginas
+	//sao metadados que o diario protege ate a transacao que as tirou estar
+	//no disco (veja marcaRecentes): ficam no fim de grupos de nfree + 1
+	//blocos, com os anteriores em links[], do ultimo para o primeiro, de
+	//modo que saiam em ordem crescente
+	struct freepage* root_fp = (struct freepage*) calloc (superBloco->blksz,1);
+	uint64_t k;
+	for(uint64_t i = memoriaOcupada; i < superBloco->blks && aux != -1; i++){
+		memset(root_fp, 0, superBloco->blksz);
+		k = (i - memoriaOcupada) % grupo;
+		if(k == grupo - 1 || i == superBloco->blks - 1){
+			for(uint64_t j = 0; j < k; j++) root_fp->links[j] = i - 1 - j;
+			root_fp->count = k ? MARCA_LOTE | k : 0;
+			if(i + grupo < superBloco->blks){
+				root_fp->next = i + grupo;
+			}
+			else if(i + 1 < superBloco->blks){
+				root_fp->next = superBloco->blks - 1;
+			}
+			else{
+				root_fp->next = 0; //ultima pagina livre
+			}
+		}
+
+		aux = formataBloco(superBloco, i, root_fp);
+	}
+	free(root_fp);
+
+	if(diario != 0 && iniciaDiario(superBloco, 1) == -1){
+		free(superBloco);
+		return NULL;
+	}
+
+	//um write por bloco: superbloco, nodeinfo e inode da raiz, diario e
+	//paginas livres
+	struct fs_stats *st = &superBloco->stats;
+	st->writes[FS_BLOCK_SUPER] = st->writes[FS_BLOCK_NODEINFO] = 1;
+	st->writes[FS_BLOCK_INODE] = 1;
+	st->writes[FS_BLOCK_FREEPAGE] = numeroBlocos - memoriaOcupada;
+	st->syscalls = numeroBlocos;
+	registraChamada(superBloco, FS_OP_FORMAT, inicio);
+	return superBloco;
+}
+
+/*
+Constroi um novo sistema de arquivos com as opcoes opts (veja fs.h)
+*/
+struct superblock * fs_format_opts(const char *fname, uint64_t blocksize,
+                                   const struct fs_options *opts){
+	uint64_t inicio = agora();
+	uint64_t diario = opts != NULL ? opts->journal : 0;
+
+	//calcula o tamanho de fname.
+	FILE* arquivo = fopen(fname, "r");
+	long fsize = 0;
+	if(arquivo != NULL){
+		fseek(arquivo, 0, SEEK_END);
+		fsize = ftell(arquivo);
+		fclose(arquivo);
+	}
+	if(validaFormato(blocksize, diario, fsize) == -1) return NULL;
+
+	//dispositivo do arquivo, que passa a ser do superbloco
+	struct fs_backend *dev = fs_backend_file(fname, 0);
+	if(dev == NULL){
+		errno = EBADF;
+		return NULL;
+	}
+	struct superblock *superBloco = formata(dev, blocksize, opts, fsize / blocksize, inicio);
+	if(superBloco == NULL){
+		int erro = errno;
+		fs_backend_close(dev);
+		errno = erro;
+		return NULL;
+	}
+	superBloco->owndev = 1;
+	return superBloco;
+}
+
+/*
+Constroi um novo sistema de arquivos com as opcoes opts na imagem em dev
+*/
+struct superblock * fs_format_dev(struct fs_backend *dev, uint64_t blocksize,
+                                  const struct fs_options *opts){
+	uint64_t inicio = agora();
+	uint64_t diario = opts != NULL ? opts->journal : 0;
+	uint64_t fsize = dev->size(dev);
+	if(validaFormato(blocksize, diario, fsize) == -1) return NULL;
+	return formata(dev, blocksize, opts, fsize / blocksize, inicio);
+}
+
+/*
+Abre o sistema de arquivos na imagem em dev e retorna seu superbloco
+*/
+static struct superblock * abre(struct fs_backend *dev, uint64_t inicio){
+	//carrega o superbloco do FS
+	struct superblock* superbloco = (struct superblock*) calloc(1, sizeof(struct superblock));
+	if(lePosicao(&superbloco->stats, dev, superbloco, SB_DISCO, 0) != SB_DISCO){
+		free(superbloco);
+		errno = EBADF;
+		return NULL;
+	}
+
+
+	//verifica o erro EBADF
+	if(superbloco->magic != 0xdcc605f5 || superbloco->blksz < MIN_BLOCK_SIZE){
+		errno = EBADF;
+		free(superbloco);
+		return NULL;
+	}
+
+	CONTA(superbloco->stats.reads[FS_BLOCK_SUPER], 1);
+
+	//a geometria nao fica no disco: eh derivada do tamanho de bloco
+	superbloco->dev = dev;
+	superbloco->fd = descritorImagem(dev);
+	calculaGeometria(superbloco);
+
+	//imagens antigas nao tem os campos depois de root: sao zerados aqui e
+	//gravados na proxima escrita do superbloco
+	if(superbloco->version != FS_VERSION){
+		superbloco->version = FS_VERSION;
+		superbloco->orphans = 0;
+		superbloco->journal = superbloco->journalblks = 0;
+		superbloco->freed = 0;
+	}
+
+	//refaz as transacoes completas do diario, que podem ter mudado o
+	//proprio superbloco, e o liga
+	if(superbloco->journal != 0){
+		int64_t seq = -1;
+		struct fs_diario *d = NULL;
+		if(superbloco->journalblks >= FS_MIN_JOURNAL &&
+		   superbloco->journal + superbloco->journalblks <= superbloco->blks &&
+		   (d = criaDiario(superbloco)) != NULL)
+			seq = recuperaDiario(d);
+		else
+			errno = EBADF;
+		if(d != NULL) liberaDiario(d);
+		if(seq == -1 ||
+		   lePosicao(&superbloco->stats, dev, superbloco, SB_DISCO, 0) != SB_DISCO ||
+		   iniciaDiario(superbloco, seq) == -1){
+			if(superbloco->bg != NULL) liberaEstado(superbloco);
+			free(superbloco);
+			return NULL;
+		}
+	}
+
+	//termina as liberacoes que ficaram pendentes
+	int aux = 0;
+	if(superbloco->orphans != 0){
+		TRAVA(superbloco);
+		aux = recuperaOrfaos(superbloco, UINT64_MAX);
+	}
+	if(aux == -1){
+		if(superbloco->bg != NULL) liberaEstado(superbloco);
+		free(superbloco);
+		return NULL;
+	}
+
+	registraChamada(superbloco, FS_OP_OPEN, inicio);
+	return superbloco;
+}
+
+/*
+Abre o sistema de arquivos em fname e retorna seu superbloco
+*/
+struct superblock * fs_open(const char *fname){
+	uint64_t inicio = agora();
+
+	//abre o arquivo com uma trava exclusiva: apenas um processo podera
+	//usar esse arquivo de cada vez
+	struct fs_backend *dev = fs_backend_file(fname, 1);
+	if(dev == NULL) return NULL;
+
+	struct superblock *superbloco = abre(dev, inicio);
+	if(superbloco == NULL){
+		int erro = errno;
+		fs_backend_close(dev);
+		errno = erro;
+		return NULL;
+	}
+	superbloco->owndev = 1;
+	return superbloco;
+}
+
+/*
+Abre o sistema de arquivos na imagem em dev
+*/
+struct superblock * fs_open_dev(struct fs_backend *dev){
+	return abre(dev, agora());
+}
+
+/*
+Fecha o sistema de arquivos apontado por sb
+ */
+int fs_close(struct superblock *sb){
+	//verifica o descritor do sistema de arquivos
+	if(sb->magic != 0xdcc605f5){
+		errno = EBADF;
+		return -1;
+	}
+
+	//desfaz uma transacao explicita que ficou aberta
+	if(sb->bg != NULL && sb->bg->explicita) fs_txn_abort(sb);
+
+	//para a thread em segundo plano; os orfaos que sobrarem ficam na
+	//lista e sao liberados pelo proximo fs_open
+	fs_set_reclaim(sb, FS_RECLAIM_SYNC);
+
+	//para o escritor e leva o diario (ou o cache da escrita adiada) para
+	//os lugares definitivos; sem FS_DURABLE_NONE, tudo chega ao disco
+	int erro = 0;
+	paraEscritor(sb);
+	if(sb->bg != NULL){
+		struct fs_diario *d = sb->bg->diario;
+		int sincroniza = sb->bg->politica != FS_DURABLE_NONE;
+		if(d != NULL && d->tamanho != 0){
+			if(checkpoint(sb) == -1 || d->erro) erro = d->erro ? d->erro : errno;
+		}else if(d != NULL){
+			if(escreveSujos(sb, sincroniza) == -1 || d->erro)
+				erro = d->erro ? d->erro : errno;
+		}else if(sincroniza && sincronizaImagem(&sb->stats, sb->dev) == -1){
+			erro = errno;
+		}
+		liberaEstado(sb);
+	}
+	//fura o que ficou na fila, ja com tudo nos lugares definitivos
+	if(sb->punch != NULL){
+		if(!erro && furaLivres(sb) == -1) erro = errno;
+		liberaFuros(sb);
+	}
+	free(sb->trace);
+	if(sb->recorder != NULL && fechaGravacao(sb->recorder) == -1 && !erro) erro = errno;
+
+	//fecha a imagem, se o superbloco a abriu (a trava do arquivo sai junto)
+	int aux = sb->owndev ? fs_backend_close(sb->dev) : 0;
+	free(sb);
+	if(erro){
+		errno = erro;
+		return -1;
+	}
+	if(aux == -1) return -1;
+
+	return 0;
+}
+
+/*
+Pega um ponteiro para um bloco livre no sistema de arquivos sb
+*/
+uint64_t fs_get_block(struct superblock *sb){
+	MEDE(sb, FS_OP_GET_BLOCK);
+	TRAVA(sb);
+	//verifica o descritor do sistema de arquivos
+	if(sb->magic != 0xdcc605f5){
+		errno = EBADF;
+		return (uint64_t) 0;
+	}
+
+	//verifica se ha blocos livres (ou orfaos a liberar)
+	if(sb->freeblks == 0 && sb->orphans == 0){
+		errno = ENOSPC;
+		return (uint64_t) 0;
+	}
+
+	//tira o bloco da primeira pagina livre (ou a propria pagina) e
+	//grava o superbloco (freelist e freeblks)
+	uint64_t bloco;
+	if(pegaBlocos(sb, &bloco, 1) == -1) return (uint64_t) 0;
+	GRAVA(NULL, bloco, 0);
+	return bloco;
+}
+
+/*
+Retorna o bloco de numero block para a lista de blocos livres do sistema de arquivo sb
+*/
+int fs_put_block(struct superblock *sb, uint64_t block){
+	MEDE(sb, FS_OP_PUT_BLOCK);
+	GRAVA(NULL, block, 0);
+	TRAVA(sb);
+	//verifica o descritor do sistema de arquivos
+	if(sb->magic != 0xdcc605f5){
+		errno = EBADF;
+		return -1;
+	}
+
+	//com fs_set_punch, o bloco vai para links[] da primeira pagina livre,
+	//se couber, para poder ser furado
+	if(sb->punch != NULL) return devolveBlocos(sb, &block, 1);
+
+	//novo bloco a ser inserido na lista de blocos livres
+	struct freepage *novoBloco = (struct freepage*) calloc (sb->blksz,1);
+
+	//setando os ponteiros do bloco, a nova posição da tabela de blocos livres
+	traca(sb, EV_LIBERA, 0, block);
+	novoBloco->next = sb->freelist;
+	sb->freelist = block;
+	sb->freeblks++;
+
+	//escrevendo os novos dados do super bloco (freelist e freeblks)
+	int aux = gravaSuperbloco(sb);
+	if(aux == -1){
+		free(novoBloco);
+		return -1;
+	}
+
+	//escrevendo novoBloco no arquivo
+	aux = escreveBlocoTipo(sb, block, novoBloco, FS_BLOCK_FREEPAGE);
+
+	free(novoBloco);
+	if(aux == -1) return -1;
+	return 0;
+}
+
+/*
+Numero de blocos ocupados por um arquivo de cnt bytes: blocos de dados (ao
+menos um), nos do mapa (o primeiro inode eh a raiz) e nodeinfo
+*/
+static uint64_t blocosArquivo(const struct superblock *sb, uint64_t cnt) {
+	uint64_t nblocos = cnt ? (cnt + sb->blksz - 1) / sb->blksz : 1;
+	uint64_t total = nblocos + 1, nos = nblocos;
+	do {
+		nos = (nos + sb->nlinks - 1) / sb->nlinks;
+		total += nos;
+	} while (nos > 1);
+	return total;
+}
+
+/*
+Numero de blocos ocupados pelo arquivo de cnt bytes cujo primeiro inode esta
+em in, que pode ter a cadeia de inodes filhos das versoes antigas
+*/
+static uint64_t blocosOcupados(const struct superblock *sb, const struct inode *in,
+                               uint64_t cnt) {
+	uint64_t nblocos = cnt ? (cnt + sb->blksz - 1) / sb->blksz : 1;
+	if ((in->mode & IMMAP) || in->next == 0) return blocosArquivo(sb, cnt);
+	return nblocos + (nblocos + sb->nlinks - 1) / sb->nlinks + 1;
+}
+
+/*
+Grava o arquivo req no inode no, filho do diretorio pai.  Os demais blocos do
+arquivo (nodeinfo, nos do mapa e dados) sao consumidos de *livres, na ordem:
+cada no do mapa logo antes do primeiro bloco de dados que ele cobre.  Com
+origem, os dados sao copiados dos blocos do arquivo aberto nela em vez de
+req->buf.  bloco e in sao areas de trabalho de um bloco
+*/
+static int gravaArquivo(struct superblock *sb, uint64_t no, uint64_t pai,
+                        const struct fs_write_req *req, const uint64_t **livres,
+                        void *bloco, struct inode *in, struct mapa *origem) {
+	struct nodeinfo *info = (struct nodeinfo*) bloco;
+	const char *buf = req->buf;
+	uint64_t resta = req->cnt, b, k, d, o;
+	uint64_t nblocos = resta ? (resta + sb->blksz - 1) / sb->blksz : 1;
+	uint64_t altura = alturaMapa(sb, nblocos);
+	uint64_t cobre[ALTURA_MAXIMA + 1], nos[ALTURA_MAXIMA + 1];
+	struct inode *nivel[ALTURA_MAXIMA + 1];
+	char *area = NULL;
+	int ret = -1;
+
+	//cria o inode do arquivo, que eh a raiz do mapa se houver um
+	memset(in, 0, sb->blksz);
+	in->mode = altura ? IMREG | IMMAP : IMREG;
+	in->parent = pai;
+	in->meta = *(*livres)++;
+	in->next = altura;
+
+	//cria o nodeinfo e o escreve
+	memset(info, 0, sb->blksz);
+	info->size = req->cnt;
+	strcpy(info->name, req->fname);
+	if (escreveInfo(sb, in->meta, info) == -1) return -1;
+
+	//um no em construcao por altura; cobre[k] blocos de dados ficam sob
+	//um no de altura k
+	if (altura && (area = (char*) malloc(altura * sb->blksz)) == NULL) return -1;
+	for (k = 0; k <= altura; k++) {
+		nivel[k] = k < altura ? (struct inode*) (area + k * sb->blksz) : in;
+		cobre[k] = k ? cobre[k - 1] * sb->nlinks : sb->nlinks;
+	}
+	nos[altura] = no;
+
+	for (b = 0; b < nblocos; b++) {
+		//abre os nos que comecam em b, de cima para baixo
+		for (k = altura; k-- > 0;) {
+			if (b % cobre[k] != 0) continue;
+			nos[k] = *(*livres)++;
+			memset(nivel[k], 0, sb->blksz);
+			nivel[k]->mode = IMCHILD | IMMAP;
+			nivel[k]->parent = no;
+			nivel[k + 1]->links[b / cobre[k] % sb->nlinks] = nos[k];
+		}
+		d = nivel[0]->links[b % sb->nlinks] = *(*livres)++;
+
+		//blocos inteiros saem direto de buf, so o ultimo pedaco eh
+		//completado com zeros
+		if (origem != NULL) {
+			if ((o = blocoMapa(sb, origem, b)) == 0 ||
+			    leBlocoTipo(sb, o, bloco, FS_BLOCK_DATA) == -1 ||
+			    escreveDados(sb, d, bloco) == -1)
+				goto fim;
+		} else if (resta >= sb->blksz) {
+			if (escreveDados(sb, d, buf) == -1) goto fim;
+			buf += sb->blksz;
+			resta -= sb->blksz;
+		} else {
+			memset(bloco, 0, sb->blksz);
+			memcpy(bloco, buf, resta);
+			if (escreveDados(sb, d, bloco) == -1) goto fim;
+			resta = 0;
+		}
+
+		//escreve os nos que terminam em b, de baixo para cima
+		for (k = 0; k < altura && ((b + 1) % cobre[k] == 0 || b + 1 == nblocos); k++) {
+			if (escreveBloco(sb, nos[k], nivel[k]) == -1) goto fim;
+		}
+	}
+
+	//escreve o primeiro inode
+	ret = escreveBloco(sb, no, in);
+
+fim:
+	free(area);
+	return ret;
+}
+
+/* Um pedido de fs_write_files.  Os pedidos sao ordenados por diretorio pai e
+ * nome, de modo que cada diretorio pai seja resolvido uma unica vez. */
+struct pedido {
+	const struct fs_write_req *req;
+	size_t ordem;   /* posicao do pedido em reqs */
+	size_t pai;     /* tamanho do caminho do diretorio pai em req->fname */
+	uint64_t dir;   /* inode do diretorio pai */
+	uint64_t no;    /* inode do arquivo, se ele ja existir; senao zero */
+	int ignora;     /* repetido: vale o ultimo pedido com o mesmo nome */
+};
+
+static int comparaPedidos(const void *a, const void *b) {
+	const struct pedido *p = (const struct pedido*) a;
+	const struct pedido *q = (const struct pedido*) b;
+	size_t n = p->pai < q->pai ? p->pai : q->pai;
+	int c = memcmp(p->req->fname, q->req->fname, n);
+	if (c == 0 && p->pai != q->pai) return p->pai < q->pai ? -1 : 1;
+	if (c == 0) c = strcmp(p->req->fname + p->pai, q->req->fname + q->pai);
+	if (c == 0) c = p->ordem < q->ordem ? -1 : p->ordem > q->ordem;
+	return c;
+}
+
+/*
+Marca o pedido p como sobrescrita do arquivo no, cujo primeiro inode esta em in
+*/
+static int sobrescrita(struct pedido *p, uint64_t no, const struct inode *in) {
+	if (in->mode & IMDIR) {
+		errno = EISDIR;
+		return -1;
+	}
+	p->no = no;
+	return 0;
+}
+
+/*
+Resolve o diretorio pai dos pedidos ped[0..n), que tem todos o mesmo pai, e
+procura nele os arquivos que ja existem.  Soma em *crescimento os blocos que
+o diretorio pode ocupar com as entradas novas
+*/
+static int resolveGrupo(struct superblock *sb, struct pedido *ped, size_t n,
+                        uint64_t *crescimento) {
+	struct inode *dir = (struct inode*) malloc(sb->blksz);
+	struct inode *in = (struct inode*) malloc(sb->blksz);
+	struct nodeinfo *info = (struct nodeinfo*) malloc(sb->blksz);
+	uint64_t no, novos = 0, entradas;
+	const char *u;
+	size_t k, ini, fim, meio;
+	int64_t i, cresce;
+	int c, ret = -1;
+
+	uint64_t dir_n = procuraCaminho(sb, ped[0].req->fname, ped[0].pai);
+	if (dir_n == 0) {
+		errno = ENOENT;
+		goto fim;
+	}
+	if (leBloco(sb, dir_n, dir) == -1) goto fim;
+	if (!(dir->mode & IMDIR)) {
+		errno = ENOTDIR;
+		goto fim;
+	}
+	if (leInfo(sb, dir->meta, info) == -1) goto fim;
+	entradas = info->size;
+
+	// nas arvores, cada pedido eh procurado direto
+	if (dir->mode & IMBTREE) {
+		for (k = 0; k < n; k++) {
+			u = ped[k].req->fname + ped[k].pai + 1;
+			no = procuraArvore(sb, dir, u, strlen(u), in, info);
+			if (no == 0) continue;
+			if (leBloco(sb, no, in) == -1) goto fim;
+			if (sobrescrita(&ped[k], no, in) == -1) goto fim;
+		}
+	}
+
+	// uma unica passada pela cadeia do diretorio; cada entrada eh procurada
+	// entre os pedidos do grupo, que estao ordenados por nome
+	else if (info->size > 0) {
+		for (;;) {
+			for (i = sb->ops->procuraUsado(sb, dir->links, 0); i >= 0;
+			     i = sb->ops->procuraUsado(sb, dir->links, i + 1)) {
+				if (leBloco(sb, dir->links[i], in) == -1) goto fim;
+				if (leInfo(sb, in->meta, info) == -1) goto fim;
+				u = ultimoNome(info->name);
+				ini = 0;
+				fim = n;
+				while (ini < fim) {
+					meio = (ini + fim) / 2;
+					c = strcmp(ped[meio].req->fname + ped[meio].pai + 1, u);
+					if (c < 0) ini = meio + 1;
+					else fim = meio;
+				}
+				for (k = ini; k < n && strcmp(ped[k].req->fname + ped[k].pai + 1, u) == 0; k++) {
+					if (sobrescrita(&ped[k], dir->links[i], in) == -1) goto fim;
+				}
+			}
+			if (dir->next == 0) break;
+			if (leBloco(sb, dir->next, dir) == -1) goto fim;
+		}
+		if (leBloco(sb, dir_n, dir) == -1) goto fim;
+	}
+
+	for (k = 0; k < n; k++) {
+		ped[k].dir = dir_n;
+		if (!ped[k].ignora && ped[k].no == 0) novos++;
+	}
+	if ((cresce = crescimentoDiretorio(sb, dir, novos, entradas)) == -1) goto fim;
+	*crescimento += cresce;
+	ret = 0;
+
+fim:
+	free(dir);
+	free(in);
+	free(info);
+	return ret;
+}
+
+/*
+Escreve varios arquivos de uma vez (veja fs.h)
+*/
+int fs_write_files(struct superblock *sb, const struct fs_write_req *reqs, size_t n) {
+	MEDE(sb, FS_OP_WRITE_FILES);
+	GRAVA_LOTE(reqs, n);
+	TRAVA(sb);
+	//verifica o descritor do sistema de arquivos
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+	if (n == 0) return 0;
+
+	struct pedido *ped = (struct pedido*) calloc(n, sizeof(struct pedido));
+	struct listaBlocos velhos = {NULL, 0, 0}, orfaos = {NULL, 0, 0};
+	struct listaBlocos mapas = {NULL, 0, 0};
+	uint64_t *blocos = NULL, *filhos = NULL;
+	struct inode *dir = (struct inode*) malloc(sb->blksz);
+	struct inode *in = (struct inode*) malloc(sb->blksz);
+	struct nodeinfo *info = (struct nodeinfo*) malloc(sb->blksz);
+	void *bloco = malloc(sb->blksz);
+	char *copias = NULL, *area;
+	const uint64_t *livre;
+	uint64_t total = 0, nfilhos, crescimento = 0;
+	const char **nomes = NULL;
+	size_t k, g, h;
+	const char *c;
+	int ret = -1;
+
+	//verifica os nomes e ordena os pedidos por diretorio pai e nome
+	for (k = 0; k < n; k++) {
+		if (strlen(reqs[k].fname) >= sb->namelen) {
+			errno = ENAMETOOLONG;
+			goto fim;
+		}
+		c = strrchr(reqs[k].fname, '/');
+		if (c == NULL) {
+			errno = ENOENT;
+			goto fim;
+		}
+		if (c[1] == '\0') {
+			errno = EISDIR;
+			goto fim;
+		}
+		ped[k].req = &reqs[k];
+		ped[k].ordem = k;
+		ped[k].pai = c - reqs[k].fname;
+	}
+	qsort(ped, n, sizeof(struct pedido), comparaPedidos);
+	for (k = 0; k + 1 < n; k++) {
+		if (strcmp(ped[k].req->fname, ped[k + 1].req->fname) == 0)
+			ped[k].ignora = 1;
+	}
+
+	//resolve cada diretorio pai uma vez, antes de alterar qualquer coisa, e
+	//confere se ha espaco para todos os arquivos
+	for (g = 0; g < n; g = h) {
+		for (h = g + 1; h < n && ped[h].pai == ped[g].pai &&
+		     memcmp(ped[h].req->fname, ped[g].req->fname, ped[g].pai) == 0; h++);
+		if (resolveGrupo(sb, ped + g, h - g, &crescimento) == -1) goto fim;
+	}
+	for (k = 0; k < n; k++) {
+		if (ped[k].ignora) continue;
+		total += blocosArquivo(sb, ped[k].req->cnt) - (ped[k].no ? 1 : 0);
+	}
+	if (garanteLivres(sb, total + crescimento) == -1) goto fim;
+
+	//junta, sem alterar nada, o conteudo dos arquivos sobrescritos; o
+	//primeiro inode de cada um eh reaproveitado, e assim a entrada no
+	//diretorio fica como esta.  com liberacao adiada, os inodes filhos (ou
+	//uma copia da raiz do mapa, no bloco do nodeinfo) viram orfaos.  nada
+	//disso eh liberado antes de os arquivos novos estarem gravados, para que
+	//um erro no meio nao deixe um arquivo antigo com blocos reaproveitados
+	for (k = 0; k < n; k++) {
+		if (ped[k].ignora || ped[k].no == 0) continue;
+		if (leBloco(sb, ped[k].no, in) == -1) goto fim;
+		if (adiaLiberacao(sb, in) && (in->mode & IMMAP)) {
+			if ((area = (char*) realloc(copias, (mapas.n + 1) * sb->blksz)) == NULL)
+				goto fim;
+			copias = area;
+			if (anexaBloco(&mapas, in->meta) == -1) goto fim;
+			in->meta = 0;
+			memcpy(copias + (mapas.n - 1) * sb->blksz, in, sb->blksz);
+			continue;
+		}
+		if (adiaLiberacao(sb, in)) {
+			if (anexaBloco(&orfaos, in->next) == -1) goto fim;
+			in->next = 0;
+		}
+		if (coletaCadeia(sb, in, 1, &velhos) == -1) goto fim;
+	}
+
+	//reserva de uma vez os blocos de todos os arquivos
+	blocos = (uint64_t*) malloc((total ? total : 1) * sizeof(uint64_t));
+	if (pegaBlocos(sb, blocos, total) == -1) goto fim;
+	livre = blocos;
+
+	filhos = (uint64_t*) malloc(n * sizeof(uint64_t));
+	nomes = (const char**) malloc(n * sizeof(char*));
+	for (g = 0; g < n; g = h) {
+		nfilhos = 0;
+		for (h = g; h < n && ped[h].dir == ped[g].dir; h++) {
+			if (ped[h].ignora) continue;
+			uint64_t no = ped[h].no;
+			if (no == 0) {
+				no = *livre++;
+				nomes[nfilhos] = ped[h].req->fname;
+				filhos[nfilhos++] = no;
+			}
+			if (gravaArquivo(sb, no, ped[h].dir, ped[h].req, &livre, bloco, in,
+			                 NULL) == -1)
+				goto fim;
+		}
+
+		//uma unica atualizacao do diretorio pai por grupo
+		if (nfilhos == 0) continue;
+		if (leBloco(sb, ped[g].dir, dir) == -1) goto fim;
+		if (leInfo(sb, dir->meta, info) == -1) goto fim;
+		if (insereEntradas(sb, ped[g].dir, dir, info, filhos, nomes, nfilhos) == -1) goto fim;
+		info->size += nfilhos;
+		if (escreveInfo(sb, dir->meta, info) == -1) goto fim;
+	}
+
+	//o resto dos arquivos sobrescritos, agora que o primeiro inode de cada
+	//um foi regravado: o nodeinfo e o que mais nao for adiado sao
+	//liberados, e as raizes dos mapas adiados vao para os nodeinfos antigos
+	if (devolveBlocos(sb, velhos.v, velhos.n) == -1) goto fim;
+	for (k = 0; k < mapas.n; k++) {
+		if (enfileiraOrfao(sb, mapas.v[k], (struct inode*) (copias + k * sb->blksz)) == -1)
+			goto fim;
+	}
+	for (k = 0; k < orfaos.n; k++) {
+		if (leBloco(sb, orfaos.v[k], in) == -1) goto fim;
+		in->meta = 0;
+		if (enfileiraOrfao(sb, orfaos.v[k], in) == -1) goto fim;
+	}
+	ret = 0;
+
+fim:
+	free(ped);
+	free(velhos.v);
+	free(orfaos.v);
+	free(mapas.v);
+	free(copias);
+	free(blocos);
+	free(filhos);
+	free(nomes);
+	free(dir);
+	free(in);
+	free(info);
+	free(bloco);
+	return ret;
+}
+
+/*
+Escreve cnt bytes de buf no sistema de arquivos apontado por sb
+*/
+int fs_write_file(struct superblock *sb, const char *fname, char *buf, size_t cnt){
+	MEDE(sb, FS_OP_WRITE_FILE);
+	GRAVA(fname, cnt, 0);
+	struct fs_write_req req = {fname, buf, cnt};
+	return fs_write_files(sb, &req, 1);
+}
+
+/*
+Le os primeiros bufsz bytes do arquivo fname e coloca no vetor apontado por buf
+*/
+ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf, size_t bufsz) {
+    return fs_read_file_at(sb, fname, buf, bufsz, 0);
+}
+
+/*
+Le ate bufsz bytes do arquivo fname a partir do byte offset e coloca no vetor
+apontado por buf
+*/
+ssize_t fs_read_file_at(struct superblock *sb, const char *fname, char *buf,
+                        size_t bufsz, uint64_t offset) {
+    MEDE(sb, FS_OP_READ_FILE);
+    GRAVA(fname, bufsz, offset);
+    TRAVA(sb);
+    // Verifica o descritor do sistema de arquivos.
+    if (sb->magic != 0xdcc605f5) {
+        errno = EBADF;
+        return -1;
+    }
 
     // Verifica se o nome do arquivo (caminho) é maior que o permitido.
-    if (strlen(fname) > ((sb->blksz) - (8 * sizeof(uint64_t)))) {
+    if (strlen(fname) >= sb->namelen) {
         errno = ENAMETOOLONG;
         return -1;
     }
 
-    // Verifica se o arquivo existe no sistema de arquivos e salva seu "endereço".
-    uint64_t block = encontraBloco(sb, fname, 0);
-    if (block == 0) {
-        errno = ENOENT;
-        return -1;
-    }
+    // Verifica se o arquivo existe no sistema de arquivos e salva seu "endereço".
+    uint64_t block = encontraBloco(sb, fname, 0);
+    if (block == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    struct inode *inode = (struct inode*) calloc(sb->blksz, 1);
+    struct nodeinfo *node_info = (struct nodeinfo*) calloc(sb->blksz, 1);
+    struct mapa mapa = {0};
+    uint64_t b, dado, desloc;
+    size_t bufaux = 0, restante, parte;
+    char* leitor = (char*) malloc(sb->blksz);
+
+    // Carrega o inode.
+    if (leBloco(sb, block, inode) == -1) goto cleanup;
+
+    // Verifica se o arquivo não é um diretório.
+    if (inode->mode & IMDIR) {
+        errno = EISDIR;
+        goto cleanup;
+    }
+
+    // Carrega o nodeinfo e limita a leitura ao tamanho do arquivo.
+    if (leInfo(sb, inode->meta, node_info) == -1) goto cleanup;
+    restante = offset >= node_info->size ? 0 : node_info->size - offset;
+    if (restante > bufsz) restante = bufsz;
+    if (abreMapa(sb, &mapa, block, inode) == -1) goto cleanup;
+
+    // Localiza cada bloco pelo mapa do arquivo (os nós já lidos são
+    // reaproveitados para os blocos seguintes).
+    b = offset / sb->blksz;
+    desloc = offset % sb->blksz;
+    while (restante > 0) {
+        if ((dado = blocoMapa(sb, &mapa, b++)) == 0) goto cleanup;
+        if (desloc == 0 && restante >= sb->blksz) {
+            // Blocos inteiros são lidos direto para buf.
+            if (leBlocoTipo(sb, dado, buf + bufaux, FS_BLOCK_DATA) == -1) goto cleanup;
+            parte = sb->blksz;
+        } else {
+            // O primeiro e o último pedaço passam por "leitor".
+            if (leBlocoTipo(sb, dado, leitor, FS_BLOCK_DATA) == -1) goto cleanup;
+            parte = sb->blksz - desloc < restante ? sb->blksz - desloc : restante;
+            memcpy(buf + bufaux, leitor + desloc, parte);
+            desloc = 0;
+        }
+        bufaux += parte;
+        restante -= parte;
+    }
+
+    fechaMapa(&mapa);
+    free(inode);
+    free(node_info);
+    free(leitor);
+    return bufaux;
+
+cleanup:
+    // Em caso de erro, libera a memória alocada.
+    fechaMapa(&mapa);
+    free(inode);
+    free(node_info);
+    free(leitor);
+    return -1;
+}
+
+/*
+Remove o arquivo chamado fname do sistema de arquivos apontado por sb
+*/
+int fs_unlink(struct superblock *sb, const char *fname) {
+    MEDE(sb, FS_OP_UNLINK);
+    GRAVA(fname, 0, 0);
+    TRAVA(sb);
+    // Verifica se o descritor do sistema de arquivos é válido.
+    if (sb->magic != 0xdcc605f5) {
+        errno = EBADF; // Define o erro como "descritor de arquivo inválido".
+        return -1;
+    }
+
+    // Verifica se o nome do arquivo (caminho) é maior do que o permitido.
+    if (strlen(fname) >= sb->namelen) {
+        errno = ENAMETOOLONG; // Define o erro como "nome de arquivo muito longo".
+        return -1;
+    }
+
+    // Verifica se o arquivo existe no sistema de arquivos.
+    uint64_t block = encontraBloco(sb, fname, 0);
+    if (block == 0) {
+        errno = ENOENT; // Define o erro como "arquivo não encontrado".
+        return -1;
+    }
+
+    int aux;
+    struct inode *inode_atual = (struct inode*) calloc(sb->blksz, 1);
+    struct inode *prox_inode = (struct inode*) calloc(sb->blksz, 1);
+    struct inode *parent_dir = (struct inode*) calloc(sb->blksz, 1);
+    struct nodeinfo *parent_inode = (struct nodeinfo*) calloc(sb->blksz, 1);
+    struct nodeinfo *node_info = (struct nodeinfo*) calloc(sb->blksz, 1);
+
+    // Lê o primeiro inode do arquivo.
+    aux = leBloco(sb, block, inode_atual);
+
+    // Verifica se é um diretório.
+    if (inode_atual->mode & IMDIR) {
+        errno = EISDIR; // Define o erro como "é um diretório".
+        goto cleanup;
+    }
+
+    // Lê o inode e o nodeinfo do diretório pai.
+    aux = leBloco(sb, inode_atual->parent, parent_dir);
+    aux = leInfo(sb, parent_dir->meta, parent_inode);
+
+    // Remove a referência do arquivo no diretório pai e atualiza o nodeinfo.
+    if (removeEntrada(sb, inode_atual->parent, parent_dir, parent_inode, block, fname) == -1)
+        goto cleanup;
+    parent_inode->size--;
+    aux = escreveInfo(sb, parent_dir->meta, parent_inode);
+
+    free(parent_dir);
+    free(parent_inode);
+
+    // Arquivos grandes podem ir para a lista de órfãos (veja fs_set_reclaim).
+    if (adiaLiberacao(sb, inode_atual)) {
+        aux = enfileiraOrfao(sb, block, inode_atual);
+        free(inode_atual);
+        free(prox_inode);
+        free(node_info);
+        return aux;
+    }
+
+    // Junta o inode, o nodeinfo, os blocos de dados e os inodes filhos do
+    // arquivo e os devolve de uma vez à lista de blocos livres.
+    struct listaBlocos blocos = {NULL, 0, 0};
+    aux = anexaBloco(&blocos, block);
+    if (aux == 0) aux = coletaCadeia(sb, inode_atual, 1, &blocos);
+    if (aux == 0) aux = devolveBlocos(sb, blocos.v, blocos.n);
+    free(blocos.v);
+
+    free(inode_atual);
+    free(prox_inode);
+    free(node_info);
+    return aux;
+
+cleanup:
+    // Em caso de erro, libera a memória alocada.
+    free(inode_atual);
+    free(prox_inode);
+    free(parent_dir);
+    free(parent_inode);
+    free(node_info);
+    return -1;
+}
+
+/*
+Cria um diretorio no caminho dpath
+*/
+int fs_mkdir(struct superblock *sb, const char *dname) {
+    MEDE(sb, FS_OP_MKDIR);
+    GRAVA(dname, 0, 0);
+    TRAVA(sb);
+    // Verifica o descritor do sistema de arquivos.
+    if (sb->magic != 0xdcc605f5) {
+        errno = EBADF;  // Definir o erro EBADF
+        return -1;
+    }
+
+    // Verifica se o nome do diretório é maior que o permitido.
+    if (strlen(dname) >= sb->namelen) {
+        errno = ENAMETOOLONG;  // Definir o erro ENAMETOOLONG
+        return -1;
+    }
+
+    // Verifica se o diretório pai existe e se o nome do diretório não contém espaços em branco.
+    if (*dname != '/' || strchr(dname, ' ') != NULL) {
+        errno = ENOENT;  // Definir o erro ENOENT
+        return -1;
+    }
+
+    // Verifica se o diretório já existe.
+    uint64_t superbloco = encontraBloco(sb, dname, 0);
+    if (superbloco > 0) {
+        errno = EEXIST;  // Definir o erro EEXIST
+        return -1;
+    }
+
+    // Encontra o número do bloco do diretório pai.
+    uint64_t parent_node = encontraBloco(sb, dname, 1);
+    if (parent_node == 0) {
+        errno = ENOENT;  // Definir o erro ENOENT
+        return -1;
+    }
+
+    // Lê o diretório pai e verifica se há espaço para o diretório, seu
+    // nodeinfo e o crescimento da cadeia (ou da árvore) do diretório pai.
+    struct inode *parent_dir = (struct inode*) calloc(sb->blksz, 1);
+    int64_t crescimento = -1;
+    if (leBloco(sb, parent_node, parent_dir) == 0)
+        crescimento = crescimentoDiretorio(sb, parent_dir, 1, 0);
+    if (crescimento == -1 || garanteLivres(sb, 2 + crescimento) == -1) {
+        free(parent_dir);
+        return -1;
+    }
+
+    // Obtém blocos para o novo diretório e as informações do nó.
+    uint64_t dir_node = fs_get_block(sb);
+    uint64_t dir_node_info_number = fs_get_block(sb);
+    if (dir_node_info_number == (uint64_t)-1 || dir_node == (uint64_t)-1) {
+        free(parent_dir);
+        return -1;  // Falha na obtenção de blocos
+    }
+
+    // Aloca memória para o novo diretório e informações do nó.
+    struct inode *dir = (struct inode*) calloc(sb->blksz, 1);
+    struct nodeinfo *dir_node_info = (struct nodeinfo*) calloc(sb->blksz, 1);
+    struct nodeinfo *parent_node_info = (struct nodeinfo*) calloc(sb->blksz, 1);
+
+    // Configura as informações do novo diretório (que herda o formato do pai).
+    dir->mode = IMDIR | (parent_dir->mode & IMBTREE);
+    dir->next = 0;
+    dir->parent = parent_node;
+    dir->meta = dir_node_info_number;
+
+    // Extrai o nome do diretório do caminho fornecido.
+    char *auxc = strrchr(dname, '/');
+    strcpy(dir_node_info->name, auxc);
+    dir_node_info->size = 0;
+
+    // Lê as informações do nó do diretório pai.
+    leInfo(sb, parent_dir->meta, parent_node_info);
+
+    // Linka o novo diretório ao diretório pai e atualiza o número de arquivos.
+    if (insereEntrada(sb, parent_node, parent_dir, parent_node_info, dir_node, dname) == -1) {
+        fs_put_block(sb, dir_node);
+        fs_put_block(sb, dir_node_info_number);
+        free(parent_dir);
+        free(parent_node_info);
+        free(dir);
+        free(dir_node_info);
+        return -1;
+    }
+    parent_node_info->size++;
+    escreveInfo(sb, parent_dir->meta, parent_node_info);
+
+    // Escreve o novo diretório e as informações do nó no disco.
+    escreveBloco(sb, dir_node, dir);
+    escreveInfo(sb, dir_node_info_number, dir_node_info);
+
+    // Libera a memória alocada.
+    free(parent_dir);
+    free(parent_node_info);
+    free(dir);
+    free(dir_node_info);
+    return 0;
+}
+
+/*
+Remove o diretório no caminho dname
+*/
+int fs_rmdir(struct superblock *sb, const char *dname) {
+	MEDE(sb, FS_OP_RMDIR);
+	GRAVA(dname, 0, 0);
+	TRAVA(sb);
+	// Verifica se o descritor do sistema de arquivos é válido.
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+
+	// Verifica se o nome do diretório (caminho) excede o tamanho máximo permitido.
+	if (strlen(dname) >= sb->namelen) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	// Verifica se o caminho do diretório não começa com '/' ou contém espaços em branco.
+	if ((*dname != '/') || (strchr(dname, ' ') != NULL)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	// Verifica se o diretório a ser removido existe.
+	uint64_t block = encontraBloco(sb, dname, 0);
+	if (block == 0) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	uint64_t parent_node = encontraBloco(sb, dname, 1);
+	struct listaBlocos blocos = {NULL, 0, 0};
+	int ret = -1;
+
+	struct inode *parent_dir = (struct inode*) calloc(sb->blksz, 1);
+	struct inode *dir = (struct inode*) calloc(sb->blksz, 1);
+	struct nodeinfo *dir_node_info = (struct nodeinfo*) calloc(sb->blksz, 1);
+	struct nodeinfo *parent_node_info = (struct nodeinfo*) calloc(sb->blksz, 1);
+
+	// Lê o inode do diretório.
+	leBloco(sb, block, dir);
+
+	// Verifica se é um diretório (e não a raiz).
+	if (!(dir->mode & IMDIR)) {
+		errno = ENOTDIR;
+		goto cleanup;
+	}
+	if (block == sb->root) {
+		errno = EBUSY;
+		goto cleanup;
+	}
+
+	// Lê as informações do nó do diretório.
+	leInfo(sb, dir->meta, dir_node_info);
+
+	// Verifica se o diretório não está vazio.
+	if (dir_node_info->size > 0) {
+		errno = ENOTEMPTY;
+		goto cleanup;
+	}
+
+	// Remove a referência ao diretório no diretório pai e atualiza o nodeinfo do pai.
+	leBloco(sb, parent_node, parent_dir);
+	leInfo(sb, parent_dir->meta, parent_node_info);
+	if (removeEntrada(sb, parent_node, parent_dir, parent_node_info, block, dname) == -1)
+		goto cleanup;
+	parent_node_info->size--;
+	escreveInfo(sb, parent_dir->meta, parent_node_info);
+
+	// Deleta o inode, o nó de informações e os inodes (vazios) da cadeia do
+	// diretório, de uma vez.
+	if (anexaBloco(&blocos, block) == 0 && coletaCadeia(sb, dir, 0, &blocos) == 0)
+		ret = devolveBlocos(sb, blocos.v, blocos.n);
+
+cleanup:
+	free(blocos.v);
+	free(parent_dir);
+	free(parent_node_info);
+	free(dir);
+	free(dir_node_info);
+	return ret;
+}
+
+/*
+Remove o diretório no caminho dname e tudo o que estiver abaixo dele
+*/
+int fs_rmdir_recursive(struct superblock *sb, const char *dname) {
+	MEDE(sb, FS_OP_RMDIR_RECURSIVE);
+	GRAVA(dname, 0, 0);
+	TRAVA(sb);
+	// Verifica se o descritor do sistema de arquivos é válido.
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+
+	// Verifica se o nome do diretório (caminho) excede o tamanho máximo permitido.
+	if (strlen(dname) >= sb->namelen) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	// Verifica se o diretório a ser removido existe.
+	uint64_t block = encontraBloco(sb, dname, 0);
+	if (block == 0) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	uint64_t parent_node, atual, k;
+	struct listaBlocos blocos = {NULL, 0, 0};
+	struct listaBlocos pilha = {NULL, 0, 0};
+	struct listaBlocos entradas = {NULL, 0, 0};
+	int ret = -1;
+
+	struct inode *dir = (struct inode*) malloc(sb->blksz);
+	struct inode *filho = (struct inode*) malloc(sb->blksz);
+	struct inode *parent_dir = (struct inode*) malloc(sb->blksz);
+	struct nodeinfo *parent_node_info = (struct nodeinfo*) malloc(sb->blksz);
+
+	// Verifica se é um diretório (e não a raiz).
+	if (leBloco(sb, block, dir) == -1) goto cleanup;
+	if (!(dir->mode & IMDIR)) {
+		errno = ENOTDIR;
+		goto cleanup;
+	}
+	if (block == sb->root) {
+		errno = EBUSY;
+		goto cleanup;
+	}
+	parent_node = dir->parent;
+
+	// Percorre a subárvore uma única vez, juntando todos os blocos: os
+	// diretórios ainda não visitados ficam em uma pilha.
+	if (anexaBloco(&pilha, block) == -1) goto cleanup;
+	while (pilha.n > 0) {
+		atual = pilha.v[--pilha.n];
+		if (anexaBloco(&blocos, atual) == -1) goto cleanup;
+		if (leBloco(sb, atual, dir) == -1) goto cleanup;
+		if (anexaBloco(&blocos, dir->meta) == -1) goto cleanup;
+
+		// Para cada entrada do diretório (os inodes da cadeia ou os nós da
+		// árvore vão junto com os demais blocos).
+		entradas.n = 0;
+		if (entradasDiretorio(sb, dir, &entradas, &blocos) == -1) goto cleanup;
+		for (k = 0; k < entradas.n; k++) {
+			if (leBloco(sb, entradas.v[k], filho) == -1) goto cleanup;
+			if (filho->mode & IMDIR) {
+				if (anexaBloco(&pilha, entradas.v[k]) == -1) goto cleanup;
+			} else {
+				if (anexaBloco(&blocos, entradas.v[k]) == -1) goto cleanup;
+				if (coletaCadeia(sb, filho, 1, &blocos) == -1) goto cleanup;
+			}
+		}
+	}
+
+	// Remove a referência ao diretório no diretório pai antes de liberar
+	// qualquer bloco, e depois devolve todos eles em um único lote.
+	if (leBloco(sb, parent_node, parent_dir) == -1) goto cleanup;
+	if (leInfo(sb, parent_dir->meta, parent_node_info) == -1) goto cleanup;
+	if (removeEntrada(sb, parent_node, parent_dir, parent_node_info, block, dname) == -1)
+		goto cleanup;
+	parent_node_info->size--;
+	if (escreveInfo(sb, parent_dir->meta, parent_node_info) == -1) goto cleanup;
+	ret = devolveBlocos(sb, blocos.v, blocos.n);
+
+cleanup:
+	free(blocos.v);
+	free(pilha.v);
+	free(entradas.v);
+	free(dir);
+	free(filho);
+	free(parent_dir);
+	free(parent_node_info);
+	return ret;
+}
+
+/* Entradas lidas por vez por fs_readdir: os inodes delas em um leBlocos e
+ * depois os nodeinfos em outro. */
+#define LOTE_DIR 64
+
+/* Posicao do cursor de fs_opendir numa cadeia: o inode da cadeia e o
+ * proximo link a olhar. */
+struct posicaoDir {
+	uint64_t no, indice;
+};
+
+/* Cursor de fs_opendir.  As entradas sao lidas adiantadas, em lotes de ate
+ * LOTE_DIR, e um lote vale enquanto nenhum bloco de metadados for escrito
+ * (sb->writes).  Nas cadeias, cada lote comeca na posicao depois da ultima
+ * entrada devolvida; nas arvores, descendo pelo nome dessa entrada, e segue
+ * pelas folhas seguintes.  Assim cada entrada existente do inicio ao fim da
+ * listagem aparece uma vez, mesmo que o diretorio mude entre as chamadas. */
+struct fs_dir {
+	struct superblock *sb;
+	uint64_t dir;     /* primeiro inode do diretorio */
+	struct posicaoDir pos;
+	uint64_t ultimo;  /* ultima entrada devolvida, ou zero */
+	int arvore;
+	int fim;
+	struct fs_dirent ent;
+	char *nome;       /* nome da ultima entrada (ent.name) */
+	void *bloco;
+	uint64_t lote[LOTE_DIR];
+	struct posicaoDir depois[LOTE_DIR]; /* posicao depois de cada entrada */
+	uint64_t nlote, plote, geracao;
+	char *inodes, *infos; /* LOTE_DIR blocos cada */
+};
+
+/*
+Abre o diretorio dname para leitura com fs_readdir
+*/
+struct fs_dir *fs_opendir(struct superblock *sb, const char *dname) {
+	MEDE(sb, FS_OP_OPENDIR);
+	GRAVA(dname, 0, 0);
+	TRAVA(sb);
+	//verifica o descritor do sistema de arquivos
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return NULL;
+	}
+	if (strlen(dname) >= sb->namelen) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	uint64_t no = encontraBloco(sb, dname, 0);
+	if (no == 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	struct fs_dir *d = (struct fs_dir*) calloc(1, sizeof(struct fs_dir));
+	d->sb = sb;
+	d->dir = no;
+	d->nome = (char*) calloc(sb->namelen, 1);
+	d->bloco = malloc(sb->blksz);
+	d->inodes = (char*) malloc(LOTE_DIR * sb->blksz);
+	d->infos = (char*) malloc(LOTE_DIR * sb->blksz);
+	struct inode *dir = (struct inode*) d->bloco;
+	if (leBloco(sb, no, dir) == -1) {
+		fs_closedir(d);
+		return NULL;
+	}
+	if (!(dir->mode & IMDIR)) {
+		fs_closedir(d);
+		errno = ENOTDIR;
+		return NULL;
+	}
+	d->arvore = (dir->mode & IMBTREE) != 0;
+	d->pos.no = no;
+	d->ent.name = d->nome;
+	GRAVA(dname, (uintptr_t) d, 0);
+	return d;
+}
+
+/*
+Junta em d->lote as entradas da arvore de d depois de d->ultimo (cujo nome
+esta em d->nome), ou desde a primeira se d->ultimo for zero: uma descida ate
+a folha e dali pelas folhas seguintes, lendo so os nos que mudam no caminho
+*/
+static int loteArvore(struct fs_dir *d) {
+	struct superblock *sb = d->sb;
+	struct inode *dir = (struct inode*) d->bloco;
+	struct dirnode *no;
+	struct caminho c;
+	uint64_t p, k, j;
+	int igual, ret = -1;
+
+	if (leBloco(sb, d->dir, dir) == -1) return -1;
+	if (dir->next == 0) return 0;
+	if (desceArvore(sb, dir, d->ultimo ? d->nome : NULL, strlen(d->nome), &c,
+	                &p, &igual, (struct inode*) d->inodes,
+	                (struct nodeinfo*) d->infos) == -1)
+		goto fim;
+	p += igual;
+
+	for (;;) {
+		no = noCaminho(sb, &c, c.altura);
+		for (; p < no->count && d->nlote < LOTE_DIR; p++) {
+			d->lote[d->nlote] = no->keys[p].node;
+			d->depois[d->nlote].no = c.nos[c.altura];
+			d->depois[d->nlote++].indice = p + 1;
+		}
+		if (d->nlote == LOTE_DIR) break;
+
+		// folha esgotada: a primeira da subarvore seguinte do ancestral
+		// mais baixo que ainda tiver uma
+		for (k = c.altura; k > 0; k--) {
+			if (c.indices[k - 1] + 1 < noCaminho(sb, &c, k - 1)->count) break;
+		}
+		if (k == 0) break;
+		c.indices[k - 1]++;
+		for (j = k; j <= c.altura; j++) {
+			c.nos[j] = noCaminho(sb, &c, j - 1)->keys[c.indices[j - 1]].node;
+			if (leBloco(sb, c.nos[j], noCaminho(sb, &c, j)) == -1) goto fim;
+			c.indices[j] = 0;
+		}
+		p = 0;
+	}
+	ret = 0;
+
+fim:
+	liberaCaminho(&c);
+	return ret;
+}
+
+/*
+Junta em d->lote as proximas entradas (ate LOTE_DIR) do diretorio de d e le os
+inodes e os nodeinfos delas com leBlocos.  O nodeinfo de um arquivo costuma
+ser o bloco seguinte ao do primeiro inode, e eh lido junto com os inodes; so
+os que estiverem noutro lugar sao lidos depois.  Sem entradas, marca o fim
+*/
+static int carregaLote(struct fs_dir *d) {
+	struct superblock *sb = d->sb;
+	struct inode *cadeia = (struct inode*) d->bloco;
+	uint64_t v[2 * LOTE_DIR], j, n;
+	char *destinos[2 * LOTE_DIR];
+	int tipos[2 * LOTE_DIR];
+	struct inode *in;
+	int64_t i;
+
+	d->nlote = d->plote = 0;
+	if (d->arvore) {
+		if (loteArvore(d) == -1) return -1;
+	}
+	while (!d->arvore && d->nlote == 0) {
+		if (leBloco(sb, d->pos.no, cadeia) == -1) return -1;
+		for (i = sb->ops->procuraUsado(sb, cadeia->links, d->pos.indice);
+		     i >= 0 && d->nlote < LOTE_DIR;
+		     i = sb->ops->procuraUsado(sb, cadeia->links, i + 1)) {
+			d->lote[d->nlote] = cadeia->links[i];
+			d->depois[d->nlote].no = d->pos.no;
+			d->depois[d->nlote++].indice = i + 1;
+		}
+		if (d->nlote > 0 || cadeia->next == 0) break;
+		d->pos.no = cadeia->next;
+		d->pos.indice = 0;
+	}
+	if (d->nlote == 0) {
+		d->fim = 1;
+		return 0;
+	}
+
+	for (j = n = 0; j < d->nlote; j++) {
+		v[n] = d->lote[j];
+		tipos[n] = FS_BLOCK_INODE;
+		destinos[n++] = d->inodes + j * sb->blksz;
+		if (d->lote[j] + 1 < sb->blks) {
+			v[n] = d->lote[j] + 1;
+			tipos[n] = FS_BLOCK_NODEINFO;
+			destinos[n++] = d->infos + j * sb->blksz;
+		}
+	}
+	if (leBlocos(sb, v, n, destinos, tipos) == -1) return -1;
+	for (j = n = 0; j < d->nlote; j++) {
+		in = (struct inode*) (d->inodes + j * sb->blksz);
+		if (in->meta == d->lote[j] + 1) continue;
+		v[n] = in->meta;
+		tipos[n] = FS_BLOCK_NODEINFO;
+		destinos[n++] = d->infos + j * sb->blksz;
+	}
+	if (leBlocos(sb, v, n, destinos, tipos) == -1) return -1;
+	d->geracao = sb->writes;
+	return 0;
+}
+
+/*
+Retorna a proxima entrada do diretorio aberto em d (veja fs.h)
+*/
+const struct fs_dirent *fs_readdir(struct fs_dir *d) {
+	struct superblock *sb = d->sb;
+	MEDE(sb, FS_OP_READDIR);
+	GRAVA(NULL, (uintptr_t) d, 0);
+	TRAVA(sb);
+	struct inode *in;
+	struct nodeinfo *info;
+	uint64_t j;
+
+	// o lote so vale se nada foi escrito desde que foi lido
+	if (!d->fim && (d->plote == d->nlote || d->geracao != sb->writes)) {
+		if (carregaLote(d) == -1) {
+			d->nlote = d->plote = 0;
+			return NULL;
+		}
+	}
+	if (d->fim) {
+		errno = 0;
+		return NULL;
+	}
+
+	j = d->plote++;
+	in = (struct inode*) (d->inodes + j * sb->blksz);
+	info = (struct nodeinfo*) (d->infos + j * sb->blksz);
+	d->pos = d->depois[j];
+	d->ultimo = d->lote[j];
+	strcpy(d->nome, ultimoNome(info->name));
+	d->ent.type = in->mode & IMDIR ? IMDIR : IMREG;
+	d->ent.inode = d->lote[j];
+	d->ent.size = info->size;
+	return &d->ent;
+}
+
+/*
+Fecha o diretorio aberto em d
+*/
+int fs_closedir(struct fs_dir *d) {
+	if (d == NULL) return 0;
+	gravaAvulsa(d->sb, FS_RECORD_CLOSEDIR, (uintptr_t) d);
+	free(d->nome);
+	free(d->bloco);
+	free(d->inodes);
+	free(d->infos);
+	free(d);
+	return 0;
+}
+
+/*
+Retorna um string com o nome de todos os elementos no diretorio dname
+*/
+char *fs_list_dir(struct superblock *sb, const char *dname) {
+	MEDE(sb, FS_OP_LIST_DIR);
+	GRAVA(dname, 0, 0);
+	TRAVA(sb);
+	struct fs_dir *d = fs_opendir(sb, dname);
+	const struct fs_dirent *e;
+	size_t tam = 0, cap = 64, n;
+	char *ret;
+
+	if (d == NULL) return NULL;
+	ret = (char*) malloc(cap);
+	ret[0] = '\0';
+	while ((e = fs_readdir(d)) != NULL) {
+		// nome, uma barra nos diretorios e o espaco antes do proximo
+		n = strlen(e->name);
+		if (tam + n + 3 > cap) {
+			cap = 2 * (tam + n + 3);
+			ret = (char*) realloc(ret, cap);
+		}
+		if (tam != 0) ret[tam++] = ' ';
+		memcpy(ret + tam, e->name, n);
+		tam += n;
+		if (e->type == IMDIR) ret[tam++] = '/';
+		ret[tam] = '\0';
+	}
+	if (errno != 0) {
+		free(ret);
+		ret = NULL;
+	}
+	fs_closedir(d);
+	return ret;
+}
+
+/*
+Preenche out com os metadados da entrada no, cujo primeiro inode e nodeinfo
+estao em in e info
+*/
+static void preencheStat(const struct superblock *sb, uint64_t no,
+                         const struct inode *in, const struct nodeinfo *info,
+                         struct fs_stat *out) {
+	memset(out, 0, sizeof(*out));
+	out->inode = no;
+	if (in->mode & IMDIR) {
+		out->mode = IMDIR;
+		out->children = info->size;
+		out->blocks = 2;
+	} else {
+		out->mode = IMREG;
+		out->size = info->size;
+		out->blocks = blocosOcupados(sb, in, info->size);
+	}
+}
+
+/*
+Le os metadados da entrada no para out
+*/
+static int leStat(struct superblock *sb, uint64_t no, struct inode *in,
+                  struct nodeinfo *info, struct fs_stat *out) {
+	if (leBloco(sb, no, in) == -1 || leInfo(sb, in->meta, info) == -1) return -1;
+	preencheStat(sb, no, in, info, out);
+	return 0;
+}
+
+/*
+Retorna em out os metadados do arquivo ou diretorio path (veja fs.h)
+*/
+int fs_stat(struct superblock *sb, const char *path, struct fs_stat *out) {
+	MEDE(sb, FS_OP_STAT);
+	GRAVA(path, 0, 0);
+	TRAVA(sb);
+	//verifica o descritor do sistema de arquivos
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+	if (strlen(path) >= sb->namelen) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	uint64_t no = encontraBloco(sb, path, 0);
+	if (no == 0) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	struct inode *in = (struct inode*) malloc(sb->blksz);
+	struct nodeinfo *info = (struct nodeinfo*) malloc(sb->blksz);
+	int ret = leStat(sb, no, in, info, out);
+	free(in);
+	free(info);
+	return ret;
+}
+
+/*
+O mesmo que fs_stat: nao ha links simbolicos
+*/
+int fs_lstat(struct superblock *sb, const char *path, struct fs_stat *out) {
+	return fs_stat(sb, path, out);
+}
+
+/* Caminho de fs_stat_many: pai eh o tamanho do caminho do diretorio pai. */
+struct consulta {
+	const char *caminho;
+	size_t pai;
+	size_t i;
+};
+
+static int comparaConsultas(const void *a, const void *b) {
+	const struct consulta *p = (const struct consulta*) a;
+	const struct consulta *q = (const struct consulta*) b;
+	size_t n = p->pai < q->pai ? p->pai : q->pai;
+	int c = memcmp(p->caminho, q->caminho, n);
+	if (c == 0 && p->pai != q->pai) return p->pai < q->pai ? -1 : 1;
+	if (c == 0) c = strcmp(p->caminho + p->pai, q->caminho + q->pai);
+	return c;
+}
+
+/*
+Procura os caminhos de con[0..n), que tem todos o mesmo pai, no diretorio
+dir_n: uma passada pela cadeia, com cada entrada procurada entre os caminhos
+(ordenados por nome), ou uma busca na arvore por caminho.  Preenche out e
+conta em *achados os que existem
+*/
+static int consultaGrupo(struct superblock *sb, uint64_t dir_n,
+                         const struct consulta *con, size_t n,
+                         struct fs_stat *out, size_t *achados) {
+	struct inode *dir = (struct inode*) malloc(sb->blksz);
+	struct inode *in = (struct inode*) malloc(sb->blksz);
+	struct nodeinfo *info = (struct nodeinfo*) malloc(sb->blksz);
+	size_t k, ini, fim, meio;
+	const char *u;
+	uint64_t no;
+	int64_t i;
+	int c, ret = -1;
+
+	if (leBloco(sb, dir_n, dir) == -1) goto fim;
+	if (!(dir->mode & IMDIR)) {
+		ret = 0;
+		goto fim;
+	}
+	if (dir->mode & IMBTREE) {
+		for (k = 0; k < n; k++) {
+			u = con[k].caminho + con[k].pai + 1;
+			no = procuraArvore(sb, dir, u, strlen(u), in, info);
+			if (no == 0) continue;
+			if (leStat(sb, no, in, info, &out[con[k].i]) == -1) goto fim;
+			(*achados)++;
+		}
+		ret = 0;
+		goto fim;
+	}
+
+	for (;;) {
+		for (i = sb->ops->procuraUsado(sb, dir->links, 0); i >= 0;
+		     i = sb->ops->procuraUsado(sb, dir->links, i + 1)) {
+			if (leBloco(sb, dir->links[i], in) == -1) goto fim;
+			if (leInfo(sb, in->meta, info) == -1) goto fim;
+			u = ultimoNome(info->name);
+			ini = 0;
+			fim = n;
+			while (ini < fim) {
+				meio = (ini + fim) / 2;
+				c = strcmp(con[meio].caminho + con[meio].pai + 1, u);
+				if (c < 0) ini = meio + 1;
+				else fim = meio;
+			}
+			for (k = ini; k < n && strcmp(con[k].caminho + con[k].pai + 1, u) == 0; k++) {
+				preencheStat(sb, dir->links[i], in, info, &out[con[k].i]);
+				(*achados)++;
+			}
+		}
+		if (dir->next == 0) break;
+		if (leBloco(sb, dir->next, dir) == -1) goto fim;
+	}
+	ret = 0;
+
+fim:
+	free(dir);
+	free(in);
+	free(info);
+	return ret;
+}
+
+/*
+fs_stat de varios caminhos, resolvendo cada diretorio pai uma vez (veja fs.h)
+*/
+ssize_t fs_stat_many(struct superblock *sb, const char **paths, size_t n,
+                     struct fs_stat *out) {
+	MEDE(sb, FS_OP_STAT_MANY);
+	GRAVA_LOTE(paths, n);
+	TRAVA(sb);
+	//verifica o descritor do sistema de arquivos
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+
+	struct consulta *con = (struct consulta*) malloc((n ? n : 1) * sizeof(struct consulta));
+	struct inode *in = (struct inode*) malloc(sb->blksz);
+	struct nodeinfo *info = (struct nodeinfo*) malloc(sb->blksz);
+	size_t k, g, h, m = 0, achados = 0;
+	ssize_t ret = -1;
+	const char *c;
+	uint64_t no;
+
+	//os caminhos com um ultimo componente sao agrupados por diretorio pai;
+	//os demais ("/", "/a/") sao resolvidos direto
+	for (k = 0; k < n; k++) {
+		memset(&out[k], 0, sizeof(out[k]));
+		if (strlen(paths[k]) >= sb->namelen) continue;
+		c = strrchr(paths[k], '/');
+		if (c != NULL && c[1] != '\0') {
+			con[m].caminho = paths[k];
+			con[m].pai = c - paths[k];
+			con[m++].i = k;
+			continue;
+		}
+		no = encontraBloco(sb, paths[k], 0);
+		if (no == 0) continue;
+		if (leStat(sb, no, in, info, &out[k]) == -1) goto fim;
+		achados++;
+	}
+	qsort(con, m, sizeof(struct consulta), comparaConsultas);
+
+	for (g = 0; g < m; g = h) {
+		for (h = g + 1; h < m && con[h].pai == con[g].pai &&
+		     memcmp(con[h].caminho, con[g].caminho, con[g].pai) == 0; h++);
+		no = procuraCaminho(sb, con[g].caminho, con[g].pai);
+		if (no != 0 && consultaGrupo(sb, no, con + g, h - g, out, &achados) == -1)
+			goto fim;
+	}
+	ret = achados;
+
+fim:
+	free(con);
+	free(in);
+	free(info);
+	return ret;
+}
+
+/*
+Libera cerca de budget blocos dos orfaos do sistema de arquivos sb
+*/
+int64_t fs_reclaim(struct superblock *sb, uint64_t budget) {
+	MEDE(sb, FS_OP_RECLAIM);
+	GRAVA(NULL, budget, 0);
+	TRAVA(sb);
+	//verifica o descritor do sistema de arquivos
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+	return recuperaOrfaos(sb, budget);
+}
+
+/* Desfragmentacao (veja fs_defrag).  Os blocos de um arquivo sao tomados na
+ * ordem em que gravaArquivo os dispoe, e cada sequencia de numeros seguidos
+ * eh um trecho.  Os blocos livres ficam num mapa de bits, um por bloco da
+ * imagem, lido da lista de blocos livres uma vez por chamada. */
+
+/* Arquivo a ser movido por fs_defrag para os blocos de destino em diante. */
+struct movimento {
+	uint64_t no;      /* primeiro inode do arquivo */
+	uint64_t pai;     /* primeiro inode do diretorio */
+	uint64_t destino;
+};
+
+/* Estado de fs_fragmentation e fs_defrag ao longo de percorreArquivos. */
+struct desfragmentacao {
+	struct fs_fragmentation medida;
+	struct listaBlocos blocos;  /* blocos do arquivo visitado */
+	int flags;
+	uint64_t orcamento, movidos;
+	uint64_t *livres;           /* blocos livres ainda nao reservados */
+	uint64_t *reservados;       /* blocos livres reservados para os arquivos */
+	/* os dois mapas de bits sao lidos so quando aparece o primeiro arquivo a
+	 * mover (NULL ate la) */
+	uint64_t nreservados;
+	uint64_t cursor;            /* onde procurar o proximo trecho livre */
+	uint64_t falha;             /* menor numero de blocos que nao coube */
+	struct movimento *mov;
+	size_t nmov, capmov;
+};
+
+/*
+Poe em l os blocos do arquivo cujo primeiro inode esta em in (in eh usado
+como area de trabalho), fora o proprio primeiro inode, e retorna em quantos
+trechos eles estao, ou -1
+*/
+static int64_t trechosArquivo(struct superblock *sb, struct inode *in,
+                              struct listaBlocos *l) {
+	uint64_t i;
+	int64_t trechos = 1;
+
+	l->n = 0;
+	if (coletaCadeia(sb, in, 1, l) == -1) return -1;
+	for (i = 1; i < l->n; i++) {
+		if (l->v[i] != l->v[i - 1] + 1) trechos++;
+	}
+	return trechos;
+}
+
+/*
+Chama visita(sb, no, pai, in, arg) para cada arquivo de sb, em que no eh o
+primeiro inode do arquivo, lido em in, e pai o do seu diretorio.  Os
+diretorios sao visitados a partir da raiz, em profundidade, e as entradas de
+cada um na ordem de fs_list_dir.  visita retorna 0 para continuar, 1 para
+parar ou -1 em caso de erro
+*/
+static int percorreArquivos(struct superblock *sb,
+                            int (*visita)(struct superblock*, uint64_t, uint64_t,
+                                          struct inode*, void*),
+                            void *arg) {
+	struct listaBlocos pilha = {NULL, 0, 0}, entradas = {NULL, 0, 0};
+	struct listaBlocos nos = {NULL, 0, 0}, subdirs = {NULL, 0, 0};
+	struct inode *in = (struct inode*) malloc(sb->blksz);
+	uint64_t dir, k;
+	int ret = -1, r;
+
+	if (in == NULL || anexaBloco(&pilha, sb->root) == -1) goto fim;
+	while (pilha.n > 0) {
+		dir = pilha.v[--pilha.n];
+		entradas.n = nos.n = subdirs.n = 0;
+		if (leBloco(sb, dir, in) == -1) goto fim;
+		if (entradasDiretorio(sb, in, &entradas, &nos) == -1) goto fim;
+		for (k = 0; k < entradas.n; k++) {
+			if (leBloco(sb, entradas.v[k], in) == -1) goto fim;
+			if (in->mode & IMDIR) {
+				if (anexaBloco(&subdirs, entradas.v[k]) == -1) goto fim;
+				continue;
+			}
+			if ((r = visita(sb, entradas.v[k], dir, in, arg)) != 0) {
+				ret = r == 1 ? 0 : -1;
+				goto fim;
+			}
+		}
+		// os subdiretorios saem da pilha na ordem em que foram listados
+		for (k = subdirs.n; k-- > 0;) {
+			if (anexaBloco(&pilha, subdirs.v[k]) == -1) goto fim;
+		}
+	}
+	ret = 0;
+
+fim:
+	free(pilha.v);
+	free(entradas.v);
+	free(nos.v);
+	free(subdirs.v);
+	free(in);
+	return ret;
+}
+
+static int medeArquivo(struct superblock *sb, uint64_t no, uint64_t pai,
+                       struct inode *in, void *arg) {
+	struct desfragmentacao *f = (struct desfragmentacao*) arg;
+	int64_t trechos = trechosArquivo(sb, in, &f->blocos);
+
+	if (trechos == -1) return -1;
+	f->medida.files++;
+	f->medida.blocks += f->blocos.n;
+	f->medida.extents += trechos;
+	if (trechos > 1) f->medida.fragmented++;
+	if (f->blocos.v[0] != no + 1) f->medida.detached++;
+	return 0;
+}
+
+/*
+Marca em f->livres os blocos das listas de blocos livres de sb
+*/
+static int carregaLivres(struct superblock *sb, struct desfragmentacao *f) {
+	uint64_t palavras = (sb->blks + 63) / 64, no, k, j, vistos = 0;
+	uint64_t listas[2] = { sb->freelist, sb->freed };
+	struct freepage *p = (struct freepage*) malloc(sb->blksz);
+	int l, ret = -1;
+
+	f->livres = (uint64_t*) calloc(palavras, sizeof(uint64_t));
+	f->reservados = (uint64_t*) calloc(palavras, sizeof(uint64_t));
+	if (p == NULL || f->livres == NULL || f->reservados == NULL) goto fim;
+	for (l = 0; l < 2; l++) {
+		for (no = listas[l]; no != 0; no = p->next) {
+			if (no >= sb->blks || vistos++ > sb->blks) {
+				errno = EIO;
+				goto fim;
+			}
+			if (leBlocoTipo(sb, no, p, FS_BLOCK_FREEPAGE) == -1) goto fim;
+			poeBit(f->livres, no);
+			for (j = 0, k = tamanhoLote(p); j < k; j++) {
+				if (p->links[j] >= sb->blks) {
+					errno = EIO;
+					goto fim;
+				}
+				poeBit(f->livres, p->links[j]);
+			}
+		}
+	}
+	ret = 0;
+
+fim:
+	free(p);
+	return ret;
+}
+
+/*
+Primeiro bloco, de inicio em diante, de um trecho de n blocos marcados em
+livres, ou zero
+*/
+static uint64_t procuraTrecho(const uint64_t *livres, uint64_t blks, uint64_t n,
+                              uint64_t inicio) {
+	uint64_t b, corrido = 0;
+
+	for (b = inicio; b < blks; b++) {
+		// palavras sem nenhum bloco livre sao puladas inteiras
+		if (b % 64 == 0 && livres[b / 64] == 0) {
+			corrido = 0;
+			b += 63;
+			continue;
+		}
+		corrido = temBit(livres, b) ? corrido + 1 : 0;
+		if (corrido == n) return b + 1 - n;
+	}
+	return 0;
+}
+
+/*
+Se o arquivo no estiver fragmentado, reserva para ele um trecho livre com
+todos os blocos que gravaArquivo vai usar (mais o primeiro inode, com
+FS_DEFRAG_INODES), logo depois do trecho reservado para o anterior se couber
+*/
+static int planejaArquivo(struct superblock *sb, uint64_t no, uint64_t pai,
+                          struct inode *in, void *arg) {
+	struct desfragmentacao *f = (struct desfragmentacao*) arg;
+	int inodes = f->flags & FS_DEFRAG_INODES;
+	struct nodeinfo *info;
+	uint64_t n, inicio, b;
+	int64_t trechos;
+
+	if (f->movidos >= f->orcamento) return 1;
+	if ((trechos = trechosArquivo(sb, in, &f->blocos)) == -1) return -1;
+	if (trechos == 1 && (!inodes || f->blocos.v[0] == no + 1)) return 0;
+
+	if ((info = (struct nodeinfo*) malloc(sb->blksz)) == NULL) return -1;
+	if (leInfo(sb, f->blocos.v[0], info) == -1) {
+		free(info);
+		return -1;
+	}
+	n = blocosArquivo(sb, info->size) - 1 + (inodes != 0);
+	free(info);
+
+	// as reservas so diminuem os trechos livres: o que nao coube nao cabe mais
+	if (n >= f->falha) return 0;
+	if (f->livres == NULL && carregaLivres(sb, f) == -1) return -1;
+	inicio = procuraTrecho(f->livres, sb->blks, n, f->cursor);
+	if (inicio == 0) inicio = procuraTrecho(f->livres, sb->blks, n, 1);
+	if (inicio == 0) {
+		f->falha = n;
+		return 0;
+	}
+
+	if (f->nmov == f->capmov) {
+		size_t cap = f->capmov ? 2 * f->capmov : 64;
+		struct movimento *v = (struct movimento*) realloc(f->mov, cap * sizeof(struct movimento));
+		if (v == NULL) return -1;
+		f->mov = v;
+		f->capmov = cap;
+	}
+	f->mov[f->nmov].no = no;
+	f->mov[f->nmov].pai = pai;
+	f->mov[f->nmov++].destino = inicio;
+	for (b = inicio; b < inicio + n; b++) {
+		tiraBit(f->livres, b);
+		poeBit(f->reservados, b);
+	}
+	f->nreservados += n;
+	f->movidos += n;
+	f->cursor = inicio + n;
+	return 0;
+}
+
+/*
+Tira das listas de blocos livres os n blocos marcados em reservados.  Cada
+pagina que guarda algum deles eh regravada sem ele; uma pagina reservada da
+lugar na lista ao ultimo bloco que guardava, gravado antes que a pagina
+anterior (ou o superbloco) passe a aponta-lo, de modo que a lista gravada
+esteja sempre inteira.  As listas so sao percorridas ate o ultimo reservado
+*/
+static int retiraLivres(struct superblock *sb, const uint64_t *reservados, uint64_t n) {
+	struct freepage *p = (struct freepage*) malloc(sb->blksz);
+	struct freepage *ant = (struct freepage*) malloc(sb->blksz), *aux;
+	uint64_t *listas[2] = { &sb->freelist, &sb->freed };
+	struct fs_diario *d = diarioRetem(sb);
+	uint64_t atual, antNo, achados = 0, proximo, k, j, m;
+	int l, antSujo = 0, grava, ret = -1;
+
+	if (p == NULL || ant == NULL) goto fim;
+	for (l = 0; l < 2 && achados < n; l++) {
+		atual = *listas[l];
+		antNo = 0;
+		while (atual != 0 && achados < n) {
+			if (leBlocoTipo(sb, atual, p, FS_BLOCK_FREEPAGE) == -1) goto fim;
+			for (j = m = 0, k = tamanhoLote(p); j < k; j++) {
+				if (!temBit(reservados, p->links[j])) {
+					p->links[m++] = p->links[j];
+					continue;
+				}
+				achados++;
+				retiraFuro(sb, p->links[j]);
+			}
+			proximo = p->next;
+			grava = m != k;
+			if (temBit(reservados, atual)) {
+				achados++;
+				if (d != NULL && marcaRecentes(sb, d, &atual, 1) == -1) goto fim;
+				// sem blocos guardados, a pagina simplesmente sai da lista
+				atual = m > 0 ? p->links[--m] : proximo;
+				if (antNo == 0) {
+					*listas[l] = atual;
+				} else {
+					ant->next = atual;
+					antSujo = 1;
+				}
+				if (atual == proximo) continue;
+				retiraFuro(sb, atual); //o bloco guardado vira pagina
+				grava = 1;
+			}
+			if (grava) {
+				p->count = MARCA_LOTE | m;
+				if (escreveBlocoTipo(sb, atual, p, FS_BLOCK_FREEPAGE) == -1) goto fim;
+			}
+			// a anterior so eh gravada depois da pagina que ela passa a apontar
+			if (antSujo && escreveBlocoTipo(sb, antNo, ant, FS_BLOCK_FREEPAGE) == -1)
+				goto fim;
+			aux = ant;
+			ant = p;
+			p = aux;
+			antNo = atual;
+			antSujo = 0;
+			atual = proximo;
+		}
+		if (antSujo && escreveBlocoTipo(sb, antNo, ant, FS_BLOCK_FREEPAGE) == -1) goto fim;
+		antSujo = 0;
+	}
+	if (achados < n) {
+		errno = EIO;
+		goto fim;
+	}
+	sb->freeblks -= n;
+	ret = gravaSuperbloco(sb);
+
+fim:
+	free(p);
+	free(ant);
+	return ret;
+}
+
+/*
+Troca, na entrada nome do diretorio dir_n, o primeiro inode velho por novo.
+Nas arvores, troca tambem as chaves dos nos internos do caminho ate ela, da
+folha para a raiz
+*/
+static int trocaEntrada(struct superblock *sb, uint64_t dir_n, uint64_t velho,
+                        uint64_t novo, const char *nome) {
+	struct inode *dir = (struct inode*) malloc(sb->blksz);
+	struct inode *in = (struct inode*) malloc(sb->blksz);
+	struct nodeinfo *info = (struct nodeinfo*) malloc(sb->blksz);
+	struct caminho c;
+	struct dirnode *nd;
+	uint64_t no = dir_n, pos, i;
+	int64_t d, j;
+	int igual, muda, ret = -1;
+
+	memset(&c, 0, sizeof(c));
+	if (leBloco(sb, dir_n, dir) == -1) goto fim;
+	if (dir->mode & IMBTREE) {
+		nome = ultimoNome(nome);
+		if (dir->next == 0) {
+			errno = ENOENT;
+			goto fim;
+		}
+		if (desceArvore(sb, dir, nome, strlen(nome), &c, &pos, &igual, in, info) == -1)
+			goto fim;
+		if (!igual) {
+			errno = ENOENT;
+			goto fim;
+		}
+		for (d = c.altura; d >= 0; d--) {
+			nd = noCaminho(sb, &c, d);
+			for (i = 0, muda = 0; i < nd->count; i++) {
+				if (nd->keys[i].inode != velho) continue;
+				nd->keys[i].inode = novo;
+				if (nd->height == 0) nd->keys[i].node = novo;
+				muda = 1;
+			}
+			if (muda && escreveBloco(sb, c.nos[d], nd) == -1) goto fim;
+		}
+		ret = 0;
+		goto fim;
+	}
+	for (;;) {
+		if ((j = sb->ops->procura(sb, dir->links, 0, velho)) >= 0) {
+			dir->links[j] = novo;
+			ret = escreveBloco(sb, no, dir);
+			goto fim;
+		}
+		if (dir->next == 0) {
+			errno = ENOENT;
+			goto fim;
+		}
+		no = dir->next;
+		if (leBloco(sb, no, dir) == -1) goto fim;
+	}
+
+fim:
+	liberaCaminho(&c);
+	free(dir);
+	free(in);
+	free(info);
+	return ret;
+}
+
+/*
+Copia o arquivo m para os blocos reservados de m->destino em diante e o troca
+de lugar: o primeiro inode (regravado no lugar ou, com inodes, no destino, e
+entao a entrada no diretorio) eh gravado por ultimo.  So entao anexa a velhos
+os blocos antigos do arquivo, que o chamador devolve depois
+*/
+static int moveArquivo(struct superblock *sb, const struct movimento *m, int inodes,
+                       struct listaBlocos *velhos) {
+	struct inode *in = (struct inode*) malloc(sb->blksz);
+	struct nodeinfo *info = (struct nodeinfo*) malloc(sb->blksz);
+	void *bloco = malloc(sb->blksz);
+	struct listaBlocos antigos = {NULL, 0, 0};
+	struct fs_write_req req;
+	struct mapa origem = {0};
+	uint64_t *alvos = NULL, n, i, no;
+	const uint64_t *livre;
+	int ret = -1;
+
+	if (in == NULL || info == NULL || bloco == NULL) goto fim;
+	if (leBloco(sb, m->no, in) == -1 || leInfo(sb, in->meta, info) == -1) goto fim;
+	n = blocosArquivo(sb, info->size) - 1 + (inodes != 0);
+	if ((alvos = (uint64_t*) malloc(n * sizeof(uint64_t))) == NULL) goto fim;
+	for (i = 0; i < n; i++) {
+		alvos[i] = m->destino + i;
+		traca(sb, EV_ALOCA, 0, alvos[i]);
+	}
+
+	// os blocos antigos sao lidos antes que o primeiro inode seja regravado
+	if (abreMapa(sb, &origem, m->no, in) == -1) goto fim;
+	if (inodes && anexaBloco(&antigos, m->no) == -1) goto fim;
+	if (coletaCadeia(sb, in, 1, &antigos) == -1) goto fim;
+
+	no = inodes ? alvos[0] : m->no;
+	livre = alvos + (inodes != 0);
+	req.fname = info->name;
+	req.buf = "";
+	req.cnt = info->size;
+	if (gravaArquivo(sb, no, m->pai, &req, &livre, bloco, in, &origem) == -1) goto fim;
+	if (inodes && trocaEntrada(sb, m->pai, m->no, no, info->name) == -1) goto fim;
+	for (i = 0; i < antigos.n; i++) {
+		if (anexaBloco(velhos, antigos.v[i]) == -1) goto fim;
+	}
+	ret = 0;
+
+fim:
+	fechaMapa(&origem);
+	free(antigos.v);
+	free(alvos);
+	free(in);
+	free(info);
+	free(bloco);
+	return ret;
+}
+
+/*
+Mede a fragmentacao dos arquivos de sb (veja fs.h)
+*/
+int fs_fragmentation(struct superblock *sb, struct fs_fragmentation *out) {
+	TRAVA(sb);
+	//verifica o descritor do sistema de arquivos
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+	struct desfragmentacao f;
+	memset(&f, 0, sizeof(f));
+	int ret = percorreArquivos(sb, medeArquivo, &f);
+	if (ret == 0) *out = f.medida;
+	free(f.blocos.v);
+	return ret;
+}
+
+/*
+Move os arquivos fragmentados de sb para trechos livres, ate cerca de budget
+blocos (veja fs.h)
+*/
+int64_t fs_defrag(struct superblock *sb, uint64_t budget, int flags) {
+	MEDE(sb, FS_OP_DEFRAG);
+	GRAVA(NULL, budget, flags);
+	TRAVA(sb);
+	//verifica o descritor do sistema de arquivos
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+	if (flags & ~FS_DEFRAG_INODES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct desfragmentacao f;
+	struct listaBlocos velhos = {NULL, 0, 0};
+	int64_t ret = -1;
+	size_t k = 0;
+	int erro = 0;
+
+	memset(&f, 0, sizeof(f));
+	f.flags = flags;
+	f.orcamento = budget;
+	f.cursor = 1;
+	f.falha = UINT64_MAX;
+
+	//escolhe os arquivos e os trechos de uma vez, e so entao tira os
+	//trechos da lista de blocos livres
+	if (percorreArquivos(sb, planejaArquivo, &f) == -1) goto fim;
+	if (f.nmov != 0 && retiraLivres(sb, f.reservados, f.nreservados) == -1) goto fim;
+	for (k = 0; k < f.nmov; k++) {
+		if (moveArquivo(sb, &f.mov[k], flags & FS_DEFRAG_INODES, &velhos) == -1) break;
+	}
+	//os arquivos ja trocados devolvem seus blocos antigos mesmo se outro falhou
+	if (k < f.nmov) erro = errno;
+	if (devolveBlocos(sb, velhos.v, velhos.n) == -1) goto fim;
+	if (erro) {
+		errno = erro;
+		goto fim;
+	}
+	ret = f.movidos;
+
+fim:
+	free(velhos.v);
+	free(f.blocos.v);
+	free(f.livres);
+	free(f.reservados);
+	free(f.mov);
+	return ret;
+}
+
+/* Exportacao compacta (veja fs_compact_export).  Os blocos em uso recebem
+ * numeros novos na ordem em que sao visitados, a partir do fim do diario, e
+ * o bloco antigo de cada numero novo fica em velhos (com seu tipo em tipos).
+ * A renumeracao eh procurada numa copia ordenada pelos blocos antigos, de
+ * modo que a memoria usada depende so dos blocos em uso. */
+
+/* nodeinfo de diretorio, cujas dicas em reserved[] sao renumeradas */
+#define INFO_DIRETORIO 8
+
+/* Blocos copiados por vez por fs_compact_export. */
+#define LOTE_EXPORTA 64
 
-    struct inode *inode = (struct inode*) calloc(sb->blksz, 1);
-    struct nodeinfo *node_info = (struct nodeinfo*) calloc(sb->blksz, 1);
-    int nlinks, i;
-    size_t bufaux = 0;
-    char* leitor = (char*) malloc(sb->blksz);
+struct exportacao {
+	struct listaBlocos velhos;  /* bloco antigo de cada bloco novo */
+	struct listaBlocos tipos;   /* FS_BLOCK_* de cada um (mais INFO_DIRETORIO) */
+	struct leitura *mapa;       /* (antigo, novo), ordenado pelo antigo */
+	uint64_t inicio;            /* numero novo de velhos.v[0] */
+};
 
-    // Posiciona o ponteiro de arquivo na posição do inode do arquivo que será lido.
-    lseek(sb->fd, block * sb->blksz, SEEK_SET);
-    // Carrega o inode.
-    read(sb->fd, inode, sb->blksz);
+static int numeraBloco(struct exportacao *e, uint64_t bloco, int tipo) {
+	if (anexaBloco(&e->velhos, bloco) == -1) return -1;
+	return anexaBloco(&e->tipos, tipo);
+}
 
-    // Verifica se o arquivo não é um diretório.
-    if (inode->mode == IMDIR) {
-        errno = EISDIR;
-        goto cleanup;
-    }
+/*
+Numera os blocos abaixo do no in do mapa, de altura k, na ordem de
+coletaMapa.  area tem espaco para k blocos
+*/
+static int numeraMapa(struct superblock *sb, struct exportacao *e,
+                      const struct inode *in, uint64_t k, char *area) {
+	struct inode *filho = (struct inode*) area;
+	int64_t i;
+
+	for (i = sb->ops->procuraUsado(sb, in->links, 0); i >= 0;
+	     i = sb->ops->procuraUsado(sb, in->links, i + 1)) {
+		if (numeraBloco(e, in->links[i], k ? FS_BLOCK_INODE : FS_BLOCK_DATA) == -1)
+			return -1;
+		if (k == 0) continue;
+		if (leBloco(sb, in->links[i], filho) == -1) return -1;
+		if (numeraMapa(sb, e, filho, k - 1, area + sb->blksz) == -1) return -1;
+	}
+	return 0;
+}
 
-    // Posiciona o ponteiro de arquivo na posição do nodeinfo desse arquivo.
-    lseek(sb->fd, inode->meta * sb->blksz, SEEK_SET);
-    // Carrega o nodeinfo.
-    read(sb->fd, node_info, sb->blksz);
-    // Quantos links existem em um inode completo.
-    nlinks = (sb->blksz - 4 * sizeof(uint64_t)) / sizeof(uint64_t);
-
-    // Enquanto houver mais inodes e não ultrapassar o tamanho do buffer.
-    while (inode->next > 0 && bufaux < bufsz) {
-        // Para todos os links do inode, se não ultrapassar o tamanho do buffer.
-        for (i = 0; i < nlinks && bufaux < bufsz; i++) {
-            // Posiciona no link[i].
-            lseek(sb->fd, inode->links[i] * sb->blksz, SEEK_SET);
-            // Lê o link[i] em uma variável auxiliar chamada "leitor".
-            ssize_t bytes_read = read(sb->fd, leitor, sb->blksz);
-            // Concatena "leitor" com "buf".
-            strncat(buf, leitor, bufsz - bufaux);
-            // Atualiza a quantidade de bytes lidos.
-            bufaux += bytes_read;
-        }
-        // Posiciona e lê o próximo inode.
-        lseek(sb->fd, inode->next * sb->blksz, SEEK_SET);
-        read(sb->fd, inode, sb->blksz);
-    }
+/*
+Numera os blocos do arquivo cujo primeiro inode no esta lido em in (in eh
+usado como area de trabalho): o primeiro inode, o nodeinfo e os blocos do
+mapa ou da cadeia, na ordem de coletaCadeia
+*/
+static int numeraArquivo(struct superblock *sb, struct exportacao *e, uint64_t no,
+                         struct inode *in) {
+	int64_t i, altura;
+
+	if (numeraBloco(e, no, FS_BLOCK_INODE) == -1 ||
+	    numeraBloco(e, in->meta, FS_BLOCK_NODEINFO) == -1) return -1;
+	if ((altura = alturaInode(in)) != 0) {
+		if (altura == -1) return -1;
+		char *area = (char*) malloc(altura * sb->blksz);
+		int ret = area != NULL ? numeraMapa(sb, e, in, altura, area) : -1;
+		free(area);
+		return ret;
+	}
+	for (;;) {
+		for (i = sb->ops->procuraUsado(sb, in->links, 0); i >= 0;
+		     i = sb->ops->procuraUsado(sb, in->links, i + 1)) {
+			if (numeraBloco(e, in->links[i], FS_BLOCK_DATA) == -1) return -1;
+		}
+		if (in->next == 0) return 0;
+		if (numeraBloco(e, in->next, FS_BLOCK_INODE) == -1) return -1;
+		if (leBloco(sb, in->next, in) == -1) return -1;
+	}
+}
 
-    // No último inode.
-    int nlinks_ult_node = ((node_info->size % sb->blksz) / sizeof(uint64_t)) - 4;
-    for (i = 0; i < nlinks_ult_node && bufaux < bufsz; i++) {
-        size_t read_size;
-        // Se o tamanho do buffer for múltiplo de sb->blksz.
-        if (bufsz % sb->blksz == 0) {
-            read_size = sb->blksz;
-        } else { // Se o tamanho do buffer não for múltiplo de sb->blksz.
-            // Calcula o módulo entre o tamanho do buffer e sb->blksz.
-            size_t mod = bufsz % sb->blksz;
-            read_size = mod;
-        }
+/*
+Numera os blocos em uso de sb: cada diretorio (primeiro inode, nodeinfo e os
+inodes da cadeia ou os nos da arvore) seguido dos seus arquivos, com os
+diretorios em profundidade a partir da raiz, como em percorreArquivos
+*/
+static int numeraArvore(struct superblock *sb, struct exportacao *e) {
+	struct listaBlocos pilha = {NULL, 0, 0}, entradas = {NULL, 0, 0};
+	struct listaBlocos nos = {NULL, 0, 0}, subdirs = {NULL, 0, 0};
+	struct inode *in = (struct inode*) malloc(sb->blksz);
+	uint64_t dir, k;
+	int ret = -1;
+
+	if (in == NULL || anexaBloco(&pilha, sb->root) == -1) goto fim;
+	while (pilha.n > 0) {
+		dir = pilha.v[--pilha.n];
+		entradas.n = nos.n = subdirs.n = 0;
+		if (leBloco(sb, dir, in) == -1) goto fim;
+		if (numeraBloco(e, dir, FS_BLOCK_INODE) == -1 ||
+		    numeraBloco(e, in->meta, FS_BLOCK_NODEINFO | INFO_DIRETORIO) == -1) goto fim;
+		if (entradasDiretorio(sb, in, &entradas, &nos) == -1) goto fim;
+		for (k = 0; k < nos.n; k++) {
+			if (numeraBloco(e, nos.v[k], FS_BLOCK_INODE) == -1) goto fim;
+		}
+		for (k = 0; k < entradas.n; k++) {
+			if (leBloco(sb, entradas.v[k], in) == -1) goto fim;
+			if (in->mode & IMDIR) {
+				if (anexaBloco(&subdirs, entradas.v[k]) == -1) goto fim;
+			} else if (numeraArquivo(sb, e, entradas.v[k], in) == -1) {
+				goto fim;
+			}
+		}
+		// os subdiretorios saem da pilha na ordem em que foram listados
+		for (k = subdirs.n; k-- > 0;) {
+			if (anexaBloco(&pilha, subdirs.v[k]) == -1) goto fim;
+		}
+	}
+	ret = 0;
 
-        // Posiciona no link[i].
-        lseek(sb->fd, inode->links[i] * sb->blksz, SEEK_SET);
-        // Lê o link[i] em uma variável auxiliar chamada "leitor".
-        ssize_t bytes_read = read(sb->fd, leitor, read_size);
-        // Concatena "leitor" com "buf".
-        strncat(buf, leitor, bufsz - bufaux);
-        // Atualiza a quantidade de bytes lidos.
-        bufaux += bytes_read;
-    }
+fim:
+	free(pilha.v);
+	free(entradas.v);
+	free(nos.v);
+	free(subdirs.v);
+	free(in);
+	return ret;
+}
 
-    free(inode);
-    free(node_info);
-    free(leitor);
-    return bufaux;
+/*
+Monta e->mapa a partir de e->velhos.  Um bloco visitado duas vezes (ou fora
+da imagem) eh uma imagem corrompida: falha com EIO
+*/
+static int ordenaExportacao(const struct superblock *sb, struct exportacao *e) {
+	uint64_t i, n = e->velhos.n;
+
+	e->mapa = (struct leitura*) malloc(n * sizeof(struct leitura));
+	if (e->mapa == NULL) return -1;
+	for (i = 0; i < n; i++) {
+		e->mapa[i].bloco = e->velhos.v[i];
+		e->mapa[i].i = e->inicio + i;
+	}
+	qsort(e->mapa, n, sizeof(struct leitura), comparaLeituras);
+	for (i = 0; i < n; i++) {
+		if (e->mapa[i].bloco == 0 || e->mapa[i].bloco >= sb->blks ||
+		    (i > 0 && e->mapa[i].bloco == e->mapa[i - 1].bloco)) {
+			errno = EIO;
+			return -1;
+		}
+	}
+	return 0;
+}
 
-cleanup:
-    // Em caso de erro, libera a memória alocada.
-    free(inode);
-    free(node_info);
-    free(leitor);
-    return -1;
+/*
+Troca o bloco antigo *p (se nao for zero) pelo seu numero novo.  Sem numero
+novo, com dica *p vira zero e sem ela falha com EIO
+*/
+static int renumera(const struct exportacao *e, uint64_t *p, int dica) {
+	struct leitura chave = {*p, 0}, *r;
+
+	if (*p == 0) return 0;
+	r = (struct leitura*) bsearch(&chave, e->mapa, e->velhos.n, sizeof(struct leitura),
+	                              comparaLeituras);
+	if (r != NULL) {
+		*p = r->i;
+		return 0;
+	}
+	if (dica) {
+		*p = 0;
+		return 0;
+	}
+	errno = EIO;
+	return -1;
 }
 
 /*
-Remove o arquivo chamado fname do sistema de arquivos apontado por sb
+Renumera os apontadores do bloco b, de tipo tipo (veja struct exportacao)
 */
-int fs_unlink(struct superblock *sb, const char *fname) {
-    // Verifica se o descritor do sistema de arquivos é válido.
-    if (sb->magic != 0xdcc605f5) {
-        errno = EBADF; // Define o erro como "descritor de arquivo inválido".
-        return -1;
-    }
+static int renumeraBloco(const struct superblock *sb, const struct exportacao *e,
+                         void *b, int tipo) {
+	struct inode *in = (struct inode*) b;
+	struct dirnode *d = (struct dirnode*) b;
+	struct nodeinfo *info = (struct nodeinfo*) b;
+	uint64_t i;
+
+	if (tipo == (FS_BLOCK_NODEINFO | INFO_DIRETORIO)) {
+		if (renumera(e, &info->reserved[DIR_CAUDA], 1) == -1) return -1;
+		for (i = 0; i < NDICAS; i++) {
+			if (renumera(e, &info->reserved[DIR_DICAS + i], 1) == -1) return -1;
+		}
+		return 0;
+	}
+	if (tipo != FS_BLOCK_INODE) return 0;
+	if ((in->mode & (IMCHILD | IMBTREE)) == (IMCHILD | IMBTREE)) {
+		if (d->count > chavesPorNo(sb)) {
+			errno = EIO;
+			return -1;
+		}
+		if (renumera(e, &d->parent, 0) == -1) return -1;
+		for (i = 0; i < d->count; i++) {
+			if (renumera(e, &d->keys[i].node, 0) == -1 ||
+			    renumera(e, &d->keys[i].inode, 0) == -1) return -1;
+		}
+		return 0;
+	}
+	// com IMMAP, next do primeiro inode eh a altura do mapa (e zero nos nos)
+	if (renumera(e, &in->parent, 0) == -1 || renumera(e, &in->meta, 0) == -1 ||
+	    (!(in->mode & IMMAP) && renumera(e, &in->next, 0) == -1)) return -1;
+	for (i = 0; i < sb->nlinks; i++) {
+		if (renumera(e, &in->links[i], 0) == -1) return -1;
+	}
+	return 0;
+}
 
-    // Verifica se o nome do arquivo (caminho) é maior do que o permitido.
-    if (strlen(fname) > ((sb->blksz) - (8 * sizeof(uint64_t)))) {
-        errno = ENAMETOOLONG; // Define o erro como "nome de arquivo muito longo".
-        return -1;
-    }
+/*
+Escreve os n blocos de buf em fd a partir do bloco bloco
+*/
+static int escreveExportacao(const struct superblock *sb, int fd, const char *buf,
+                             uint64_t n, uint64_t bloco) {
+	ssize_t r = pwrite(fd, buf, n * sb->blksz, (off_t) (bloco * sb->blksz));
+	if (r == (ssize_t) (n * sb->blksz)) return 0;
+	if (r >= 0) errno = EIO;
+	return -1;
+}
 
-    // Verifica se o arquivo existe no sistema de arquivos.
-    uint64_t block = encontraBloco(sb, fname, 0);
-    if (block == 0) {
-        errno = ENOENT; // Define o erro como "arquivo não encontrado".
-        return -1;
-    }
+/*
+Cria (ou trunca) path para a exportacao de sb, com uma trava exclusiva.
+Falha com EBUSY se path estiver aberto por outro processo, e com EINVAL se
+for a propria imagem de sb
+*/
+static int criaExportacao(const struct superblock *sb, const char *path) {
+	struct stat novo, atual;
+	int fd = open(path, O_RDWR | O_CREAT, 0666);
 
-    int aux;
-    int i, index;
-    struct inode *inode_atual = (struct inode*) calloc(sb->blksz, 1);
-    struct inode *prox_inode = (struct inode*) calloc(sb->blksz, 1);
-    struct inode *parent_dir = (struct inode*) calloc(sb->blksz, 1);
-    struct nodeinfo *parent_inode = (struct nodeinfo*) calloc(sb->blksz, 1);
-    struct nodeinfo *node_info = (struct nodeinfo*) calloc(sb->blksz, 1);
+	if (fd == -1) return -1;
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		close(fd);
+		errno = EBUSY;
+		return -1;
+	}
+	if (sb->fd != -1 && fstat(fd, &novo) == 0 && fstat(sb->fd, &atual) == 0 &&
+	    novo.st_dev == atual.st_dev && novo.st_ino == atual.st_ino) {
+		fechaDescritor(fd, 1);
+		errno = EINVAL;
+		return -1;
+	}
+	if (ftruncate(fd, 0) == -1) {
+		int erro = errno;
+		fechaDescritor(fd, 1);
+		errno = erro;
+		return -1;
+	}
+	return fd;
+}
 
-    // Posiciona o ponteiro na posição do primeiro inode para leitura.
-    lseek(sb->fd, block * sb->blksz, SEEK_SET);
-    aux = read(sb->fd, inode_atual, sb->blksz);
+/*
+Grava em path uma copia de sb so com os blocos em uso, renumerados (veja
+fs.h)
+*/
+int fs_compact_export(struct superblock *sb, const char *path) {
+	TRAVA(sb);
+	//verifica o descritor do sistema de arquivos
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
 
-    // Verifica se é um diretório.
-    if (inode_atual->mode == IMDIR) {
-        errno = EISDIR; // Define o erro como "é um diretório".
-        goto cleanup;
-    }
+	struct exportacao e;
+	struct superblock novo;
+	char *buf = (char*) malloc(LOTE_EXPORTA * sb->blksz);
+	char *v[LOTE_EXPORTA];
+	int tipos[LOTE_EXPORTA];
+	uint64_t lidos[LOTE_EXPORTA];
+	uint64_t diario = sb->journal ? sb->journalblks : 0;
+	uint64_t i, j, n, usados, total;
+	int fd = -1, ret = -1, erro;
+
+	memset(&e, 0, sizeof(e));
+	e.inicio = 1 + diario;
+	if (buf == NULL || numeraArvore(sb, &e) == -1 || ordenaExportacao(sb, &e) == -1)
+		goto fim;
+	usados = e.inicio + e.velhos.n;
+	total = usados > MIN_BLOCK_COUNT + diario ? usados : MIN_BLOCK_COUNT + diario;
+	if ((fd = criaExportacao(sb, path)) == -1) goto fim;
+
+	//os blocos em uso, em lotes lidos de uma vez e gravados em sequencia
+	for (i = 0; i < e.velhos.n; i += n) {
+		n = e.velhos.n - i < LOTE_EXPORTA ? e.velhos.n - i : LOTE_EXPORTA;
+		for (j = 0; j < n; j++) {
+			v[j] = buf + j * sb->blksz;
+			lidos[j] = e.velhos.v[i + j];
+			tipos[j] = e.tipos.v[i + j] & ~INFO_DIRETORIO;
+		}
+		if (leBlocos(sb, lidos, n, v, tipos) == -1) goto fim;
+		for (j = 0; j < n; j++) {
+			if (renumeraBloco(sb, &e, v[j], e.tipos.v[i + j]) == -1) goto fim;
+		}
+		if (escreveExportacao(sb, fd, buf, n, e.inicio + i) == -1) goto fim;
+	}
+
+	//o diario, vazio, logo depois do superbloco
+	if (diario != 0) {
+		struct registro *cabecalho = (struct registro*) buf;
+		memset(buf, 0, sb->blksz);
+		cabecalho->magic = MAGIC_DIARIO;
+		cabecalho->tipo = DIARIO_CABECALHO;
+		cabecalho->seq = 1;
+		if (escreveExportacao(sb, fd, buf, 1, 1) == -1) goto fim;
+		memset(buf, 0, LOTE_EXPORTA * sb->blksz);
+		for (i = 1; i < diario; i += n) {
+			n = diario - i < LOTE_EXPORTA ? diario - i : LOTE_EXPORTA;
+			if (escreveExportacao(sb, fd, buf, n, 1 + i) == -1) goto fim;
+		}
+	}
 
-    // Lê o inode do diretório pai.
-    lseek(sb->fd, inode_atual->parent * sb->blksz, SEEK_SET);
-    aux = read(sb->fd, parent_dir, sb->blksz);
+	//os blocos que sobram ate o tamanho minimo, na lista de blocos livres
+	memset(buf, 0, sb->blksz);
+	for (i = usados; i < total; i++) {
+		((struct freepage*) buf)->next = i + 1 < total ? i + 1 : 0;
+		if (escreveExportacao(sb, fd, buf, 1, i) == -1) goto fim;
+	}
 
-    // Lê o nodeinfo do diretório pai e atualiza-o.
-    lseek(sb->fd, parent_dir->meta * sb->blksz, SEEK_SET);
-    aux = read(sb->fd, parent_inode, sb->blksz);
-    parent_inode->size--;
+	//o superbloco por ultimo (o resto do bloco 0 fica zerado)
+	memset(&novo, 0, sizeof(novo));
+	novo.magic = 0xdcc605f5;
+	novo.blks = total;
+	novo.blksz = sb->blksz;
+	novo.freeblks = total - usados;
+	novo.freelist = total > usados ? usados : 0;
+	novo.root = e.inicio;
+	novo.version = FS_VERSION;
+	novo.journal = diario ? 1 : 0;
+	novo.journalblks = diario;
+	memset(buf, 0, sb->blksz);
+	memcpy(buf, &novo, SB_DISCO);
+	if (escreveExportacao(sb, fd, buf, 1, 0) == -1 || fdatasync(fd) == -1) goto fim;
+	ret = 0;
+
+fim:
+	erro = errno;
+	if (fd != -1 && fechaDescritor(fd, 1) == -1 && ret == 0) {
+		erro = errno;
+		ret = -1;
+	}
+	free(e.velhos.v);
+	free(e.tipos.v);
+	free(e.mapa);
+	free(buf);
+	errno = erro;
+	return ret;
+}
 
-    lseek(sb->fd, parent_dir->meta * sb->blksz, SEEK_SET);
-    aux = write(sb->fd, parent_inode, sb->blksz);
-
-    uint64_t node_atual;
-    struct inode *aux_inode = (struct inode*) calloc(sb->blksz, 1);
-
-    // Procura a referência do arquivo no diretório pai e remove-a.
-    node_atual = inode_atual->parent;
-    do {
-        lseek(sb->fd, node_atual * sb->blksz, SEEK_SET);
-        aux = read(sb->fd, aux_inode, sb->blksz);
-        for (i = 0; i < NLINKS; i++) {
-            if (aux_inode->links[i] == block) {
-                aux_inode->links[i] = 0;
-                lseek(sb->fd, node_atual * sb->blksz, SEEK_SET);
-                aux = write(sb->fd, aux_inode, sb->blksz);
-                break;
-            }
-        }
-        node_atual = aux_inode->next;
-    } while (node_atual != 0);
+/*
+Diz se o estado compartilhado de um superbloco sem outras threads deixou de
+ser necessario
+*/
+static int estadoOcioso(const struct fs_background *bg) {
+	return !bg->temThread && !bg->temEscritor && bg->diario == NULL &&
+	       bg->politica == FS_DURABLE_NONE;
+}
 
-    free(aux_inode);
-    free(parent_dir);
-    free(parent_inode);
+/*
+Laco da thread em segundo plano: libera os orfaos em lotes, cada um numa
+operacao propria (uma transacao, com o diario), e dorme enquanto nao houver
+orfaos
+*/
+static void *recuperador(void *arg) {
+	struct superblock *sb = (struct superblock*) arg;
+	struct fs_background *bg = sb->bg;
+	int erro = 0;
+
+	pthread_mutex_lock(&bg->trava);
+	while (!bg->parar) {
+		if (sb->orphans == 0 || erro) {
+			//sem orfaos (ou com erro de E/S): espera o proximo
+			erro = 0;
+			pthread_cond_wait(&bg->acorda, &bg->trava);
+			continue;
+		}
+		pthread_mutex_unlock(&bg->trava);
+		{
+			TRAVA(sb);
+			erro = recuperaOrfaos(sb, LOTE_RECUPERACAO) == -1;
+		}
+		sched_yield();
+		pthread_mutex_lock(&bg->trava);
+	}
+	pthread_mutex_unlock(&bg->trava);
+	return NULL;
+}
 
-    // Lê o nodeinfo para obter o tamanho do arquivo.
-    lseek(sb->fd, inode_atual->meta * sb->blksz, SEEK_SET);
-    aux = read(sb->fd, node_info, sb->blksz);
+/*
+Escolhe como os blocos de arquivos grandes sao liberados (veja fs.h),
+iniciando ou parando a thread em segundo plano
+*/
+int fs_set_reclaim(struct superblock *sb, int mode) {
+	//verifica o descritor do sistema de arquivos
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+	if (mode != FS_RECLAIM_SYNC && mode != FS_RECLAIM_DEFERRED &&
+	    mode != FS_RECLAIM_BACKGROUND) {
+		errno = EINVAL;
+		return -1;
+	}
 
-    // Libera o nodeinfo desse arquivo.
-    fs_put_block(sb, inode_atual->meta);
+	struct fs_background *bg = sb->bg;
+	if (mode != FS_RECLAIM_BACKGROUND && bg != NULL && bg->temThread) {
+		//para a thread; sem o diario, so depois o superbloco deixa de usar
+		//a trava
+		pthread_mutex_lock(&bg->trava);
+		bg->parar = 1;
+		pthread_cond_signal(&bg->acorda);
+		pthread_mutex_unlock(&bg->trava);
+		pthread_join(bg->thread, NULL);
+		bg->temThread = bg->parar = 0;
+		if (estadoOcioso(bg)) liberaEstado(sb);
+	}
 
-    // Libera os links utilizados.
-    for (i = 0; i < NLINKS; i++) {
-        if (inode_atual->links[i] > 0) {
-            fs_put_block(sb, inode_atual->links[i]);
-        }
-    }
+	if (mode == FS_RECLAIM_BACKGROUND && (bg == NULL || !bg->temThread)) {
+		if ((bg = criaEstado(sb)) == NULL) return -1;
+		if ((errno = pthread_create(&bg->thread, NULL, recuperador, sb)) != 0) {
+			if (estadoOcioso(bg)) liberaEstado(sb);
+			return -1;
+		}
+		bg->temThread = 1;
+	}
 
-    // Se houver um child.
-    while (inode_atual->next > 0) {
-        // Salva o índice do próximo inode.
-        index = inode_atual->next;
-        // Lê o próximo inode.
-        lseek(sb->fd, inode_atual->next * sb->blksz, SEEK_SET);
-        aux = read(sb->fd, inode_atual, sb->blksz);
-
-        // Libera os links utilizados.
-        for (i = 0; i < NLINKS; i++) {
-            if (inode_atual->links[i] > 0) {
-                fs_put_block(sb, inode_atual->links[i]);
-            }
-        }
+	sb->reclaim = mode;
+	return 0;
+}
 
-        // Libera o inode.
-        fs_put_block(sb, index);
-    }
+/*
+Copia os contadores de sb para out (veja fs.h).  Sao lidos um a um, pois as
+threads em segundo plano podem estar contando
+*/
+int fs_get_stats(struct superblock *sb, struct fs_stats *out) {
+	const uint64_t *c = (const uint64_t*) &sb->stats;
+	uint64_t *o = (uint64_t*) out;
+	for (size_t i = 0; i < sizeof(struct fs_stats) / sizeof(uint64_t); i++)
+		o[i] = __atomic_load_n(&c[i], __ATOMIC_RELAXED);
+	return 0;
+}
 
-    // Libera o inode deste arquivo.
-    fs_put_block(sb, block);
+/*
+Zera os contadores de sb
+*/
+int fs_reset_stats(struct superblock *sb) {
+	uint64_t *c = (uint64_t*) &sb->stats;
+	for (size_t i = 0; i < sizeof(struct fs_stats) / sizeof(uint64_t); i++)
+		__atomic_store_n(&c[i], 0, __ATOMIC_RELAXED);
+	return 0;
+}
 
-    // Em caso de sucesso.
-    free(inode_atual);
-    free(prox_inode);
-    free(node_info);
-    return 0;
+/*
+Liga o traco de sb com um anel de ao menos nevents eventos (veja fs.h)
+*/
+int fs_trace_start(struct superblock *sb, uint64_t nevents) {
+	//verifica o descritor do sistema de arquivos
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+	if (nevents == 0 || nevents > ((uint64_t)1 << 40)) {
+		errno = EINVAL;
+		return -1;
+	}
+	uint64_t n = 1;
+	while (n < nevents) n *= 2;
+	struct fs_trace *t = (struct fs_trace*) calloc(1, sizeof(struct fs_trace) +
+	                                               n * sizeof(struct evento));
+	if (t == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	t->mascara = n - 1;
+	TRAVA(sb);
+	free(sb->trace);
+	sb->trace = t;
+	return 0;
+}
 
-cleanup:
-    // Em caso de erro, libera a memória alocada.
-    free(inode_atual);
-    free(prox_inode);
-    free(parent_dir);
-    free(parent_inode);
-    free(node_info);
-    return -1;
+/*
+Desliga o traco de sb
+*/
+int fs_trace_stop(struct superblock *sb) {
+	TRAVA(sb);
+	free(sb->trace);
+	sb->trace = NULL;
+	return 0;
+}
+
+static const char *nomesOp[FS_NOPS] = {
+	"fs_format", "fs_open", "fs_get_block", "fs_put_block", "fs_write_file",
+	"fs_write_files", "fs_read_file", "fs_unlink", "fs_mkdir", "fs_rmdir",
+	"fs_rmdir_recursive", "fs_reclaim", "fs_opendir", "fs_readdir",
+	"fs_list_dir", "fs_stat", "fs_stat_many", "fs_txn_commit", "fs_txn_abort",
+	"fs_defrag"
+};
+
+static const char *nomesBloco[FS_NBLOCKS] = {
+	"super", "inode", "nodeinfo", "freepage", "data"
+};
+
+/*
+Copia o evento de posicao i do anel t para e, se ele estiver completo e ainda
+nao tiver sido sobrescrito
+*/
+static int copiaEvento(const struct fs_trace *t, uint64_t i, struct evento *e) {
+	const struct evento *v = &t->v[i & t->mascara];
+	if (__atomic_load_n(&v->seq, __ATOMIC_ACQUIRE) != i + 1) return 0;
+	*e = *v;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&v->seq, __ATOMIC_RELAXED) == i + 1;
+}
+
+/*
+Grava os eventos do anel de sb em path como JSON do Chrome trace (veja fs.h)
+*/
+int64_t fs_trace_dump(struct superblock *sb, const char *path) {
+	struct fs_trace *t = sb->trace;
+	if (t == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) return -1;
+
+	uint64_t fim = __atomic_load_n(&t->cabeca, __ATOMIC_ACQUIRE), i, base = 0;
+	uint64_t inicio = fim > t->mascara + 1 ? fim - t->mascara - 1 : 0;
+	int64_t n = 0;
+	int pid = (int) getpid();
+	struct evento e;
+	fprintf(fp, "{\"traceEvents\":[");
+	for (i = inicio; i < fim; i++) {
+		if (!copiaEvento(t, i, &e)) continue;
+		if (n == 0) base = e.instante;
+		//tempos em microssegundos desde o primeiro evento
+		fprintf(fp, "%s\n{\"ts\":%.3f,\"pid\":%d,\"tid\":%u,", n ? "," : "",
+		        (double)(e.instante - base) / 1000, pid, e.thread);
+		switch (e.tipo) {
+		case EV_INICIO:
+		case EV_FIM:
+			fprintf(fp, "\"name\":\"%s\",\"cat\":\"call\",\"ph\":\"%s\"}",
+			        nomesOp[e.arg], e.tipo == EV_INICIO ? "B" : "E");
+			break;
+		case EV_LEITURA:
+		case EV_ESCRITA:
+			fprintf(fp, "\"name\":\"%s %s\",\"cat\":\"io\",\"ph\":\"i\",\"s\":\"t\","
+			        "\"args\":{\"block\":%" PRIu64,
+			        e.tipo == EV_LEITURA ? "read" : "write",
+			        nomesBloco[e.arg & ~EV_CACHE], e.bloco);
+			if (e.tipo == EV_LEITURA) fprintf(fp, ",\"cached\":%d", (e.arg & EV_CACHE) != 0);
+			fprintf(fp, "}}");
+			break;
+		default:
+			fprintf(fp, "\"name\":\"%s\",\"cat\":\"alloc\",\"ph\":\"i\",\"s\":\"t\","
+			        "\"args\":{\"block\":%" PRIu64 "}}",
+			        e.tipo == EV_ALOCA ? "alloc" : "free", e.bloco);
+		}
+		n++;
+	}
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	if (fclose(fp) == EOF) return -1;
+	return n;
+}
+
+/* Gravacao das chamadas publicas de um superbloco (veja fs_record_start). */
+struct fs_recorder {
+	FILE *arquivo;
+	uint64_t inicio; /* instante de fs_record_start */
+	pthread_mutex_t mutex; /* protege arquivo e erro */
+	int erro;
+};
+
+/* Bytes de um registro de m depois da struct fs_record, e seus caminhos. */
+static uint64_t tamanhoRegistro(const struct medida *m, uint32_t *n) {
+	uint64_t len = 0, i;
+	*n = 0;
+	if (m->lote != NULL && m->op == FS_OP_WRITE_FILES) {
+		const struct fs_write_req *v = (const struct fs_write_req*) m->lote;
+		for (i = 0; i < m->nlote; i++) len += strlen(v[i].fname) + 1;
+		*n = m->nlote;
+		return (len + 7) / 8 * 8 + m->nlote * sizeof(uint64_t);
+	}
+	if (m->lote != NULL) {
+		const char **v = (const char**) m->lote;
+		for (i = 0; i < m->nlote; i++) len += strlen(v[i]) + 1;
+		*n = m->nlote;
+	} else if (m->caminho != NULL) {
+		len = strlen(m->caminho) + 1;
+		*n = 1;
+	}
+	return (len + 7) / 8 * 8;
+}
+
+/* Copia o caminho c para p, retornando o byte seguinte. */
+static char *copiaCaminho(char *p, const char *c) {
+	size_t n = strlen(c) + 1;
+	memcpy(p, c, n);
+	return p + n;
+}
+
+/*
+Grava a chamada m, que acabou agora, no arquivo de g: monta o registro em um
+buffer e o escreve de uma vez sob o mutex
+*/
+static void gravaChamada(struct fs_recorder *g, const struct medida *m) {
+	uint64_t fim = agora(), i;
+	struct fs_record r;
+	char local[512], *buf = local, *p;
+	uint64_t len = tamanhoRegistro(m, &r.count);
+	if (sizeof(r) + len > sizeof(local) &&
+	    (buf = (char*) malloc(sizeof(r) + len)) == NULL) {
+		pthread_mutex_lock(&g->mutex);
+		g->erro = ENOMEM;
+		pthread_mutex_unlock(&g->mutex);
+		return;
+	}
+	r.start = m->inicio > g->inicio ? m->inicio - g->inicio : 0;
+	r.ns = fim - m->inicio;
+	r.arg[0] = m->arg[0];
+	r.arg[1] = m->arg[1];
+	r.thread = numeroThread();
+	r.op = m->op;
+	r.len = len;
+	memcpy(buf, &r, sizeof(r));
+	memset(buf + sizeof(r), 0, len);
+	p = buf + sizeof(r);
+	if (m->lote != NULL && m->op == FS_OP_WRITE_FILES) {
+		const struct fs_write_req *v = (const struct fs_write_req*) m->lote;
+		uint64_t *tam = (uint64_t*) (buf + sizeof(r) + len) - m->nlote;
+		for (i = 0; i < m->nlote; i++) {
+			p = copiaCaminho(p, v[i].fname);
+			tam[i] = v[i].cnt;
+		}
+	} else if (m->lote != NULL) {
+		for (i = 0; i < m->nlote; i++) p = copiaCaminho(p, ((const char**) m->lote)[i]);
+	} else if (m->caminho != NULL) {
+		copiaCaminho(p, m->caminho);
+	}
+
+	pthread_mutex_lock(&g->mutex);
+	if (fwrite(buf, sizeof(r) + len, 1, g->arquivo) != 1 && g->erro == 0)
+		g->erro = errno ? errno : EIO;
+	pthread_mutex_unlock(&g->mutex);
+	if (buf != local) free(buf);
+}
+
+/*
+Fecha o arquivo de g e libera g.  Retorna -1 se algum registro nao foi
+gravado
+*/
+static int fechaGravacao(struct fs_recorder *g) {
+	int erro = g->erro;
+	if (fclose(g->arquivo) == EOF && erro == 0) erro = errno ? errno : EIO;
+	pthread_mutex_destroy(&g->mutex);
+	free(g);
+	if (erro) {
+		errno = erro;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+Passa a gravar as chamadas publicas de sb em path (veja fs.h)
+*/
+int fs_record_start(struct superblock *sb, const char *path) {
+	//verifica o descritor do sistema de arquivos
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+	if (sb->recorder != NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+	struct fs_record_header h = { FS_RECORD_MAGIC, sb->blksz, sb->blks, sb->journalblks, 0 };
+	struct inode *raiz = (struct inode*) malloc(sb->blksz);
+	if (raiz == NULL) return -1;
+	{
+		TRAVA(sb);
+		if (leBloco(sb, sb->root, raiz) == -1) {
+			free(raiz);
+			return -1;
+		}
+	}
+	h.btree = (raiz->mode & IMBTREE) != 0;
+	free(raiz);
+
+	struct fs_recorder *g = (struct fs_recorder*) calloc(1, sizeof(struct fs_recorder));
+	if (g == NULL) return -1;
+	g->arquivo = fopen(path, "w");
+	if (g->arquivo == NULL) {
+		free(g);
+		return -1;
+	}
+	pthread_mutex_init(&g->mutex, NULL);
+	if (fwrite(&h, sizeof(h), 1, g->arquivo) != 1) {
+		int erro = errno;
+		fechaGravacao(g);
+		errno = erro;
+		return -1;
+	}
+	g->inicio = agora();
+	TRAVA(sb);
+	sb->recorder = g;
+	return 0;
 }
 
 /*
-Cria um diretorio no caminho dpath
+Para a gravacao de sb e fecha o arquivo
 */
-int fs_mkdir(struct superblock *sb, const char *dname) {
-    // Verifica o descritor do sistema de arquivos.
-    if (sb->magic != 0xdcc605f5) {
-        errno = EBADF;  // Definir o erro EBADF
-        return -1;
-    }
-
-    // Verifica se o nome do diretório é maior que o permitido.
-    if (strlen(dname) > sb->blksz - 8 * sizeof(uint64_t)) {
-        errno = ENAMETOOLONG;  // Definir o erro ENAMETOOLONG
-        return -1;
-    }
-
-    // Verifica se o diretório pai existe e se o nome do diretório não contém espaços em branco.
-    if (*dname != '/' || strchr(dname, ' ') != NULL) {
-        errno = ENOENT;  // Definir o erro ENOENT
-        return -1;
-    }
-
-    // Verifica se o diretório já existe.
-    uint64_t superbloco = encontraBloco(sb, dname, 0);
-    if (superbloco > 0) {
-        errno = EEXIST;  // Definir o erro EEXIST
-        return -1;
-    }
-
-    // Encontra o número do bloco do diretório pai.
-    uint64_t parent_node = encontraBloco(sb, dname, 1);
-    if (parent_node == 0) {
-        errno = ENOENT;  // Definir o erro ENOENT
-        return -1;
-    }
-
-    // Obtém blocos para o novo diretório e as informações do nó.
-    uint64_t dir_node = fs_get_block(sb);
-    uint64_t dir_node_info_number = fs_get_block(sb);
-    if (dir_node_info_number == (uint64_t)-1 || dir_node == (uint64_t)-1) {
-        return -1;  // Falha na obtenção de blocos
-    }
+int fs_record_stop(struct superblock *sb) {
+	TRAVA(sb);
+	struct fs_recorder *g = sb->recorder;
+	if (g == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	sb->recorder = NULL;
+	return fechaGravacao(g);
+}
 
-    // Aloca memória para os diretórios pai, novo diretório e informações do nó.
-    struct inode *parent_dir = (struct inode*) calloc(sb->blksz, 1);
-    struct inode *dir = (struct inode*) calloc(sb->blksz, 1);
-    struct nodeinfo *dir_node_info = (struct nodeinfo*) calloc(sb->blksz, 1);
-    struct nodeinfo *parent_node_info = (struct nodeinfo*) calloc(sb->blksz, 1);
+/* Par de um numero gravado (bloco ou fs_dir) e seu equivalente no replay. */
+struct par {
+	uint64_t gravado;
+	void *atual;
+};
+
+struct pares {
+	struct par *v;
+	uint64_t n, cap;
+};
+
+/* Estado de uma thread de fs_replay. */
+struct reprodutor {
+	struct superblock *sb;
+	const struct fs_record **v; /* registros, em ordem */
+	const uint32_t *trilha; /* thread de fs_replay de cada registro */
+	uint64_t n, indice;
+	double speedup;
+	uint64_t t0; /* inicio do replay */
+	uint64_t chamadas, falhas;
+	char *buf; /* conteudo dos arquivos escritos e lidos */
+	uint64_t capBuf;
+	struct pares dirs, blocos; /* fs_dir abertos e blocos pegos */
+	int transacao; /* ha um fs_txn_begin sem commit nem abort */
+};
+
+static struct par *procuraPar(struct pares *t, uint64_t gravado) {
+	for (uint64_t i = 0; i < t->n; i++)
+		if (t->v[i].gravado == gravado) return &t->v[i];
+	return NULL;
+}
 
-    // Configura as informações do novo diretório.
-    dir->mode = IMDIR;
-    dir->next = 0;
-    dir->parent = parent_node;
-    dir->meta = dir_node_info_number;
+static int anexaPar(struct pares *t, uint64_t gravado, void *atual) {
+	if (t->n == t->cap) {
+		uint64_t cap = t->cap ? 2 * t->cap : 16;
+		struct par *v = (struct par*) realloc(t->v, cap * sizeof(struct par));
+		if (v == NULL) return -1;
+		t->v = v;
+		t->cap = cap;
+	}
+	t->v[t->n].gravado = gravado;
+	t->v[t->n++].atual = atual;
+	return 0;
+}
 
-    // Extrai o nome do diretório do caminho fornecido.
-    char *auxc = strrchr(dname, '/');
-    strcpy(dir_node_info->name, auxc);
-    dir_node_info->size = 0;
+static void removePar(struct pares *t, struct par *p) {
+	*p = t->v[--t->n];
+}
 
-    // Lê o diretório pai do disco.
-    lseek(sb->fd, parent_node* sb->blksz, SEEK_SET);
-    read(sb->fd, parent_dir, sb->blksz);
+/* Garante n bytes (com o padrao dos arquivos) em r->buf. */
+static char *bufferReplay(struct reprodutor *r, uint64_t n) {
+	if (n > r->capBuf) {
+		char *b = (char*) realloc(r->buf, n);
+		if (b == NULL) return NULL;
+		for (uint64_t i = r->capBuf; i < n; i++) b[i] = 'a' + i % 26;
+		r->buf = b;
+		r->capBuf = n;
+	}
+	return r->buf ? r->buf : (char*) "";
+}
 
-    // Linka o novo diretório ao diretório pai.
-    linkaBlocos(sb, parent_dir, parent_node, dir_node);
+/*
+Refaz a chamada gravada em e.  Retorna -1 se ela falhou
+*/
+static int refazChamada(struct reprodutor *r, const struct fs_record *e) {
+	struct superblock *sb = r->sb;
+	const char *c = (const char*) (e + 1);
+	const char **caminhos = NULL;
+	struct par *p;
+	uint64_t i, b;
+	char *buf;
+	int ret = -1;
+
+	if ((e->op == FS_OP_WRITE_FILES || e->op == FS_OP_STAT_MANY) && e->count != 0) {
+		caminhos = (const char**) malloc(e->count * sizeof(char*));
+		if (caminhos == NULL) return -1;
+		for (i = 0; i < e->count; i++, c += strlen(c) + 1) caminhos[i] = c;
+	}
+	switch (e->op) {
+	case FS_OP_GET_BLOCK:
+		b = fs_get_block(sb);
+		if (b != 0 && b != (uint64_t) -1)
+			ret = anexaPar(&r->blocos, e->arg[0], (void*) (uintptr_t) b);
+		break;
+	case FS_OP_PUT_BLOCK:
+		if ((p = procuraPar(&r->blocos, e->arg[0])) == NULL) break;
+		b = (uintptr_t) p->atual;
+		removePar(&r->blocos, p);
+		ret = fs_put_block(sb, b);
+		break;
+	case FS_OP_WRITE_FILE:
+		if ((buf = bufferReplay(r, e->arg[0])) != NULL)
+			ret = fs_write_file(sb, c, buf, e->arg[0]);
+		break;
+	case FS_OP_WRITE_FILES: {
+		const uint64_t *tam = (const uint64_t*) ((const char*) (e + 1) + e->len) - e->count;
+		struct fs_write_req *v = (struct fs_write_req*) malloc((e->count + 1) * sizeof(*v));
+		for (i = 0, b = 0; i < e->count; i++) b = tam[i] > b ? tam[i] : b;
+		if (v != NULL && (buf = bufferReplay(r, b)) != NULL) {
+			for (i = 0; i < e->count; i++) {
+				v[i].fname = caminhos[i];
+				v[i].buf = buf;
+				v[i].cnt = tam[i];
+			}
+			ret = fs_write_files(sb, v, e->count);
+		}
+		free(v);
+		break;
+	}
+	case FS_OP_READ_FILE:
+		if ((buf = bufferReplay(r, e->arg[0])) != NULL)
+			ret = fs_read_file_at(sb, c, buf, e->arg[0], e->arg[1]) < 0 ? -1 : 0;
+		break;
+	case FS_OP_UNLINK:
+		ret = fs_unlink(sb, c);
+		break;
+	case FS_OP_MKDIR:
+		ret = fs_mkdir(sb, c);
+		break;
+	case FS_OP_RMDIR:
+		ret = fs_rmdir(sb, c);
+		break;
+	case FS_OP_RMDIR_RECURSIVE:
+		ret = fs_rmdir_recursive(sb, c);
+		break;
+	case FS_OP_RECLAIM:
+		ret = fs_reclaim(sb, e->arg[0]) < 0 ? -1 : 0;
+		break;
+	case FS_OP_DEFRAG:
+		ret = fs_defrag(sb, e->arg[0], (int) e->arg[1]) < 0 ? -1 : 0;
+		break;
+	case FS_OP_OPENDIR: {
+		struct fs_dir *d = fs_opendir(sb, c);
+		if (d == NULL) break;
+		//o mesmo numero pode ter sido de um fs_dir ja fechado
+		if ((p = procuraPar(&r->dirs, e->arg[0])) != NULL) {
+			fs_closedir((struct fs_dir*) p->atual);
+			removePar(&r->dirs, p);
+		}
+		ret = anexaPar(&r->dirs, e->arg[0], d);
+		if (ret == -1) fs_closedir(d);
+		break;
+	}
+	case FS_OP_READDIR:
+		if ((p = procuraPar(&r->dirs, e->arg[0])) == NULL) break;
+		errno = 0;
+		ret = fs_readdir((struct fs_dir*) p->atual) == NULL && errno ? -1 : 0;
+		break;
+	case FS_RECORD_CLOSEDIR:
+		if ((p = procuraPar(&r->dirs, e->arg[0])) == NULL) break;
+		ret = fs_closedir((struct fs_dir*) p->atual);
+		removePar(&r->dirs, p);
+		break;
+	case FS_OP_LIST_DIR:
+		buf = fs_list_dir(sb, c);
+		ret = buf == NULL ? -1 : 0;
+		free(buf);
+		break;
+	case FS_OP_STAT: {
+		struct fs_stat st;
+		ret = fs_stat(sb, c, &st);
+		break;
+	}
+	case FS_OP_STAT_MANY: {
+		struct fs_stat *st = (struct fs_stat*) calloc(e->count + 1, sizeof(struct fs_stat));
+		if (st != NULL) ret = fs_stat_many(sb, caminhos, e->count, st) < 0 ? -1 : 0;
+		free(st);
+		break;
+	}
+	case FS_RECORD_TXN_BEGIN:
+		ret = fs_txn_begin(sb);
+		if (ret == 0) r->transacao = 1;
+		break;
+	case FS_OP_TXN_COMMIT:
+	case FS_OP_TXN_ABORT:
+		ret = e->op == FS_OP_TXN_COMMIT ? fs_txn_commit(sb) : fs_txn_abort(sb);
+		if (ret == 0) r->transacao = 0;
+		break;
+	}
+	free(caminhos);
+	return ret;
+}
 
-    // Lê as informações do nó do diretório pai para atualizar o número de arquivos.
-    lseek(sb->fd, parent_dir->meta* sb->blksz, SEEK_SET);
-    read(sb->fd, parent_node_info, sb->blksz);
-    parent_node_info->size++;
+/*
+Thread de fs_replay: refaz, em ordem, os registros da sua trilha
+*/
+static void *reproduz(void *arg) {
+	struct reprodutor *r = (struct reprodutor*) arg;
+	for (uint64_t i = 0; i < r->n; i++) {
+		const struct fs_record *e = r->v[i];
+		if (r->trilha[i] != r->indice) continue;
+		if (r->speedup > 0) {
+			uint64_t alvo = r->t0 + (uint64_t) (e->start / r->speedup), t = agora();
+			if (t < alvo) espera(alvo - t);
+		}
+		r->chamadas++;
+		if (refazChamada(r, e) == -1) r->falhas++;
+	}
+	//desfaz o que a gravacao deixou aberto
+	if (r->transacao) fs_txn_abort(r->sb);
+	for (uint64_t i = 0; i < r->dirs.n; i++) fs_closedir((struct fs_dir*) r->dirs.v[i].atual);
+	return NULL;
+}
 
-    lseek(sb->fd, parent_dir->meta* sb->blksz, SEEK_SET);
-    write(sb->fd, parent_node_info, sb->blksz);
+/*
+Verifica se o registro e (com seus e->len bytes) pode ser refeito: seus
+caminhos terminam dentro dele e as chamadas com caminho tem um
+*/
+static int validaRegistro(const struct fs_record *e) {
+	uint64_t tamanhos = e->op == FS_OP_WRITE_FILES ? (uint64_t) e->count * 8 : 0;
+	const char *c = (const char*) (e + 1), *f;
+	if (e->op > FS_RECORD_CLOSEDIR || e->len % 8 != 0 || tamanhos > e->len) return -1;
+	f = c + e->len - tamanhos;
+	for (uint32_t i = 0; i < e->count; i++) {
+		const char *z = (const char*) memchr(c, 0, f - c);
+		if (z == NULL) return -1;
+		c = z + 1;
+	}
+	switch (e->op) {
+	case FS_OP_WRITE_FILE: case FS_OP_READ_FILE: case FS_OP_UNLINK:
+	case FS_OP_MKDIR: case FS_OP_RMDIR: case FS_OP_RMDIR_RECURSIVE:
+	case FS_OP_OPENDIR: case FS_OP_LIST_DIR: case FS_OP_STAT:
+		return e->count == 1 ? 0 : -1;
+	}
+	return 0;
+}
 
-    // Escreve o diretório pai de volta no disco.
-    lseek(sb->fd, parent_node* sb->blksz, SEEK_SET);
-    write(sb->fd, parent_dir, sb->blksz);
+/*
+Le a gravacao em path: o arquivo todo em *dados e os registros, em ordem, em
+*v.  Retorna o numero de registros ou -1
+*/
+static int64_t leGravacao(const char *path, char **dados, const struct fs_record ***v) {
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) return -1;
+	long tam = -1;
+	if (fseek(fp, 0, SEEK_END) == 0) tam = ftell(fp);
+	rewind(fp);
+	*dados = tam >= 0 ? (char*) malloc(tam + 1) : NULL;
+	*v = NULL;
+	if (*dados == NULL || fread(*dados, 1, tam, fp) != (size_t) tam) {
+		fclose(fp);
+		free(*dados);
+		errno = tam >= 0 ? EIO : errno;
+		return -1;
+	}
+	fclose(fp);
+
+	const struct fs_record_header *h = (const struct fs_record_header*) *dados;
+	uint64_t pos = sizeof(*h), n = 0, cap = 0;
+	if ((uint64_t) tam < sizeof(*h) || h->magic != FS_RECORD_MAGIC) goto invalida;
+	while (pos < (uint64_t) tam) {
+		const struct fs_record *e = (const struct fs_record*) (*dados + pos);
+		if (tam - pos < sizeof(*e) || tam - pos - sizeof(*e) < e->len ||
+		    validaRegistro(e) == -1)
+			goto invalida;
+		if (n == cap) {
+			cap = cap ? 2 * cap : 1024;
+			const struct fs_record **w = (const struct fs_record**) realloc(*v, cap * sizeof(*w));
+			if (w == NULL) {
+				free(*v);
+				free(*dados);
+				errno = ENOMEM;
+				return -1;
+			}
+			*v = w;
+		}
+		(*v)[n++] = e;
+		pos += sizeof(*e) + e->len;
+	}
+	return n;
 
-    // Escreve o novo diretório e as informações do nó no disco.
-    lseek(sb->fd, dir_node* sb->blksz, SEEK_SET);
-    write(sb->fd, dir, sb->blksz);
-    lseek(sb->fd, dir_node_info_number* sb->blksz, SEEK_SET);
-    write(sb->fd, dir_node_info, sb->blksz);
+invalida:
+	free(*v);
+	free(*dados);
+	errno = EBADF;
+	return -1;
+}
 
-    // Libera a memória alocada.
-    free(parent_dir);
-    free(parent_node_info);
-    free(dir);
-    free(dir_node_info);
-    return 0;
+/*
+Refaz em sb as chamadas gravadas em path (veja fs.h)
+*/
+int fs_replay(struct superblock *sb, const char *path,
+              const struct fs_replay_options *opts, struct fs_replay_result *out) {
+	struct fs_replay_options padrao = { 0, 0 };
+	const struct fs_record **v;
+	char *dados;
+	uint64_t i, j, nt = 0, nthreads;
+	int ret = -1;
+	if (opts == NULL) opts = &padrao;
+	int64_t n = leGravacao(path, &dados, &v);
+	if (n == -1) return -1;
+
+	//numera as threads gravadas na ordem da primeira chamada
+	uint32_t *trilha = (uint32_t*) malloc((n + 1) * sizeof(uint32_t));
+	uint32_t *gravadas = (uint32_t*) malloc((n + 1) * sizeof(uint32_t));
+	struct reprodutor *r = NULL;
+	pthread_t *threads = NULL;
+	if (trilha == NULL || gravadas == NULL) goto fim;
+	for (i = 0; i < (uint64_t) n; i++) {
+		for (j = 0; j < nt && gravadas[j] != v[i]->thread; j++);
+		if (j == nt) gravadas[nt++] = v[i]->thread;
+		trilha[i] = j;
+	}
+	nthreads = opts->threads ? opts->threads : nt ? nt : 1;
+	for (i = 0; i < (uint64_t) n; i++) trilha[i] %= nthreads;
+
+	r = (struct reprodutor*) calloc(nthreads, sizeof(struct reprodutor));
+	threads = (pthread_t*) calloc(nthreads, sizeof(pthread_t));
+	if (r == NULL || threads == NULL) goto fim;
+	//com mais de uma thread, as operacoes precisam da trava
+	int criado = sb->bg == NULL;
+	if (nthreads > 1 && criaEstado(sb) == NULL) goto fim;
+	uint64_t t0 = agora();
+	for (i = 0; i < nthreads; i++) {
+		r[i].sb = sb;
+		r[i].v = v;
+		r[i].trilha = trilha;
+		r[i].n = n;
+		r[i].indice = i;
+		r[i].speedup = opts->speedup;
+		r[i].t0 = t0;
+		if (pthread_create(&threads[i], NULL, reproduz, &r[i]) != 0) break;
+	}
+	for (j = 0; j < i; j++) pthread_join(threads[j], NULL);
+	if (criado && sb->bg != NULL && estadoOcioso(sb->bg)) liberaEstado(sb);
+	if (i < nthreads) {
+		errno = EAGAIN;
+		goto fim;
+	}
+	if (out != NULL) {
+		memset(out, 0, sizeof(*out));
+		for (i = 0; i < nthreads; i++) {
+			out->calls += r[i].chamadas;
+			out->failed += r[i].falhas;
+		}
+		out->ns = agora() - t0;
+	}
+	ret = 0;
+
+fim:
+	if (r != NULL) {
+		for (i = 0; i < nthreads; i++) {
+			free(r[i].buf);
+			free(r[i].dirs.v);
+			free(r[i].blocos.v);
+		}
+	}
+	if (ret == -1 && errno == 0) errno = ENOMEM;
+	free(r);
+	free(threads);
+	free(trilha);
+	free(gravadas);
+	free(v);
+	free(dados);
+	return ret;
 }
 
 /*
-Remove o diretório no caminho dname
+Abre uma transacao explicita (veja fs.h): segura a trava ate fs_txn_commit
+ou fs_txn_abort, como um TRAVA que atravessa varias operacoes
 */
-int fs_rmdir(struct superblock *sb, const char *dname) {
-	// Verifica se o descritor do sistema de arquivos é válido.
+int fs_txn_begin(struct superblock *sb) {
+	//verifica o descritor do sistema de arquivos
 	if (sb->magic != 0xdcc605f5) {
 		errno = EBADF;
 		return -1;
 	}
-
-	// Verifica se o nome do diretório (caminho) excede o tamanho máximo permitido.
-	if (strlen(dname) > (sb->blksz - 8 * sizeof(uint64_t))) {
-		errno = ENAMETOOLONG;
+	struct fs_background *bg = criaEstado(sb);
+	if (bg == NULL) return -1;
+	pthread_mutex_lock(&bg->trava);
+	if (bg->explicita) {
+		pthread_mutex_unlock(&bg->trava);
+		errno = EBUSY;
 		return -1;
 	}
-
-	// Verifica se o caminho do diretório não começa com '/' ou contém espaços em branco.
-	if ((*dname != '/') || (strchr(dname, ' ') != NULL)) {
-		errno = ENOENT;
+	//sem journal, as imagens ficam so na memoria ate o commit
+	if (bg->diario == NULL && iniciaDiario(sb, 1) == -1) {
+		pthread_mutex_unlock(&bg->trava);
 		return -1;
 	}
-
-	// Verifica se o diretório a ser removido existe.
-	uint64_t block = encontraBloco(sb, dname, 0);
-	if (block == 0) {
-		errno = ENOENT;
+	bg->explicita = 1;
+	bg->dono = pthread_self();
+	trava(sb);
+	pthread_mutex_unlock(&bg->trava);
+	gravaAvulsa(sb, FS_RECORD_TXN_BEGIN, 0);
+
+	//com a escrita adiada, o cache comeca vazio: tudo nele sera da transacao
+	struct fs_diario *d = bg->diario;
+	if (d->tamanho == 0 && bg->maxSujos != 0) escreveSujos(sb, 0);
+	if ((d->tamanho != 0 && d->cabeca != 0) || d->erro) {
+		//o checkpoint de trava (ou a gravacao do cache) falhou
+		errno = d->erro ? d->erro : EIO;
+		bg->explicita = 0;
+		bg->profundidade--;
+		pthread_mutex_unlock(&bg->trava);
 		return -1;
 	}
+	memcpy(d->salvo, sb, SB_DISCO);
+	d->falhou = 0;
+	if (sb->punch != NULL) sb->punch->inicioTxn = sb->punch->nfila;
+	return 0;
+}
 
-	uint64_t parent_node = encontraBloco(sb, dname, 1);
-	uint64_t node_atual;
+/*
+Verifica se a thread corrente tem uma transacao explicita aberta em sb e,
+se tiver, a encerra, ainda com a trava (que o chamador solta)
+*/
+static struct fs_diario *encerraTransacao(struct superblock *sb) {
+	struct fs_background *bg = sb->bg;
+	if (sb->magic != 0xdcc605f5 || bg == NULL) {
+		errno = sb->magic != 0xdcc605f5 ? EBADF : EINVAL;
+		return NULL;
+	}
+	pthread_mutex_lock(&bg->trava);
+	if (!bg->explicita || !pthread_equal(bg->dono, pthread_self())) {
+		pthread_mutex_unlock(&bg->trava);
+		errno = EINVAL;
+		return NULL;
+	}
+	bg->explicita = 0;
+	pthread_mutex_unlock(&bg->trava);
+	return bg->diario;
+}
 
-	struct inode *parent_dir = (struct inode*) calloc(sb->blksz, 1);
-	struct inode *dir = (struct inode*) calloc(sb->blksz, 1);
-	struct nodeinfo *dir_node_info = (struct nodeinfo*) calloc(sb->blksz, 1);
-	struct nodeinfo *parent_node_info = (struct nodeinfo*) calloc(sb->blksz, 1);
+/*
+Sem journal nem escrita adiada, o diario so existia para a transacao e eh
+descartado.  O estado compartilhado fica ate fs_close: outras threads podem
+estar esperando a trava
+*/
+static void descartaDiario(struct superblock *sb) {
+	if (sb->journal != 0 || sb->bg->maxSujos != 0) return;
+	liberaDiario(sb->bg->diario);
+	sb->bg->diario = NULL;
+}
 
-	// Lê o inode do diretório.
-	lseek(sb->fd, block * sb->blksz, SEEK_SET);
-	read(sb->fd, dir, sb->blksz);
+/*
+Desfaz a transacao explicita ja encerrada: as imagens dela saem do cache e o
+superbloco em memoria volta ao que era em fs_txn_begin.  Solta a trava
+*/
+static void desfazTransacao(struct superblock *sb, struct fs_diario *d) {
+	struct fs_background *bg = sb->bg;
 
-	// Lê as informações do nó do diretório.
-	lseek(sb->fd, dir->meta * sb->blksz, SEEK_SET);
-	read(sb->fd, dir_node_info, sb->blksz);
+	//a transacao comecou com o log vazio: tudo no cache eh dela
+	for (uint64_t i = 0; i <= d->mascara; i++) {
+		free(d->cache[i].dados);
+		d->cache[i].dados = NULL;
+	}
+	d->ncache = d->nblocos = d->nrevogados = 0;
+	memcpy(sb, d->salvo, SB_DISCO);
+	//os blocos liberados pela transacao voltam a estar em uso (os que ela
+	//pegou voltam a lista livre sem marca, e apenas nao serao furados)
+	if (sb->punch != NULL) {
+		struct fs_punch *f = sb->punch;
+		for (uint64_t i = f->inicioTxn; i < f->nfila; i++) tiraBit(f->marcados, f->fila[i]);
+		f->nfila = f->inicioTxn;
+	}
+	bg->profundidade--;
+	descartaDiario(sb);
+	pthread_mutex_unlock(&bg->trava);
+}
 
-	// Verifica se o diretório não está vazio.
-	if (dir_node_info->size > 0) {
-		errno = ENOTEMPTY;
-		goto cleanup;
+/*
+Grava as operacoes da transacao explicita: com journal, como uma unica
+transacao do diario, esperando que chegue ao disco; sem journal, em ordem de
+bloco direto nos lugares definitivos (ou deixa para o escritor, com a escrita
+adiada).  Se uma escrita da transacao falhou (veja registraBloco), ela eh
+desfeita como em fs_txn_abort e o commit falha com o mesmo erro
+*/
+int fs_txn_commit(struct superblock *sb) {
+	MEDE(sb, FS_OP_TXN_COMMIT);
+	struct fs_diario *d = encerraTransacao(sb);
+	if (d == NULL) return -1;
+	struct fs_background *bg = sb->bg;
+	int ret = 0;
+
+	if (d->falhou) {
+		int erro = d->falhou;
+		desfazTransacao(sb, d);
+		errno = erro;
+		return -1;
 	}
 
-	fs_put_block(sb, dir->meta); // Deleta o nó de informações do diretório.
-	fs_put_block(sb, block);     // Deleta o inode do diretório.
-	memset(dir, 0, sb->blksz);   // Limpa a estrutura do diretório.
+	if (sb->journal != 0) {
+		//o TRAVA de fs_txn_begin acaba aqui: fecha a transacao e espera,
+		//qualquer que seja a politica
+		destrava(&sb);
+		pthread_mutex_lock(&d->mutex);
+		uint64_t seq = d->ultimo;
+		pthread_mutex_unlock(&d->mutex);
+		return aguardaDuravel(d, seq);
+	}
 
-	// Atualiza as informações do nó de informações e do inode do diretório pai.
-	lseek(sb->fd, parent_node* sb->blksz, SEEK_SET);
-	read(sb->fd, parent_dir, sb->blksz);
-	lseek(sb->fd, parent_dir->meta* sb->blksz, SEEK_SET);
-	read(sb->fd, parent_node_info, sb->blksz);
-	parent_node_info->size--;
+	bg->profundidade--;
+	int fsync = bg->politica == FS_DURABLE_FSYNC;
+	if (bg->maxSujos == 0) {
+		if (gravaCache(d) == -1 || (fsync && sincronizaImagem(&sb->stats, sb->dev) == -1)) ret = -1;
+	} else if (fsync && escreveSujos(sb, 1) == -1) {
+		ret = -1;
+	}
+	descartaDiario(sb);
+	pthread_mutex_unlock(&bg->trava);
+	return ret;
+}
 
-	lseek(sb->fd, parent_dir->meta* sb->blksz, SEEK_SET);
-	write(sb->fd, parent_node_info, sb->blksz);
+/*
+Desfaz as operacoes da transacao explicita (veja desfazTransacao)
+*/
+int fs_txn_abort(struct superblock *sb) {
+	MEDE(sb, FS_OP_TXN_ABORT);
+	struct fs_diario *d = encerraTransacao(sb);
+	if (d == NULL) return -1;
+	desfazTransacao(sb, d);
+	return 0;
+}
 
-	// Procura pela referência ao diretório a ser removido no diretório pai e a remove.
-	node_atual = parent_node;
-	do {
-		lseek(sb->fd, node_atual* sb->blksz, SEEK_SET);
-		read(sb->fd, dir, sb->blksz);
+static void somaMs(struct timespec *t, uint64_t ms) {
+	t->tv_sec += ms / 1000;
+	t->tv_nsec += (ms % 1000) * 1000000;
+	if (t->tv_nsec >= 1000000000) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000;
+	}
+}
 
-		for(int ii = 0; ii < NLINKS; ii++) {
-			if (dir->links[ii] == block) {
-				dir->links[ii] = 0;
-				lseek(sb->fd, node_atual* sb->blksz, SEEK_SET);
-				write(sb->fd, dir, sb->blksz);
+/*
+Laco do escritor.  Acorda quando o cache sem log passa de maxSujos blocos ou,
+com FS_DURABLE_PERIODIC, a cada periodo.  Leva o cache inteiro (as operacoes
+continuam num cache vazio) e o grava fora da trava, em ordem de bloco; no
+periodo faz tambem o fdatasync.  Com journal, o periodo so leva ao disco as
+transacoes fechadas
+*/
+static void *escritor(void *arg) {
+	struct superblock *sb = (struct superblock*) arg;
+	struct fs_background *bg = sb->bg;
+	struct timespec prazo;
+	clock_gettime(CLOCK_REALTIME, &prazo);
+	somaMs(&prazo, bg->periodo);
+
+	pthread_mutex_lock(&bg->trava);
+	while (!bg->pararEscritor) {
+		struct fs_diario *d = bg->diario;
+		int cheio = d != NULL && d->tamanho == 0 && bg->maxSujos != 0 &&
+		            d->ncache >= bg->maxSujos;
+		if (!cheio) {
+			if (bg->politica != FS_DURABLE_PERIODIC) {
+				pthread_cond_wait(&bg->sinal, &bg->trava);
+				continue;
+			}
+			if (pthread_cond_timedwait(&bg->sinal, &bg->trava, &prazo) != ETIMEDOUT)
+				continue;
+			clock_gettime(CLOCK_REALTIME, &prazo);
+			somaMs(&prazo, bg->periodo);
+		}
 
-				break;
+		if (d != NULL && d->tamanho != 0) {
+			pthread_mutex_unlock(&bg->trava);
+			pthread_mutex_lock(&d->mutex);
+			uint64_t seq = d->ultimo;
+			pthread_mutex_unlock(&d->mutex);
+			aguardaDuravel(d, seq);
+		} else if (d != NULL) {
+			//leva o cache; a tabela nova tem o mesmo tamanho
+			struct imagem *nova = NULL;
+			recolheEscrita(d);
+			if (d->ncache != 0 &&
+			    (nova = (struct imagem*) calloc(d->mascara + 1, sizeof(struct imagem))) != NULL) {
+				d->escrita = d->cache;
+				d->mascaraEscrita = d->mascara;
+				d->cache = nova;
+				d->ncache = 0;
 			}
+			pthread_mutex_unlock(&bg->trava);
+			int erro = 0;
+			if ((nova != NULL && gravaImagens(d, d->escrita, d->mascaraEscrita) == -1) ||
+			    (!cheio && sincronizaImagem(d->stats, d->dev) == -1))
+				erro = errno ? errno : EIO;
+			pthread_mutex_lock(&d->mutex);
+			if (erro) d->erro = erro;
+			if (nova != NULL) d->escritaPronta = 1;
+			pthread_cond_broadcast(&d->pronto);
+			pthread_mutex_unlock(&d->mutex);
+		} else {
+			pthread_mutex_unlock(&bg->trava);
+			sincronizaImagem(&sb->stats, sb->dev);
 		}
-		node_atual = dir->next;
-	} while (node_atual != 0);
+		pthread_mutex_lock(&bg->trava);
+	}
+	pthread_mutex_unlock(&bg->trava);
+	return NULL;
+}
 
-cleanup:
-	free(parent_dir);
-	free(parent_node_info);
-	free(dir);
-	free(dir_node_info);
+static void paraEscritor(struct superblock *sb) {
+	struct fs_background *bg = sb->bg;
+	if (bg == NULL || !bg->temEscritor) return;
+	pthread_mutex_lock(&bg->trava);
+	bg->pararEscritor = 1;
+	pthread_cond_signal(&bg->sinal);
+	pthread_mutex_unlock(&bg->trava);
+	pthread_join(bg->escritor, NULL);
+	bg->temEscritor = bg->pararEscritor = 0;
+}
+
+/* Inicia o escritor se a configuracao de sb pedir um. */
+static int iniciaEscritor(struct superblock *sb) {
+	struct fs_background *bg = sb->bg;
+	if (bg->temEscritor || (bg->maxSujos == 0 && bg->politica != FS_DURABLE_PERIODIC))
+		return 0;
+	if ((errno = pthread_create(&bg->escritor, NULL, escritor, sb)) != 0) return -1;
+	bg->temEscritor = 1;
 	return 0;
 }
 
 /*
-Retorna um string com o nome de todos os elementos no diretorio dname
+Escolhe quando as escritas de sb chegam ao disco (veja fs.h)
 */
-char *fs_list_dir(struct superblock *sb, const char *dname) {
-    // Verifica o descritor do sistema de arquivos.
-    if (sb->magic != 0xdcc605f5) {
-        errno = EBADF;
-        return NULL;
-    }
-
-    // Verifica se o nome do arquivo (caminho) é maior que o permitido.
-    if (strlen(dname) > (sb->blksz - 8 * sizeof(uint64_t))) {
-        errno = ENAMETOOLONG;
-        return NULL;
-    }
-
-    // Procura o índice do inode de dname e verifica se dname existe.
-    uint64_t superbloco = encontraBloco(sb, dname, 0);
-    if (superbloco == 0) {
-        errno = ENOENT;
-        return NULL;
-    }
-
-    int i;
-    char *ret = (char*) calloc(500, sizeof(char));
-    struct inode *inode = (struct inode*) calloc(1, sb->blksz);
-    struct inode *inode_aux = (struct inode*) calloc(1, sb->blksz);
-    struct nodeinfo *node_info = (struct nodeinfo*) calloc(1, sb->blksz);
-    struct nodeinfo *node_info_aux = (struct nodeinfo*) calloc(1, sb->blksz);
+int fs_set_durability(struct superblock *sb, int policy, uint64_t period_ms) {
+	//verifica o descritor do sistema de arquivos
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+	if (policy < FS_DURABLE_NONE || policy > FS_DURABLE_FSYNC ||
+	    (policy == FS_DURABLE_PERIODIC && period_ms == 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (policy == FS_DURABLE_NONE && sb->bg == NULL) return 0;
+
+	struct fs_background *bg = criaEstado(sb);
+	if (bg == NULL) return -1;
+	paraEscritor(sb);
+	pthread_mutex_lock(&bg->trava);
+	bg->politica = policy;
+	bg->periodo = period_ms;
+	pthread_mutex_unlock(&bg->trava);
+	return iniciaEscritor(sb);
+}
 
-    char *tok;
-    char nome[50];
+/*
+Liga (max_dirty > 0) ou desliga a escrita adiada de sb (veja fs.h)
+*/
+int fs_set_writeback(struct superblock *sb, uint64_t max_dirty) {
+	//verifica o descritor do sistema de arquivos
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+	//com journal, os metadados ja passam pelo diario
+	if (sb->journal != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (max_dirty == 0 && sb->bg == NULL) return 0;
+
+	struct fs_background *bg = criaEstado(sb);
+	if (bg == NULL) return -1;
+	paraEscritor(sb);
+	int ret = 0;
+	pthread_mutex_lock(&bg->trava);
+	if (bg->explicita) {
+		errno = EBUSY;
+		ret = -1;
+	} else if (max_dirty != 0 && bg->diario == NULL) {
+		ret = iniciaDiario(sb, 1);
+	} else if (max_dirty == 0 && bg->diario != NULL) {
+		//grava o que ficou no cache antes de voltar a escrever direto
+		ret = escreveSujos(sb, 0);
+		liberaDiario(bg->diario);
+		bg->diario = NULL;
+	}
+	if (ret == 0) bg->maxSujos = max_dirty;
+	pthread_mutex_unlock(&bg->trava);
+	if (iniciaEscritor(sb) == -1) ret = -1;
+	return ret;
+}
 
-    // Posiciona e lê o inode de dname.
-    lseek(sb->fd, superbloco * sb->blksz, SEEK_SET);
-    read(sb->fd, inode, sb->blksz);
+/*
+Poe na fila de furos os blocos livres de sb que nao sao paginas, lendo cada
+pagina das duas listas uma vez, e fura a fila a cada lote.  As paginas sem
+blocos em links[] (como as gravadas por fs_format sem journal) que seguem uma
+pagina com espaco passam a links[] dela, regravada uma vez apontando a pagina
+seguinte a essas, de modo que tambem possam ser furadas
+*/
+static int furaLista(struct superblock *sb) {
+	struct freepage *p = (struct freepage*) malloc(sb->blksz);
+	struct freepage *q = (struct freepage*) malloc(sb->blksz);
+	uint64_t listas[2] = { sb->freelist, sb->freed };
+	uint64_t no, prox, vistos = 0, i, j, k;
+	int l, ret = -1;
+
+	if (p == NULL || q == NULL) goto fim;
+	for (l = 0; l < 2; l++) {
+		for (no = listas[l]; no != 0 && vistos < sb->freeblks; no = p->next) {
+			if (leBlocoTipo(sb, no, p, FS_BLOCK_FREEPAGE) == -1) goto fim;
+			if ((k = tamanhoLote(p)) > sb->nfree) {
+				errno = EIO;
+				goto fim;
+			}
+			for (j = k, prox = p->next; prox != 0 && k < sb->nfree &&
+			     vistos + k + 1 < sb->freeblks; prox = q->next) {
+				if (leBlocoTipo(sb, prox, q, FS_BLOCK_FREEPAGE) == -1) goto fim;
+				if (tamanhoLote(q) != 0) break;
+				p->links[k++] = prox;
+			}
+			if (k > j) {
+				p->next = prox;
+				p->count = MARCA_LOTE | k;
+				if (escreveBlocoTipo(sb, no, p, FS_BLOCK_FREEPAGE) == -1) goto fim;
+			}
+			for (i = 0; i < k; i++) marcaFuro(sb, p->links[i]);
+			vistos += k + 1;
+			if (sb->punch->nfila >= sb->punch->lote && esvaziaFuros(sb) == -1)
+				goto fim;
+		}
+	}
+	ret = 0;
 
-    // Verifica se o caminho dname aponta para um diretório.
-    if (inode->mode != IMDIR) {
-        goto cleanup;
-    }
+fim:
+	free(p);
+	free(q);
+	return ret;
+}
 
-    // Posiciona e lê o nodeinfo do diretório dname.
-    lseek(sb->fd, inode->meta * sb->blksz, SEEK_SET);
-    read(sb->fd, node_info, sb->blksz);
-
-    // Percorre os links do diretório dname.
-    for (i = 0; i < NLINKS; i++) {
-        if (inode->links[i] != 0) {
-            // Lê o inode de cada arquivo/pasta dentro do diretório dname.
-            lseek(sb->fd, inode->links[i] * sb->blksz, SEEK_SET);
-            read(sb->fd, inode_aux, sb->blksz);
-
-            // Lê o nodeinfo desse inode.
-            lseek(sb->fd, inode_aux->meta * sb->blksz, SEEK_SET);
-            read(sb->fd, node_info_aux, sb->blksz);
-
-            // Pega o nome completo desse arquivo/pasta e divide-o em
-            // substrings divididas pelo caractere '/'. Salva a última parte.
-            tok = strtok(node_info_aux->name, "/");
-            while (tok != NULL){
-                strcpy(nome, tok);
-                tok = strtok(NULL, "/");
-            }
-
-            if (inode_aux->mode == IMDIR)
-                strcat(nome, "/");
-
-            // Concatena o nome do arquivo/pasta à string de resultado.
-            strcat(ret, nome);
-
-            // Acrescenta um espaço entre os arquivos/pastas.
-            if (i + 1 < node_info->size)
-                strcat(ret, " ");
-        }
-    }
+/*
+Liga (batch > 0) ou desliga os furos nos blocos livres de sb (veja fs.h)
+*/
+int fs_set_punch(struct superblock *sb, uint64_t batch) {
+	TRAVA(sb);
+	//verifica o descritor do sistema de arquivos
+	if (sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+	if (sb->bg != NULL && sb->bg->explicita) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (batch == 0) {
+		if (sb->punch == NULL) return 0;
+		int ret = esvaziaFuros(sb);
+		liberaFuros(sb);
+		return ret;
+	}
+	if (sb->punch != NULL) {
+		sb->punch->lote = batch;
+		return 0;
+	}
+	if (sb->dev->discard == NULL) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
 
-    cleanup:
-	    free(inode);
-	    free(inode_aux);
-	    free(node_info);
-	    free(node_info_aux);
-    	return ret;
+	struct fs_punch *f = (struct fs_punch*) calloc(1, sizeof(struct fs_punch));
+	if (f == NULL) return -1;
+	f->marcados = (uint64_t*) calloc((sb->blks + 63) / 64, sizeof(uint64_t));
+	if (f->marcados == NULL) {
+		free(f);
+		return -1;
+	}
+	f->lote = batch;
+	sb->punch = f;
+
+	//os blocos que ja estavam livres entram na fila
+	if (furaLista(sb) == -1 || esvaziaFuros(sb) == -1) {
+		int erro = errno;
+		liberaFuros(sb);
+		errno = erro;
+		return -1;
+	}
+	return 0;
 }
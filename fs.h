@@ -19,11 +19,82 @@
  */
 
 #include <inttypes.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define IMREG 1   /* regular inode */
 #define IMDIR 2   /* directory inode */
 #define IMCHILD 4 /* child inode */
+#define IMMAP 8   /* inode of a file's block map, see struct inode */
+#define IMBTREE 16 /* directory indexed by name, see struct dirnode */
 
+/* Public calls counted by fs_get_stats.  fs_format_opts counts as
+ * FS_OP_FORMAT, fs_read_file_at as FS_OP_READ_FILE and fs_lstat as
+ * FS_OP_STAT; a call made by another public call (such as fs_readdir under
+ * fs_list_dir) is only part of the outer one. */
+#define FS_OP_FORMAT 0
+#define FS_OP_OPEN 1
+#define FS_OP_GET_BLOCK 2
+#define FS_OP_PUT_BLOCK 3
+#define FS_OP_WRITE_FILE 4
+#define FS_OP_WRITE_FILES 5
+#define FS_OP_READ_FILE 6
+#define FS_OP_UNLINK 7
+#define FS_OP_MKDIR 8
+#define FS_OP_RMDIR 9
+#define FS_OP_RMDIR_RECURSIVE 10
+#define FS_OP_RECLAIM 11
+#define FS_OP_OPENDIR 12
+#define FS_OP_READDIR 13
+#define FS_OP_LIST_DIR 14
+#define FS_OP_STAT 15
+#define FS_OP_STAT_MANY 16
+#define FS_OP_TXN_COMMIT 17
+#define FS_OP_TXN_ABORT 18
+#define FS_OP_DEFRAG 19
+#define FS_NOPS 20
+
+/* Kinds of blocks counted by fs_get_stats.  The nodes of block maps and of
+ * directory B+trees are counted as inodes. */
+#define FS_BLOCK_SUPER 0
+#define FS_BLOCK_INODE 1
+#define FS_BLOCK_NODEINFO 2
+#define FS_BLOCK_FREEPAGE 3
+#define FS_BLOCK_DATA 4
+#define FS_NBLOCKS 5
+
+#define FS_LATENCY_BUCKETS 32
+
+struct fs_stats {
+	uint64_t calls[FS_NOPS]; /* calls to each FS_OP_* */
+	uint64_t ns[FS_NOPS]; /* total time spent in them, in nanoseconds */
+	uint64_t latency[FS_NOPS][FS_LATENCY_BUCKETS];
+	/* latency histogram of each FS_OP_*: =latency[op][k] counts the calls
+	 * that took from 2^k to 2^(k+1) - 1 nanoseconds (the last bucket has
+	 * every slower call). */
+	uint64_t reads[FS_NBLOCKS];
+	uint64_t writes[FS_NBLOCKS];
+	/* blocks of each FS_BLOCK_* read and written by the filesystem, whether
+	 * they came from the image or from memory.  with a journal or inside a
+	 * transaction, a metadata block is counted when it is logged. */
+	uint64_t cache_hits;
+	/* block reads served from the blocks kept in memory by the journal,
+	 * write-back or a transaction. */
+	uint64_t cache_misses; /* block reads that went to the image */
+	uint64_t syscalls;
+	/* reads, writes and flushes issued on the image's device (see struct
+	 * fs_backend; system calls for a file), including those of the journal
+	 * and of background threads. */
+	uint64_t syncs; /* flush (fdatasync) calls, also counted in =syscalls */
+	uint64_t discards; /* discard calls, also counted in =syscalls */
+	uint64_t punched; /* blocks released by them, see fs_set_punch */
+};
+
+/* An open filesystem.  While it has a journal, a transaction open (see
+ * fs_txn_begin), a durability policy other than FS_DURABLE_NONE or write-back
+ * on, or reclaims orphans with FS_RECLAIM_BACKGROUND (see fs_set_reclaim),
+ * its operations may be called from several threads at once and take turns
+ * on it; otherwise they must not be called concurrently. */
 struct superblock {
 	uint64_t magic; /* 0xdcc605f5 */
 	uint64_t blks; /* number of blocks in the filesystem */
@@ -31,9 +102,51 @@ struct superblock {
 	uint64_t freeblks; /* number of free blocks in the filesystem */
 	uint64_t freelist; /* pointer to free block list */
 	uint64_t root; /* pointer to root directory's inode */
-	int fd; /* file descriptor for the filesystem image */
+	uint64_t version;
+	/* FS_VERSION when the fields below (up to =fd) were initialized; older
+	 * images are upgraded by fs_open. */
+	uint64_t orphans;
+	/* first inode in the list of orphans: files already removed from their
+	 * directories whose blocks have not been freed yet.  see fs_reclaim. */
+	uint64_t journal;
+	/* first block of the metadata journal, or zero if the filesystem has no
+	 * journal.  see fs_format_opts. */
+	uint64_t journalblks; /* number of blocks in the journal */
+	uint64_t freed;
+	/* with a journal, free block list where blocks freed by the filesystem
+	 * are held until the transactions that freed them are on disk; only
+	 * then are they reused before =freelist (before that, only once
+	 * =freelist runs out).  zero without a journal. */
+	int fd;
+	/* file descriptor for the filesystem image when it is a plain file (see
+	 * fs_backend_file), -1 otherwise. */
+	struct fs_backend *dev; /* block device holding the image */
+	int owndev; /* nonzero when fs_close also closes =dev */
+	/* the fields below are derived from =blksz by fs_format and fs_open;
+	 * they are kept per superblock and never stored in the image. */
+	uint64_t nlinks; /* number of entries in a struct inode's =links */
+	uint64_t namelen; /* bytes available in a struct nodeinfo's =name */
+	uint64_t nfree; /* number of entries in a struct freepage's =links */
+	const struct fs_geomops *ops;
+	/* link-scan and block I/O routines for this block size; specialized
+	 * versions exist for 128, 256, 512, 1024 and 4096-byte blocks, other
+	 * sizes use a generic version. */
+	int reclaim; /* FS_RECLAIM_* mode, see fs_set_reclaim */
+	struct fs_background *bg;
+	/* background thread and journal state, or NULL when there is neither.
+	 * while it exists, operations on this superblock hold its lock. */
+	uint64_t writes;
+	/* metadata blocks written through this superblock; fs_readdir keeps
+	 * the entries it read ahead only while this does not change. */
+	struct fs_stats stats; /* see fs_get_stats */
+	struct fs_trace *trace; /* see fs_trace_start; NULL when not tracing */
+	struct fs_recorder *recorder;
+	/* see fs_record_start; NULL when not recording. */
+	struct fs_punch *punch; /* see fs_set_punch; NULL when off */
 };
 
+#define FS_VERSION (((uint64_t)0xdcc605f5 << 32) | 1)
+
 struct inode {
 	uint64_t mode;
 	uint64_t parent;
@@ -44,14 +157,24 @@ struct inode {
 	uint64_t meta;
 	/* if =mode does not contain IMCHILD, then meta points to this inode's
 	 * metadata (struct iinfo).  if =mode contains IMCHILD, then meta
-	 * points to the previous inode for this inode's entity. */
+	 * points to the previous inode for this inode's entity (zero for the
+	 * nodes of a block map). */
 	uint64_t next;
 	/* if this file's date block do not fit in this inode, =next points to
-	 * the next inode for this entity; otherwise =next should be zero. */
+	 * the next inode for this entity; otherwise =next should be zero.  if
+	 * =mode contains IMMAP, =next is the height of the block map instead
+	 * (see =links). */
 	uint64_t links[];
 	/* if =mode contains IMDIR, then entries in =links point to inode's
 	 * for each entity in the directory.  otherwise, if =mode contains
-	 * IMREG, then entries in =links point to this file's data blocks. */
+	 * IMREG, then entries in =links point to this file's data blocks.
+	 * files whose data blocks do not fit in one inode are written with
+	 * IMREG|IMMAP: =links of the first inode is the root of a block map of
+	 * height =next, whose other nodes are IMCHILD|IMMAP inodes.  each link
+	 * of a node at height k covers nlinks^k consecutive data blocks, and
+	 * the links of nodes at height zero point to the data blocks, so any
+	 * block is =next + 1 reads away from the first inode.  images written
+	 * by older versions may instead chain IMCHILD inodes through =next. */
 };
 
 struct nodeinfo {
@@ -61,11 +184,39 @@ struct nodeinfo {
 	 * number of files in the directory. */
 	uint64_t reserved[7];
 	/* reserving some space to implement security and ownership in the
-	 * future. */
+	 * future.  for directories, =reserved[0] points to the last inode in
+	 * the directory's chain (zero if the chain has a single inode),
+	 * =reserved[1] counts free entries in the other inodes of the chain,
+	 * and =reserved[2] to =reserved[5] point to chain inodes known to have
+	 * free entries (zero if unused).  these are only hints: a zeroed
+	 * =reserved is always valid. */
 	char name[];
 	/* remainder of block used to store this entity's name. */
 };
 
+struct dirkey {
+	uint64_t node;
+	/* in leaves, the first inode of a directory entry; in other nodes, a
+	 * child node whose smallest key is this key. */
+	uint64_t inode; /* first inode of the entry whose name is the key */
+	char prefix[16];
+	/* first bytes of the last component of that name, zero-padded.  keys
+	 * are ordered as strcmp orders the names; the name itself is read from
+	 * the entry's nodeinfo only when two prefixes are equal. */
+};
+
+struct dirnode {
+	uint64_t mode; /* IMCHILD | IMBTREE */
+	uint64_t parent; /* first inode of the directory */
+	uint64_t count; /* number of keys, stored from keys[0] in name order */
+	uint64_t height; /* zero for leaves */
+	struct dirkey keys[];
+	/* a directory with IMDIR|IMBTREE in =mode has no entries in its
+	 * =links: its =next points to the root of a B+tree of dirnodes (zero
+	 * when the directory is empty).  a node only leaves the tree when it
+	 * becomes empty, so nodes may be less than half full. */
+};
+
 struct freepage {
 	uint64_t next;
 	/* link to next freepage; or zero if this is the last freepage */
@@ -73,7 +224,10 @@ struct freepage {
 	uint64_t links[];
 	/* remainder of block used to store links to free blocks.  =count
 	 * counts the number of elements in links, stored from links[0] to
-	 * links[counts-1]. */
+	 * links[counts-1].  the upper 32 bits of =count hold 0xdcc605f5 when
+	 * =links is in use; pages without this mark (including those written
+	 * by older versions, which left =count uninitialized) hold no links.
+	 * the blocks in =links are handed out before the page itself. */
 };
 
 #define MIN_BLOCK_SIZE 128
@@ -90,9 +244,45 @@ struct freepage {
  * =fname, then the function fails and sets errno to ENOSPC. */
 struct superblock * fs_format(const char *fname, uint64_t blocksize);
 
+#define FS_MIN_JOURNAL 16
+
+struct fs_options {
+	uint64_t journal;
+	/* number of blocks reserved for the metadata journal (at least
+	 * FS_MIN_JOURNAL), or zero for no journal. */
+	int btree_dirs;
+	/* if nonzero, the root directory is indexed by a B+tree of names (see
+	 * struct dirnode), and so is every directory created under an indexed
+	 * directory: lookups and inserts read one node per level of the tree
+	 * and fs_list_dir lists names in strcmp order.  otherwise directories
+	 * are chains of inodes listed in the order entries were added. */
+};
+
+/* Same as fs_format, with the optional features in =opts (NULL means the
+ * defaults of fs_format).  With a journal, the superblock, inodes, nodeinfos
+ * and free pages written by each operation are logged as one transaction and
+ * reach their home locations only at a later checkpoint; operations that
+ * finish concurrently share a single write and fdatasync of the log, and
+ * (under FS_DURABLE_FSYNC, the default with a journal) each operation returns
+ * only after its transaction is durable.  File data is written in place and
+ * not logged, except in blocks the metadata on disk may still use until a
+ * transaction is durable (blocks it freed, and free-list pages it took).
+ * With a journal, fs_format lists the free blocks in the =links of one page
+ * per =nfree + 1 blocks, so few of them are pages.  Operations too large for
+ * half the journal are split into several transactions.  fs_open replays the
+ * complete transactions found in the journal.  Errors while writing the
+ * journal after an operation has returned are reported by fs_close.  Fails
+ * with EINVAL if =opts->journal is below FS_MIN_JOURNAL and with ENOSPC if
+ * the journal does not leave MIN_BLOCK_COUNT blocks. */
+struct superblock * fs_format_opts(const char *fname, uint64_t blocksize,
+                                   const struct fs_options *opts);
+
 /* Open the filesystem in =fname and return its superblock.  Returns NULL on
  * error, and sets errno accordingly.  If =fname does not contain a
- * 0xdcc605fs, then errno is set to EBADF. */
+ * 0xdcc605fs, then errno is set to EBADF.  Each superblock carries its own
+ * geometry, so several images (possibly with different block sizes) can be
+ * open at the same time, and distinct superblocks can be used concurrently
+ * from different threads. */
 struct superblock * fs_open(const char *fname);
 
 /* Close the filesystem pointed to by =sb.  Returns zero on success and a
@@ -100,6 +290,87 @@ struct superblock * fs_open(const char *fname);
  * and errno is set appropriately. */
 int fs_close(struct superblock *sb);
 
+/* A block device holding a filesystem image.  Every read and write of the
+ * image, including those of the journal and of background threads, goes
+ * through these functions, possibly from several threads at once.  Offsets
+ * and lengths are in bytes; apart from the persistent part of the
+ * superblock, written at offset zero, they are multiples of the block size.
+ * Other devices may be written by embedding this struct as the first member
+ * of a larger one. */
+struct fs_backend {
+	ssize_t (*read_blocks)(struct fs_backend *dev, const struct iovec *iov,
+	                       int iovcnt, uint64_t offset);
+	/* fill the =iovcnt buffers of =iov, in order, with the bytes of the
+	 * image from =offset on.  returns the number of bytes read (fewer at
+	 * the end of the image) or -1, setting errno. */
+	ssize_t (*write_blocks)(struct fs_backend *dev, const struct iovec *iov,
+	                        int iovcnt, uint64_t offset);
+	/* same as =read_blocks, writing the buffers to the image. */
+	int (*flush)(struct fs_backend *dev);
+	/* make every write that returned durable.  returns zero or -1. */
+	uint64_t (*size)(struct fs_backend *dev); /* bytes in the image */
+	int (*close)(struct fs_backend *dev);
+	/* release the device.  returns zero or -1, setting errno. */
+	int (*discard)(struct fs_backend *dev, uint64_t offset, uint64_t len);
+	/* release the storage of =len bytes of the image from =offset, which
+	 * then read as zeros (see fs_set_punch).  returns zero or -1, setting
+	 * errno.  NULL if the device cannot do it. */
+};
+
+/* Same as fs_format_opts, on the image in =dev instead of a file.  The number
+ * of blocks comes from =dev->size.  fs_close does not close =dev, which may
+ * be opened again with fs_open_dev. */
+struct superblock * fs_format_dev(struct fs_backend *dev, uint64_t blocksize,
+                                  const struct fs_options *opts);
+
+/* Same as fs_open, on the image in =dev.  fs_close does not close =dev. */
+struct superblock * fs_open_dev(struct fs_backend *dev);
+
+/* The file =fname, read and written with preadv and pwritev; =discard
+ * punches a hole in it with fallocate.  fs_format and fs_open use this
+ * device.  If =exclusive is nonzero, the file is locked with flock (as
+ * fs_open does) and the call fails with EBUSY if another process
+ * holds the lock.  Returns NULL on error and sets errno. */
+struct fs_backend * fs_backend_file(const char *fname, int exclusive);
+
+/* The file =fname mapped into memory: reads and writes are copies, =flush
+ * is an msync and =discard punches a hole in the file.  The image keeps the
+ * size the file had when it was mapped.  =exclusive as in fs_backend_file.
+ * Returns NULL on error and sets errno. */
+struct fs_backend * fs_backend_mmap(const char *fname, int exclusive);
+
+/* An image of =size bytes in anonymous memory, initially zeroed, that
+ * disappears when closed.  =flush does nothing, and =discard gives the whole
+ * pages in its range back to the system.  Returns NULL on error and
+ * sets errno. */
+struct fs_backend * fs_backend_memory(uint64_t size);
+
+/* Delays of a simulated disk, see fs_backend_latency. */
+struct fs_latency {
+	uint64_t read_ns; /* added to every =read_blocks call */
+	uint64_t write_ns; /* added to every =write_blocks call */
+	uint64_t flush_ns; /* added to every =flush call */
+	uint64_t seek_ns;
+	/* added to a read or write that does not start where the previous one
+	 * ended (a head seek on a hard disk). */
+	uint64_t bytes_per_us;
+	/* transfer rate: each call also takes its length divided by this, or
+	 * nothing if zero. */
+};
+
+/* A device that forwards every call to =inner and then waits as long as the
+ * profile in =lat says it took, so that a fast image (such as one from
+ * fs_backend_memory) behaves like a slow disk.  =discard, if =inner has one,
+ * is forwarded with no delay.  Concurrent calls wait in parallel, as on a
+ * device with a deep queue.  Closing it also closes =inner.  Returns NULL on
+ * error and sets errno. */
+struct fs_backend * fs_backend_latency(struct fs_backend *inner,
+                                       const struct fs_latency *lat);
+
+/* Close =dev (=dev->close).  Returns zero or a negative value on error,
+ * setting errno. */
+int fs_backend_close(struct fs_backend *dev);
+
 /* Get a free block in the filesystem.  This block shall be removed from the
  * list of free blocks in the filesystem.  If there are no free blocks, zero
  * is returned.  If an error occurs, (uint64_t)-1 is returned and errno is set
@@ -114,15 +385,399 @@ int fs_put_block(struct superblock *sb, uint64_t block);
 int fs_write_file(struct superblock *sb, const char *fname, char *buf,
                   size_t cnt);
 
+struct fs_write_req {
+	const char *fname; /* full path of the file to write */
+	const char *buf; /* file contents */
+	size_t cnt; /* number of bytes in =buf */
+};
+
+/* Write the =n files described by =reqs, with the same semantics as calling
+ * fs_write_file for each request in order (if a name is repeated, the last
+ * request wins).  Requests are grouped by parent directory: each parent is
+ * resolved and scanned once, the blocks for all files are allocated in one
+ * pass over the free list, and each parent's inode chain and nodeinfo are
+ * written once.  Missing parents (ENOENT), parents that are not directories
+ * (ENOTDIR), names of existing directories (EISDIR), names that are too long
+ * (ENAMETOOLONG) and lack of space (ENOSPC) are detected before anything is
+ * written, in which case no file is written.  The blocks of an overwritten
+ * file are freed only once its new contents are written, so there must be
+ * room for both.  Returns zero on success or a negative value on error,
+ * setting errno accordingly. */
+int fs_write_files(struct superblock *sb, const struct fs_write_req *reqs,
+                   size_t n);
+
 ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf,
                      size_t bufsz);
 
+/* Same as fs_read_file, but reads from byte =offset of the file.  The blocks
+ * at =offset are located through the file's block map (see struct inode) in
+ * at most one read per level of the map, and inodes already read are reused
+ * for the following blocks.  Returns the number of bytes read (zero if
+ * =offset is at or past the end of the file) or a negative value on error,
+ * setting errno as fs_read_file. */
+ssize_t fs_read_file_at(struct superblock *sb, const char *fname, char *buf,
+                        size_t bufsz, uint64_t offset);
+
 int fs_unlink(struct superblock *sb, const char *fname);
 
 int fs_mkdir(struct superblock *sb, const char *dname);
 
 int fs_rmdir(struct superblock *sb, const char *dname);
 
+/* Remove the directory =dname and everything below it.  The subtree is
+ * walked once; every inode, nodeinfo and data block found is returned to the
+ * free list in a single batch, after =dname is unlinked from its parent.
+ * Returns zero on success or a negative value on error, setting errno to
+ * ENOENT, ENOTDIR, EBUSY (for the root directory) or ENAMETOOLONG. */
+int fs_rmdir_recursive(struct superblock *sb, const char *dname);
+
+#define FS_RECLAIM_SYNC 0 /* free blocks before returning (default) */
+#define FS_RECLAIM_DEFERRED 1 /* leave them to fs_reclaim */
+#define FS_RECLAIM_BACKGROUND 2 /* leave them to a background thread */
+
+/* Choose how fs_unlink and overwrites through fs_write_file(s) free the
+ * blocks of files that span more than one inode.  In the deferred modes the
+ * file is detached from its directory and its inode chain is put on the
+ * persistent orphan list (=orphans in the superblock); blocks are freed
+ * later, in order, by fs_reclaim or by a background thread started by this
+ * call.  Orphans left when the filesystem is closed or the process dies are
+ * freed by the next fs_open.  Allocations that would fail for lack of space
+ * reclaim orphans first.  Must not be called concurrently with other
+ * operations on =sb.  Returns zero on success or a negative value on error
+ * (EINVAL for an unknown mode). */
+int fs_set_reclaim(struct superblock *sb, int mode);
+
+/* Free blocks held by orphans, stopping once about =budget blocks have been
+ * freed (one inode's worth of blocks may go over the budget).  Returns the
+ * number of blocks freed, zero if there were no orphans, or a negative value
+ * on error. */
+int64_t fs_reclaim(struct superblock *sb, uint64_t budget);
+
+/* How scattered the files of an image are, as reported by fs_fragmentation.
+ * The blocks of a file are taken in the order fs_write_file lays them out:
+ * its nodeinfo, then its data blocks, each node of its block map right
+ * before the first data block it covers. */
+struct fs_fragmentation {
+	uint64_t files; /* regular files */
+	uint64_t blocks; /* their blocks, not counting first inodes */
+	uint64_t extents;
+	/* runs of consecutive block numbers in those blocks; =files when every
+	 * file is contiguous. */
+	uint64_t fragmented; /* files in more than one extent */
+	uint64_t detached;
+	/* files whose first inode is not the block right before their
+	 * nodeinfo (see FS_DEFRAG_INODES). */
+};
+
+/* Store in =out the fragmentation of every file of =sb.  Walks the whole
+ * tree, reading each file's inodes and block map but not its data.  Returns
+ * zero on success or a negative value on error, setting errno. */
+int fs_fragmentation(struct superblock *sb, struct fs_fragmentation *out);
+
+#define FS_DEFRAG_INODES 1 /* also move first inodes, see fs_defrag */
+
+/* Move fragmented files of =sb (those in more than one extent) into runs of
+ * free blocks, stopping once about =budget blocks have been moved (one file
+ * may go over the budget).  Files are taken directory by directory, in the
+ * order fs_list_dir lists them, and placed one after the other in the free
+ * runs found from the start of the image, so that the files of a directory
+ * end up together.  With FS_DEFRAG_INODES in =flags, detached files are
+ * moved too and each moved file's first inode goes right before its
+ * nodeinfo.  Each file is copied to its new blocks and switched over by
+ * rewriting its first inode (or, with FS_DEFRAG_INODES, its directory entry)
+ * last; its old blocks are freed after that, so an interruption at any point
+ * leaves every file readable.  Files with no free run large enough are left
+ * as they are.  Each call walks the tree and the free list once, so it can
+ * be called repeatedly, while the image is in use, until it returns zero.
+ * Returns the number of blocks moved, zero if no file could be moved, or a
+ * negative value on error (EINVAL for unknown =flags). */
+int64_t fs_defrag(struct superblock *sb, uint64_t budget, int flags);
+
+/* Write to the file =path (created or truncated) a copy of =sb that holds
+ * only the blocks in use, renumbered from the start of the image: the
+ * superblock, an empty journal of the same size (if =sb has one), then each
+ * directory followed by its files, each file's blocks in order, so every
+ * file of the copy is contiguous.  Every pointer (=parent, =meta, =next,
+ * =links, the keys of directory trees and the hints in a directory's
+ * =reserved) is rewritten to the new numbers.  The copy has no free blocks,
+ * except those needed to reach the minimum size of fs_format_opts, which
+ * form its free list.  Orphans not yet reclaimed and blocks taken with
+ * fs_get_block are left out.  Only blocks in use are read, in batches, and
+ * the copy is written in order and synced before returning.  Returns zero
+ * on success or a negative value on error (EIO if =sb references a block
+ * twice, EBUSY if =path is locked by an open image, EINVAL if =path is the
+ * image of =sb itself); on error the contents of =path are unspecified. */
+int fs_compact_export(struct superblock *sb, const char *path);
+
+#define FS_DURABLE_NONE 0 /* never fdatasync (default without journal) */
+#define FS_DURABLE_CLOSE 1 /* fdatasync in fs_close */
+#define FS_DURABLE_PERIODIC 2 /* fdatasync every period_ms, from a thread */
+#define FS_DURABLE_FSYNC 3 /* durable when each operation returns (default
+                             with journal) */
+
+/* Choose when writes to =sb reach stable storage.  With a journal, the policy
+ * decides when closed transactions are written to the log: each operation
+ * waits for its group (FS_DURABLE_FSYNC), a thread writes them every
+ * =period_ms (FS_DURABLE_PERIODIC), or they are written only when the log
+ * needs a checkpoint and in fs_close.  Without a journal, it decides when
+ * fdatasync is called (and, with write-back, also when cached blocks are
+ * written: FS_DURABLE_FSYNC writes an operation's blocks before it returns).
+ * Must not be called concurrently with other operations on =sb.  Returns
+ * zero on success or a negative value on error (EINVAL for an unknown policy
+ * or a zero period with FS_DURABLE_PERIODIC). */
+int fs_set_durability(struct superblock *sb, int policy, uint64_t period_ms);
+
+/* Turn write-back on (=max_dirty > 0) or off (=max_dirty == 0) for an image
+ * without journal.  With write-back, every block written by an operation,
+ * data included, stays in memory and the operation returns without writing
+ * to the image.  A thread takes all cached blocks once there are =max_dirty
+ * of them (and every period with FS_DURABLE_PERIODIC) and writes them in
+ * block order, coalescing adjacent blocks, while operations go on with an
+ * empty cache.  An operation that finds 4 * =max_dirty blocks cached writes
+ * them itself.  Turning write-back off and fs_close write every cached block.
+ * Must not be called concurrently with other operations on =sb.  Returns zero
+ * on success or a negative value on error (EINVAL on images with a journal,
+ * EBUSY inside a transaction). */
+int fs_set_writeback(struct superblock *sb, uint64_t max_dirty);
+
+/* Turn hole punching on (=batch > 0) or off (=batch == 0): the storage of
+ * free blocks is released with =discard of the image's device (see struct
+ * fs_backend), so that a sparse image file only keeps the blocks in use.
+ * Turning it on releases the blocks already free right away, reading each
+ * free-list page once; runs of pages holding no other blocks (as written by
+ * fs_format) are folded into the links of the page before them, rewritten
+ * once, so that they can be released too.  Blocks freed afterwards are
+ * queued, and the operation that brings the queue to =batch blocks first gets
+ * the image to disk (a checkpoint with a journal, the cached blocks with
+ * write-back) and then releases them, with one =discard per run of
+ * consecutive blocks.  Blocks that hold the free list itself are never
+ * released, so freed blocks (fs_put_block's included) first fill the room
+ * left in the first page of their free list before new pages are made.
+ * Blocks freed by a transaction that is aborted leave the queue.  Turning it
+ * off and fs_close release the queue.  Must not be called concurrently with
+ * other operations on =sb.  Returns zero on success or a negative value on
+ * error (EOPNOTSUPP if the device has no =discard, EBUSY inside a
+ * transaction, or the errno of a failed =discard, after which punching stays
+ * off). */
+int fs_set_punch(struct superblock *sb, uint64_t batch);
+
+/* One directory entry, as returned by fs_readdir. */
+struct fs_dirent {
+	const char *name; /* last component of the entry's path */
+	int type; /* IMREG or IMDIR */
+	uint64_t inode; /* first inode of the entry */
+	uint64_t size; /* bytes in a file, entries in a directory */
+};
+
+struct fs_dir;
+
+/* Open the directory =dname of =sb for reading with fs_readdir.  Returns
+ * NULL on error and sets errno (ENOTDIR if =dname is not a directory).  The
+ * cursor uses a fixed amount of memory, whatever the size of the directory,
+ * and must be released with fs_closedir. */
+struct fs_dir * fs_opendir(struct superblock *sb, const char *dname);
+
+/* Return the next entry of the directory opened in =d, or NULL at the end of
+ * the directory (with errno set to zero) or on error (with errno set).
+ * Entries are read ahead in batches: the inodes and nodeinfos of up to 64
+ * entries are fetched together, with one vectored read per run of nearby
+ * blocks, so a listing costs a few reads per batch instead of two dependent
+ * reads per entry.  Entries come in the order fs_list_dir lists them; the
+ * returned entry and its =name are valid until the next call on =d.  The
+ * directory may be changed between calls: entries that exist from fs_opendir
+ * to the end are returned exactly once, entries added or removed meanwhile
+ * may or may not be.  The directory itself must not be removed while it is
+ * open. */
+const struct fs_dirent * fs_readdir(struct fs_dir *d);
+
+/* Release =d.  Returns zero. */
+int fs_closedir(struct fs_dir *d);
+
+/* Return a newly allocated string with the names of the entries of =dname,
+ * separated by spaces, with a slash after the names of directories.  Built
+ * on fs_readdir.  Returns NULL on error and sets errno. */
 char * fs_list_dir(struct superblock *sb, const char *dname);
 
+/* Metadata of a file or directory, as returned by fs_stat. */
+struct fs_stat {
+	uint64_t mode; /* IMREG or IMDIR */
+	uint64_t size; /* bytes in a file; zero for a directory */
+	uint64_t inode; /* first inode of the entry */
+	uint64_t blocks;
+	/* blocks used by a file: its inodes, nodeinfo, block map and data.
+	 * for a directory, its first inode and nodeinfo only. */
+	uint64_t children; /* entries in a directory; zero for a file */
+};
+
+/* Store the metadata of =path in =out.  Only the entry's first inode and
+ * nodeinfo are read, never its data.  Returns zero on success or a negative
+ * value on error, and sets errno. */
+int fs_stat(struct superblock *sb, const char *path, struct fs_stat *out);
+
+/* Same as fs_stat (there are no symbolic links). */
+int fs_lstat(struct superblock *sb, const char *path, struct fs_stat *out);
+
+/* fs_stat for the =n paths in =paths, storing each result in the same
+ * position of =out.  Paths are grouped by parent directory and each parent
+ * is resolved once; in a chain directory all the paths under it are matched
+ * in a single pass over its entries.  A path that does not exist (or is too
+ * long) leaves its =out zeroed.  Returns the number of paths found, or a
+ * negative value on error (and sets errno). */
+ssize_t fs_stat_many(struct superblock *sb, const char **paths, size_t n,
+                     struct fs_stat *out);
+
+/* Copy the counters of =sb (see struct fs_stats) to =out.  They start at
+ * zero when the superblock is created by fs_format or fs_open and are only
+ * kept in memory.  Counting takes a few relaxed atomic additions per block
+ * and two clock reads per call, so it is always on.  Returns zero. */
+int fs_get_stats(struct superblock *sb, struct fs_stats *out);
+
+/* Set every counter of =sb to zero.  Returns zero. */
+int fs_reset_stats(struct superblock *sb);
+
+/* Record the last =nevents (rounded up to a power of two) events of =sb in a
+ * ring buffer in memory: the beginning and end of each public call (as
+ * counted by fs_get_stats), every block read or written with its number and
+ * kind (FS_BLOCK_*, and whether a read came from the cache), and every block
+ * taken from or returned to the free list.  Threads add events with one
+ * atomic addition and no lock; the oldest events are overwritten.  Starting
+ * again discards the events recorded so far.  Must not be called
+ * concurrently with other operations on =sb.  Returns zero on success or a
+ * negative value on error (EINVAL if =nevents is zero, ENOMEM). */
+int fs_trace_start(struct superblock *sb, uint64_t nevents);
+
+/* Stop recording events and release the ring buffer (also done by fs_close).
+ * Must not be called concurrently with other operations on =sb.  Returns
+ * zero. */
+int fs_trace_stop(struct superblock *sb);
+
+/* Write the events in the ring buffer of =sb, oldest first, to the file
+ * =path as Chrome trace JSON (loadable by chrome://tracing and Perfetto):
+ * public calls are duration events per thread and block events are instant
+ * events whose args hold the block number.  May be called while other
+ * threads use =sb; events being written at that moment are left out.
+ * Returns the number of events written, or a negative value on error (EINVAL
+ * if =sb is not tracing, or the errno of creating =path). */
+int64_t fs_trace_dump(struct superblock *sb, const char *path);
+
+/* Calls recorded by fs_record_start besides the FS_OP_* ones. */
+#define FS_RECORD_TXN_BEGIN FS_NOPS
+#define FS_RECORD_CLOSEDIR (FS_NOPS + 1)
+
+#define FS_RECORD_MAGIC 0xdcc605f5736c6f67ULL
+
+/* First bytes of a file written by fs_record_start: the geometry of the
+ * image being recorded, so that a replay can format a similar one. */
+struct fs_record_header {
+	uint64_t magic; /* FS_RECORD_MAGIC */
+	uint64_t blksz;
+	uint64_t blks;
+	uint64_t journal; /* =journalblks of the superblock */
+	uint64_t btree; /* nonzero if the root directory is a B+tree */
+};
+
+/* One recorded call, followed in the file by =len bytes: the =count paths
+ * of the call, each ending in a zero byte, padded with zeros to a multiple
+ * of eight bytes, and then (for FS_OP_WRITE_FILES only) =count uint64_t
+ * sizes.  =arg depends on =op:
+ *
+ *   FS_OP_GET_BLOCK        arg[0] is the block returned
+ *   FS_OP_PUT_BLOCK        arg[0] is the block
+ *   FS_OP_WRITE_FILE       one path; arg[0] is the size
+ *   FS_OP_WRITE_FILES      count paths and sizes
+ *   FS_OP_READ_FILE        one path; arg[0] is the buffer size, arg[1] the
+ *                          offset given to fs_read_file_at
+ *   FS_OP_OPENDIR          one path; arg[0] identifies the fs_dir returned
+ *   FS_OP_READDIR          arg[0] identifies the fs_dir
+ *   FS_RECORD_CLOSEDIR     arg[0] identifies the fs_dir
+ *   FS_OP_STAT_MANY        count paths
+ *   FS_OP_RECLAIM          arg[0] is the budget
+ *   FS_OP_DEFRAG           arg[0] is the budget, arg[1] the flags
+ *
+ * FS_OP_UNLINK, FS_OP_MKDIR, FS_OP_RMDIR, FS_OP_RMDIR_RECURSIVE,
+ * FS_OP_LIST_DIR and FS_OP_STAT have one path; the other calls have none.
+ * File contents are not recorded. */
+struct fs_record {
+	uint64_t start; /* nanoseconds from fs_record_start to the call */
+	uint64_t ns; /* duration of the call */
+	uint64_t arg[2];
+	uint32_t thread; /* small number given to each thread, from 1 */
+	uint32_t op; /* FS_OP_* or FS_RECORD_* */
+	uint32_t count; /* number of paths */
+	uint32_t len; /* bytes that follow */
+};
+
+/* Append to the file =path (created or truncated) a struct fs_record_header
+ * and then a struct fs_record for each public call made on =sb (as counted by
+ * fs_get_stats, plus fs_txn_begin and fs_closedir) when it returns, in that
+ * order.  Records are buffered and written under a lock shared by all
+ * threads.  fs_set_reclaim, fs_set_durability, fs_set_writeback, fs_set_punch
+ * and the tracing calls are not recorded.  Must not be called concurrently
+ * with other operations on =sb.  Returns zero on success or a negative value
+ * on error (EBUSY if =sb is already recording, or the errno of creating
+ * =path). */
+int fs_record_start(struct superblock *sb, const char *path);
+
+/* Stop recording and close the file (also done by fs_close).  Must not be
+ * called concurrently with other operations on =sb.  Returns zero on success
+ * or a negative value if a record could not be written (EINVAL if =sb is not
+ * recording). */
+int fs_record_stop(struct superblock *sb);
+
+struct fs_replay_options {
+	uint64_t threads;
+	/* threads that make the calls, or zero for one per recorded thread.
+	 * the calls of a recorded thread are made in order by thread number
+	 * k % =threads, where k counts recorded threads in order of their first
+	 * call.  with more than one thread, each call holds the lock of the
+	 * superblock, as with a journal. */
+	double speedup;
+	/* if nonzero, each call is made no earlier than its =start divided by
+	 * =speedup after the replay started; if zero, as soon as possible. */
+};
+
+struct fs_replay_result {
+	uint64_t calls; /* calls made */
+	uint64_t failed; /* calls that returned an error */
+	uint64_t ns; /* time from the first call to the end of the last one */
+};
+
+/* Make again on =sb the calls recorded in the file =path by fs_record_start,
+ * as described by =opts (NULL for the defaults), and store the totals in
+ * =out if it is not NULL.  Files are written with a fixed pattern of the
+ * recorded sizes; blocks put back are those returned by the replayed
+ * fs_get_block calls.  The latency of each call is counted in the
+ * statistics of =sb (see fs_get_stats), which may be reset first.  Failed
+ * calls do not stop the replay.  Returns zero on success or a negative value
+ * on error (EBADF if =path is not a recording, ENOMEM). */
+int fs_replay(struct superblock *sb, const char *path,
+              const struct fs_replay_options *opts, struct fs_replay_result *out);
+
+/* Start a transaction on =sb.  Until fs_txn_commit or fs_txn_abort, the
+ * calling thread holds =sb (other threads wait) and every block written by
+ * its operations, data included, is kept in memory: a block written several
+ * times is stored once, and the operations see their own writes.  With a
+ * journal the transaction starts with an empty log and is limited to its
+ * size: an operation that does not fit fails with ENOSPC, and so will
+ * fs_txn_commit.  Returns zero on success or a negative value on error (EBUSY
+ * if the thread already has a transaction open on =sb). */
+int fs_txn_begin(struct superblock *sb);
+
+/* Write everything done since fs_txn_begin.  With a journal this is a single
+ * journal transaction, durable when the function returns; otherwise the
+ * blocks are written to their home locations in block order, coalescing
+ * adjacent blocks (left to the write-back thread if write-back is on, see
+ * fs_set_writeback), but with no atomicity if the process dies.  If an
+ * operation of the transaction failed while keeping its blocks (ENOSPC,
+ * ENOMEM), some of its writes may be missing, so the transaction is discarded
+ * as by fs_txn_abort and the commit fails with that error.  Returns zero on
+ * success or a negative value on error (EINVAL if the calling thread has no
+ * transaction open on =sb). */
+int fs_txn_commit(struct superblock *sb);
+
+/* Discard everything done since fs_txn_begin, leaving the filesystem as it
+ * was.  fs_close aborts a transaction still open.  Returns zero on success
+ * or a negative value on error (EINVAL as for fs_txn_commit). */
+int fs_txn_abort(struct superblock *sb);
+
 #endif
@@ -0,0 +1,253 @@
+/* I/O accounting for the test binaries, loaded with LD_PRELOAD (see the
+ * IOTRACE mode of tests/testN.sh).  Counts the system calls made on image
+ * files, which are the files opened read-write with open(2), as fs_format
+ * and fs_open do (images created with fopen by the tests are not counted).
+ * At exit, one line is written to the file named by $IOTRACE_OUT (stderr if
+ * unset):
+ *
+ *   ios=<n> reads=<n> writes=<n> syncs=<n> lseeks=<n> bytes_read=<n> bytes_written=<n> seek_bytes=<n> sequential=<fraction>
+ *
+ * ios counts reads, writes and syncs.  Each read or write starts where the
+ * previous I/O on its descriptor ended (sequential) or seek_bytes away from
+ * it.  A test can check budgets while it runs through iotrace_ios and
+ * iotrace_seek_bytes, declared weak so that it also links without this
+ * library. */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define MAXFD 4096
+
+static uint64_t reads, writes, syncs, lseeks, bytes_read, bytes_written;
+static uint64_t seek_bytes, sequential;
+static char traced[MAXFD]; /* image descriptors */
+static int64_t position[MAXFD]; /* where the last I/O on each ended */
+
+#define ADD(c, n) __atomic_fetch_add(&(c), (uint64_t)(n), __ATOMIC_RELAXED)
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_open64)(const char *, int, ...);
+static int (*real_close)(int);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static ssize_t (*real_pread)(int, void *, size_t, off_t);
+static ssize_t (*real_pread64)(int, void *, size_t, off_t);
+static ssize_t (*real_pwrite)(int, const void *, size_t, off_t);
+static ssize_t (*real_pwrite64)(int, const void *, size_t, off_t);
+static ssize_t (*real_preadv)(int, const struct iovec *, int, off_t);
+static ssize_t (*real_preadv64)(int, const struct iovec *, int, off_t);
+static ssize_t (*real_pwritev)(int, const struct iovec *, int, off_t);
+static ssize_t (*real_pwritev64)(int, const struct iovec *, int, off_t);
+static off_t (*real_lseek)(int, off_t, int);
+static off_t (*real_lseek64)(int, off_t, int);
+static int (*real_fsync)(int);
+static int (*real_fdatasync)(int);
+
+
+#define RESOLVE(f) real_##f = dlsym(RTLD_NEXT, #f)
+static void __attribute__((constructor)) resolve(void)/*{{{*/
+{
+	RESOLVE(open); RESOLVE(open64); RESOLVE(close);
+	RESOLVE(read); RESOLVE(write);
+	RESOLVE(pread); RESOLVE(pread64); RESOLVE(pwrite); RESOLVE(pwrite64);
+	RESOLVE(preadv); RESOLVE(preadv64); RESOLVE(pwritev); RESOLVE(pwritev64);
+	RESOLVE(lseek); RESOLVE(lseek64); RESOLVE(fsync); RESOLVE(fdatasync);
+}
+/*}}}*/
+
+
+uint64_t iotrace_ios(void)/*{{{*/
+{
+	return __atomic_load_n(&reads, __ATOMIC_RELAXED) +
+		__atomic_load_n(&writes, __ATOMIC_RELAXED) +
+		__atomic_load_n(&syncs, __ATOMIC_RELAXED);
+}
+/*}}}*/
+
+
+uint64_t iotrace_seek_bytes(void)/*{{{*/
+{
+	return __atomic_load_n(&seek_bytes, __ATOMIC_RELAXED);
+}
+/*}}}*/
+
+
+static int is_traced(int fd)/*{{{*/
+{
+	return fd >= 0 && fd < MAXFD && traced[fd];
+}
+/*}}}*/
+
+
+/* one read or write of n bytes at offset off */
+static void account(int fd, int64_t off, ssize_t n, int write)/*{{{*/
+{
+	int64_t last = __atomic_exchange_n(&position[fd], off + (n > 0 ? n : 0),
+			__ATOMIC_RELAXED);
+	if(write) ADD(writes, 1); else ADD(reads, 1);
+	if(n > 0 && write) ADD(bytes_written, n);
+	if(n > 0 && !write) ADD(bytes_read, n);
+	if(off == last) ADD(sequential, 1);
+	else ADD(seek_bytes, off > last ? off - last : last - off);
+}
+/*}}}*/
+
+
+static ssize_t total(const struct iovec *iov, int n)/*{{{*/
+{
+	ssize_t t = 0;
+	int i;
+	for(i = 0; i < n; i++) t += iov[i].iov_len;
+	return t;
+}
+/*}}}*/
+
+
+static int opened(int fd, int flags)/*{{{*/
+{
+	if(fd >= 0 && fd < MAXFD) {
+		traced[fd] = (flags & O_ACCMODE) == O_RDWR;
+		position[fd] = 0;
+	}
+	return fd;
+}
+/*}}}*/
+
+
+int open(const char *path, int flags, ...)/*{{{*/
+{
+	va_list ap;
+	va_start(ap, flags);
+	mode_t mode = (flags & O_CREAT) ? va_arg(ap, mode_t) : 0;
+	va_end(ap);
+	return opened(real_open(path, flags, mode), flags);
+}
+/*}}}*/
+
+
+int open64(const char *path, int flags, ...)/*{{{*/
+{
+	va_list ap;
+	va_start(ap, flags);
+	mode_t mode = (flags & O_CREAT) ? va_arg(ap, mode_t) : 0;
+	va_end(ap);
+	return opened(real_open64(path, flags, mode), flags);
+}
+/*}}}*/
+
+
+int close(int fd)/*{{{*/
+{
+	if(fd >= 0 && fd < MAXFD) traced[fd] = 0;
+	return real_close(fd);
+}
+/*}}}*/
+
+
+ssize_t read(int fd, void *buf, size_t n)/*{{{*/
+{
+	ssize_t r = real_read(fd, buf, n);
+	if(is_traced(fd)) account(fd, position[fd], r, 0);
+	return r;
+}
+/*}}}*/
+
+
+ssize_t write(int fd, const void *buf, size_t n)/*{{{*/
+{
+	ssize_t r = real_write(fd, buf, n);
+	if(is_traced(fd)) account(fd, position[fd], r, 1);
+	return r;
+}
+/*}}}*/
+
+
+#define POSITIONED(name, buf_t, write) \
+ssize_t name(int fd, buf_t buf, size_t n, off_t off) \
+{ \
+	ssize_t r = real_##name(fd, buf, n, off); \
+	if(is_traced(fd)) account(fd, off, r, write); \
+	return r; \
+}
+
+POSITIONED(pread, void *, 0)
+POSITIONED(pread64, void *, 0)
+POSITIONED(pwrite, const void *, 1)
+POSITIONED(pwrite64, const void *, 1)
+
+#define VECTORED(name, write) \
+ssize_t name(int fd, const struct iovec *iov, int n, off_t off) \
+{ \
+	ssize_t r = real_##name(fd, iov, n, off); \
+	if(is_traced(fd)) account(fd, off, r < 0 ? r : total(iov, n), write); \
+	return r; \
+}
+
+VECTORED(preadv, 0)
+VECTORED(preadv64, 0)
+VECTORED(pwritev, 1)
+VECTORED(pwritev64, 1)
+
+
+off_t lseek(int fd, off_t off, int whence)/*{{{*/
+{
+	off_t r = real_lseek(fd, off, whence);
+	if(is_traced(fd) && r >= 0) {
+		ADD(lseeks, 1);
+		position[fd] = r;
+	}
+	return r;
+}
+/*}}}*/
+
+
+off_t lseek64(int fd, off_t off, int whence)/*{{{*/
+{
+	off_t r = real_lseek64(fd, off, whence);
+	if(is_traced(fd) && r >= 0) {
+		ADD(lseeks, 1);
+		position[fd] = r;
+	}
+	return r;
+}
+/*}}}*/
+
+
+int fsync(int fd)/*{{{*/
+{
+	if(is_traced(fd)) ADD(syncs, 1);
+	return real_fsync(fd);
+}
+/*}}}*/
+
+
+int fdatasync(int fd)/*{{{*/
+{
+	if(is_traced(fd)) ADD(syncs, 1);
+	return real_fdatasync(fd);
+}
+/*}}}*/
+
+
+static void __attribute__((destructor)) report(void)/*{{{*/
+{
+	const char *out = getenv("IOTRACE_OUT");
+	FILE *fp = out ? fopen(out, "w") : stderr;
+	uint64_t ios = reads + writes;
+	if(!fp) return;
+	fprintf(fp, "ios=%" PRIu64 " reads=%" PRIu64 " writes=%" PRIu64
+			" syncs=%" PRIu64 " lseeks=%" PRIu64 " bytes_read=%" PRIu64
+			" bytes_written=%" PRIu64 " seek_bytes=%" PRIu64
+			" sequential=%.3f\n", ios + syncs, reads, writes, syncs, lseeks,
+			bytes_read, bytes_written, seek_bytes,
+			ios ? (double)sequential / ios : 0.0);
+	if(fp != stderr) fclose(fp);
+}
+/*}}}*/
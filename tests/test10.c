@@ -0,0 +1,139 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int build_tree(struct superblock *sb, int nfiles);
+int drain_test(struct superblock *sb);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define BIGSZ 3000
+
+static char *fname = "img";
+static char *dirs[] = {"/t", "/t/a", "/t/a/b", "/t/c"};
+static char big[BIGSZ];
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 21, 1 << 22};
+	uint64_t blkszs[] = {128, 256, 1024};
+	int i, j;
+	for(i = 0; i < BIGSZ; i++) big[i] = 'a' + i % 26;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	uint64_t freeblks = sb->freeblks;
+
+	if(fs_write_file(sb, "/keep", "keep", 5) < 0) ERROR("FAIL fs_write_file\n");
+	uint64_t base = sb->freeblks;
+
+	if(build_tree(sb, 3 * sb->nlinks)) return -1;
+	if(fs_rmdir_recursive(sb, "/") == 0 || errno != EBUSY) ERROR("FAIL rmdir root\n");
+	if(fs_rmdir_recursive(sb, "/keep") == 0 || errno != ENOTDIR) ERROR("FAIL rmdir file\n");
+	if(fs_rmdir_recursive(sb, "/none") == 0 || errno != ENOENT) ERROR("FAIL rmdir missing\n");
+	if(fs_rmdir_recursive(sb, "/t/a") < 0) ERROR("FAIL fs_rmdir_recursive /t/a\n");
+	if(fs_read_file(sb, "/t/a/b/f0", big, BIGSZ) >= 0) ERROR("FAIL file survived\n");
+	char *list = fs_list_dir(sb, "/t");
+	if(strcmp(list, "c/ f0 f1")) ERROR("FAIL fs_list_dir /t\n");
+	free(list);
+	if(fs_rmdir_recursive(sb, "/t") < 0) ERROR("FAIL fs_rmdir_recursive /t\n");
+	if(sb->freeblks != base) ERROR("FAIL freeblks after fs_rmdir_recursive\n");
+	list = fs_list_dir(sb, "/");
+	if(strcmp(list, "keep")) ERROR("FAIL fs_list_dir /\n");
+	free(list);
+
+	/* the freed blocks are usable again, also after a reopen. */
+	if(build_tree(sb, 2 * sb->nlinks)) return -1;
+	if(fs_rmdir_recursive(sb, "/t") < 0) ERROR("FAIL fs_rmdir_recursive (2nd time)\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(sb->freeblks != base) ERROR("FAIL freeblks after fs_open\n");
+	if(drain_test(sb)) return -1;
+	if(fs_unlink(sb, "/keep") < 0) ERROR("FAIL fs_unlink\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after fs_unlink\n");
+
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int build_tree(struct superblock *sb, int nfiles)/*{{{*/
+{
+	char name[32];
+	int i, j;
+	for(i = 0; i < NELEMS(dirs); i++) {
+		if(fs_mkdir(sb, dirs[i]) < 0) ERROR("FAIL fs_mkdir\n");
+	}
+	for(i = 0; i < 3; i++) {
+		/* /t/c stays empty */
+		for(j = 0; j < (i < 2 ? 2 : nfiles); j++) {
+			sprintf(name, "%s/f%d", dirs[i], j);
+			if(fs_write_file(sb, name, big, j % 4 ? 10 : BIGSZ) < 0)
+				ERROR("FAIL fs_write_file in tree\n");
+		}
+	}
+	return 0;
+}
+/*}}}*/
+
+
+/* every free block is handed out exactly once. */
+int drain_test(struct superblock *sb)/*{{{*/
+{
+	uint64_t n = sb->freeblks, i, b;
+	uint64_t *blocks = malloc(n * sizeof(uint64_t));
+	char *seen = calloc(sb->blks, 1);
+	for(i = 0; i < n; i++) {
+		b = fs_get_block(sb);
+		if(b == 0 || b >= sb->blks || seen[b]) ERROR("FAIL fs_get_block\n");
+		seen[b] = 1;
+		blocks[i] = b;
+	}
+	if(fs_get_block(sb) != 0) ERROR("FAIL fs_get_block past the end\n");
+	for(i = 0; i < n; i++) {
+		if(fs_put_block(sb, blocks[i])) ERROR("FAIL fs_put_block\n");
+	}
+	if(sb->freeblks != n) ERROR("FAIL freeblks after drain\n");
+	free(blocks);
+	free(seen);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,206 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int deferred_test(struct superblock *sb);
+int background_test(struct superblock *sb);
+int recovery_test(struct superblock **sb);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+/* spans several inodes for every block size below */
+#define BIGSZ(sb) (4 * (sb)->nlinks * (sb)->blksz + 100)
+
+static char *fname = "img";
+static char *big;
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 22, 1 << 23};
+	uint64_t blkszs[] = {128, 256, 1024};
+	int i, j;
+	big = malloc(4 * 1024 * 1024);
+	for(i = 0; i < 4 * 1024 * 1024; i++) big[i] = 'a' + i % 26;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(sb->version != FS_VERSION || sb->orphans != 0) ERROR("FAIL version\n");
+	if(fs_set_reclaim(sb, 42) == 0 || errno != EINVAL) ERROR("FAIL bad mode\n");
+
+	if(deferred_test(sb)) return -1;
+	if(recovery_test(&sb)) return -1;
+	if(background_test(sb)) return -1;
+
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int check_file(struct superblock *sb, const char *name, const char *data,/*{{{*/
+		size_t cnt)
+{
+	char *buf = calloc(cnt + 16, 1);
+	ssize_t r = fs_read_file(sb, name, buf, cnt + 16);
+	int ret = (r == cnt && memcmp(buf, data, cnt) == 0) ? 0 : -1;
+	free(buf);
+	return ret;
+}
+/*}}}*/
+
+
+int deferred_test(struct superblock *sb)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks, used;
+	int64_t r, total = 0;
+
+	if(fs_set_reclaim(sb, FS_RECLAIM_DEFERRED)) ERROR("FAIL fs_set_reclaim\n");
+	if(fs_write_file(sb, "/small", "small", 6) < 0) ERROR("FAIL fs_write_file\n");
+	uint64_t base = sb->freeblks;
+	if(fs_write_file(sb, "/big", big, BIGSZ(sb)) < 0) ERROR("FAIL fs_write_file big\n");
+	used = base - sb->freeblks;
+
+	/* small files are still freed right away. */
+	if(fs_unlink(sb, "/small") < 0) ERROR("FAIL fs_unlink small\n");
+	if(sb->freeblks != base - used + 3) ERROR("FAIL small file deferred\n");
+	if(sb->orphans != 0) ERROR("FAIL small file orphaned\n");
+	if(fs_write_file(sb, "/small", "small", 6) < 0) ERROR("FAIL fs_write_file\n");
+
+	/* unlink only detaches a big file; fs_reclaim frees it in steps. */
+	if(fs_unlink(sb, "/big") < 0) ERROR("FAIL fs_unlink big\n");
+	if(sb->freeblks != base - used) ERROR("FAIL blocks freed inline\n");
+	if(sb->orphans == 0) ERROR("FAIL no orphan\n");
+	if(fs_read_file(sb, "/big", big, 10) >= 0) ERROR("FAIL orphan still visible\n");
+	char *list = fs_list_dir(sb, "/");
+	if(strcmp(list, "small")) ERROR("FAIL fs_list_dir\n");
+	free(list);
+	while((r = fs_reclaim(sb, 10)) > 0) {
+		if(r > 10 + sb->nlinks + 2) ERROR("FAIL reclaim over budget\n");
+		total += r;
+	}
+	if(r < 0) ERROR("FAIL fs_reclaim\n");
+	if(total != used || sb->orphans != 0) ERROR("FAIL blocks reclaimed\n");
+	if(sb->freeblks != base) ERROR("FAIL freeblks after fs_reclaim\n");
+
+	/* an overwrite frees the first inode inline and orphans the rest. */
+	if(fs_write_file(sb, "/big", big, BIGSZ(sb)) < 0) ERROR("FAIL fs_write_file big\n");
+	if(fs_write_file(sb, "/big", big + 1, 100) < 0) ERROR("FAIL overwrite\n");
+	if(sb->orphans == 0) ERROR("FAIL overwrite not deferred\n");
+	if(check_file(sb, "/big", big + 1, 100)) ERROR("FAIL overwritten contents\n");
+	if(fs_reclaim(sb, UINT64_MAX) <= 0) ERROR("FAIL fs_reclaim overwrite\n");
+	if(sb->freeblks != base - 3) ERROR("FAIL freeblks after overwrite\n");
+	if(fs_unlink(sb, "/big") < 0) ERROR("FAIL fs_unlink big\n");
+
+	/* running out of space reclaims orphans first. */
+	if(fs_write_file(sb, "/big", big, BIGSZ(sb)) < 0) ERROR("FAIL fs_write_file big\n");
+	if(fs_unlink(sb, "/big") < 0) ERROR("FAIL fs_unlink big\n");
+	uint64_t fill = sb->freeblks - used / 2;
+	uint64_t *blocks = malloc(fill * sizeof(uint64_t)), i;
+	for(i = 0; i < fill; i++) {
+		blocks[i] = fs_get_block(sb);
+		if(blocks[i] == 0) ERROR("FAIL fs_get_block\n");
+	}
+	if(fs_write_file(sb, "/big", big, BIGSZ(sb)) < 0) ERROR("FAIL fs_write_file with orphans\n");
+	for(i = 0; i < fill; i++) {
+		if(fs_put_block(sb, blocks[i])) ERROR("FAIL fs_put_block\n");
+	}
+	free(blocks);
+	if(check_file(sb, "/big", big, BIGSZ(sb))) ERROR("FAIL contents after ENOSPC\n");
+	if(fs_unlink(sb, "/big") < 0 || fs_unlink(sb, "/small") < 0) ERROR("FAIL fs_unlink\n");
+	if(fs_reclaim(sb, UINT64_MAX) < 0) ERROR("FAIL fs_reclaim\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after deferred_test\n");
+	return 0;
+}
+/*}}}*/
+
+
+/* orphans left by a process that died are freed by the next fs_open. */
+int recovery_test(struct superblock **sb)/*{{{*/
+{
+	uint64_t freeblks = (*sb)->freeblks;
+	if(fs_write_file(*sb, "/big", big, BIGSZ(*sb)) < 0) ERROR("FAIL fs_write_file big\n");
+	if(fs_close(*sb)) ERROR("FAIL error on fs_close");
+
+	pid_t pid = fork();
+	if(pid == 0) {
+		struct superblock *child = fs_open(fname);
+		if(!child || fs_set_reclaim(child, FS_RECLAIM_DEFERRED)) _exit(1);
+		if(fs_unlink(child, "/big") < 0 || child->orphans == 0) _exit(1);
+		_exit(0);
+	}
+	int status;
+	if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+		ERROR("FAIL child\n");
+
+	*sb = fs_open(fname);
+	if(*sb == NULL) ERROR("FAIL fs_open\n");
+	if((*sb)->orphans != 0) ERROR("FAIL orphans after fs_open\n");
+	if((*sb)->freeblks != freeblks) ERROR("FAIL freeblks after recovery\n");
+	return 0;
+}
+/*}}}*/
+
+
+int background_test(struct superblock *sb)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks;
+	char name[16];
+	int i, j;
+
+	if(fs_set_reclaim(sb, FS_RECLAIM_BACKGROUND)) ERROR("FAIL fs_set_reclaim\n");
+	for(i = 0; i < 5; i++) {
+		for(j = 0; j < 4; j++) {
+			sprintf(name, "/b%d", j);
+			if(fs_write_file(sb, name, big, BIGSZ(sb)) < 0) ERROR("FAIL fs_write_file\n");
+		}
+		for(j = 0; j < 4; j++) {
+			sprintf(name, "/b%d", j);
+			if(fs_unlink(sb, name) < 0) ERROR("FAIL fs_unlink\n");
+		}
+	}
+	/* the thread drains the list on its own. */
+	for(i = 0; i < 5000 && fs_reclaim(sb, 0) == 0 && sb->orphans != 0; i++)
+		usleep(1000);
+	if(fs_set_reclaim(sb, FS_RECLAIM_SYNC)) ERROR("FAIL fs_set_reclaim sync\n");
+	if(sb->orphans != 0) ERROR("FAIL background thread did not reclaim\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after background_test\n");
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,28 @@
+#!/bin/bash
+set -u
+
+i=11
+
+gcc -g -Wall -c fs.c &>> gcc.log
+gcc -g -Wall -I. tests/test$i.c fs.o -o test$i -pthread &>> gcc.log
+if [ ! -x test$i ] ; then
+    echo "[$i] compilation error"
+    exit 1 ;
+fi
+
+# with IOTRACE set, the test runs under tests/iotrace.c and its I/O on the
+# image is reported
+preload=
+if [ -n "${IOTRACE:-}" ] ; then
+    gcc -g -Wall -shared -fPIC tests/iotrace.c -o iotrace.so -ldl &>> gcc.log
+    preload="LD_PRELOAD=./iotrace.so IOTRACE_OUT=test$i.io"
+fi
+
+if ! env $preload ./test$i > test$i.out 2> test$i.err ; then
+    echo "[$i] error"
+    exit 1
+fi
+
+if [ -n "$preload" ] ; then echo "[$i] $(cat test$i.io)" ; fi
+rm -f test$i test$i.out test$i.err test$i.io
+exit 0
@@ -0,0 +1,278 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int basic_test(struct superblock *sb);
+int crash_test(struct superblock **sb);
+int held_test(struct superblock **sb);
+int thread_test(struct superblock *sb);
+void * fs_thread(void *arg);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define JOURNAL 64
+#define NTHREADS 4
+/* spans several inodes and more than half the journal */
+#define BIGSZ(sb) (4 * (sb)->nlinks * (sb)->blksz + 100)
+
+static char *fname = "img";
+static char *big;
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 22, 1 << 23};
+	uint64_t blkszs[] = {128, 256, 1024};
+	int i, j;
+	big = malloc(4 * 1024 * 1024);
+	for(i = 0; i < 4 * 1024 * 1024; i++) big[i] = 'a' + i % 26;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	struct fs_options opts = {.journal = FS_MIN_JOURNAL - 1};
+	generate_file(fsize);
+	if(fs_format_opts(fname, blksz, &opts) || errno != EINVAL)
+		ERROR("FAIL small journal\n");
+	opts.journal = fsize / blksz;
+	if(fs_format_opts(fname, blksz, &opts) || errno != ENOSPC)
+		ERROR("FAIL huge journal\n");
+
+	/* without options there is no journal. */
+	struct superblock *sb = fs_format_opts(fname, blksz, NULL);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(sb->journal != 0 || sb->blks - sb->freeblks > 6) ERROR("FAIL default format\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	opts.journal = JOURNAL;
+	sb = fs_format_opts(fname, blksz, &opts);
+	if(sb == NULL) ERROR("FAIL no sb with journal\n");
+	if(sb->journal == 0 || sb->journalblks != JOURNAL) ERROR("FAIL journal fields\n");
+	if(sb->blks - sb->freeblks != 3 + JOURNAL) ERROR("FAIL blocks used by journal\n");
+
+	if(basic_test(sb)) return -1;
+	if(crash_test(&sb)) return -1;
+	if(held_test(&sb)) return -1;
+	if(thread_test(sb)) return -1;
+
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int check_file(struct superblock *sb, const char *name, const char *data,/*{{{*/
+		size_t cnt)
+{
+	char *buf = calloc(cnt + 16, 1);
+	ssize_t r = fs_read_file(sb, name, buf, cnt + 16);
+	int ret = (r == cnt && memcmp(buf, data, cnt) == 0) ? 0 : -1;
+	free(buf);
+	return ret;
+}
+/*}}}*/
+
+
+/* operations behave as without a journal, across checkpoints. */
+int basic_test(struct superblock *sb)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks;
+	char name[32];
+	int i;
+
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir\n");
+	for(i = 0; i < 3 * JOURNAL; i++) {
+		sprintf(name, "/d/f%d", i);
+		if(fs_write_file(sb, name, name, strlen(name) + 1) < 0)
+			ERROR("FAIL fs_write_file\n");
+	}
+	if(fs_write_file(sb, "/big", big, BIGSZ(sb)) < 0) ERROR("FAIL fs_write_file big\n");
+	for(i = 0; i < 3 * JOURNAL; i++) {
+		sprintf(name, "/d/f%d", i);
+		if(check_file(sb, name, name, strlen(name) + 1)) ERROR("FAIL contents\n");
+	}
+	if(check_file(sb, "/big", big, BIGSZ(sb))) ERROR("FAIL contents big\n");
+
+	/* everything is in place after fs_close. */
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(check_file(sb, "/big", big, BIGSZ(sb))) ERROR("FAIL contents big after fs_open\n");
+	if(fs_rmdir_recursive(sb, "/d") < 0) ERROR("FAIL fs_rmdir_recursive\n");
+	if(fs_unlink(sb, "/big") < 0) ERROR("FAIL fs_unlink\n");
+	char *list = fs_list_dir(sb, "/");
+	if(strcmp(list, "")) ERROR("FAIL fs_list_dir\n");
+	free(list);
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after basic_test\n");
+	return fs_close(sb);
+}
+/*}}}*/
+
+
+/* operations return only once durable: a process that dies without fs_close
+ * loses nothing, and blocks reused for data are not overwritten by older
+ * metadata from the journal. */
+int crash_test(struct superblock **sb)/*{{{*/
+{
+	char name[32];
+	int i;
+
+	*sb = fs_open(fname);
+	if(*sb == NULL) ERROR("FAIL fs_open\n");
+	uint64_t freeblks = (*sb)->freeblks;
+	if(fs_close(*sb)) ERROR("FAIL error on fs_close");
+
+	pid_t pid = fork();
+	if(pid == 0) {
+		struct superblock *child = fs_open(fname);
+		if(!child || fs_mkdir(child, "/c") < 0) _exit(1);
+		for(i = 0; i < 40; i++) {
+			sprintf(name, "/c/f%d", i);
+			if(fs_write_file(child, name, name, strlen(name) + 1) < 0) _exit(1);
+		}
+		for(i = 0; i < 40; i += 2) {
+			sprintf(name, "/c/f%d", i);
+			if(fs_unlink(child, name) < 0) _exit(1);
+		}
+		if(fs_write_file(child, "/data", big, 8 * child->blksz) < 0) _exit(1);
+		_exit(0);
+	}
+	int status;
+	if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+		ERROR("FAIL child\n");
+
+	*sb = fs_open(fname);
+	if(*sb == NULL) ERROR("FAIL fs_open\n");
+	for(i = 0; i < 40; i++) {
+		sprintf(name, "/c/f%d", i);
+		if(i % 2 == 0 && fs_read_file(*sb, name, name, sizeof(name)) >= 0)
+			ERROR("FAIL unlinked file after recovery\n");
+		if(i % 2 == 1 && check_file(*sb, name, name, strlen(name) + 1))
+			ERROR("FAIL file after recovery\n");
+	}
+	if(check_file(*sb, "/data", big, 8 * (*sb)->blksz)) ERROR("FAIL data after recovery\n");
+	if(fs_unlink(*sb, "/data") < 0 || fs_rmdir_recursive(*sb, "/c") < 0)
+		ERROR("FAIL cleanup after recovery\n");
+	if((*sb)->freeblks != freeblks) ERROR("FAIL freeblks after recovery\n");
+	return 0;
+}
+/*}}}*/
+
+
+/* blocks freed by a transaction that is not on disk yet are not reused
+ * until it is: a crash would bring back the metadata pointing to them. */
+int held_test(struct superblock **sb)/*{{{*/
+{
+	uint64_t freeblks, held;
+
+	/* starts with an empty log, so that no checkpoint comes in between */
+	if(fs_close(*sb)) ERROR("FAIL error on fs_close");
+	*sb = fs_open(fname);
+	if(*sb == NULL) ERROR("FAIL fs_open\n");
+	freeblks = (*sb)->freeblks;
+	if(fs_write_file(*sb, "/held", big, 4 * (*sb)->blksz) < 0)
+		ERROR("FAIL fs_write_file held\n");
+	if(fs_set_durability(*sb, FS_DURABLE_CLOSE, 0)) ERROR("FAIL fs_set_durability\n");
+	if(fs_unlink(*sb, "/held") < 0) ERROR("FAIL fs_unlink held\n");
+	held = (*sb)->freed;
+	if(held == 0) ERROR("FAIL freed blocks not held\n");
+	if(fs_write_file(*sb, "/a", big, 2 * (*sb)->blksz) < 0) ERROR("FAIL fs_write_file\n");
+	if((*sb)->freed != held) ERROR("FAIL held blocks reused before durable\n");
+
+	/* once the unlink is durable, the held blocks are reused first (/c
+	 * needs more blocks than there are held) */
+	if(fs_set_durability(*sb, FS_DURABLE_FSYNC, 0)) ERROR("FAIL fs_set_durability\n");
+	if(fs_write_file(*sb, "/b", big, 2 * (*sb)->blksz) < 0 ||
+	   fs_write_file(*sb, "/c", big, 8 * (*sb)->blksz) < 0)
+		ERROR("FAIL fs_write_file\n");
+	if((*sb)->freed == held) ERROR("FAIL held blocks not reused once durable\n");
+	if(check_file(*sb, "/a", big, 2 * (*sb)->blksz) ||
+	   check_file(*sb, "/b", big, 2 * (*sb)->blksz) ||
+	   check_file(*sb, "/c", big, 8 * (*sb)->blksz))
+		ERROR("FAIL contents\n");
+	if(fs_unlink(*sb, "/a") < 0 || fs_unlink(*sb, "/b") < 0 || fs_unlink(*sb, "/c") < 0)
+		ERROR("FAIL fs_unlink\n");
+	if((*sb)->freeblks != freeblks) ERROR("FAIL freeblks after held_test\n");
+	return 0;
+}
+/*}}}*/
+
+
+/* concurrent operations are committed in groups. */
+int thread_test(struct superblock *sb)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks;
+	pthread_t threads[NTHREADS];
+	intptr_t ret;
+	int i;
+
+	for(i = 0; i < NTHREADS; i++) {
+		if(pthread_create(&threads[i], NULL, fs_thread, sb)) ERROR("FAIL pthread_create\n");
+	}
+	for(i = 0; i < NTHREADS; i++) {
+		pthread_join(threads[i], (void **)&ret);
+		if(ret) ERROR("FAIL thread\n");
+	}
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after thread_test\n");
+	return 0;
+}
+/*}}}*/
+
+
+void * fs_thread(void *arg)/*{{{*/
+{
+	static int next;
+	struct superblock *sb = arg;
+	intptr_t ret = 0;
+	char name[32];
+	int id = __sync_fetch_and_add(&next, 1), i;
+
+	sprintf(name, "/t%d", id);
+	if(fs_mkdir(sb, name) < 0) return (void *)-1;
+	for(i = 0; i < 50 && !ret; i++) {
+		sprintf(name, "/t%d/f%d", id, i);
+		if(fs_write_file(sb, name, name, strlen(name) + 1) < 0) ret = -1;
+	}
+	for(i = 0; i < 50 && !ret; i++) {
+		sprintf(name, "/t%d/f%d", id, i);
+		if(check_file(sb, name, name, strlen(name) + 1)) ret = -1;
+		if(fs_unlink(sb, name) < 0) ret = -1;
+	}
+	sprintf(name, "/t%d", id);
+	if(fs_rmdir(sb, name) < 0) ret = -1;
+	return (void *)ret;
+}
+/*}}}*/
@@ -0,0 +1,300 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, uint64_t journal);
+int commit_test(struct superblock **sb);
+int abort_test(struct superblock *sb);
+int thread_test(struct superblock *sb);
+int crash_test(struct superblock **sb);
+int failed_test(void);
+void * fs_thread(void *arg);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 30
+/* spans several inodes */
+#define BIGSZ(sb) (4 * (sb)->nlinks * (sb)->blksz + 100)
+
+static char *fname = "img";
+static char *big;
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 22, 1 << 23};
+	uint64_t blkszs[] = {128, 256, 1024};
+	uint64_t journals[] = {0, 1024};
+	int i, j, k;
+	big = malloc(4 * 1024 * 1024);
+	for(i = 0; i < 4 * 1024 * 1024; i++) big[i] = 'a' + i % 26;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(k = 0; k < NELEMS(journals); k++) {
+		printf("fsize %d blksz %d journal %d\n", (int)fsizes[j],
+				(int)blkszs[i], (int)journals[k]);
+		if(test(fsizes[j], blkszs[i], journals[k])) exit(EXIT_FAILURE);
+	}
+	}
+	}
+	if(failed_test()) exit(EXIT_FAILURE);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, uint64_t journal)/*{{{*/
+{
+	struct fs_options opts = {.journal = journal};
+	generate_file(fsize);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+
+	if(fs_txn_commit(sb) == 0 || errno != EINVAL) ERROR("FAIL commit without txn\n");
+	if(fs_txn_abort(sb) == 0 || errno != EINVAL) ERROR("FAIL abort without txn\n");
+	if(fs_txn_begin(sb)) ERROR("FAIL fs_txn_begin\n");
+	if(fs_txn_begin(sb) == 0 || errno != EBUSY) ERROR("FAIL nested fs_txn_begin\n");
+	if(fs_txn_commit(sb)) ERROR("FAIL empty commit\n");
+
+	if(commit_test(&sb)) return -1;
+	if(abort_test(sb)) return -1;
+	if(thread_test(sb)) return -1;
+	if(journal && crash_test(&sb)) return -1;
+
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int check_file(struct superblock *sb, const char *name, const char *data,/*{{{*/
+		size_t cnt)
+{
+	char *buf = calloc(cnt + 16, 1);
+	ssize_t r = fs_read_file(sb, name, buf, cnt + 16);
+	int ret = (r == cnt && memcmp(buf, data, cnt) == 0) ? 0 : -1;
+	free(buf);
+	return ret;
+}
+/*}}}*/
+
+
+/* committed operations are all there, also after fs_close. */
+int commit_test(struct superblock **sb)/*{{{*/
+{
+	uint64_t freeblks = (*sb)->freeblks;
+	char name[32];
+	int i;
+
+	if(fs_txn_begin(*sb)) ERROR("FAIL fs_txn_begin\n");
+	if(fs_mkdir(*sb, "/a") < 0) ERROR("FAIL fs_mkdir\n");
+	for(i = 0; i < NFILES; i++) {
+		sprintf(name, "/a/f%d", i);
+		if(fs_write_file(*sb, name, name, strlen(name) + 1) < 0)
+			ERROR("FAIL fs_write_file\n");
+	}
+	if(fs_write_file(*sb, "/a/big", big, BIGSZ(*sb)) < 0) ERROR("FAIL fs_write_file big\n");
+	if(fs_unlink(*sb, "/a/f0") < 0) ERROR("FAIL fs_unlink\n");
+	/* the transaction sees its own writes */
+	if(check_file(*sb, "/a/big", big, BIGSZ(*sb))) ERROR("FAIL contents in txn\n");
+	if(fs_txn_commit(*sb)) ERROR("FAIL fs_txn_commit\n");
+
+	if(fs_close(*sb)) ERROR("FAIL error on fs_close");
+	*sb = fs_open(fname);
+	if(*sb == NULL) ERROR("FAIL fs_open\n");
+	if(check_file(*sb, "/a/big", big, BIGSZ(*sb))) ERROR("FAIL contents after commit\n");
+	for(i = 1; i < NFILES; i++) {
+		sprintf(name, "/a/f%d", i);
+		if(check_file(*sb, name, name, strlen(name) + 1)) ERROR("FAIL file after commit\n");
+	}
+	if(fs_read_file(*sb, "/a/f0", name, sizeof(name)) >= 0) ERROR("FAIL unlinked file\n");
+	if(fs_rmdir_recursive(*sb, "/a") < 0) ERROR("FAIL fs_rmdir_recursive\n");
+	if((*sb)->freeblks != freeblks) ERROR("FAIL freeblks after commit_test\n");
+	return 0;
+}
+/*}}}*/
+
+
+/* aborted operations leave no trace, on disk or in the superblock. */
+int abort_test(struct superblock *sb)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks;
+	if(fs_write_file(sb, "/keep", "keep", 5) < 0) ERROR("FAIL fs_write_file\n");
+	uint64_t kept = sb->freeblks, freelist = sb->freelist;
+
+	if(fs_txn_begin(sb)) ERROR("FAIL fs_txn_begin\n");
+	if(fs_mkdir(sb, "/b") < 0) ERROR("FAIL fs_mkdir\n");
+	if(fs_write_file(sb, "/b/big", big, BIGSZ(sb)) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_write_file(sb, "/keep", "changed", 8) < 0) ERROR("FAIL overwrite\n");
+	if(fs_txn_abort(sb)) ERROR("FAIL fs_txn_abort\n");
+
+	if(sb->freeblks != kept || sb->freelist != freelist)
+		ERROR("FAIL free list after abort\n");
+	if(check_file(sb, "/keep", "keep", 5)) ERROR("FAIL contents after abort\n");
+	char *list = fs_list_dir(sb, "/");
+	if(strcmp(list, "keep")) ERROR("FAIL fs_list_dir after abort\n");
+	free(list);
+	if(fs_unlink(sb, "/keep") < 0) ERROR("FAIL fs_unlink\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after abort_test\n");
+
+	/* with a journal, a transaction cannot outgrow it. */
+	if(sb->journal) {
+		if(fs_txn_begin(sb)) ERROR("FAIL fs_txn_begin\n");
+		if(fs_write_file(sb, "/huge", big, sb->journalblks * sb->blksz) == 0 ||
+				errno != ENOSPC)
+			ERROR("FAIL transaction larger than the journal\n");
+		if(fs_txn_abort(sb)) ERROR("FAIL fs_txn_abort\n");
+		if(sb->freeblks != freeblks) ERROR("FAIL freeblks after ENOSPC\n");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+/* other threads wait for the transaction to end. */
+int thread_test(struct superblock *sb)/*{{{*/
+{
+	pthread_t thread;
+	intptr_t ret;
+
+	if(fs_txn_begin(sb)) ERROR("FAIL fs_txn_begin\n");
+	if(pthread_create(&thread, NULL, fs_thread, sb)) ERROR("FAIL pthread_create\n");
+	usleep(20000);
+	if(fs_read_file(sb, "/t", big, 10) >= 0) ERROR("FAIL thread ran during txn\n");
+	if(fs_write_file(sb, "/u", "u", 2) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_txn_commit(sb)) ERROR("FAIL fs_txn_commit\n");
+	pthread_join(thread, (void **)&ret);
+	if(ret) ERROR("FAIL thread\n");
+	if(check_file(sb, "/t", "t", 2) || check_file(sb, "/u", "u", 2))
+		ERROR("FAIL files after thread_test\n");
+	if(fs_unlink(sb, "/t") < 0 || fs_unlink(sb, "/u") < 0) ERROR("FAIL fs_unlink\n");
+	return 0;
+}
+/*}}}*/
+
+
+void * fs_thread(void *arg)/*{{{*/
+{
+	struct superblock *sb = arg;
+	/* not the owner: waits, then finds no transaction to end */
+	if(fs_txn_commit(sb) == 0 || errno != EINVAL) return (void *)-1;
+	if(fs_write_file(sb, "/t", "t", 2) < 0) return (void *)-1;
+	return NULL;
+}
+/*}}}*/
+
+
+/* with a journal, a transaction is atomic: one that was not committed when
+ * the process died is not there after fs_open, one that was is. */
+int crash_test(struct superblock **sb)/*{{{*/
+{
+	uint64_t freeblks = (*sb)->freeblks;
+	char name[32];
+	int i, c;
+	if(fs_close(*sb)) ERROR("FAIL error on fs_close");
+
+	for(c = 0; c < 2; c++) {
+		pid_t pid = fork();
+		if(pid == 0) {
+			struct superblock *child = fs_open(fname);
+			if(!child || fs_txn_begin(child) || fs_mkdir(child, "/c") < 0) _exit(1);
+			for(i = 0; i < NFILES; i++) {
+				sprintf(name, "/c/f%d", i);
+				if(fs_write_file(child, name, name, strlen(name) + 1) < 0) _exit(1);
+			}
+			if(c == 1 && fs_txn_commit(child)) _exit(1);
+			_exit(0);
+		}
+		int status;
+		if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+			ERROR("FAIL child\n");
+
+		*sb = fs_open(fname);
+		if(*sb == NULL) ERROR("FAIL fs_open\n");
+		char *list = fs_list_dir(*sb, "/");
+		if(strcmp(list, c ? "c/" : "")) ERROR("FAIL fs_list_dir after crash\n");
+		free(list);
+		if(c == 0 && (*sb)->freeblks != freeblks) ERROR("FAIL freeblks after crash\n");
+		if(c == 1 && check_file(*sb, "/c/f7", "/c/f7", 6)) ERROR("FAIL file after crash\n");
+		if(c == 0 && fs_close(*sb)) ERROR("FAIL error on fs_close");
+	}
+	if(fs_rmdir_recursive(*sb, "/c") < 0) ERROR("FAIL fs_rmdir_recursive\n");
+	if((*sb)->freeblks != freeblks) ERROR("FAIL freeblks after crash_test\n");
+	return 0;
+}
+/*}}}*/
+
+
+static char *read_image(void)/*{{{*/
+{
+	struct stat st;
+	char *buf;
+	FILE *fd = fopen(fname, "r");
+	if(!fd || fstat(fileno(fd), &st)) return NULL;
+	buf = malloc(st.st_size);
+	if(buf && fread(buf, 1, st.st_size, fd) != st.st_size) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(fd);
+	return buf;
+}
+/*}}}*/
+
+
+/* an operation that fails inside a transaction (here for lack of room in
+ * the log) fails the commit too, which then leaves the image as it was. */
+int failed_test(void)/*{{{*/
+{
+	struct fs_options opts = {.journal = 16};
+	uint64_t fsize = 1 << 20, freeblks;
+	char *before, *after;
+	generate_file(fsize);
+	struct superblock *sb = fs_format_opts(fname, 128, &opts);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(fs_write_file(sb, "/f", big, 22 * 1024) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	if((before = read_image()) == NULL) ERROR("FAIL read image\n");
+
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	freeblks = sb->freeblks;
+	if(fs_txn_begin(sb)) ERROR("FAIL fs_txn_begin\n");
+	if(fs_write_file(sb, "/f", big + 1, 100) == 0 || errno != ENOSPC)
+		ERROR("FAIL overwrite larger than the journal\n");
+	if(fs_txn_commit(sb) == 0 || errno != ENOSPC) ERROR("FAIL commit after ENOSPC\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after failed commit\n");
+	if(check_file(sb, "/f", big, 22 * 1024)) ERROR("FAIL contents after failed commit\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	if((after = read_image()) == NULL) ERROR("FAIL read image\n");
+	if(memcmp(before, after, fsize)) ERROR("FAIL image changed by failed commit\n");
+	free(before);
+	free(after);
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,250 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int writeback_test(struct superblock *sb);
+int thread_test(struct superblock *sb);
+int crash_test(uint64_t blksz, uint64_t journal, int policy, int writeback);
+void * fs_thread(void *arg);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NTHREADS 4
+#define PERIOD 10
+/* spans several inodes */
+#define BIGSZ(sb) (4 * (sb)->nlinks * (sb)->blksz + 100)
+
+static char *fname = "img";
+static char *big;
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 22, 1 << 23};
+	uint64_t blkszs[] = {128, 256, 1024};
+	int i, j;
+	big = malloc(4 * 1024 * 1024);
+	for(i = 0; i < 4 * 1024 * 1024; i++) big[i] = 'a' + i % 26;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+/* superblock as stored in the image, bypassing the filesystem */
+struct superblock on_disk(void)/*{{{*/
+{
+	struct superblock sb;
+	int fd = open(fname, O_RDONLY);
+	memset(&sb, 0, sizeof(sb));
+	if(fd >= 0 && pread(fd, &sb, offsetof(struct superblock, fd), 0) < 0) sb.magic = 0;
+	close(fd);
+	return sb;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	struct fs_options opts = {.journal = 256};
+	generate_file(fsize);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(fs_set_writeback(sb, 64) == 0 || errno != EINVAL) ERROR("FAIL writeback with journal\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(fs_set_durability(sb, 42, 0) == 0 || errno != EINVAL) ERROR("FAIL bad policy\n");
+	if(fs_set_durability(sb, FS_DURABLE_PERIODIC, 0) == 0 || errno != EINVAL)
+		ERROR("FAIL periodic without period\n");
+	if(writeback_test(sb)) return -1;
+	if(thread_test(sb)) return -1;
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	if(crash_test(blksz, 0, FS_DURABLE_FSYNC, 1)) return -1;
+	if(crash_test(blksz, 0, FS_DURABLE_PERIODIC, 1)) return -1;
+	if(crash_test(blksz, 0, FS_DURABLE_CLOSE, 1)) return -1;
+	if(crash_test(blksz, 256, FS_DURABLE_PERIODIC, 0)) return -1;
+	if(crash_test(blksz, 256, FS_DURABLE_CLOSE, 0)) return -1;
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int check_file(struct superblock *sb, const char *name, const char *data,/*{{{*/
+		size_t cnt)
+{
+	char *buf = calloc(cnt + 16, 1);
+	ssize_t r = fs_read_file(sb, name, buf, cnt + 16);
+	int ret = (r == cnt && memcmp(buf, data, cnt) == 0) ? 0 : -1;
+	free(buf);
+	return ret;
+}
+/*}}}*/
+
+
+/* with write-back, blocks reach the image only when flushed. */
+int writeback_test(struct superblock *sb)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks;
+	char name[32];
+	int i;
+
+	if(fs_set_writeback(sb, 1 << 20)) ERROR("FAIL fs_set_writeback\n");
+	if(fs_write_file(sb, "/big", big, BIGSZ(sb)) < 0) ERROR("FAIL fs_write_file\n");
+	if(check_file(sb, "/big", big, BIGSZ(sb))) ERROR("FAIL contents in cache\n");
+	if(on_disk().freeblks != freeblks) ERROR("FAIL write reached the image\n");
+
+	/* the periodic thread writes the cache. */
+	if(fs_set_durability(sb, FS_DURABLE_PERIODIC, PERIOD)) ERROR("FAIL fs_set_durability\n");
+	for(i = 0; i < 500 && on_disk().freeblks != sb->freeblks; i++) usleep(1000);
+	if(on_disk().freeblks != sb->freeblks) ERROR("FAIL periodic write-back\n");
+
+	/* with FS_DURABLE_FSYNC, each operation writes its blocks. */
+	if(fs_set_durability(sb, FS_DURABLE_FSYNC, 0)) ERROR("FAIL fs_set_durability\n");
+	if(fs_unlink(sb, "/big") < 0) ERROR("FAIL fs_unlink\n");
+	if(on_disk().freeblks != freeblks) ERROR("FAIL fsync write-back\n");
+
+	/* a small limit has the thread (and operations) write as they go. */
+	if(fs_set_durability(sb, FS_DURABLE_NONE, 0)) ERROR("FAIL fs_set_durability\n");
+	if(fs_set_writeback(sb, 16)) ERROR("FAIL fs_set_writeback\n");
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir\n");
+	for(i = 0; i < 100; i++) {
+		sprintf(name, "/d/f%d", i);
+		if(fs_write_file(sb, name, name, strlen(name) + 1) < 0) ERROR("FAIL fs_write_file\n");
+	}
+	for(i = 0; i < 100; i++) {
+		sprintf(name, "/d/f%d", i);
+		if(check_file(sb, name, name, strlen(name) + 1)) ERROR("FAIL contents\n");
+	}
+	if(fs_rmdir_recursive(sb, "/d") < 0) ERROR("FAIL fs_rmdir_recursive\n");
+
+	/* turning it off writes what is left. */
+	if(fs_write_file(sb, "/keep", "keep", 5) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_set_writeback(sb, 0)) ERROR("FAIL fs_set_writeback off\n");
+	if(on_disk().freeblks != sb->freeblks) ERROR("FAIL write-back off\n");
+	if(fs_unlink(sb, "/keep") < 0) ERROR("FAIL fs_unlink\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after writeback_test\n");
+	return 0;
+}
+/*}}}*/
+
+
+/* operations from several threads while the write-back thread writes. */
+int thread_test(struct superblock *sb)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks;
+	pthread_t threads[NTHREADS];
+	intptr_t ret;
+	int i;
+
+	if(fs_set_writeback(sb, 8)) ERROR("FAIL fs_set_writeback\n");
+	if(fs_set_durability(sb, FS_DURABLE_PERIODIC, 1)) ERROR("FAIL fs_set_durability\n");
+	if(fs_mkdir(sb, "/t") < 0) ERROR("FAIL fs_mkdir\n");
+	for(i = 0; i < NTHREADS; i++) {
+		if(pthread_create(&threads[i], NULL, fs_thread, sb)) ERROR("FAIL pthread_create\n");
+	}
+	for(i = 0; i < NTHREADS; i++) {
+		pthread_join(threads[i], (void **)&ret);
+		if(ret) ERROR("FAIL thread\n");
+	}
+	/* the directory keeps the inodes it grew into */
+	if(fs_rmdir_recursive(sb, "/t") < 0) ERROR("FAIL fs_rmdir_recursive\n");
+	if(fs_set_writeback(sb, 0)) ERROR("FAIL fs_set_writeback off\n");
+	if(fs_set_durability(sb, FS_DURABLE_NONE, 0)) ERROR("FAIL fs_set_durability\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after thread_test\n");
+	if(on_disk().freeblks != freeblks) ERROR("FAIL image after thread_test\n");
+	return 0;
+}
+/*}}}*/
+
+
+void * fs_thread(void *arg)/*{{{*/
+{
+	static int next;
+	struct superblock *sb = arg;
+	intptr_t ret = 0;
+	char name[32];
+	int id = __sync_fetch_and_add(&next, 1), i, r;
+
+	for(r = 0; r < 5 && !ret; r++) {
+		for(i = 0; i < 20 && !ret; i++) {
+			sprintf(name, "/t/%d-%d", id, i);
+			if(fs_write_file(sb, name, name, strlen(name) + 1) < 0) ret = -1;
+		}
+		for(i = 0; i < 20 && !ret; i++) {
+			sprintf(name, "/t/%d-%d", id, i);
+			if(check_file(sb, name, name, strlen(name) + 1)) ret = -1;
+			if(fs_unlink(sb, name) < 0) ret = -1;
+		}
+	}
+	return (void *)ret;
+}
+/*}}}*/
+
+
+/* what each policy promises survives a process that dies right after. */
+int crash_test(uint64_t blksz, uint64_t journal, int policy, int writeback)/*{{{*/
+{
+	struct fs_options opts = {.journal = journal};
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	uint64_t freeblks = sb->freeblks;
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	pid_t pid = fork();
+	if(pid == 0) {
+		struct superblock *child = fs_open(fname);
+		if(!child || fs_set_durability(child, policy, PERIOD)) _exit(1);
+		if(writeback && fs_set_writeback(child, 1 << 20)) _exit(1);
+		if(fs_mkdir(child, "/c") < 0) _exit(1);
+		if(fs_write_file(child, "/c/big", big, BIGSZ(child)) < 0) _exit(1);
+		if(policy == FS_DURABLE_PERIODIC) usleep(20 * PERIOD * 1000);
+		if(policy == FS_DURABLE_CLOSE && fs_close(child)) _exit(1);
+		_exit(0);
+	}
+	int status;
+	if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+		ERROR("FAIL child\n");
+
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(check_file(sb, "/c/big", big, BIGSZ(sb))) ERROR("FAIL file after crash\n");
+	if(fs_rmdir_recursive(sb, "/c") < 0) ERROR("FAIL fs_rmdir_recursive\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after crash_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
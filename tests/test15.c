@@ -0,0 +1,302 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int map_test(struct superblock *sb, uint64_t cnt);
+int reclaim_test(struct superblock **sb, uint64_t cnt);
+int chain_test(struct superblock *sb);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NREADS 200
+
+static char *fname = "img";
+static char *big;
+static uint64_t bigsz = 4 * 1024 * 1024;
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 22, 1 << 23};
+	uint64_t blkszs[] = {128, 256, 1024};
+	int i, j;
+	big = malloc(bigsz);
+	srand(42);
+	for(i = 0; i < bigsz; i++) big[i] = rand();
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+void read_block(struct superblock *sb, uint64_t block, void *buf)/*{{{*/
+{
+	if(pread(sb->fd, buf, sb->blksz, block * sb->blksz) != sb->blksz) {
+		perror("pread");
+		exit(EXIT_FAILURE);
+	}
+}
+/*}}}*/
+
+
+void write_block(struct superblock *sb, uint64_t block, void *buf)/*{{{*/
+{
+	if(pwrite(sb->fd, buf, sb->blksz, block * sb->blksz) != sb->blksz) {
+		perror("pwrite");
+		exit(EXIT_FAILURE);
+	}
+}
+/*}}}*/
+
+
+/* first inode of the file =name in the root directory */
+uint64_t find_inode(struct superblock *sb, const char *name)/*{{{*/
+{
+	struct inode *dir = malloc(sb->blksz), *in = malloc(sb->blksz);
+	struct nodeinfo *info = malloc(sb->blksz);
+	uint64_t i, found = 0;
+	read_block(sb, sb->root, dir);
+	for(;;) {
+		for(i = 0; i < sb->nlinks && !found; i++) {
+			if(!dir->links[i]) continue;
+			read_block(sb, dir->links[i], in);
+			read_block(sb, in->meta, info);
+			if(!strcmp(info->name, name)) found = dir->links[i];
+		}
+		if(found || !dir->next) break;
+		read_block(sb, dir->next, dir);
+	}
+	free(dir);
+	free(in);
+	free(info);
+	return found;
+}
+/*}}}*/
+
+
+/* blocks used by a file of =cnt bytes: data, map nodes and nodeinfo */
+uint64_t file_blocks(struct superblock *sb, uint64_t cnt, uint64_t *height)/*{{{*/
+{
+	uint64_t n = cnt ? (cnt + sb->blksz - 1) / sb->blksz : 1;
+	uint64_t total = n + 1, nodes = n;
+	*height = 0;
+	for(;;) {
+		nodes = (nodes + sb->nlinks - 1) / sb->nlinks;
+		total += nodes;
+		if(nodes == 1) break;
+		(*height)++;
+	}
+	return total;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	uint64_t freeblks = sb->freeblks, nl = sb->nlinks, bs = sb->blksz;
+	uint64_t sizes[] = {0, 1, nl * bs, nl * bs + 1, nl * nl * bs, nl * nl * bs + 1,
+		nl * nl * nl * bs + 1, fsize / 2};
+	int i;
+
+	for(i = 0; i < NELEMS(sizes); i++) {
+		if(sizes[i] > bigsz) continue;
+		if(map_test(sb, sizes[i])) return -1;
+	}
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after map_test\n");
+	/* with a map of height two where the image has room for one */
+	if(reclaim_test(&sb, 2 * nl * nl * bs < fsize / 4 ? 2 * nl * nl * bs : fsize / 4)) return -1;
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after reclaim_test\n");
+	if(chain_test(sb)) return -1;
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after chain_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int check_reads(struct superblock *sb, const char *name, const char *data,/*{{{*/
+		uint64_t cnt)
+{
+	char *buf = malloc(cnt + 16);
+	uint64_t off, len;
+	ssize_t r;
+	int i;
+
+	r = fs_read_file(sb, name, buf, cnt + 16);
+	if(r != cnt || memcmp(buf, data, cnt)) ERROR("FAIL fs_read_file\n");
+	if(fs_read_file_at(sb, name, buf, 16, cnt) != 0) ERROR("FAIL read at end\n");
+	if(fs_read_file_at(sb, name, buf, 16, cnt + 1000) != 0) ERROR("FAIL read past end\n");
+	for(i = 0; i < NREADS && cnt > 0; i++) {
+		off = (uint64_t)rand() % cnt;
+		len = 1 + (uint64_t)rand() % (4 * sb->blksz);
+		r = fs_read_file_at(sb, name, buf, len, off);
+		if(r != (off + len > cnt ? cnt - off : len)) ERROR("FAIL fs_read_file_at length\n");
+		if(memcmp(buf, data + off, r)) ERROR("FAIL fs_read_file_at contents\n");
+	}
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+/* the block map has the expected height and size, and any offset reads back */
+int map_test(struct superblock *sb, uint64_t cnt)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks, height;
+	uint64_t used = file_blocks(sb, cnt, &height);
+	struct inode *in = malloc(sb->blksz);
+
+	if(fs_write_file(sb, "/f", big, cnt) < 0) ERROR("FAIL fs_write_file\n");
+	if(freeblks - sb->freeblks != used) ERROR("FAIL blocks used by file\n");
+	read_block(sb, find_inode(sb, "/f"), in);
+	if(height == 0 && (in->mode != IMREG || in->next != 0)) ERROR("FAIL small file mode\n");
+	if(height != 0 && (in->mode != (IMREG | IMMAP) || in->next != height))
+		ERROR("FAIL block map height\n");
+	if(height != 0) {
+		read_block(sb, in->links[0], in);
+		if(in->mode != (IMCHILD | IMMAP)) ERROR("FAIL map node mode\n");
+	}
+	free(in);
+	if(check_reads(sb, "/f", big, cnt)) return -1;
+
+	/* overwrite with a smaller file, then unlink. */
+	if(cnt > 1 && fs_write_file(sb, "/f", big + 1, cnt / 2) < 0) ERROR("FAIL overwrite\n");
+	if(cnt > 1 && check_reads(sb, "/f", big + 1, cnt / 2)) return -1;
+	if(fs_unlink(sb, "/f") < 0) ERROR("FAIL fs_unlink\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after fs_unlink\n");
+	return 0;
+}
+/*}}}*/
+
+
+/* deferred reclamation frees the map in bounded steps. */
+int reclaim_test(struct superblock **psb, uint64_t cnt)/*{{{*/
+{
+	struct superblock *sb = *psb;
+	uint64_t base = sb->freeblks, height;
+	uint64_t used = file_blocks(sb, cnt, &height);
+	int64_t r, total = 0;
+
+	if(fs_set_reclaim(sb, FS_RECLAIM_DEFERRED)) ERROR("FAIL fs_set_reclaim\n");
+	if(fs_write_file(sb, "/big", big, cnt) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_unlink(sb, "/big") < 0) ERROR("FAIL fs_unlink\n");
+	if(sb->orphans == 0 || sb->freeblks != base - used) ERROR("FAIL unlink not deferred\n");
+	while((r = fs_reclaim(sb, 10)) > 0) {
+		if(r > 10 + sb->nlinks + height + 2) ERROR("FAIL reclaim over budget\n");
+		total += r;
+	}
+	if(r < 0 || total != used || sb->freeblks != base) ERROR("FAIL fs_reclaim\n");
+
+	/* an overwrite moves the old map to an orphan, freed by fs_open. */
+	if(fs_write_file(sb, "/big", big, cnt) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_write_file(sb, "/big", big + 3, 100) < 0) ERROR("FAIL overwrite\n");
+	if(sb->orphans == 0) ERROR("FAIL overwrite not deferred\n");
+	if(check_reads(sb, "/big", big + 3, 100)) return -1;
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	sb = *psb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(sb->orphans != 0 || sb->freeblks != base - 3) ERROR("FAIL orphans after fs_open\n");
+	if(fs_unlink(sb, "/big") < 0) ERROR("FAIL fs_unlink\n");
+	return 0;
+}
+/*}}}*/
+
+
+/* appends three child inodes (the last one half full) to the file =name,
+ * whose first inode is full, as older versions did.  returns its size. */
+uint64_t make_chain(struct superblock *sb, const char *name)/*{{{*/
+{
+	uint64_t nl = sb->nlinks, bs = sb->blksz, cnt = nl * bs, no, prev, child, i, c;
+	struct inode *in = malloc(bs), *ch = malloc(bs);
+	struct nodeinfo *info = malloc(bs);
+
+	if(fs_write_file(sb, name, big, cnt) < 0) return 0;
+	no = prev = find_inode(sb, name);
+	read_block(sb, no, in);
+	if(in->mode != IMREG || in->next != 0) return 0;
+	for(c = 0; c < 3; c++) {
+		child = fs_get_block(sb);
+		memset(ch, 0, bs);
+		ch->mode = IMCHILD;
+		ch->parent = no;
+		ch->meta = prev;
+		for(i = 0; i < (c < 2 ? nl : nl / 2); i++) {
+			ch->links[i] = fs_get_block(sb);
+			write_block(sb, ch->links[i], big + cnt);
+			cnt += bs;
+		}
+		write_block(sb, child, ch);
+		read_block(sb, prev, in);
+		in->next = child;
+		write_block(sb, prev, in);
+		prev = child;
+	}
+	read_block(sb, no, in);
+	read_block(sb, in->meta, info);
+	info->size = cnt - 7;
+	write_block(sb, in->meta, info);
+	free(in);
+	free(ch);
+	free(info);
+	return cnt - 7;
+}
+/*}}}*/
+
+
+/* a file written as a chain of child inodes can still be read at any
+ * offset, overwritten and removed (also through the orphan list). */
+int chain_test(struct superblock *sb)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks, bs = sb->blksz, cnt;
+	struct inode *in = malloc(bs);
+
+	if((cnt = make_chain(sb, "/old")) == 0) ERROR("FAIL make_chain\n");
+	if(check_reads(sb, "/old", big, cnt)) return -1;
+	if(fs_write_file(sb, "/old", big + 5, 2 * sb->nlinks * bs) < 0) ERROR("FAIL overwrite\n");
+	read_block(sb, find_inode(sb, "/old"), in);
+	if(in->mode != (IMREG | IMMAP)) ERROR("FAIL overwrite without map\n");
+	if(check_reads(sb, "/old", big + 5, 2 * sb->nlinks * bs)) return -1;
+	if(fs_unlink(sb, "/old") < 0) ERROR("FAIL fs_unlink\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after overwrite\n");
+
+	if((cnt = make_chain(sb, "/old")) == 0) ERROR("FAIL make_chain\n");
+	if(fs_set_reclaim(sb, FS_RECLAIM_DEFERRED)) ERROR("FAIL fs_set_reclaim\n");
+	if(fs_unlink(sb, "/old") < 0) ERROR("FAIL fs_unlink\n");
+	if(sb->orphans == 0) ERROR("FAIL chain not deferred\n");
+	if(fs_reclaim(sb, UINT64_MAX) <= 0 || sb->orphans != 0) ERROR("FAIL fs_reclaim\n");
+	if(fs_set_reclaim(sb, FS_RECLAIM_SYNC)) ERROR("FAIL fs_set_reclaim\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after fs_reclaim\n");
+	free(in);
+	return 0;
+}
+/*}}}*/
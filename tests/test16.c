@@ -0,0 +1,236 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fill_test(struct superblock *sb, const char *dir, int nfiles);
+int batch_test(struct superblock *sb);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 400
+
+static char *fname = "img";
+static char *names[NFILES];
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 21, 1 << 22};
+	uint64_t blkszs[] = {128, 256, 1024};
+	int i, j;
+	srand(42);
+	for(i = 0; i < NFILES; i++) {
+		names[i] = malloc(32);
+		/* every third name shares more than a key prefix with others */
+		if(i % 3) sprintf(names[i], "f%d", rand() % 100000 * NFILES + i);
+		else sprintf(names[i], "shared_prefix_of_names_%04d", i);
+	}
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+static int cmp(const void *a, const void *b)/*{{{*/
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+/*}}}*/
+
+
+/* the space-separated listing of the names in names[0..n) that are
+ * marked in present, sorted with strcmp */
+char *expected_listing(char **names, int n, const char *present)/*{{{*/
+{
+	char **sorted = malloc(n * sizeof(char *));
+	char *out = calloc(n, 34);
+	int i, k = 0;
+	for(i = 0; i < n; i++) if(!present || present[i]) sorted[k++] = names[i];
+	qsort(sorted, k, sizeof(char *), cmp);
+	for(i = 0; i < k; i++) {
+		if(i) strcat(out, " ");
+		strcat(out, sorted[i]);
+	}
+	free(sorted);
+	return out;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	struct fs_options opts = {.btree_dirs = 1};
+	generate_file(fsize);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(!sb) ERROR("FAIL fs_format_opts");
+	uint64_t freeblks = sb->freeblks;
+
+	if(fill_test(sb, "", NFILES)) return -1;
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after fill_test /");
+
+	/* subdirectories inherit the index; removing them frees every node */
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL fs_mkdir /d");
+	if(fs_mkdir(sb, "/d/e")) ERROR("FAIL fs_mkdir /d/e");
+	if(fill_test(sb, "/d/e", NFILES / 2)) return -1;
+	char *list = fs_list_dir(sb, "/d");
+	if(strcmp(list, "e/")) ERROR("FAIL fs_list_dir /d");
+	free(list);
+	char name[64];
+	int i;
+	for(i = 0; i < NFILES / 2; i++) {
+		sprintf(name, "/d/e/%s", names[i]);
+		if(fs_write_file(sb, name, name, strlen(name) + 1))
+			ERROR("FAIL fs_write_file /d/e");
+	}
+	if(fs_rmdir(sb, "/d") != -1 || errno != ENOTEMPTY) ERROR("FAIL fs_rmdir /d");
+	if(fs_rmdir_recursive(sb, "/d")) ERROR("FAIL fs_rmdir_recursive /d");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after fs_rmdir_recursive");
+	list = fs_list_dir(sb, "/");
+	if(strcmp(list, "")) ERROR("FAIL fs_list_dir / not empty");
+	free(list);
+
+	if(batch_test(sb)) return -1;
+
+	/* the tree survives a reopen */
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open");
+	list = fs_list_dir(sb, "/");
+	char *expected = expected_listing(names, NFILES / 4, NULL);
+	if(strcmp(list, expected)) ERROR("FAIL fs_list_dir after fs_open");
+	free(list);
+	free(expected);
+	for(i = 0; i < NFILES / 4; i++) {
+		sprintf(name, "/%s", names[i]);
+		if(fs_unlink(sb, name)) ERROR("FAIL fs_unlink after fs_open");
+	}
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after fs_open");
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+/* create nfiles files under dir, check lookups, listing order, overwrites
+ * and removals in random order, and leave dir empty */
+int fill_test(struct superblock *sb, const char *dir, int nfiles)/*{{{*/
+{
+	char name[64], buf[64], *present = calloc(nfiles, 1);
+	int i, j, k;
+
+	for(i = 0; i < nfiles; i++) {
+		sprintf(name, "%s/%s", dir, names[i]);
+		if(fs_write_file(sb, name, name, strlen(name) + 1))
+			ERROR("FAIL fs_write_file");
+		present[i] = 1;
+	}
+	sprintf(name, "%s/%s", dir, names[0]);
+	if(fs_mkdir(sb, name) != -1 || errno != EEXIST) ERROR("FAIL fs_mkdir existing");
+
+	for(k = 0; k < 3; k++) {
+		sprintf(name, "%s/", dir);
+		char *list = fs_list_dir(sb, name);
+		char *expected = expected_listing(names, nfiles, present);
+		if(strcmp(list, expected)) ERROR("FAIL fs_list_dir order");
+		free(list);
+		free(expected);
+
+		for(i = 0; i < nfiles; i++) {
+			sprintf(name, "%s/%s", dir, names[i]);
+			int n = fs_read_file(sb, name, buf, sizeof(buf));
+			if(present[i] && (n != strlen(name) + 1 || strcmp(buf, name)))
+				ERROR("FAIL fs_read_file");
+			if(!present[i] && (n != -1 || errno != ENOENT))
+				ERROR("FAIL fs_read_file removed");
+		}
+		/* a prefix of a name is a different name */
+		sprintf(name, "%s/shared_prefix_of_names_", dir);
+		if(fs_read_file(sb, name, buf, sizeof(buf)) != -1) ERROR("FAIL prefix");
+
+		/* remove about half in random order, then put some back */
+		for(j = 0; j < nfiles; j++) {
+			i = rand() % nfiles;
+			sprintf(name, "%s/%s", dir, names[i]);
+			if(present[i] && rand() % 2) {
+				if(fs_unlink(sb, name)) ERROR("FAIL fs_unlink");
+				present[i] = 0;
+			} else if(!present[i] && rand() % 4 == 0) {
+				if(fs_write_file(sb, name, name, strlen(name) + 1))
+					ERROR("FAIL fs_write_file again");
+				present[i] = 1;
+			}
+		}
+	}
+
+	for(i = 0; i < nfiles; i++) {
+		if(!present[i]) continue;
+		sprintf(name, "%s/%s", dir, names[i]);
+		if(fs_unlink(sb, name)) ERROR("FAIL fs_unlink all");
+	}
+	free(present);
+	return 0;
+}
+/*}}}*/
+
+
+/* fs_write_files with new, repeated and overwritten names in one call */
+int batch_test(struct superblock *sb)/*{{{*/
+{
+	struct fs_write_req reqs[NFILES / 4 + 2];
+	char fnames[NFILES / 4 + 2][40], buf[64];
+	int i, n = NFILES / 4;
+
+	for(i = 0; i < n; i += 2) {
+		sprintf(fnames[i], "/%s", names[i]);
+		if(fs_write_file(sb, fnames[i], "old", 4)) ERROR("FAIL fs_write_file old");
+	}
+	for(i = 0; i < n; i++) {
+		sprintf(fnames[i], "/%s", names[i]);
+		reqs[i] = (struct fs_write_req){fnames[i], fnames[i], strlen(fnames[i]) + 1};
+	}
+	strcpy(fnames[n], fnames[1]);
+	reqs[n] = (struct fs_write_req){fnames[n], "dup", 4};
+	strcpy(fnames[n + 1], fnames[1]);
+	reqs[n + 1] = (struct fs_write_req){fnames[n + 1], fnames[1], strlen(fnames[1]) + 1};
+	if(fs_write_files(sb, reqs, n + 2)) ERROR("FAIL fs_write_files");
+
+	for(i = 0; i < n; i++) {
+		if(fs_read_file(sb, fnames[i], buf, sizeof(buf)) != strlen(fnames[i]) + 1 ||
+				strcmp(buf, fnames[i]))
+			ERROR("FAIL fs_read_file after fs_write_files");
+	}
+	char *list = fs_list_dir(sb, "/");
+	char *expected = expected_listing(names, n, NULL);
+	if(strcmp(list, expected)) ERROR("FAIL fs_list_dir after fs_write_files");
+	free(list);
+	free(expected);
+	return 0;
+}
+/*}}}*/
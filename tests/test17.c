@@ -0,0 +1,222 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, int btree);
+int scan_test(struct superblock *sb, int btree);
+int change_test(struct superblock *sb);
+int txn_test(uint64_t fsize, uint64_t blksz, int btree);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 300
+
+static char *fname = "img";
+static char data[NFILES];
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 21, 1 << 22};
+	uint64_t blkszs[] = {128, 256, 1024};
+	int i, j, btree;
+	srand(7);
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(btree = 0; btree <= 1; btree++) {
+		printf("fsize %d blksz %d btree %d\n", (int)fsizes[j],
+				(int)blkszs[i], btree);
+		if(test(fsizes[j], blkszs[i], btree)) exit(EXIT_FAILURE);
+	}
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, int btree)/*{{{*/
+{
+	struct fs_options opts = {.btree_dirs = btree};
+	generate_file(fsize);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(!sb) ERROR("FAIL fs_format_opts");
+
+	if(fs_opendir(sb, "/none") || errno != ENOENT) ERROR("FAIL fs_opendir ENOENT");
+	if(fs_write_file(sb, "/file", "x", 1)) ERROR("FAIL fs_write_file");
+	if(fs_opendir(sb, "/file") || errno != ENOTDIR) ERROR("FAIL fs_opendir ENOTDIR");
+	if(fs_list_dir(sb, "/file") || errno != ENOTDIR) ERROR("FAIL fs_list_dir ENOTDIR");
+	if(fs_unlink(sb, "/file")) ERROR("FAIL fs_unlink");
+
+	struct fs_dir *d = fs_opendir(sb, "/");
+	if(!d) ERROR("FAIL fs_opendir /");
+	if(fs_readdir(d) || errno != 0) ERROR("FAIL fs_readdir empty");
+	if(fs_readdir(d) || errno != 0) ERROR("FAIL fs_readdir past the end");
+	fs_closedir(d);
+
+	if(scan_test(sb, btree)) return -1;
+	if(change_test(sb)) return -1;
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+	unlink(fname);
+	return txn_test(fsize, blksz, btree);
+}
+/*}}}*/
+
+
+/* inside a transaction the entries and sizes come from blocks that are
+ * still only in memory */
+int txn_test(uint64_t fsize, uint64_t blksz, int btree)/*{{{*/
+{
+	struct fs_options opts = {.journal = 256, .btree_dirs = btree};
+	const struct fs_dirent *e;
+	char name[32];
+	int i, n = 0;
+
+	generate_file(fsize);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(!sb) ERROR("FAIL fs_format_opts journal");
+	if(fs_txn_begin(sb)) ERROR("FAIL fs_txn_begin");
+	for(i = 0; i < 40; i++) {
+		sprintf(name, "/t%02d", i);
+		if(fs_write_file(sb, name, data, i)) ERROR("FAIL fs_write_file in txn");
+	}
+	struct fs_dir *d = fs_opendir(sb, "/");
+	if(!d) ERROR("FAIL fs_opendir in txn");
+	while((e = fs_readdir(d)) != NULL) {
+		if(sscanf(e->name, "t%d", &i) != 1 || i != n++ || e->size != i)
+			ERROR("FAIL fs_readdir in txn");
+	}
+	if(errno != 0 || n != 40) ERROR("FAIL fs_readdir count in txn");
+	fs_closedir(d);
+	if(fs_txn_abort(sb)) ERROR("FAIL fs_txn_abort");
+	char *list = fs_list_dir(sb, "/");
+	if(strcmp(list, "")) ERROR("FAIL fs_list_dir after abort");
+	free(list);
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+/* a directory much larger than one inode: every entry once, with its type,
+ * inode and size, and fs_list_dir agreeing with fs_readdir */
+int scan_test(struct superblock *sb, int btree)/*{{{*/
+{
+	char name[32], *seen = calloc(NFILES, 1), *expected = calloc(NFILES, 16);
+	const struct fs_dirent *e;
+	int i, n = 0;
+
+	if(fs_mkdir(sb, "/s")) ERROR("FAIL fs_mkdir /s");
+	for(i = 0; i < NFILES; i++) {
+		sprintf(name, "/s/e%03d", i);
+		if(i % 10 == 0) {
+			if(fs_mkdir(sb, name)) ERROR("FAIL fs_mkdir");
+		} else if(fs_write_file(sb, name, data, i)) {
+			ERROR("FAIL fs_write_file");
+		}
+	}
+	/* both layouts list these names in creation order */
+	for(i = 0; i < NFILES; i++) {
+		sprintf(name, "%se%03d%s", i ? " " : "", i, i % 10 ? "" : "/");
+		strcat(expected, name);
+	}
+
+	struct fs_dir *d = fs_opendir(sb, "/s");
+	if(!d) ERROR("FAIL fs_opendir /s");
+	while((e = fs_readdir(d)) != NULL) {
+		if(sscanf(e->name, "e%d", &i) != 1 || i < 0 || i >= NFILES || seen[i])
+			ERROR("FAIL fs_readdir name");
+		seen[i] = 1;
+		if(i != n++) ERROR("FAIL fs_readdir order");
+		if(e->type != (i % 10 ? IMREG : IMDIR)) ERROR("FAIL fs_readdir type");
+		if(e->size != (i % 10 ? i : 0)) ERROR("FAIL fs_readdir size");
+		if(e->inode < 2 || e->inode >= sb->blks) ERROR("FAIL fs_readdir inode");
+	}
+	if(errno != 0 || n != NFILES) ERROR("FAIL fs_readdir count");
+	fs_closedir(d);
+
+	char *list = fs_list_dir(sb, "/s");
+	if(!list || strcmp(list, expected)) ERROR("FAIL fs_list_dir /s");
+	free(list);
+	if(fs_rmdir_recursive(sb, "/s")) ERROR("FAIL fs_rmdir_recursive");
+	free(seen);
+	free(expected);
+	return 0;
+}
+/*}}}*/
+
+
+/* remove and add entries between calls: entries present throughout come
+ * out exactly once and removed ones never after their removal */
+int change_test(struct superblock *sb)/*{{{*/
+{
+	char name[32], *state = calloc(2 * NFILES, 1), *seen = calloc(2 * NFILES, 1);
+	const struct fs_dirent *e;
+	int i, k, round;
+
+	/* state: 1 present from the start, 2 removed, 3 added during the scan */
+	for(round = 0; round < 3; round++) {
+		memset(seen, 0, 2 * NFILES);
+		for(i = 0; i < NFILES; i++) {
+			sprintf(name, "/c%04d", i * 37 % NFILES);
+			if(fs_write_file(sb, name, "", 0)) ERROR("FAIL fs_write_file");
+			state[i * 37 % NFILES] = 1;
+		}
+		struct fs_dir *d = fs_opendir(sb, "/");
+		if(!d) ERROR("FAIL fs_opendir");
+		while((e = fs_readdir(d)) != NULL) {
+			if(sscanf(e->name, "c%d", &i) != 1 || seen[i]) ERROR("FAIL fs_readdir twice");
+			if(state[i] == 2) ERROR("FAIL fs_readdir removed entry");
+			seen[i] = 1;
+			for(k = 0; k < 3; k++) {
+				i = rand() % (2 * NFILES);
+				sprintf(name, "/c%04d", i);
+				if(state[i] == 1 && rand() % 4 == 0) {
+					if(fs_unlink(sb, name)) ERROR("FAIL fs_unlink");
+					state[i] = 2;
+				} else if(state[i] == 0 && i >= NFILES) {
+					if(fs_write_file(sb, name, "", 0)) ERROR("FAIL fs_write_file");
+					state[i] = 3;
+				}
+			}
+		}
+		if(errno != 0) ERROR("FAIL fs_readdir error");
+		fs_closedir(d);
+		for(i = 0; i < 2 * NFILES; i++) {
+			if(state[i] == 1 && !seen[i]) ERROR("FAIL fs_readdir missed entry");
+			if(state[i] == 1 || state[i] == 3) {
+				sprintf(name, "/c%04d", i);
+				if(fs_unlink(sb, name)) ERROR("FAIL fs_unlink all");
+			}
+			state[i] = 0;
+		}
+	}
+	char *list = fs_list_dir(sb, "/");
+	if(strcmp(list, "")) ERROR("FAIL fs_list_dir not empty");
+	free(list);
+	free(state);
+	free(seen);
+	return 0;
+}
+/*}}}*/
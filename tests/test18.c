@@ -0,0 +1,161 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, int btree);
+int stat_test(struct superblock *sb);
+int many_test(struct superblock *sb);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 120
+
+static char *fname = "img";
+static char *data;
+static uint64_t datasz = 256 * 1024;
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 21, 1 << 22};
+	uint64_t blkszs[] = {128, 256, 1024};
+	int i, j, btree;
+	data = malloc(datasz);
+	for(i = 0; i < datasz; i++) data[i] = i;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(btree = 0; btree <= 1; btree++) {
+		printf("fsize %d blksz %d btree %d\n", (int)fsizes[j],
+				(int)blkszs[i], btree);
+		if(test(fsizes[j], blkszs[i], btree)) exit(EXIT_FAILURE);
+	}
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, int btree)/*{{{*/
+{
+	struct fs_options opts = {.btree_dirs = btree};
+	generate_file(fsize);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(!sb) ERROR("FAIL fs_format_opts");
+	if(stat_test(sb)) return -1;
+	if(many_test(sb)) return -1;
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+/* sizes, types, child counts and block counts, which must match the free
+ * blocks each file took */
+int stat_test(struct superblock *sb)/*{{{*/
+{
+	uint64_t sizes[] = {0, 1, 100, sb->blksz, sb->blksz * sb->nlinks,
+			sb->blksz * sb->nlinks + 1, 100000};
+	struct fs_stat st;
+	char name[32];
+	int i;
+
+	if(fs_stat(sb, "/", &st)) ERROR("FAIL fs_stat /");
+	if(st.mode != IMDIR || st.inode != sb->root || st.children != 0 || st.size)
+		ERROR("FAIL fs_stat / fields");
+	if(fs_stat(sb, "/none", &st) != -1 || errno != ENOENT) ERROR("FAIL fs_stat ENOENT");
+
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL fs_mkdir");
+	for(i = 0; i < NELEMS(sizes); i++) {
+		uint64_t freeblks = sb->freeblks;
+		sprintf(name, "/d/f%d", i);
+		if(fs_write_file(sb, name, data, sizes[i])) ERROR("FAIL fs_write_file");
+		if(fs_stat(sb, name, &st)) ERROR("FAIL fs_stat file");
+		if(st.mode != IMREG || st.size != sizes[i] || st.children)
+			ERROR("FAIL fs_stat file fields");
+		/* the directory may have grown by a chain inode or a few nodes */
+		if(st.blocks > freeblks - sb->freeblks ||
+				st.blocks + 4 < freeblks - sb->freeblks)
+			ERROR("FAIL fs_stat blocks");
+		if(i == 1 && st.blocks != 3) ERROR("FAIL fs_stat blocks of a small file");
+		struct fs_stat lst;
+		if(fs_lstat(sb, name, &lst) || memcmp(&st, &lst, sizeof(st)))
+			ERROR("FAIL fs_lstat");
+	}
+	if(fs_stat(sb, "/d/", &st) || st.mode != IMDIR || st.children != NELEMS(sizes))
+		ERROR("FAIL fs_stat /d");
+	if(fs_stat(sb, "/d/f1/x", &st) != -1 || errno != ENOENT)
+		ERROR("FAIL fs_stat below a file");
+	if(fs_rmdir_recursive(sb, "/d")) ERROR("FAIL fs_rmdir_recursive");
+	return 0;
+}
+/*}}}*/
+
+
+/* fs_stat_many agrees with fs_stat on each path, found or not */
+int many_test(struct superblock *sb)/*{{{*/
+{
+	const char *paths[3 * NFILES + 6];
+	char names[3 * NFILES][32];
+	struct fs_stat out[3 * NFILES + 6], st;
+	int i, n = 0, found = 0;
+
+	if(fs_mkdir(sb, "/a")) ERROR("FAIL fs_mkdir /a");
+	if(fs_mkdir(sb, "/a/b")) ERROR("FAIL fs_mkdir /a/b");
+	for(i = 0; i < NFILES; i++) {
+		sprintf(names[i], "/a/%s%d", i % 2 ? "x" : "y", i);
+		if(fs_write_file(sb, names[i], data, i)) ERROR("FAIL fs_write_file /a");
+		sprintf(names[NFILES + i], "/a/b/z%d", i);
+		if(i % 3 && fs_write_file(sb, names[NFILES + i], data, 3 * i))
+			ERROR("FAIL fs_write_file /a/b");
+		sprintf(names[2 * NFILES + i], "/%s/q%d", i % 2 ? "a" : "none", i);
+	}
+	/* interleaved parents, missing files and directories, repeats */
+	for(i = 0; i < NFILES; i++) {
+		paths[n++] = names[2 * NFILES + i];
+		paths[n++] = names[NFILES - 1 - i];
+		paths[n++] = names[NFILES + i];
+	}
+	paths[n++] = "/";
+	paths[n++] = "/a/b/";
+	paths[n++] = "/a/b";
+	paths[n++] = names[0];
+	paths[n++] = "/a/x1/y";
+
+	if(fs_stat_many(sb, paths, n, out) < 0) ERROR("FAIL fs_stat_many");
+	for(i = 0; i < n; i++) {
+		if(fs_stat(sb, paths[i], &st) == 0) {
+			found++;
+			if(memcmp(&st, &out[i], sizeof(st))) ERROR("FAIL fs_stat_many entry");
+		} else if(out[i].inode || out[i].mode) {
+			ERROR("FAIL fs_stat_many missing entry");
+		}
+	}
+	if(fs_stat_many(sb, paths, n, out) != found) ERROR("FAIL fs_stat_many count");
+	if(found != 1 + 2 + 1 + NFILES + (NFILES - NFILES / 3))
+		ERROR("FAIL fs_stat_many found");
+	if(fs_rmdir_recursive(sb, "/a")) ERROR("FAIL fs_rmdir_recursive");
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,215 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, uint64_t journal);
+int count_test(struct superblock *sb);
+int block_test(struct superblock *sb);
+int reopen_test(uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 20
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 21, 1 << 22};
+	uint64_t blkszs[] = {128, 256, 1024};
+	uint64_t journals[] = {0, 64};
+	int i, j, k;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(k = 0; k < NELEMS(journals); k++) {
+		printf("fsize %d blksz %d journal %d\n", (int)fsizes[j],
+				(int)blkszs[i], (int)journals[k]);
+		if(test(fsizes[j], blkszs[i], journals[k])) exit(EXIT_FAILURE);
+	}
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+/* every call in the histogram of its operation, and no time without calls */
+int check_latency(const struct fs_stats *st)/*{{{*/
+{
+	int op, k;
+	for(op = 0; op < FS_NOPS; op++) {
+		uint64_t n = 0;
+		for(k = 0; k < FS_LATENCY_BUCKETS; k++) n += st->latency[op][k];
+		if(n != st->calls[op]) return -1;
+		if(st->calls[op] == 0 && st->ns[op] != 0) return -1;
+	}
+	return 0;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, uint64_t journal)/*{{{*/
+{
+	struct fs_options opts = {.journal = journal};
+	struct fs_stats st;
+	generate_file(fsize);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(!sb) ERROR("FAIL fs_format_opts");
+	if(fs_get_stats(sb, &st)) ERROR("FAIL fs_get_stats");
+	if(st.calls[FS_OP_FORMAT] != 1) ERROR("FAIL format not counted");
+	if(st.writes[FS_BLOCK_FREEPAGE] != sb->freeblks)
+		ERROR("FAIL free pages written by format");
+	if(st.syscalls < sb->blks) ERROR("FAIL syscalls of format");
+	if(check_latency(&st)) ERROR("FAIL latency after format");
+	if(count_test(sb)) return -1;
+	if(block_test(sb)) return -1;
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+	if(reopen_test(blksz)) return -1;
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+/* calls, nesting of public calls, data blocks and the cache */
+int count_test(struct superblock *sb)/*{{{*/
+{
+	uint64_t nblocks = sb->nlinks < 8 ? sb->nlinks : 8;
+	uint64_t size = nblocks * sb->blksz;
+	char *data = malloc(size), *back = malloc(size), name[32];
+	struct fs_stats st, zero;
+	struct fs_stat info;
+	const struct fs_dirent *e;
+	int i, n;
+
+	memset(&zero, 0, sizeof(zero));
+	for(i = 0; i < size; i++) data[i] = i;
+	if(fs_reset_stats(sb)) ERROR("FAIL fs_reset_stats");
+	fs_get_stats(sb, &st);
+	if(memcmp(&st, &zero, sizeof(st))) ERROR("FAIL counters after reset");
+
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL fs_mkdir");
+	if(fs_write_file(sb, "/d/big", data, size)) ERROR("FAIL fs_write_file");
+	fs_get_stats(sb, &st);
+	if(st.calls[FS_OP_MKDIR] != 1) ERROR("FAIL mkdir calls");
+	/* fs_write_file is built on fs_write_files, but counts only once */
+	if(st.calls[FS_OP_WRITE_FILE] != 1 || st.calls[FS_OP_WRITE_FILES] != 0)
+		ERROR("FAIL write_file calls");
+	if(st.writes[FS_BLOCK_DATA] != nblocks) ERROR("FAIL data blocks written");
+	if(st.reads[FS_BLOCK_DATA] != 0) ERROR("FAIL data blocks read");
+	if(st.writes[FS_BLOCK_INODE] == 0 || st.writes[FS_BLOCK_NODEINFO] == 0 ||
+			st.writes[FS_BLOCK_SUPER] == 0 || st.reads[FS_BLOCK_FREEPAGE] == 0)
+		ERROR("FAIL metadata blocks written");
+
+	fs_reset_stats(sb);
+	if(fs_read_file(sb, "/d/big", back, size) != size) ERROR("FAIL fs_read_file");
+	if(memcmp(data, back, size)) ERROR("FAIL contents");
+	if(fs_read_file_at(sb, "/d/big", back, 1, size - 1) != 1)
+		ERROR("FAIL fs_read_file_at");
+	fs_get_stats(sb, &st);
+	if(st.calls[FS_OP_READ_FILE] != 2) ERROR("FAIL read_file calls");
+	if(st.reads[FS_BLOCK_DATA] != nblocks + 1) ERROR("FAIL data blocks read");
+	if(st.writes[FS_BLOCK_DATA] != 0) ERROR("FAIL data blocks written on read");
+	uint64_t reads = 0;
+	for(i = 0; i < FS_NBLOCKS; i++) reads += st.reads[i];
+	if(reads != st.cache_hits + st.cache_misses) ERROR("FAIL hits + misses");
+	if(st.syscalls < st.cache_misses) ERROR("FAIL syscalls below misses");
+	/* written blocks stay in the journal's cache until a checkpoint */
+	if(!sb->journal && st.cache_hits != 0) ERROR("FAIL cache hits without cache");
+	if(sb->journal && st.cache_hits == 0) ERROR("FAIL no cache hits");
+
+	for(i = 0; i < NFILES; i++) {
+		sprintf(name, "/d/f%d", i);
+		if(fs_write_file(sb, name, name, strlen(name) + 1))
+			ERROR("FAIL fs_write_file");
+	}
+	fs_reset_stats(sb);
+	char *list = fs_list_dir(sb, "/d");
+	if(!list) ERROR("FAIL fs_list_dir");
+	free(list);
+	struct fs_dir *d = fs_opendir(sb, "/d");
+	if(!d) ERROR("FAIL fs_opendir");
+	for(n = 0; (e = fs_readdir(d)); n++);
+	fs_closedir(d);
+	if(n != NFILES + 1) ERROR("FAIL fs_readdir entries");
+	if(fs_stat(sb, "/d/f0", &info) || fs_lstat(sb, "/d/f1", &info))
+		ERROR("FAIL fs_stat");
+	fs_get_stats(sb, &st);
+	if(st.calls[FS_OP_LIST_DIR] != 1 || st.calls[FS_OP_OPENDIR] != 1)
+		ERROR("FAIL list_dir/opendir calls");
+	if(st.calls[FS_OP_READDIR] != n + 1) ERROR("FAIL readdir calls");
+	if(st.calls[FS_OP_STAT] != 2) ERROR("FAIL stat calls");
+	if(st.reads[FS_BLOCK_NODEINFO] < 2 * (NFILES + 1))
+		ERROR("FAIL nodeinfos read by listing");
+	if(st.writes[FS_BLOCK_INODE] || st.writes[FS_BLOCK_NODEINFO])
+		ERROR("FAIL blocks written by listing");
+	if(check_latency(&st)) ERROR("FAIL latency");
+
+	if(fs_rmdir_recursive(sb, "/d")) ERROR("FAIL fs_rmdir_recursive");
+	free(data);
+	free(back);
+	return 0;
+}
+/*}}}*/
+
+
+/* free pages through fs_get_block and fs_put_block */
+int block_test(struct superblock *sb)/*{{{*/
+{
+	struct fs_stats st;
+	fs_reset_stats(sb);
+	uint64_t b = fs_get_block(sb);
+	if(b == 0 || b == (uint64_t)-1) ERROR("FAIL fs_get_block");
+	if(fs_put_block(sb, b)) ERROR("FAIL fs_put_block");
+	fs_get_stats(sb, &st);
+	if(st.calls[FS_OP_GET_BLOCK] != 1 || st.calls[FS_OP_PUT_BLOCK] != 1)
+		ERROR("FAIL block calls");
+	/* a page holding other free blocks is rewritten when one is taken */
+	if(st.reads[FS_BLOCK_FREEPAGE] != 1 || st.writes[FS_BLOCK_FREEPAGE] < 1 ||
+			st.writes[FS_BLOCK_FREEPAGE] > 2)
+		ERROR("FAIL free pages");
+	if(st.writes[FS_BLOCK_SUPER] != 2) ERROR("FAIL superblock writes");
+	if(sb->journal && st.syncs == 0) ERROR("FAIL no fdatasync with journal");
+	if(check_latency(&st)) ERROR("FAIL latency");
+	return 0;
+}
+/*}}}*/
+
+
+/* counters start at zero for each superblock */
+int reopen_test(uint64_t blksz)/*{{{*/
+{
+	struct fs_stats st;
+	struct superblock *sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open");
+	fs_get_stats(sb, &st);
+	if(st.calls[FS_OP_OPEN] != 1 || st.calls[FS_OP_FORMAT] != 0)
+		ERROR("FAIL open calls");
+	if(st.reads[FS_BLOCK_SUPER] != 1) ERROR("FAIL superblock reads");
+	if(st.writes[FS_BLOCK_DATA] || st.reads[FS_BLOCK_DATA])
+		ERROR("FAIL data blocks on open");
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+	return 0;
+}
+/*}}}*/
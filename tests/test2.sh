@@ -9,10 +9,19 @@ if [ ! -x test$i ] ; then
     exit 1 ;
 fi
 
-if ! ./test$i > test$i.out 2> test$i.err ; then
+# with IOTRACE set, the test runs under tests/iotrace.c and its I/O on the
+# image is reported
+preload=
+if [ -n "${IOTRACE:-}" ] ; then
+    gcc -g -Wall -shared -fPIC tests/iotrace.c -o iotrace.so -ldl &>> gcc.log
+    preload="LD_PRELOAD=./iotrace.so IOTRACE_OUT=test$i.io"
+fi
+
+if ! env $preload ./test$i > test$i.out 2> test$i.err ; then
     echo "[$i] error"
     exit 1
 fi
 
-rm -f test$i test$i.out test$i.err
+if [ -n "$preload" ] ; then echo "[$i] $(cat test$i.io)" ; fi
+rm -f test$i test$i.out test$i.err test$i.io
 exit 0
@@ -0,0 +1,235 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, uint64_t journal);
+int events_test(struct superblock *sb);
+int ring_test(struct superblock *sb);
+int thread_test(struct superblock *sb);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NTHREADS 4
+#define NFILES 20
+
+static char *fname = "img";
+static char *tname = "trace.json";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 21, 1 << 22};
+	uint64_t blkszs[] = {128, 256, 1024};
+	uint64_t journals[] = {0, 64};
+	int i, j, k;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(k = 0; k < NELEMS(journals); k++) {
+		printf("fsize %d blksz %d journal %d\n", (int)fsizes[j],
+				(int)blkszs[i], (int)journals[k]);
+		if(test(fsizes[j], blkszs[i], journals[k])) exit(EXIT_FAILURE);
+	}
+	}
+	}
+	unlink(tname);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+/* the dumped trace, as a string */
+char * read_trace(void)/*{{{*/
+{
+	FILE *fp = fopen(tname, "r");
+	if(!fp) return NULL;
+	fseek(fp, 0, SEEK_END);
+	long n = ftell(fp);
+	char *buf = malloc(n + 1);
+	fseek(fp, 0, SEEK_SET);
+	if(fread(buf, 1, n, fp) != n) { free(buf); buf = NULL; }
+	else buf[n] = '\0';
+	fclose(fp);
+	return buf;
+}
+/*}}}*/
+
+
+int count(const char *s, const char *what)/*{{{*/
+{
+	int n = 0;
+	for(s = strstr(s, what); s; s = strstr(s + 1, what)) n++;
+	return n;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, uint64_t journal)/*{{{*/
+{
+	struct fs_options opts = {.journal = journal};
+	generate_file(fsize);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(!sb) ERROR("FAIL fs_format_opts");
+	if(fs_trace_dump(sb, tname) >= 0 || errno != EINVAL)
+		ERROR("FAIL dump without trace");
+	if(fs_trace_start(sb, 0) >= 0 || errno != EINVAL)
+		ERROR("FAIL empty ring");
+	if(events_test(sb)) return -1;
+	if(ring_test(sb)) return -1;
+	if(journal && thread_test(sb)) return -1;
+	/* fs_close releases a ring still in use */
+	if(fs_trace_start(sb, 64)) ERROR("FAIL fs_trace_start");
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+/* the events of one fs_write_file, in order */
+int events_test(struct superblock *sb)/*{{{*/
+{
+	uint64_t nblocks = sb->nlinks < 4 ? sb->nlinks : 4;
+	uint64_t size = nblocks * sb->blksz, freeblks = sb->freeblks;
+	char *data = calloc(size, 1), *trace;
+
+	if(fs_trace_start(sb, 4096)) ERROR("FAIL fs_trace_start");
+	if(fs_write_file(sb, "/f", data, size)) ERROR("FAIL fs_write_file");
+	int64_t n = fs_trace_dump(sb, tname);
+	if(n <= 0) ERROR("FAIL fs_trace_dump");
+	if(!(trace = read_trace())) ERROR("FAIL reading trace");
+	if(strncmp(trace, "{\"traceEvents\":[", 16)) ERROR("FAIL trace header");
+	if(count(trace, "\"ts\"") != n) ERROR("FAIL number of events");
+
+	/* one call, nested fs_write_files included */
+	if(count(trace, "\"ph\":\"B\"") != 1 || count(trace, "\"ph\":\"E\"") != 1)
+		ERROR("FAIL call events");
+	char *b = strstr(trace, "\"ph\":\"B\""), *e = strstr(trace, "\"ph\":\"E\"");
+	if(!strstr(trace, "\"name\":\"fs_write_file\"") || b > e)
+		ERROR("FAIL call event names");
+	if(count(trace, "\"name\":\"alloc\"") != freeblks - sb->freeblks)
+		ERROR("FAIL alloc events");
+	if(count(trace, "\"name\":\"write data\"") != nblocks)
+		ERROR("FAIL data write events");
+	if(count(trace, "\"name\":\"write super\"") == 0)
+		ERROR("FAIL superblock write events");
+	/* every I/O event falls between the begin and end of the call */
+	char *first = strstr(trace, "\"cat\":\"io\"");
+	if(!first || first < b || strstr(e, "\"cat\":\"io\""))
+		ERROR("FAIL I/O events outside the call");
+	free(trace);
+
+	/* a read of the file: its data blocks by number */
+	uint64_t before = sb->freeblks;
+	if(fs_trace_start(sb, 4096)) ERROR("FAIL fs_trace_start");
+	if(fs_read_file(sb, "/f", data, size) != size) ERROR("FAIL fs_read_file");
+	if(fs_unlink(sb, "/f")) ERROR("FAIL fs_unlink");
+	if(fs_trace_dump(sb, tname) <= 0) ERROR("FAIL fs_trace_dump");
+	if(!(trace = read_trace())) ERROR("FAIL reading trace");
+	if(count(trace, "\"name\":\"read data\"") != nblocks)
+		ERROR("FAIL data read events");
+	if(count(trace, "\"name\":\"free\"") != sb->freeblks - before)
+		ERROR("FAIL free events");
+	if(count(trace, "\"name\":\"fs_unlink\"") != 2) ERROR("FAIL unlink events");
+	free(trace);
+	if(fs_trace_stop(sb)) ERROR("FAIL fs_trace_stop");
+	if(fs_trace_dump(sb, tname) >= 0) ERROR("FAIL dump after stop");
+	free(data);
+	return 0;
+}
+/*}}}*/
+
+
+/* a full ring keeps the last events */
+int ring_test(struct superblock *sb)/*{{{*/
+{
+	char name[32], *trace;
+	int i;
+	if(fs_trace_start(sb, 10)) ERROR("FAIL fs_trace_start");
+	for(i = 0; i < NFILES; i++) {
+		sprintf(name, "/r%d", i);
+		if(fs_write_file(sb, name, name, strlen(name))) ERROR("FAIL fs_write_file");
+	}
+	for(i = 0; i < NFILES; i++) {
+		sprintf(name, "/r%d", i);
+		if(fs_unlink(sb, name)) ERROR("FAIL fs_unlink");
+	}
+	/* rounded up to 16 events */
+	if(fs_trace_dump(sb, tname) != 16) ERROR("FAIL events in a full ring");
+	if(!(trace = read_trace())) ERROR("FAIL reading trace");
+	if(count(trace, "fs_write_file")) ERROR("FAIL old events kept");
+	if(count(trace, "\"ph\":\"E\"") == 0) ERROR("FAIL last call missing");
+	free(trace);
+	return fs_trace_stop(sb);
+}
+/*}}}*/
+
+
+void * fs_thread(void *arg)/*{{{*/
+{
+	struct superblock *sb = arg;
+	char name[32];
+	intptr_t ret = 0;
+	int i;
+	static int next;
+	int t = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+	for(i = 0; i < NFILES && !ret; i++) {
+		sprintf(name, "/t%d_%d", t, i);
+		if(fs_write_file(sb, name, name, strlen(name))) ret = -1;
+		if(fs_unlink(sb, name)) ret = -1;
+	}
+	return (void *)ret;
+}
+/*}}}*/
+
+
+/* events of several threads in one ring, with no event lost */
+int thread_test(struct superblock *sb)/*{{{*/
+{
+	pthread_t threads[NTHREADS];
+	intptr_t ret;
+	char *trace;
+	int i;
+	if(fs_trace_start(sb, 1 << 16)) ERROR("FAIL fs_trace_start");
+	for(i = 0; i < NTHREADS; i++)
+		if(pthread_create(&threads[i], NULL, fs_thread, sb)) ERROR("FAIL pthread_create");
+	for(i = 0; i < NTHREADS; i++) {
+		pthread_join(threads[i], (void **)&ret);
+		if(ret) ERROR("FAIL operations in thread");
+	}
+	if(fs_trace_dump(sb, tname) <= 0) ERROR("FAIL fs_trace_dump");
+	if(!(trace = read_trace())) ERROR("FAIL reading trace");
+	if(count(trace, "\"ph\":\"B\"") != 2 * NTHREADS * NFILES ||
+			count(trace, "\"ph\":\"E\"") != 2 * NTHREADS * NFILES)
+		ERROR("FAIL call events from threads");
+	/* one thread id per thread */
+	uint64_t seen = 0;
+	unsigned tid;
+	char *s;
+	for(s = strstr(trace, "\"tid\":"); s; s = strstr(s + 1, "\"tid\":"))
+		if(sscanf(s, "\"tid\":%u", &tid) == 1 && tid < 64) seen |= 1ULL << tid;
+	if(__builtin_popcountll(seen) != NTHREADS) ERROR("FAIL thread ids");
+	free(trace);
+	return fs_trace_stop(sb);
+}
+/*}}}*/
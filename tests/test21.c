@@ -0,0 +1,150 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, int btree);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 30
+
+/* from tests/iotrace.c, preloaded by tests/test21.sh */
+extern uint64_t iotrace_ios(void) __attribute__((weak));
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 22};
+	uint64_t blkszs[] = {256, 1024, 4096};
+	int i, j, btree;
+	if(!iotrace_ios) {
+		puts("FAIL tests/iotrace.c is not preloaded");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(btree = 0; btree <= 1; btree++) {
+		printf("fsize %d blksz %d btree %d\n", (int)fsizes[j],
+				(int)blkszs[i], btree);
+		if(test(fsizes[j], blkszs[i], btree)) exit(EXIT_FAILURE);
+	}
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+/* System calls on the image allowed for each operation, without journal.
+ * Chain directories are scanned, two reads per entry before the one looked
+ * up, so budgets of lookups there grow with the number of entries in the
+ * root. */
+struct budget {
+	const char *op;
+	int chain;
+	int btree;
+	int lookup; /* chain budget plus two per entry in the root */
+};
+
+static struct budget budgets[] = {
+	{"write_1block", 16, 24, 1},
+	{"overwrite_1block", 16, 16, 1},
+	{"read_1block", 8, 6, 1},
+	{"stat", 6, 5, 1},
+	{"stat_depth2", 6, 7, 1},
+	{"mkdir", 16, 28, 1},
+	{"rmdir", 16, 16, 1},
+	{"unlink", 12, 14, 1},
+	{"list_dir", 8, 20, 0},
+	{"get_block", 3, 3, 0},
+	{"reopen", 1, 1, 0},
+};
+
+static uint64_t start;
+static int entries, layout;
+
+
+#define ERROR(str) { puts(str); return -1; }
+int check(const char *op)/*{{{*/
+{
+	uint64_t ios = iotrace_ios() - start, limit = 0;
+	int i;
+	for(i = 0; i < NELEMS(budgets); i++) {
+		if(strcmp(budgets[i].op, op)) continue;
+		limit = layout ? budgets[i].btree : budgets[i].chain;
+		if(!layout && budgets[i].lookup) limit += 2 * entries;
+	}
+	printf("%s ios %d budget %d\n", op, (int)ios, (int)limit);
+	if(ios > limit) ERROR("FAIL over budget");
+	start = iotrace_ios();
+	return 0;
+}
+/*}}}*/
+
+
+#define MEASURE(op, call) { start = iotrace_ios(); call; if(check(op)) return -1; }
+int test(uint64_t fsize, uint64_t blksz, int btree)/*{{{*/
+{
+	struct fs_options opts = {.btree_dirs = btree};
+	struct fs_stat st;
+	char *buf = calloc(blksz, 1), name[32], *list = NULL;
+	int i, ret = 0;
+
+	generate_file(fsize);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(!sb) ERROR("FAIL fs_format_opts");
+	for(i = 0; i < NFILES; i++) {
+		sprintf(name, "/f%d", i);
+		if(fs_write_file(sb, name, name, strlen(name))) ERROR("FAIL fs_write_file");
+	}
+	if(fs_mkdir(sb, "/d") || fs_mkdir(sb, "/d/e")) ERROR("FAIL fs_mkdir");
+	layout = btree;
+	entries = NFILES + 1;
+
+	/* the new entry goes at the end of the chain */
+	MEASURE("write_1block", ret = fs_write_file(sb, "/one", buf, blksz));
+	entries++;
+	MEASURE("overwrite_1block", ret |= fs_write_file(sb, "/one", buf, blksz));
+	MEASURE("read_1block", ret |= fs_read_file(sb, "/one", buf, blksz) != blksz);
+	MEASURE("stat", ret |= fs_stat(sb, "/one", &st));
+	MEASURE("stat_depth2", ret |= fs_stat(sb, "/d/e", &st));
+	MEASURE("mkdir", ret |= fs_mkdir(sb, "/m"));
+	entries++;
+	MEASURE("rmdir", ret |= fs_rmdir(sb, "/m"));
+	entries--;
+	MEASURE("unlink", ret |= fs_unlink(sb, "/one"));
+	MEASURE("list_dir", list = fs_list_dir(sb, "/"));
+	MEASURE("get_block", ret |= fs_get_block(sb) == 0);
+	if(ret || !list) ERROR("FAIL operations");
+	free(list);
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+
+	MEASURE("reopen", sb = fs_open(fname));
+	if(!sb) ERROR("FAIL fs_open");
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+	unlink(fname);
+	free(buf);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,237 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, uint64_t journal);
+int fill_test(struct superblock *sb, int check);
+int file_test(uint64_t fsize, uint64_t blksz);
+int latency_test(uint64_t fsize, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 20
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 1024, 4096};
+	uint64_t journals[] = {0, 64};
+	int i, j, k;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(k = 0; k < NELEMS(journals); k++) {
+		printf("fsize %d blksz %d journal %d\n", (int)fsizes[j],
+				(int)blkszs[i], (int)journals[k]);
+		if(test(fsizes[j], blkszs[i], journals[k])) exit(EXIT_FAILURE);
+	}
+		if(file_test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	if(latency_test(1 << 20, 1024)) exit(EXIT_FAILURE);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+/* a device written by the test: forwards to another one and counts calls */
+struct counting {
+	struct fs_backend dev;
+	struct fs_backend *inner;
+	uint64_t reads, writes, flushes;
+};
+
+static ssize_t counting_read(struct fs_backend *dev, const struct iovec *iov,/*{{{*/
+		int iovcnt, uint64_t offset)
+{
+	struct counting *c = (struct counting *)dev;
+	__atomic_add_fetch(&c->reads, 1, __ATOMIC_RELAXED);
+	return c->inner->read_blocks(c->inner, iov, iovcnt, offset);
+}
+/*}}}*/
+
+static ssize_t counting_write(struct fs_backend *dev, const struct iovec *iov,/*{{{*/
+		int iovcnt, uint64_t offset)
+{
+	struct counting *c = (struct counting *)dev;
+	__atomic_add_fetch(&c->writes, 1, __ATOMIC_RELAXED);
+	return c->inner->write_blocks(c->inner, iov, iovcnt, offset);
+}
+/*}}}*/
+
+static int counting_flush(struct fs_backend *dev)/*{{{*/
+{
+	struct counting *c = (struct counting *)dev;
+	__atomic_add_fetch(&c->flushes, 1, __ATOMIC_RELAXED);
+	return c->inner->flush(c->inner);
+}
+/*}}}*/
+
+static uint64_t counting_size(struct fs_backend *dev)/*{{{*/
+{
+	struct counting *c = (struct counting *)dev;
+	return c->inner->size(c->inner);
+}
+/*}}}*/
+
+static int counting_close(struct fs_backend *dev)/*{{{*/
+{
+	struct counting *c = (struct counting *)dev;
+	return fs_backend_close(c->inner);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int fill_test(struct superblock *sb, int check)/*{{{*/
+{
+	char name[16], buf[16];
+	int i;
+	for(i = 0; i < NFILES && !check; i++) {
+		sprintf(name, "/f%02d", i);
+		if(fs_write_file(sb, name, name, strlen(name) + 1)) ERROR("FAIL fs_write_file");
+	}
+	if(!check && fs_mkdir(sb, "/d")) ERROR("FAIL fs_mkdir");
+	for(i = 0; i < NFILES; i++) {
+		sprintf(name, "/f%02d", i);
+		if(fs_read_file(sb, name, buf, sizeof(buf)) != strlen(name) + 1)
+			ERROR("FAIL fs_read_file");
+		if(strcmp(buf, name)) ERROR("FAIL file contents");
+	}
+	char *dir = fs_list_dir(sb, "/d");
+	if(!dir || strcmp(dir, "")) ERROR("FAIL fs_list_dir /d");
+	free(dir);
+	return 0;
+}
+/*}}}*/
+
+
+/* an image in memory, seen through a device defined here */
+int test(uint64_t fsize, uint64_t blksz, uint64_t journal)/*{{{*/
+{
+	struct fs_options opts = {.journal = journal};
+	struct fs_stats st;
+	struct counting c = {{counting_read, counting_write, counting_flush,
+			counting_size, counting_close}};
+	c.inner = fs_backend_memory(fsize);
+	if(!c.inner) ERROR("FAIL fs_backend_memory");
+	if(c.dev.size(&c.dev) != fsize) ERROR("FAIL size");
+
+	opts.journal = fsize / blksz;
+	if(fs_format_dev(&c.dev, blksz, &opts) || errno != ENOSPC)
+		ERROR("FAIL fs_format_dev on too small a device");
+	opts.journal = journal;
+	struct superblock *sb = fs_format_dev(&c.dev, blksz, &opts);
+	if(!sb) ERROR("FAIL fs_format_dev");
+	if(sb->fd != -1) ERROR("FAIL fd of a memory image");
+	if(sb->blks != fsize / blksz) ERROR("FAIL blks");
+	if(fill_test(sb, 0)) return -1;
+	if(fs_get_stats(sb, &st)) ERROR("FAIL fs_get_stats");
+	if(st.syscalls != c.reads + c.writes + c.flushes)
+		ERROR("FAIL device calls not counted as syscalls");
+	if(journal && !c.flushes) ERROR("FAIL no flush with a journal");
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+
+	/* fs_close leaves the device open */
+	uint64_t reads = c.reads;
+	sb = fs_open_dev(&c.dev);
+	if(!sb) ERROR("FAIL fs_open_dev");
+	if(c.reads == reads) ERROR("FAIL fs_open_dev did not read the device");
+	if(sb->blksz != blksz || sb->journalblks != journal) ERROR("FAIL superblock");
+	if(fill_test(sb, 1)) return -1;
+	if(fs_close(sb)) ERROR("FAIL fs_close (2nd time)");
+	if(fs_backend_close(&c.dev)) ERROR("FAIL fs_backend_close");
+	return 0;
+}
+/*}}}*/
+
+
+/* the same file through the mmap and file devices */
+int file_test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct fs_backend *dev = fs_backend_mmap(fname, 1);
+	if(!dev) ERROR("FAIL fs_backend_mmap");
+	if(dev->size(dev) != fsize) ERROR("FAIL size of the mapping");
+	if(fs_open(fname) || errno != EBUSY) ERROR("FAIL fs_open of a locked image");
+	struct superblock *sb = fs_format_dev(dev, blksz, NULL);
+	if(!sb) ERROR("FAIL fs_format_dev on mmap");
+	if(fill_test(sb, 0)) return -1;
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+	if(dev->flush(dev)) ERROR("FAIL msync");
+	if(fs_backend_close(dev)) ERROR("FAIL fs_backend_close");
+
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open after mmap");
+	if(sb->fd == -1 || !sb->owndev) ERROR("FAIL file device of fs_open");
+	if(fill_test(sb, 1)) return -1;
+	if(fs_close(sb)) ERROR("FAIL fs_close (2nd time)");
+
+	if(fs_backend_file("nonexistent", 0) || errno != ENOENT)
+		ERROR("FAIL fs_backend_file of a missing file");
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+static double now(void)/*{{{*/
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/*}}}*/
+
+
+/* every call to the slow device takes at least its profile */
+int latency_test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	struct fs_latency lat = {.read_ns = 200000, .write_ns = 100000,
+			.flush_ns = 1000000, .seek_ns = 50000};
+	struct fs_stats st;
+	char buf[16];
+	struct fs_backend *dev = fs_backend_latency(fs_backend_memory(fsize), &lat);
+	if(!dev) ERROR("FAIL fs_backend_latency");
+	if(fs_backend_latency(NULL, &lat) || errno != EINVAL)
+		ERROR("FAIL fs_backend_latency without a device");
+	struct superblock *sb = fs_format_dev(dev, blksz, NULL);
+	if(!sb) ERROR("FAIL fs_format_dev on a slow device");
+	if(fs_write_file(sb, "/a", "slow", 5)) ERROR("FAIL fs_write_file");
+	if(fs_reset_stats(sb)) ERROR("FAIL fs_reset_stats");
+	double t = now();
+	if(fs_read_file(sb, "/a", buf, sizeof(buf)) != 5) ERROR("FAIL fs_read_file");
+	t = now() - t;
+	if(fs_get_stats(sb, &st)) ERROR("FAIL fs_get_stats");
+	printf("read %d calls %.0f ns\n", (int)st.syscalls, t);
+	if(t < st.syscalls * lat.read_ns) ERROR("FAIL reads faster than the profile");
+	t = now();
+	if(dev->flush(dev)) ERROR("FAIL flush");
+	if(now() - t < lat.flush_ns) ERROR("FAIL flush faster than the profile");
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+	if(fs_backend_close(dev)) ERROR("FAIL fs_backend_close");
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,286 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, int btree);
+int workload(struct superblock *sb);
+int check_trace(uint64_t blksz, int btree, uint64_t *ops);
+int replay_test(uint64_t fsize, uint64_t blksz, int btree, uint64_t ncalls,
+		uint64_t threads, double speedup);
+void * fs_thread(void *arg);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NTHREADS 4
+#define NFILES 10
+
+static char *fname = "img";
+static char *fname2 = "img2";
+static char *tname = "trace.rec";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 21};
+	uint64_t blkszs[] = {256, 1024};
+	int i, j, btree;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(btree = 0; btree <= 1; btree++) {
+		printf("fsize %d blksz %d btree %d\n", (int)fsizes[j],
+				(int)blkszs[i], btree);
+		if(test(fsizes[j], blkszs[i], btree)) exit(EXIT_FAILURE);
+	}
+	}
+	}
+	unlink(tname);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(const char *name, uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(name);
+	FILE *fd = fopen(name, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+static int compare_words(const void *a, const void *b)/*{{{*/
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+/*}}}*/
+
+
+/* sort the space-separated words of s in place */
+char * sort_words(char *s)/*{{{*/
+{
+	char *words[64], *copy = strdup(s), *w;
+	int n = 0, i;
+	for(w = strtok(copy, " "); w && n < 64; w = strtok(NULL, " ")) words[n++] = w;
+	qsort(words, n, sizeof(char *), compare_words);
+	for(s[0] = 0, i = 0; i < n; i++) {
+		if(i) strcat(s, " ");
+		strcat(s, words[i]);
+	}
+	free(copy);
+	return s;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+/* one call of each kind from the main thread */
+int workload(struct superblock *sb)/*{{{*/
+{
+	struct fs_write_req reqs[] = {{"/d/x", "xx", 2}, {"/d/y", "yyy", 3}};
+	const char *paths[] = {"/d/x", "/d/y", "/missing"};
+	struct fs_stat st[3];
+	char buf[64];
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL fs_mkdir");
+	if(fs_write_file(sb, "/d/f", buf, 40)) ERROR("FAIL fs_write_file");
+	if(fs_write_files(sb, reqs, 2)) ERROR("FAIL fs_write_files");
+	if(fs_read_file_at(sb, "/d/f", buf, sizeof(buf), 8) != 32) ERROR("FAIL fs_read_file_at");
+	if(fs_stat(sb, "/d/f", st)) ERROR("FAIL fs_stat");
+	if(fs_stat_many(sb, paths, 3, st) != 2) ERROR("FAIL fs_stat_many");
+	struct fs_dir *d = fs_opendir(sb, "/d");
+	if(!d || !fs_readdir(d) || fs_closedir(d)) ERROR("FAIL fs_opendir");
+	char *list = fs_list_dir(sb, "/d");
+	if(!list) ERROR("FAIL fs_list_dir");
+	free(list);
+	uint64_t b = fs_get_block(sb);
+	if(!b || fs_put_block(sb, b)) ERROR("FAIL fs_get_block");
+	if(fs_txn_begin(sb) || fs_unlink(sb, "/d/x") || fs_txn_commit(sb))
+		ERROR("FAIL transaction");
+	if(fs_txn_begin(sb) || fs_unlink(sb, "/d/y") || fs_txn_abort(sb))
+		ERROR("FAIL aborted transaction");
+	if(fs_mkdir(sb, "/e") || fs_rmdir(sb, "/e")) ERROR("FAIL fs_rmdir");
+	if(fs_mkdir(sb, "/e") || fs_write_file(sb, "/e/z", "z", 1) ||
+			fs_rmdir_recursive(sb, "/e"))
+		ERROR("FAIL fs_rmdir_recursive");
+	if(fs_reclaim(sb, 10) < 0) ERROR("FAIL fs_reclaim");
+	/* a failed call is recorded too */
+	if(fs_unlink(sb, "/missing") != -1) ERROR("FAIL unlink of a missing file");
+	return 0;
+}
+/*}}}*/
+
+
+void * fs_thread(void *arg)/*{{{*/
+{
+	struct superblock *sb = arg;
+	intptr_t ret = 0;
+	char name[32], buf[16];
+	int i;
+	sprintf(name, "/t%lu", (unsigned long)pthread_self() % 100000);
+	if(fs_mkdir(sb, name)) return (void *)-1;
+	for(i = 0; i < NFILES && !ret; i++) {
+		sprintf(name + strlen(name), "/%d", i);
+		if(fs_write_file(sb, name, name, strlen(name) + 1)) ret = -1;
+		if(fs_read_file(sb, name, buf, sizeof(buf)) <= 0) ret = -1;
+		*strrchr(name, '/') = 0;
+	}
+	return (void *)ret;
+}
+/*}}}*/
+
+
+/* expected calls of each kind in the recording */
+static uint64_t expected[FS_NOPS + 2];
+
+int test(uint64_t fsize, uint64_t blksz, int btree)/*{{{*/
+{
+	/* the journal makes the threads take the superblock's lock */
+	struct fs_options opts = {.journal = 64, .btree_dirs = btree};
+	pthread_t threads[NTHREADS];
+	intptr_t ret;
+	uint64_t ops[FS_NOPS + 2];
+	int i;
+
+	generate_file(fname, fsize);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(!sb) ERROR("FAIL fs_format_opts");
+	if(fs_record_stop(sb) != -1 || errno != EINVAL) ERROR("FAIL fs_record_stop without recording");
+	if(fs_record_start(sb, tname)) ERROR("FAIL fs_record_start");
+	if(fs_record_start(sb, tname) != -1 || errno != EBUSY) ERROR("FAIL fs_record_start twice");
+	if(workload(sb)) return -1;
+	memset(expected, 0, sizeof(expected));
+	expected[FS_OP_MKDIR] = 3 + NTHREADS;
+	expected[FS_OP_WRITE_FILE] = 2 + NTHREADS * NFILES;
+	expected[FS_OP_READ_FILE] = 1 + NTHREADS * NFILES;
+	expected[FS_OP_UNLINK] = 3;
+	expected[FS_OP_WRITE_FILES] = expected[FS_OP_STAT] = 1;
+	expected[FS_OP_STAT_MANY] = expected[FS_OP_OPENDIR] = 1;
+	expected[FS_OP_READDIR] = expected[FS_RECORD_CLOSEDIR] = 1;
+	expected[FS_OP_LIST_DIR] = expected[FS_OP_GET_BLOCK] = 1;
+	expected[FS_OP_PUT_BLOCK] = expected[FS_OP_RMDIR] = 1;
+	expected[FS_OP_RMDIR_RECURSIVE] = expected[FS_OP_RECLAIM] = 1;
+	expected[FS_RECORD_TXN_BEGIN] = 2;
+	expected[FS_OP_TXN_COMMIT] = expected[FS_OP_TXN_ABORT] = 1;
+
+	for(i = 0; i < NTHREADS; i++) {
+		if(pthread_create(&threads[i], NULL, fs_thread, sb))
+			ERROR("FAIL pthread_create");
+	}
+	for(i = 0; i < NTHREADS; i++) {
+		pthread_join(threads[i], (void **)&ret);
+		if(ret) ERROR("FAIL calls in thread");
+	}
+	if(fs_record_stop(sb)) ERROR("FAIL fs_record_stop");
+	char *list = fs_list_dir(sb, "/");
+	/* calls after the recording stopped are not in it */
+	if(fs_mkdir(sb, "/after")) ERROR("FAIL fs_mkdir");
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+
+	if(check_trace(blksz, btree, ops)) return -1;
+	for(i = 0; i < FS_NOPS + 2; i++) {
+		if(ops[i] != expected[i]) {
+			printf("op %d: %d records, expected %d\n", i, (int)ops[i], (int)expected[i]);
+			ERROR("FAIL records");
+		}
+	}
+
+	uint64_t ncalls = 0;
+	for(i = 0; i < FS_NOPS + 2; i++) ncalls += expected[i];
+	if(replay_test(fsize, blksz, btree, ncalls, 0, 0)) return -1;
+	if(replay_test(fsize, blksz, btree, ncalls, 1, 0)) return -1;
+	if(replay_test(fsize, blksz, btree, ncalls, 2, 100)) return -1;
+
+	/* the replayed tree is the recorded one, though threads may have
+	 * created their directories in another order */
+	sb = fs_open(fname2);
+	if(!sb) ERROR("FAIL fs_open of the replayed image");
+	char *list2 = fs_list_dir(sb, "/");
+	if(!list || !list2) ERROR("FAIL fs_list_dir");
+	if(strcmp(sort_words(list), sort_words(list2))) ERROR("FAIL replayed tree");
+	free(list);
+	free(list2);
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+	unlink(fname);
+	unlink(fname2);
+	return 0;
+}
+/*}}}*/
+
+
+/* count the records of each kind and check their arguments */
+int check_trace(uint64_t blksz, int btree, uint64_t *ops)/*{{{*/
+{
+	struct fs_record_header h;
+	struct fs_record r;
+	char buf[4096];
+	uint64_t last = 0;
+	FILE *fp = fopen(tname, "r");
+	if(!fp) ERROR("FAIL no recording");
+	if(fread(&h, sizeof(h), 1, fp) != 1) ERROR("FAIL no header");
+	if(h.magic != FS_RECORD_MAGIC || h.blksz != blksz || h.btree != btree)
+		ERROR("FAIL header");
+	memset(ops, 0, (FS_NOPS + 2) * sizeof(uint64_t));
+	while(fread(&r, sizeof(r), 1, fp) == 1) {
+		if(r.op >= FS_NOPS + 2 || r.len % 8 || r.len > sizeof(buf)) ERROR("FAIL record");
+		if(fread(buf, 1, r.len, fp) != r.len) ERROR("FAIL truncated record");
+		if(r.thread == 0) ERROR("FAIL thread");
+		ops[r.op]++;
+		if(r.op == FS_OP_WRITE_FILE && !strcmp(buf, "/d/f") && r.arg[0] != 40)
+			ERROR("FAIL size of fs_write_file");
+		if(r.op == FS_OP_READ_FILE && !strcmp(buf, "/d/f") &&
+				(r.arg[0] != 64 || r.arg[1] != 8))
+			ERROR("FAIL arguments of fs_read_file_at");
+		if(r.op == FS_OP_WRITE_FILES) {
+			uint64_t *sizes = (uint64_t *)(buf + r.len) - 2;
+			if(r.count != 2 || strcmp(buf, "/d/x") || strcmp(buf + 5, "/d/y") ||
+					sizes[0] != 2 || sizes[1] != 3)
+				ERROR("FAIL fs_write_files record");
+		}
+		if(r.op == FS_OP_STAT_MANY && r.count != 3) ERROR("FAIL fs_stat_many record");
+		if(r.op == FS_OP_RECLAIM && r.arg[0] != 10) ERROR("FAIL fs_reclaim record");
+		if(r.op == FS_OP_GET_BLOCK) last = r.arg[0];
+		if(r.op == FS_OP_PUT_BLOCK && r.arg[0] != last) ERROR("FAIL block record");
+	}
+	fclose(fp);
+	return 0;
+}
+/*}}}*/
+
+
+int replay_test(uint64_t fsize, uint64_t blksz, int btree, uint64_t ncalls,/*{{{*/
+		uint64_t threads, double speedup)
+{
+	struct fs_options opts = {.btree_dirs = btree};
+	struct fs_replay_options ropts = {threads, speedup};
+	struct fs_replay_result res;
+	struct fs_stats st;
+	generate_file(fname2, fsize);
+	struct superblock *sb = fs_format_opts(fname2, blksz, &opts);
+	if(!sb) ERROR("FAIL fs_format_opts");
+	if(fs_reset_stats(sb)) ERROR("FAIL fs_reset_stats");
+	if(fs_replay(sb, tname, &ropts, &res)) ERROR("FAIL fs_replay");
+	printf("replay threads %d speedup %.0f: %d calls %d failed %d us\n",
+			(int)threads, speedup, (int)res.calls, (int)res.failed,
+			(int)(res.ns / 1000));
+	if(res.calls != ncalls) ERROR("FAIL replayed calls");
+	/* the unlink of /missing fails again */
+	if(threads == 0 && res.failed != 1) ERROR("FAIL failed calls");
+	if(fs_get_stats(sb, &st)) ERROR("FAIL fs_get_stats");
+	if(st.calls[FS_OP_WRITE_FILE] != expected[FS_OP_WRITE_FILE])
+		ERROR("FAIL replayed calls not counted");
+	if(fs_replay(sb, fname, NULL, NULL) != -1 || errno != EBADF)
+		ERROR("FAIL fs_replay of an image");
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+	return 0;
+}
+/*}}}*/
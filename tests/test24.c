@@ -0,0 +1,189 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, uint64_t journal, int btree, int flags);
+int check_files(struct superblock *sb);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 200
+#define NCYCLES 3000
+#define MAXBLOCKS 40
+
+static char *fname = "img";
+
+static uint64_t sizes[NFILES]; /* bytes of each file, zero if missing */
+static int seeds[NFILES]; /* contents of each file, see fill */
+static char *buf, *rbuf;
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t blkszs[] = {128, 1024};
+	uint64_t journals[] = {0, 64};
+	int i, j, btree, flags;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(journals); j++) {
+	for(btree = 0; btree < 2; btree++) {
+	for(flags = 0; flags <= FS_DEFRAG_INODES; flags += FS_DEFRAG_INODES) {
+		printf("blksz %d journal %d btree %d flags %d\n", (int)blkszs[i],
+				(int)journals[j], btree, flags);
+		if(test(1 << 21, blkszs[i], journals[j], btree, flags))
+			exit(EXIT_FAILURE);
+	}
+	}
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+static void file_name(char *name, int i)/*{{{*/
+{
+	sprintf(name, "/d%d/f%d", i % 4, i);
+}
+/*}}}*/
+
+
+static void fill(char *p, uint64_t n, int seed)/*{{{*/
+{
+	uint64_t k;
+	for(k = 0; k < n; k++) p[k] = (char)(seed * 131 + k * 7 + k / 251);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int check_files(struct superblock *sb)/*{{{*/
+{
+	char name[32];
+	int i;
+	for(i = 0; i < NFILES; i++) {
+		if(!sizes[i]) continue;
+		file_name(name, i);
+		if(fs_read_file(sb, name, rbuf, sizes[i] + 1) != sizes[i])
+			ERROR("FAIL fs_read_file");
+		fill(buf, sizes[i], seeds[i]);
+		if(memcmp(buf, rbuf, sizes[i])) ERROR("FAIL file contents");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+/* files aged by churn are made contiguous without changing their contents,
+ * a few blocks per call, and the free list stays consistent */
+int test(uint64_t fsize, uint64_t blksz, uint64_t journal, int btree, int flags)/*{{{*/
+{
+	struct fs_options opts = {.journal = journal, .btree_dirs = btree};
+	struct fs_fragmentation before, after;
+	char name[32];
+	int i, cycle, calls = 0;
+	int64_t moved;
+	generate_file(fsize);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(!sb) ERROR("FAIL fs_format_opts");
+	buf = malloc(MAXBLOCKS * blksz + 1);
+	rbuf = malloc(MAXBLOCKS * blksz + 1);
+	memset(sizes, 0, sizeof(sizes));
+	srand(blksz + journal + btree);
+
+	if(fs_fragmentation(sb, &before)) ERROR("FAIL fs_fragmentation");
+	if(before.files || before.extents) ERROR("FAIL fragmentation of an empty image");
+	if(fs_defrag(sb, 100, 0) != 0) ERROR("FAIL fs_defrag of an empty image");
+	if(fs_defrag(sb, 100, 2) != -1 || errno != EINVAL) ERROR("FAIL fs_defrag flags");
+
+	for(i = 0; i < 4; i++) {
+		sprintf(name, "/d%d", i);
+		if(fs_mkdir(sb, name)) ERROR("FAIL fs_mkdir");
+	}
+	/* interleaved creates, overwrites and unlinks scatter the files */
+	for(cycle = 0; cycle < NCYCLES; cycle++) {
+		i = rand() % NFILES;
+		file_name(name, i);
+		if(sizes[i] && rand() % 3 == 0) {
+			if(fs_unlink(sb, name)) ERROR("FAIL fs_unlink");
+			sizes[i] = 0;
+			continue;
+		}
+		uint64_t size = rand() % 4 ? 1 + rand() % (3 * blksz)
+				: 1 + rand() % (MAXBLOCKS * blksz);
+		if(sb->freeblks < 3 * MAXBLOCKS + sb->blks / 2) continue;
+		seeds[i] = cycle;
+		fill(buf, size, cycle);
+		if(fs_write_file(sb, name, buf, size)) ERROR("FAIL fs_write_file");
+		sizes[i] = size;
+	}
+	if(check_files(sb)) return -1;
+	if(fs_fragmentation(sb, &before)) ERROR("FAIL fs_fragmentation");
+	printf("before files %d extents %d fragmented %d detached %d\n", (int)before.files,
+			(int)before.extents, (int)before.fragmented, (int)before.detached);
+	if(!before.fragmented) ERROR("FAIL churn left no fragmented file");
+	char *list = fs_list_dir(sb, "/d1");
+	uint64_t freeblks = sb->freeblks;
+
+	/* small budgets: every step leaves a consistent image, and other calls
+	 * may come in between */
+	while((moved = fs_defrag(sb, 2 * MAXBLOCKS, flags)) > 0) {
+		calls++;
+		if(check_files(sb)) return -1;
+		if(fs_fragmentation(sb, &after)) ERROR("FAIL fs_fragmentation");
+		if(after.files != before.files) ERROR("FAIL files lost");
+		if(sb->freeblks != freeblks) ERROR("FAIL blocks lost by fs_defrag");
+	}
+	if(moved < 0) ERROR("FAIL fs_defrag");
+	if(fs_fragmentation(sb, &after)) ERROR("FAIL fs_fragmentation");
+	printf("after %d calls extents %d fragmented %d detached %d\n", calls,
+			(int)after.extents, (int)after.fragmented, (int)after.detached);
+	if(calls < 2) ERROR("FAIL budget not honored");
+	if(after.fragmented >= before.fragmented || after.extents >= before.extents)
+		ERROR("FAIL fragmentation did not improve");
+	if(after.blocks != before.blocks) ERROR("FAIL blocks of the files changed");
+	if(flags && after.detached >= before.detached) ERROR("FAIL inodes not moved");
+	if(fs_defrag(sb, UINT64_MAX, flags) != 0) ERROR("FAIL nothing left to move");
+	char *list2 = fs_list_dir(sb, "/d1");
+	if(!list || !list2 || strcmp(list, list2)) ERROR("FAIL fs_list_dir changed");
+	free(list);
+	free(list2);
+
+	/* the free list hands out no block still in use: fill the image */
+	for(i = 0;; i++) {
+		sprintf(name, "/x%d", i);
+		memset(buf, 'x', blksz);
+		if(fs_write_file(sb, name, buf, blksz)) break;
+	}
+	if(errno != ENOSPC) ERROR("FAIL filling the image");
+	if(check_files(sb)) return -1;
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open");
+	if(check_files(sb)) return -1;
+	if(fs_close(sb)) ERROR("FAIL fs_close (2nd time)");
+	free(buf);
+	free(rbuf);
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
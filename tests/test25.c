@@ -0,0 +1,234 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, uint64_t journal, int btree);
+int check_files(struct superblock *sb);
+int check_dirs(struct superblock *sb, struct superblock *copy);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 120
+#define NCYCLES 1000
+#define MAXBLOCKS 40
+
+static char *fname = "img";
+static char *cname = "img.compact";
+static char *dirs[] = {"/", "/d0", "/d1", "/d2", "/d0/s", "/d0/s/t"};
+
+static uint64_t sizes[NFILES]; /* bytes of each file, zero if missing */
+static int seeds[NFILES]; /* contents of each file, see fill */
+static char *buf, *rbuf;
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t blkszs[] = {128, 1024};
+	uint64_t journals[] = {0, 64};
+	int i, j, btree;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(journals); j++) {
+	for(btree = 0; btree < 2; btree++) {
+		printf("blksz %d journal %d btree %d\n", (int)blkszs[i],
+				(int)journals[j], btree);
+		if(test(1 << 21, blkszs[i], journals[j], btree))
+			exit(EXIT_FAILURE);
+	}
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+static void file_name(char *name, int i)/*{{{*/
+{
+	sprintf(name, "%s/f%d", dirs[1 + i % (NELEMS(dirs) - 1)], i);
+}
+/*}}}*/
+
+
+static void fill(char *p, uint64_t n, int seed)/*{{{*/
+{
+	uint64_t k;
+	for(k = 0; k < n; k++) p[k] = (char)(seed * 131 + k * 7 + k / 251);
+}
+/*}}}*/
+
+
+static uint64_t file_size(const char *path)/*{{{*/
+{
+	struct stat st;
+	if(stat(path, &st)) return 0;
+	return st.st_size;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int check_files(struct superblock *sb)/*{{{*/
+{
+	char name[32];
+	int i;
+	for(i = 0; i < NFILES; i++) {
+		if(!sizes[i]) continue;
+		file_name(name, i);
+		if(fs_read_file(sb, name, rbuf, sizes[i] + 1) != sizes[i])
+			ERROR("FAIL fs_read_file");
+		fill(buf, sizes[i], seeds[i]);
+		if(memcmp(buf, rbuf, sizes[i])) ERROR("FAIL file contents");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+/* every directory lists the same entries, with the same sizes */
+int check_dirs(struct superblock *sb, struct superblock *copy)/*{{{*/
+{
+	struct fs_stat a, b;
+	char name[32];
+	int i;
+	for(i = 0; i < NELEMS(dirs); i++) {
+		char *l1 = fs_list_dir(sb, dirs[i]);
+		char *l2 = fs_list_dir(copy, dirs[i]);
+		if(!l1 || !l2 || strcmp(l1, l2)) ERROR("FAIL fs_list_dir of the copy");
+		free(l1);
+		free(l2);
+		if(fs_stat(sb, dirs[i], &a) || fs_stat(copy, dirs[i], &b))
+			ERROR("FAIL fs_stat of a directory");
+		if(a.mode != b.mode || a.children != b.children)
+			ERROR("FAIL fs_stat of a directory of the copy");
+	}
+	for(i = 0; i < NFILES; i++) {
+		if(!sizes[i]) continue;
+		file_name(name, i);
+		if(fs_stat(sb, name, &a) || fs_stat(copy, name, &b))
+			ERROR("FAIL fs_stat of a file");
+		if(a.size != b.size || a.blocks != b.blocks)
+			ERROR("FAIL fs_stat of a file of the copy");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+/* an aged image is copied with only its used blocks, every file contiguous,
+ * and the copy is a working image */
+int test(uint64_t fsize, uint64_t blksz, uint64_t journal, int btree)/*{{{*/
+{
+	struct fs_options opts = {.journal = journal, .btree_dirs = btree};
+	struct fs_fragmentation frag;
+	char name[32];
+	int i, cycle;
+	uint64_t used, minimum = (MIN_BLOCK_COUNT + journal) * blksz;
+	generate_file(fsize);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(!sb) ERROR("FAIL fs_format_opts");
+	buf = malloc(MAXBLOCKS * blksz + 1);
+	rbuf = malloc(MAXBLOCKS * blksz + 1);
+	memset(sizes, 0, sizeof(sizes));
+	srand(blksz + journal + btree);
+
+	/* an empty image gives a copy of the minimum size */
+	unlink(cname);
+	if(fs_compact_export(sb, cname)) ERROR("FAIL fs_compact_export of an empty image");
+	if(file_size(cname) != minimum) ERROR("FAIL size of an empty copy");
+	struct superblock *copy = fs_open(cname);
+	if(!copy) ERROR("FAIL fs_open of an empty copy");
+	if(copy->freeblks != MIN_BLOCK_COUNT - 3)
+		ERROR("FAIL free blocks of an empty copy");
+	for(i = 0;; i++) {
+		sprintf(name, "/x%d", i);
+		if(fs_write_file(copy, name, buf, 1)) break;
+	}
+	if(errno != ENOSPC || i == 0) ERROR("FAIL filling an empty copy");
+	if(fs_close(copy)) ERROR("FAIL fs_close of an empty copy");
+
+	for(i = 1; i < NELEMS(dirs); i++) {
+		if(fs_mkdir(sb, dirs[i])) ERROR("FAIL fs_mkdir");
+	}
+	/* interleaved creates, overwrites and unlinks scatter the files and
+	 * leave holes in the directories */
+	for(cycle = 0; cycle < NCYCLES; cycle++) {
+		i = rand() % NFILES;
+		file_name(name, i);
+		if(sizes[i] && rand() % 3 == 0) {
+			if(fs_unlink(sb, name)) ERROR("FAIL fs_unlink");
+			sizes[i] = 0;
+			continue;
+		}
+		uint64_t size = rand() % 4 ? 1 + rand() % (3 * blksz)
+				: 1 + rand() % (MAXBLOCKS * blksz);
+		if(sb->freeblks < 3 * MAXBLOCKS + sb->blks / 2) continue;
+		seeds[i] = cycle;
+		fill(buf, size, cycle);
+		if(fs_write_file(sb, name, buf, size)) ERROR("FAIL fs_write_file");
+		sizes[i] = size;
+	}
+	/* a block taken with fs_get_block is not part of the tree */
+	if(fs_get_block(sb) == 0) ERROR("FAIL fs_get_block");
+	if(fs_reclaim(sb, UINT64_MAX) < 0) ERROR("FAIL fs_reclaim");
+	used = sb->blks - sb->freeblks - 1;
+
+	if(fs_compact_export(sb, fname) != -1 || errno != EINVAL)
+		ERROR("FAIL fs_compact_export onto its own image");
+	if(fs_compact_export(sb, cname)) ERROR("FAIL fs_compact_export");
+	if(file_size(cname) != (used > minimum / blksz ? used * blksz : minimum))
+		ERROR("FAIL size of the copy");
+	copy = fs_open(cname);
+	if(!copy) ERROR("FAIL fs_open of the copy");
+	if(fs_compact_export(sb, cname) != -1 || errno != EBUSY)
+		ERROR("FAIL fs_compact_export onto an open image");
+	if(copy->blks - copy->freeblks != used) ERROR("FAIL blocks in use in the copy");
+	if(check_files(copy)) return -1;
+	if(check_dirs(sb, copy)) return -1;
+	if(fs_fragmentation(copy, &frag)) ERROR("FAIL fs_fragmentation");
+	if(frag.extents != frag.files || frag.detached)
+		ERROR("FAIL files of the copy not contiguous");
+	if(fs_defrag(copy, UINT64_MAX, FS_DEFRAG_INODES) != 0)
+		ERROR("FAIL fs_defrag of the copy");
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+
+	/* the copy takes writes once blocks are freed */
+	for(i = 0; i < NFILES && sizes[i] < 8 * blksz; i++) ;
+	if(i == NFILES) ERROR("FAIL no file to rewrite");
+	file_name(name, i);
+	if(fs_unlink(copy, name)) ERROR("FAIL fs_unlink in the copy");
+	seeds[i] = -1;
+	sizes[i] = blksz;
+	fill(buf, sizes[i], seeds[i]);
+	if(fs_write_file(copy, name, buf, sizes[i])) ERROR("FAIL fs_write_file in the copy");
+	if(check_files(copy)) return -1;
+	if(fs_close(copy)) ERROR("FAIL fs_close of the copy");
+
+	copy = fs_open(cname);
+	if(!copy) ERROR("FAIL fs_open of the copy (2nd time)");
+	if(check_files(copy)) return -1;
+	if(fs_close(copy)) ERROR("FAIL fs_close of the copy (2nd time)");
+	free(buf);
+	free(rbuf);
+	unlink(fname);
+	unlink(cname);
+	return 0;
+}
+/*}}}*/
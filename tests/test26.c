@@ -0,0 +1,346 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, uint64_t journal, int btree);
+int test_devices(uint64_t blksz);
+int check_files(struct superblock *sb);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 100
+#define NCYCLES 600
+#define MAXBLOCKS 48
+#define BATCH 64
+
+static char *fname = "img";
+
+static uint64_t sizes[NFILES]; /* bytes of each file, zero if missing */
+static int seeds[NFILES]; /* contents of each file, see fill */
+static char *buf, *rbuf;
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t blkszs[] = {1024, 4096};
+	uint64_t journals[] = {0, 64};
+	int i, j, btree;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(journals); j++) {
+	for(btree = 0; btree < 2; btree++) {
+		printf("blksz %d journal %d btree %d\n", (int)blkszs[i],
+				(int)journals[j], btree);
+		if(test(1 << 22, blkszs[i], journals[j], btree))
+			exit(EXIT_FAILURE);
+	}
+	}
+	}
+	printf("devices\n");
+	if(test_devices(1024)) exit(EXIT_FAILURE);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+static void file_name(char *name, int i)/*{{{*/
+{
+	sprintf(name, "/d%d/f%d", i % 4, i);
+}
+/*}}}*/
+
+
+static void fill(char *p, uint64_t n, int seed)/*{{{*/
+{
+	uint64_t k;
+	for(k = 0; k < n; k++) p[k] = (char)(seed * 131 + k * 7 + k / 251);
+}
+/*}}}*/
+
+
+/* bytes of the image actually stored by the host filesystem */
+static uint64_t host_bytes(void)/*{{{*/
+{
+	struct stat st;
+	if(stat(fname, &st)) return 0;
+	return (uint64_t)st.st_blocks * 512;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int check_files(struct superblock *sb)/*{{{*/
+{
+	char name[32];
+	int i;
+	for(i = 0; i < NFILES; i++) {
+		if(!sizes[i]) continue;
+		file_name(name, i);
+		if(fs_read_file(sb, name, rbuf, sizes[i] + 1) != sizes[i])
+			ERROR("FAIL fs_read_file");
+		fill(buf, sizes[i], seeds[i]);
+		if(memcmp(buf, rbuf, sizes[i])) ERROR("FAIL file contents");
+	}
+	return 0;
+}
+/*}}}*/
+
+
+/* once punching is on, the host keeps little more than the blocks in use,
+ * through frees of every kind, and no block in use is ever released */
+int test(uint64_t fsize, uint64_t blksz, uint64_t journal, int btree)/*{{{*/
+{
+	struct fs_options opts = {.journal = journal, .btree_dirs = btree};
+	struct fs_stats st;
+	char name[32];
+	int i, cycle;
+	uint64_t before, after, block, slack = fsize / 8;
+	generate_file(fsize);
+	struct superblock *sb = fs_format_opts(fname, blksz, &opts);
+	if(!sb) ERROR("FAIL fs_format_opts");
+	buf = malloc(MAXBLOCKS * blksz + 1);
+	rbuf = malloc(MAXBLOCKS * blksz + 1);
+	memset(sizes, 0, sizeof(sizes));
+	srand(blksz + journal + btree);
+
+	for(i = 0; i < 4; i++) {
+		sprintf(name, "/d%d", i);
+		if(fs_mkdir(sb, name)) ERROR("FAIL fs_mkdir");
+	}
+	/* churn with punching off: the whole image stays on the host */
+	for(cycle = 0; cycle < NCYCLES; cycle++) {
+		i = rand() % NFILES;
+		file_name(name, i);
+		if(sizes[i] && rand() % 3 == 0) {
+			if(fs_unlink(sb, name)) ERROR("FAIL fs_unlink");
+			sizes[i] = 0;
+			continue;
+		}
+		uint64_t size = rand() % 4 ? 1 + rand() % (3 * blksz)
+				: 1 + rand() % (MAXBLOCKS * blksz);
+		if(sb->freeblks < 3 * MAXBLOCKS + sb->blks / 2) continue;
+		seeds[i] = cycle;
+		fill(buf, size, cycle);
+		if(fs_write_file(sb, name, buf, size)) ERROR("FAIL fs_write_file");
+		sizes[i] = size;
+	}
+	before = host_bytes();
+	if(before < fsize) ERROR("FAIL image not fully allocated");
+	if(fs_get_stats(sb, &st)) ERROR("FAIL fs_get_stats");
+	if(st.discards || st.punched) ERROR("FAIL discards with punching off");
+
+	/* turning it on releases the free blocks already there */
+	if(fs_set_punch(sb, BATCH)) ERROR("FAIL fs_set_punch");
+	after = host_bytes();
+	if(fs_get_stats(sb, &st)) ERROR("FAIL fs_get_stats");
+	printf("host %d -> %d KB, used %d KB, %d discards, %d punched\n",
+			(int)(before >> 10), (int)(after >> 10),
+			(int)((sb->blks - sb->freeblks) * blksz >> 10),
+			(int)st.discards, (int)st.punched);
+	if(!st.discards || st.punched < sb->freeblks / 2)
+		ERROR("FAIL free blocks not punched");
+	if(st.discards > st.syscalls) ERROR("FAIL discards not counted as syscalls");
+	if(after > (sb->blks - sb->freeblks) * blksz + slack)
+		ERROR("FAIL host keeps free blocks");
+	if(check_files(sb)) return -1;
+	if(fs_set_punch(sb, 2 * BATCH)) ERROR("FAIL fs_set_punch with a new batch");
+
+	/* blocks freed by unlinks and overwrites are released batch by batch */
+	for(cycle = 0; cycle < NCYCLES; cycle++) {
+		i = rand() % NFILES;
+		file_name(name, i);
+		if(sizes[i] && rand() % 3 == 0) {
+			if(fs_unlink(sb, name)) ERROR("FAIL fs_unlink with punching");
+			sizes[i] = 0;
+			continue;
+		}
+		uint64_t size = 1 + rand() % (MAXBLOCKS * blksz);
+		if(sb->freeblks < 3 * MAXBLOCKS + sb->blks / 2) continue;
+		seeds[i] = NCYCLES + cycle;
+		fill(buf, size, seeds[i]);
+		if(fs_write_file(sb, name, buf, size)) ERROR("FAIL fs_write_file with punching");
+		sizes[i] = size;
+	}
+	if(check_files(sb)) return -1;
+	/* at most a batch still queued */
+	if(host_bytes() > (sb->blks - sb->freeblks + 2 * BATCH) * blksz + slack)
+		ERROR("FAIL host keeps blocks freed by the churn");
+
+	/* fs_put_block, and a block given back to the allocator by an aborted
+	 * transaction, are never released while in use */
+	block = fs_get_block(sb);
+	if(block == 0 || block == (uint64_t)-1) ERROR("FAIL fs_get_block");
+	if(fs_put_block(sb, block)) ERROR("FAIL fs_put_block");
+	if(fs_txn_begin(sb)) ERROR("FAIL fs_txn_begin");
+	if(fs_set_punch(sb, BATCH) != -1 || errno != EBUSY)
+		ERROR("FAIL fs_set_punch inside a transaction");
+	for(i = 0; i < NFILES; i++) {
+		if(!sizes[i]) continue;
+		file_name(name, i);
+		if(fs_unlink(sb, name)) ERROR("FAIL fs_unlink inside a transaction");
+	}
+	if(fs_txn_abort(sb)) ERROR("FAIL fs_txn_abort");
+	if(check_files(sb)) return -1;
+
+	/* the free list hands out no block still in use: fill the image */
+	for(i = 0;; i++) {
+		sprintf(name, "/x%d", i);
+		memset(buf, 'x', blksz);
+		if(fs_write_file(sb, name, buf, blksz)) break;
+	}
+	if(errno != ENOSPC) ERROR("FAIL filling the image");
+	if(check_files(sb)) return -1;
+	while(i--) {
+		sprintf(name, "/x%d", i);
+		if(fs_unlink(sb, name)) ERROR("FAIL fs_unlink of a filler");
+	}
+	if(check_files(sb)) return -1;
+	/* fs_close releases what is still queued */
+	after = (sb->blks - sb->freeblks) * blksz + slack;
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+	if(host_bytes() > after) ERROR("FAIL host keeps the queue after fs_close");
+
+	/* punching is off again after fs_open */
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open");
+	if(sb->punch) ERROR("FAIL punching on after fs_open");
+	if(check_files(sb)) return -1;
+	if(fs_set_punch(sb, 1)) ERROR("FAIL fs_set_punch after fs_open");
+	if(host_bytes() > (sb->blks - sb->freeblks) * blksz + slack)
+		ERROR("FAIL host keeps free blocks after fs_open");
+	if(fs_set_punch(sb, 0)) ERROR("FAIL fs_set_punch off");
+	if(sb->punch) ERROR("FAIL punching still on");
+	if(check_files(sb)) return -1;
+	if(fs_close(sb)) ERROR("FAIL fs_close (2nd time)");
+	free(buf);
+	free(rbuf);
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+/* a device written by the test, forwarding to another one, with no discard */
+struct plain {
+	struct fs_backend dev;
+	struct fs_backend *inner;
+};
+
+static ssize_t plain_read(struct fs_backend *dev, const struct iovec *iov,/*{{{*/
+		int iovcnt, uint64_t offset)
+{
+	struct fs_backend *inner = ((struct plain *)dev)->inner;
+	return inner->read_blocks(inner, iov, iovcnt, offset);
+}
+/*}}}*/
+
+static ssize_t plain_write(struct fs_backend *dev, const struct iovec *iov,/*{{{*/
+		int iovcnt, uint64_t offset)
+{
+	struct fs_backend *inner = ((struct plain *)dev)->inner;
+	return inner->write_blocks(inner, iov, iovcnt, offset);
+}
+/*}}}*/
+
+static int plain_flush(struct fs_backend *dev)/*{{{*/
+{
+	struct fs_backend *inner = ((struct plain *)dev)->inner;
+	return inner->flush(inner);
+}
+/*}}}*/
+
+static uint64_t plain_size(struct fs_backend *dev)/*{{{*/
+{
+	struct fs_backend *inner = ((struct plain *)dev)->inner;
+	return inner->size(inner);
+}
+/*}}}*/
+
+static int plain_close(struct fs_backend *dev)/*{{{*/
+{
+	return 0;
+}
+/*}}}*/
+
+
+/* an image in memory gives its pages back; a device with no discard and a
+ * slow device forwarding to it refuse punching */
+int test_devices(uint64_t blksz)/*{{{*/
+{
+	struct fs_options opts = {.journal = 64};
+	struct fs_stats st;
+	char name[32];
+	int i;
+	struct fs_backend *mem = fs_backend_memory(1 << 22);
+	if(!mem) ERROR("FAIL fs_backend_memory");
+	struct superblock *sb = fs_format_dev(mem, blksz, &opts);
+	if(!sb) ERROR("FAIL fs_format_dev");
+	buf = malloc(MAXBLOCKS * blksz + 1);
+	rbuf = malloc(MAXBLOCKS * blksz + 1);
+	memset(sizes, 0, sizeof(sizes));
+	for(i = 0; i < 4; i++) {
+		sprintf(name, "/d%d", i);
+		if(fs_mkdir(sb, name)) ERROR("FAIL fs_mkdir");
+	}
+	if(fs_set_punch(sb, BATCH)) ERROR("FAIL fs_set_punch in memory");
+	for(i = 0; i < NFILES; i++) {
+		file_name(name, i);
+		seeds[i] = i;
+		sizes[i] = 1 + rand() % (MAXBLOCKS * blksz);
+		fill(buf, sizes[i], seeds[i]);
+		if(fs_write_file(sb, name, buf, sizes[i])) {
+			if(errno != ENOSPC) ERROR("FAIL fs_write_file in memory");
+			sizes[i] = 0;
+		}
+		if(i % 2 && sizes[i - 1]) {
+			file_name(name, i - 1);
+			if(fs_unlink(sb, name)) ERROR("FAIL fs_unlink in memory");
+			sizes[i - 1] = 0;
+		}
+	}
+	if(fs_get_stats(sb, &st)) ERROR("FAIL fs_get_stats");
+	if(!st.discards || !st.punched) ERROR("FAIL nothing punched in memory");
+	if(check_files(sb)) return -1;
+	if(fs_close(sb)) ERROR("FAIL fs_close in memory");
+	sb = fs_open_dev(mem);
+	if(!sb) ERROR("FAIL fs_open_dev");
+	if(check_files(sb)) return -1;
+	if(fs_close(sb)) ERROR("FAIL fs_close in memory (2nd time)");
+
+	struct plain p = {{plain_read, plain_write, plain_flush, plain_size,
+			plain_close}, mem};
+	sb = fs_open_dev(&p.dev);
+	if(!sb) ERROR("FAIL fs_open_dev with no discard");
+	if(fs_set_punch(sb, BATCH) != -1 || errno != EOPNOTSUPP)
+		ERROR("FAIL fs_set_punch with no discard");
+	if(sb->punch) ERROR("FAIL punching on with no discard");
+	if(fs_close(sb)) ERROR("FAIL fs_close with no discard");
+	struct fs_latency lat = {.seek_ns = 0};
+	struct fs_backend *slow = fs_backend_latency(&p.dev, &lat);
+	if(!slow) ERROR("FAIL fs_backend_latency");
+	if(slow->discard) ERROR("FAIL discard of a slow device with no discard");
+	if(fs_backend_close(slow)) ERROR("FAIL fs_backend_close");
+	if(fs_backend_close(mem)) ERROR("FAIL fs_backend_close in memory");
+	free(buf);
+	free(rbuf);
+	return 0;
+}
+/*}}}*/
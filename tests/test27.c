@@ -0,0 +1,268 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(int policy);
+int run_ops(struct superblock *sb);
+int check_image(int policy, uint64_t k);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define FSIZE (1 << 20)
+#define BLKSZ 512
+#define JOURNAL 64
+#define NBLOCKS 16 /* data blocks of /a and /b */
+#define NPADS 64
+
+static char *fname = "img";
+static char *image; /* the image before the operations */
+static char *buf, *rbuf;
+
+/* versions of /a and /b after each operation of run_ops (0 is missing); a
+ * crash must leave one of them */
+static const int states[][2] = {{1, 1}, {2, 1}, {2, 2}, {3, 2}, {3, 3}, {0, 3}, {4, 3}};
+static uint64_t fillsz; /* bytes of /fill */
+static int npads;
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	int policies[] = {FS_DURABLE_FSYNC, FS_DURABLE_NONE};
+	int i;
+	image = malloc(FSIZE);
+	buf = malloc(FSIZE);
+	rbuf = malloc(FSIZE);
+	for(i = 0; i < NELEMS(policies); i++) {
+		printf("policy %d\n", policies[i]);
+		if(test(policies[i])) exit(EXIT_FAILURE);
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+static void fill(char *p, uint64_t n, int seed)/*{{{*/
+{
+	uint64_t k;
+	for(k = 0; k < n; k++) p[k] = (char)(seed * 131 + k * 7 + k / 251);
+}
+/*}}}*/
+
+
+static int copy_image(int save)/*{{{*/
+{
+	FILE *fd = fopen(fname, save ? "r" : "r+");
+	if(!fd) return -1;
+	size_t n = save ? fread(image, 1, FSIZE, fd) : fwrite(image, 1, FSIZE, fd);
+	return fclose(fd) || n != FSIZE ? -1 : 0;
+}
+/*}}}*/
+
+
+/* the image file, seen through a device that kills the process on its k-th
+ * write, before doing it */
+struct crashing {
+	struct fs_backend dev;
+	struct fs_backend *inner;
+	uint64_t writes, limit;
+};
+
+static ssize_t crashing_read(struct fs_backend *dev, const struct iovec *iov,/*{{{*/
+		int iovcnt, uint64_t offset)
+{
+	struct crashing *c = (struct crashing *)dev;
+	return c->inner->read_blocks(c->inner, iov, iovcnt, offset);
+}
+/*}}}*/
+
+static ssize_t crashing_write(struct fs_backend *dev, const struct iovec *iov,/*{{{*/
+		int iovcnt, uint64_t offset)
+{
+	struct crashing *c = (struct crashing *)dev;
+	if(++c->writes == c->limit) _exit(2);
+	return c->inner->write_blocks(c->inner, iov, iovcnt, offset);
+}
+/*}}}*/
+
+static int crashing_flush(struct fs_backend *dev)/*{{{*/
+{
+	struct crashing *c = (struct crashing *)dev;
+	return c->inner->flush(c->inner);
+}
+/*}}}*/
+
+static uint64_t crashing_size(struct fs_backend *dev)/*{{{*/
+{
+	struct crashing *c = (struct crashing *)dev;
+	return c->inner->size(c->inner);
+}
+/*}}}*/
+
+static int crashing_close(struct fs_backend *dev)/*{{{*/
+{
+	struct crashing *c = (struct crashing *)dev;
+	return fs_backend_close(c->inner);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+static int write_version(struct superblock *sb, const char *name, int version)/*{{{*/
+{
+	fill(buf, NBLOCKS * BLKSZ, name[1] * 8 + version);
+	return fs_write_file(sb, name, buf, NBLOCKS * BLKSZ);
+}
+/*}}}*/
+
+
+/* overwrites /a and /b twice, then replaces /a; the image is nearly full,
+ * so the second file written reuses the blocks the first one freed */
+int run_ops(struct superblock *sb)/*{{{*/
+{
+	if(write_version(sb, "/a", 2) || write_version(sb, "/b", 2)) return -1;
+	if(write_version(sb, "/a", 3) || write_version(sb, "/b", 3)) return -1;
+	if(fs_unlink(sb, "/a") || write_version(sb, "/a", 4)) return -1;
+	return fs_close(sb);
+}
+/*}}}*/
+
+
+/* version of name in sb, 0 if missing, -1 if it has none */
+static int version(struct superblock *sb, const char *name)/*{{{*/
+{
+	ssize_t r = fs_read_file(sb, name, rbuf, FSIZE);
+	int v;
+	if(r < 0) return errno == ENOENT ? 0 : -1;
+	if(r != NBLOCKS * BLKSZ) return -1;
+	for(v = 1; v <= 4; v++) {
+		fill(buf, NBLOCKS * BLKSZ, name[1] * 8 + v);
+		if(!memcmp(buf, rbuf, r)) return v;
+	}
+	return -1;
+}
+/*}}}*/
+
+
+/* the image left by a crash on write k holds one of the states, the files
+ * not touched, and a free list the whole image can be filled from */
+int check_image(int policy, uint64_t k)/*{{{*/
+{
+	char name[32];
+	int a, b, i, n;
+	struct superblock *sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open after crash");
+	uint64_t freeblks = sb->freeblks;
+	a = version(sb, "/a");
+	b = version(sb, "/b");
+	for(i = 0; i < NELEMS(states); i++) {
+		if(states[i][0] == a && states[i][1] == b) break;
+	}
+	if(i == NELEMS(states)) {
+		printf("policy %d write %d: /a %d /b %d\n", policy, (int)k, a, b);
+		ERROR("FAIL files after crash");
+	}
+	fill(buf, fillsz, 1);
+	if(fs_read_file(sb, "/fill", rbuf, FSIZE) != fillsz || memcmp(buf, rbuf, fillsz))
+		ERROR("FAIL /fill after crash");
+	for(i = 0; i < npads; i++) {
+		sprintf(name, "/p%d", i);
+		if(fs_read_file(sb, name, rbuf, BLKSZ) != 1 || rbuf[0] != (char)i)
+			ERROR("FAIL pad after crash");
+	}
+
+	memset(buf, 'x', 4 * BLKSZ);
+	for(n = 0; ; n++) {
+		sprintf(name, "/x%d", n);
+		if(fs_write_file(sb, name, buf, 4 * BLKSZ) == 0) continue;
+		if(errno != ENOSPC) ERROR("FAIL fs_write_file after crash");
+		break;
+	}
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/x%d", i);
+		if(fs_read_file(sb, name, rbuf, FSIZE) != 4 * BLKSZ || memcmp(buf, rbuf, 4 * BLKSZ))
+			ERROR("FAIL file written after crash");
+		if(fs_unlink(sb, name)) ERROR("FAIL fs_unlink after crash");
+	}
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after crash");
+	return fs_close(sb);
+}
+/*}}}*/
+
+
+/* a crash on any write of run_ops, with the journal, recovers to the state
+ * after one of its operations: no block freed by an operation that is lost
+ * was overwritten in place */
+int test(int policy)/*{{{*/
+{
+	struct fs_options opts = {.journal = JOURNAL};
+	uint64_t k, need;
+	char name[32];
+	int status;
+	pid_t pid;
+
+	generate_file(FSIZE);
+	struct superblock *sb = fs_format_opts(fname, BLKSZ, &opts);
+	if(!sb) ERROR("FAIL fs_format_opts");
+	need = sb->freeblks;
+	if(write_version(sb, "/a", 1)) ERROR("FAIL fs_write_file /a");
+	need -= sb->freeblks;
+	if(write_version(sb, "/b", 1)) ERROR("FAIL fs_write_file /b");
+	/* room for one more copy of /a and a half: one big file (with its map
+	 * nodes), then small files to get there exactly */
+	k = sb->freeblks - need - need / 2 - NPADS;
+	fillsz = (k - k / sb->nlinks - 4) * BLKSZ;
+	fill(buf, fillsz, 1);
+	if(fs_write_file(sb, "/fill", buf, fillsz)) ERROR("FAIL fs_write_file /fill");
+	for(npads = 0; sb->freeblks > need + need / 2; npads++) {
+		if(npads == NPADS) ERROR("FAIL too many pads");
+		sprintf(name, "/p%d", npads);
+		buf[0] = (char)npads;
+		if(fs_write_file(sb, name, buf, 1)) ERROR("FAIL fs_write_file pad");
+	}
+	if(sb->freeblks < need) ERROR("FAIL no room for an overwrite");
+	if(fs_close(sb)) ERROR("FAIL fs_close");
+	if(copy_image(1)) ERROR("FAIL saving the image");
+
+	for(k = 1; ; k++) {
+		if(copy_image(0)) ERROR("FAIL restoring the image");
+		fflush(stdout);
+		if((pid = fork()) == 0) {
+			struct crashing c = {{crashing_read, crashing_write, crashing_flush,
+					crashing_size, crashing_close}};
+			c.limit = k;
+			c.inner = fs_backend_file(fname, 0);
+			if(!c.inner) _exit(1);
+			sb = fs_open_dev(&c.dev);
+			if(!sb || fs_set_durability(sb, policy, 0) || run_ops(sb)) _exit(1);
+			_exit(0);
+		}
+		if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+			ERROR("FAIL child");
+		if(WEXITSTATUS(status) == 1) ERROR("FAIL operations");
+		if(check_image(policy, k)) return -1;
+		if(WEXITSTATUS(status) == 0) break;
+	}
+	printf("%d writes\n", (int)k - 1);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,154 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blkszs[2]);
+int fs_fill_test(struct superblock *sb);
+void * fs_thread(void *arg);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 60
+/* fs_list_dir only looks at the directory's first inode */
+#define NENTRIES(sb) ((sb)->nlinks < NFILES ? (int)(sb)->nlinks : NFILES)
+
+static char *fnames[] = {"img", "img2"};
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 21};
+	uint64_t blkszs[][2] = {{1024, 256}, {256, 1024}, {4096, 128}};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d/%d\n", (int)fsizes[j],
+				(int)blkszs[i][0], (int)blkszs[i][1]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(const char *fname, uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blkszs[2])/*{{{*/
+{
+	struct superblock *sbs[2];
+	pthread_t threads[2];
+	intptr_t ret;
+	int i;
+
+	/* format both images before using either, so that the geometry of the
+	 * second format cannot leak into the first superblock. */
+	for(i = 0; i < 2; i++) {
+		generate_file(fnames[i], fsize);
+		sbs[i] = fs_format(fnames[i], blkszs[i]);
+		if(sbs[i] == NULL) ERROR("FAIL no sb\n");
+	}
+	for(i = 0; i < 2; i++) {
+		if(sbs[i]->nlinks != (blkszs[i] - 32) / 8) ERROR("FAIL nlinks\n");
+		if(fs_fill_test(sbs[i])) ERROR("FAIL fs_fill_test\n");
+		if(fs_close(sbs[i])) ERROR("FAIL error on fs_close");
+	}
+
+	/* reopen in reverse order and use both images from two threads. */
+	for(i = 1; i >= 0; i--) {
+		sbs[i] = fs_open(fnames[i]);
+		if(!sbs[i]) ERROR("FAIL fs_open (2nd time)\n");
+		if(sbs[i]->blksz != blkszs[i]) ERROR("FAIL block size\n");
+		if(sbs[i]->nlinks != (blkszs[i] - 32) / 8) ERROR("FAIL nlinks\n");
+		if(sbs[i]->namelen != blkszs[i] - 64) ERROR("FAIL namelen\n");
+		if(sbs[i]->nfree != (blkszs[i] - 16) / 8) ERROR("FAIL nfree\n");
+	}
+	for(i = 0; i < 2; i++) {
+		if(pthread_create(&threads[i], NULL, fs_thread, sbs[i]))
+			ERROR("FAIL pthread_create\n");
+	}
+	for(i = 0; i < 2; i++) {
+		pthread_join(threads[i], (void **)&ret);
+		if(ret) ERROR("FAIL fs_fill_test in thread\n");
+	}
+	for(i = 0; i < 2; i++) {
+		if(fs_close(sbs[i])) ERROR("FAIL error on fs_close");
+		unlink(fnames[i]);
+	}
+	return 0;
+}
+/*}}}*/
+
+
+void * fs_thread(void *arg)/*{{{*/
+{
+	struct superblock *sb = arg;
+	intptr_t ret = 0;
+	char name[16];
+	int i, j;
+	for(i = 0; i < 10 && !ret; i++) {
+		for(j = 0; j < NENTRIES(sb) && !ret; j++) {
+			sprintf(name, "/f%02d", j);
+			if(fs_unlink(sb, name) < 0) ret = -1;
+			if(fs_write_file(sb, name, name, strlen(name)+1) < 0) ret = -1;
+		}
+		char *dir = fs_list_dir(sb, "/");
+		if(strlen(dir) != NENTRIES(sb) * 4 - 1) ret = -1;
+		free(dir);
+	}
+	return (void *)ret;
+}
+/*}}}*/
+
+
+int fs_fill_test(struct superblock *sb)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks;
+	char name[16], expected[NFILES * 4 + 1] = "";
+	int i, nfiles = NENTRIES(sb);
+
+	for(i = 0; i < nfiles; i++) {
+		sprintf(name, "/f%02d", i);
+		if(fs_write_file(sb, name, name, strlen(name)+1) < 0)
+			ERROR("FAIL fs_write_file\n");
+		if(i) strcat(expected, " ");
+		strcat(expected, name + 1);
+	}
+
+	char *dir = fs_list_dir(sb, "/");
+	if(strcmp(dir, expected)) ERROR("FAIL fs_list_dir /\n");
+	free(dir);
+
+	for(i = 0; i < nfiles; i++) {
+		sprintf(name, "/f%02d", i);
+		if(fs_unlink(sb, name) < 0) ERROR("FAIL fs_unlink\n");
+	}
+	for(i = 0; i < nfiles; i++) {
+		sprintf(name, "/f%02d", i);
+		if(fs_write_file(sb, name, name, strlen(name)+1) < 0)
+			ERROR("FAIL fs_write_file\n");
+	}
+	if(freeblks - sb->freeblks != 3 * nfiles)
+		ERROR("FAIL freeblks after fs_fill_test\n");
+	return 0;
+}
+/*}}}*/
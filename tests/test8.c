@@ -0,0 +1,146 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_chain_test(struct superblock *sb, const char *dir, int nfiles);
+int fs_count_entries(struct superblock *sb, const char *dir);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+/* enough entries to spread a directory over several inodes */
+#define NFILES(sb) (3 * (int)(sb)->nlinks + 5)
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 22, 1 << 23};
+	uint64_t blkszs[] = {128, 256, 1024};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+
+	if(fs_chain_test(sb, "", NFILES(sb))) return -1;
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	/* the hints must survive a reopen */
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(fs_count_entries(sb, "/") != NFILES(sb)) ERROR("FAIL entries after fs_open\n");
+
+	uint64_t freeblks = sb->freeblks;
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir\n");
+	if(fs_chain_test(sb, "/d", NFILES(sb))) return -1;
+
+	char name[32];
+	int i;
+	if(fs_rmdir(sb, "/d") == 0 || errno != ENOTEMPTY) ERROR("FAIL rmdir non-empty\n");
+	for(i = 0; i < NFILES(sb); i++) {
+		sprintf(name, "/d/f%03d", i);
+		if(fs_unlink(sb, name) < 0) ERROR("FAIL fs_unlink /d\n");
+	}
+	if(fs_count_entries(sb, "/d") != 0) ERROR("FAIL entries after unlink\n");
+	if(fs_rmdir(sb, "/d") < 0) ERROR("FAIL fs_rmdir\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL fs_rmdir leaked chain inodes\n");
+
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_count_entries(struct superblock *sb, const char *dir)/*{{{*/
+{
+	char *list = fs_list_dir(sb, dir), *c;
+	int n = 0;
+	if(list == NULL) return -1;
+	if(*list) n = 1;
+	for(c = list; *c; c++) if(*c == ' ') n++;
+	free(list);
+	return n;
+}
+/*}}}*/
+
+
+int fs_chain_test(struct superblock *sb, const char *dir, int nfiles)/*{{{*/
+{
+	char name[32], buf[32];
+	int i;
+
+	for(i = 0; i < nfiles; i++) {
+		sprintf(name, "%s/f%03d", dir, i);
+		if(fs_write_file(sb, name, name, strlen(name)+1) < 0)
+			ERROR("FAIL fs_write_file\n");
+	}
+	if(fs_count_entries(sb, *dir ? dir : "/") != nfiles)
+		ERROR("FAIL entries after fs_write_file\n");
+
+	/* holes left anywhere in the chain are reused before the directory
+	 * grows: removing and recreating entries costs no extra blocks. */
+	uint64_t freeblks = sb->freeblks;
+	for(i = 0; i < nfiles; i += 3) {
+		sprintf(name, "%s/f%03d", dir, i);
+		if(fs_unlink(sb, name) < 0) ERROR("FAIL fs_unlink\n");
+	}
+	for(i = 0; i < nfiles; i += 3) {
+		sprintf(name, "%s/f%03d", dir, i);
+		if(fs_write_file(sb, name, name, strlen(name)+1) < 0)
+			ERROR("FAIL fs_write_file (2nd time)\n");
+	}
+	if(sb->freeblks != freeblks) ERROR("FAIL directory grew\n");
+
+	/* overwriting keeps the entry */
+	sprintf(name, "%s/f%03d", dir, 1);
+	if(fs_write_file(sb, name, name, strlen(name)+1) < 0)
+		ERROR("FAIL fs_write_file (overwrite)\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL overwrite leaked\n");
+	if(fs_count_entries(sb, *dir ? dir : "/") != nfiles)
+		ERROR("FAIL entries after rewrite\n");
+
+	for(i = 0; i < nfiles; i++) {
+		sprintf(name, "%s/f%03d", dir, i);
+		memset(buf, 0, sizeof(buf));
+		if(fs_read_file(sb, name, buf, sizeof(buf)) != strlen(name)+1)
+			ERROR("FAIL fs_read_file\n");
+		if(strcmp(buf, name)) ERROR("FAIL file contents\n");
+	}
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,199 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_batch_test(struct superblock *sb);
+int fs_count_entries(struct superblock *sb, const char *dir);
+int check_file(struct superblock *sb, const char *name, const char *data,
+		size_t cnt);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 90
+#define BIGSZ 5000
+
+static char *fname = "img";
+static char *dirs[] = {"", "/a", "/a/b"};
+static char big[BIGSZ];
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 21, 1 << 22};
+	uint64_t blkszs[] = {128, 256, 1024};
+	int i, j;
+	for(i = 0; i < BIGSZ; i++) big[i] = 'a' + i % 26;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(fs_mkdir(sb, "/a") < 0) ERROR("FAIL fs_mkdir /a\n");
+	if(fs_mkdir(sb, "/a/b") < 0) ERROR("FAIL fs_mkdir /a/b\n");
+
+	if(fs_batch_test(sb)) return -1;
+
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	unlink(fname);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_count_entries(struct superblock *sb, const char *dir)/*{{{*/
+{
+	char *list = fs_list_dir(sb, *dir ? dir : "/"), *c;
+	int n = 0;
+	if(list == NULL) return -1;
+	if(*list) n = 1;
+	for(c = list; *c; c++) if(*c == ' ') n++;
+	free(list);
+	return n;
+}
+/*}}}*/
+
+
+int check_file(struct superblock *sb, const char *name, const char *data,/*{{{*/
+		size_t cnt)
+{
+	char *buf = calloc(cnt + 16, 1);
+	ssize_t r = fs_read_file(sb, name, buf, cnt + 16);
+	int ret = (r == cnt && memcmp(buf, data, cnt) == 0) ? 0 : -1;
+	free(buf);
+	return ret;
+}
+/*}}}*/
+
+
+int fs_batch_test(struct superblock *sb)/*{{{*/
+{
+	struct fs_write_req reqs[NFILES + 2];
+	char names[NFILES][32];
+	uint64_t freeblks = sb->freeblks, used;
+	int i;
+
+	/* interleave parents so that grouping has work to do; every fifth
+	 * file spans several inodes. */
+	for(i = 0; i < NFILES; i++) {
+		sprintf(names[i], "%s/f%02d", dirs[i % NELEMS(dirs)], i);
+		reqs[i].fname = names[i];
+		reqs[i].buf = i % 5 ? names[i] : big;
+		reqs[i].cnt = i % 5 ? strlen(names[i]) + 1 : BIGSZ;
+	}
+	if(fs_write_files(sb, reqs, NFILES) < 0) ERROR("FAIL fs_write_files\n");
+	for(i = 0; i < NFILES; i++) {
+		if(check_file(sb, reqs[i].fname, reqs[i].buf, reqs[i].cnt))
+			ERROR("FAIL file contents\n");
+	}
+	for(i = 0; i < NELEMS(dirs); i++) {
+		/* /a and /a/b also list their subdirectory */
+		int extra = i + 1 < NELEMS(dirs) ? 1 : 0;
+		if(fs_count_entries(sb, dirs[i]) != NFILES / NELEMS(dirs) + extra)
+			ERROR("FAIL entries after fs_write_files\n");
+	}
+	used = freeblks - sb->freeblks;
+
+	/* errors are detected before anything is written. */
+	reqs[0].fname = "/new";
+	reqs[1].fname = "/missing/f";
+	if(fs_write_files(sb, reqs, 2) == 0 || errno != ENOENT)
+		ERROR("FAIL missing parent\n");
+	reqs[1].fname = "/f03/f";
+	if(fs_write_files(sb, reqs, 2) == 0 || errno != ENOTDIR)
+		ERROR("FAIL parent is a file\n");
+	reqs[1].fname = "/a/b";
+	if(fs_write_files(sb, reqs, 2) == 0 || errno != EISDIR)
+		ERROR("FAIL overwrite directory\n");
+	if(check_file(sb, "/new", "", 0) == 0) ERROR("FAIL partial batch\n");
+	if(freeblks - sb->freeblks != used) ERROR("FAIL freeblks after errors\n");
+
+	/* overwrites reuse the existing entry, and the last of repeated names
+	 * wins. */
+	for(i = 0; i < NFILES; i++) {
+		reqs[i].fname = names[i];
+		reqs[i].buf = i % 5 ? big : names[i];
+		reqs[i].cnt = i % 5 ? 10 : strlen(names[i]) + 1;
+	}
+	reqs[NFILES].fname = names[7];
+	reqs[NFILES].buf = "last";
+	reqs[NFILES].cnt = 5;
+	if(fs_write_files(sb, reqs, NFILES + 1) < 0) ERROR("FAIL fs_write_files (2nd time)\n");
+	for(i = 0; i < NFILES; i++) {
+		if(i == 7) continue;
+		if(check_file(sb, reqs[i].fname, reqs[i].buf, reqs[i].cnt))
+			ERROR("FAIL file contents (2nd time)\n");
+	}
+	if(check_file(sb, names[7], "last", 5)) ERROR("FAIL repeated name\n");
+	for(i = 0; i < NELEMS(dirs); i++) {
+		int extra = i + 1 < NELEMS(dirs) ? 1 : 0;
+		if(fs_count_entries(sb, dirs[i]) != NFILES / NELEMS(dirs) + extra)
+			ERROR("FAIL entries after overwrite\n");
+	}
+
+	/* a batch costs the same blocks as the equivalent single writes. */
+	for(i = 0; i < NFILES; i++) {
+		if(fs_unlink(sb, names[i]) < 0) ERROR("FAIL fs_unlink\n");
+	}
+	uint64_t base = sb->freeblks;
+	for(i = 0; i < NFILES; i++) {
+		if(fs_write_file(sb, names[i], big, BIGSZ) < 0) ERROR("FAIL fs_write_file\n");
+	}
+	uint64_t single = base - sb->freeblks;
+	for(i = 0; i < NFILES; i++) {
+		if(fs_unlink(sb, names[i]) < 0) ERROR("FAIL fs_unlink (2nd time)\n");
+		reqs[i].fname = names[i];
+		reqs[i].buf = big;
+		reqs[i].cnt = BIGSZ;
+	}
+	if(sb->freeblks != base) ERROR("FAIL freeblks after fs_unlink\n");
+	if(fs_write_files(sb, reqs, NFILES) < 0) ERROR("FAIL fs_write_files (3rd time)\n");
+	if(base - sb->freeblks != single) ERROR("FAIL batch used more blocks\n");
+
+	/* not enough space for the whole batch: nothing is written. */
+	base = sb->freeblks;
+	for(i = 0; i < NFILES; i++) {
+		sprintf(names[i], "%s/g%02d", dirs[i % NELEMS(dirs)], i);
+		reqs[i].cnt = (sb->freeblks / NFILES + 1) * sb->blksz;
+		if(reqs[i].cnt > BIGSZ) reqs[i].buf = NULL;
+	}
+	reqs[0].buf = big;
+	reqs[0].cnt = 1;
+	if(fs_write_files(sb, reqs + 1, NFILES - 1) == 0 || errno != ENOSPC)
+		ERROR("FAIL fs_write_files without space\n");
+	if(sb->freeblks != base) ERROR("FAIL freeblks after ENOSPC\n");
+	if(fs_write_files(sb, reqs, 1) < 0) ERROR("FAIL fs_write_files after ENOSPC\n");
+	return 0;
+}
+/*}}}*/